@@ -1,14 +1,599 @@
 #include <lua.h>
 #include <lauxlib.h>
 #include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <unistd.h>
 
 #include <fluidsynth.h>
 
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define HAVE_CONVERT_X86 1
+#endif
+
+// strdup is POSIX, not ISO C
+static char*
+farm_strdup (const char* s)
+{
+        size_t n = strlen(s) + 1;
+        char* copy = malloc(n);
+        if (copy != NULL) { memcpy(copy, s, n); }
+        return copy;
+}
+
 /*-------------------------------------------------------------------
   ---=  Sequencer =---
   ------------------------------------------------------------------*/
 
+/*
+ * Statistics kept for every sequencer used through the binding and
+ * read with `fluid_sequencer_get_stats`. Counters bumped from the
+ * thread that processes the sequencer queue are atomic, the others are
+ * only touched on the thread that owns the Lua state.
+ *
+ * Lateness is the number of ticks between the time an event was
+ * scheduled for and the tick at which the Lua callback ran. Bucket 0
+ * counts on-time callbacks, bucket `n` counts lateness in
+ * [2^(n-1), 2^n) and the last bucket everything above.
+ *
+ */
+
+#define LATENESS_BUCKETS 12
+
+struct client_stats {
+        atomic_ulong dispatched;
+        atomic_ulong lateness[LATENESS_BUCKETS];
+        atomic_ullong callback_ns;
+        atomic_ullong callback_max_ns;
+};
+
+struct dest_stats {
+        short dest;
+        unsigned long scheduled;
+        unsigned long cancelled;
+        unsigned long removed;
+        unsigned long remove_calls;
+};
+
+struct seq_stats {
+        fluid_sequencer_t* seq;
+        unsigned long scheduled;
+        unsigned long cancelled;
+        unsigned long removed;
+        unsigned long remove_calls;     // calls, the events they remove are not known
+        unsigned int horizon;   // latest tick anything was scheduled for
+
+        int ndests;
+        int capacity;
+        struct dest_stats* dests;
+
+        struct seq_stats* next;
+};
+
+static struct seq_stats* seq_stats_list = NULL;
+
+static unsigned long long
+clock_ns (void)
+{
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (unsigned long long)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static struct seq_stats*
+seq_stats_get (fluid_sequencer_t* seq)
+{
+        struct seq_stats* st;
+        for (st = seq_stats_list; st != NULL; st = st->next) {
+                if (st->seq == seq) { return st; }
+        }
+
+        st = calloc(1, sizeof(struct seq_stats));
+        if (st == NULL) { return NULL; }
+        st->seq = seq;
+        st->next = seq_stats_list;
+        seq_stats_list = st;
+
+        return st;
+}
+
+static struct dest_stats*
+seq_stats_dest (struct seq_stats* st, short dest)
+{
+        for (int i = 0; i < st->ndests; i++) {
+                if (st->dests[i].dest == dest) { return &st->dests[i]; }
+        }
+
+        if (st->ndests == st->capacity) {
+                int capacity = st->capacity ? st->capacity * 2 : 8;
+                struct dest_stats* dests = realloc(st->dests, capacity * sizeof(struct dest_stats));
+                if (dests == NULL) { return NULL; }
+                st->dests = dests;
+                st->capacity = capacity;
+        }
+
+        struct dest_stats* d = &st->dests[st->ndests++];
+        memset(d, 0, sizeof(struct dest_stats));
+        d->dest = dest;
+
+        return d;
+}
+
+static void
+seq_stats_scheduled (struct seq_stats* st, short dest, unsigned int tick)
+{
+        if (st == NULL) { return; }
+
+        st->scheduled++;
+        if (tick > st->horizon) { st->horizon = tick; }
+
+        struct dest_stats* d = seq_stats_dest(st, dest);
+        if (d != NULL) { d->scheduled++; }
+}
+
+// a ledger event for `dest` was cancelled, or removed by
+// `fluid_sequencer_remove_events` if `removed` is set
+static void
+seq_stats_dropped (struct seq_stats* st, short dest, int removed)
+{
+        if (st == NULL) { return; }
+
+        struct dest_stats* d = seq_stats_dest(st, dest);
+        if (removed) {
+                st->removed++;
+                if (d != NULL) { d->removed++; }
+        } else {
+                st->cancelled++;
+                if (d != NULL) { d->cancelled++; }
+        }
+}
+
+static void
+seq_stats_forget (fluid_sequencer_t* seq)
+{
+        for (struct seq_stats** p = &seq_stats_list; *p != NULL; p = &(*p)->next) {
+                if ((*p)->seq == seq) {
+                        struct seq_stats* st = *p;
+                        *p = st->next;
+                        free(st->dests);
+                        free(st);
+                        return;
+                }
+        }
+}
+
+static void
+client_stats_record (struct client_stats* st, unsigned int time,
+                     unsigned int now, unsigned long long ns)
+{
+        unsigned int late = now > time ? now - time : 0;
+        int bucket = 0;
+        while (late != 0 && bucket < LATENESS_BUCKETS - 1) {
+                late >>= 1;
+                bucket++;
+        }
+
+        atomic_fetch_add_explicit(&st->dispatched, 1, memory_order_relaxed);
+        atomic_fetch_add_explicit(&st->lateness[bucket], 1, memory_order_relaxed);
+        atomic_fetch_add_explicit(&st->callback_ns, ns, memory_order_relaxed);
+
+        unsigned long long max = atomic_load_explicit(&st->callback_max_ns, memory_order_relaxed);
+        while (ns > max
+               && !atomic_compare_exchange_weak_explicit(&st->callback_max_ns, &max, ns,
+                                                         memory_order_relaxed,
+                                                         memory_order_relaxed)) {
+        }
+}
+
+/*
+ * Ledger of events scheduled through the binding, enabled per
+ * sequencer with `fluid_sequencer_enable_ledger`. libfluidsynth can
+ * only remove queued events by source, destination and type, so
+ * events further ahead than `lookahead` ticks are kept here instead,
+ * in a treap ordered by absolute tick, and handed to the sequencer by
+ * a pump client when they come within `lookahead` ticks of the
+ * current tick. Until then they can be cancelled by time range with
+ * `fluid_sequencer_cancel_range`, and `fluid_sequencer_remove_events`
+ * drops the matching ones.
+ *
+ * The ledger is touched by the thread that owns the Lua state and by
+ * the pump, which runs on the thread processing the sequencer queue,
+ * so every access holds `lock`.
+ *
+ */
+
+struct ledger_node {
+        unsigned int tick;
+        unsigned int order;     // insertion order, keeps equal ticks stable
+        unsigned int priority;
+        struct ledger_node* left;
+        struct ledger_node* right;
+
+        // a copy of the scheduled event
+        int type;
+        short source;
+        short dest;
+        int channel;
+        short key;
+        short velocity;
+        short control;
+        short value;
+        short program;
+        short bank;
+        int pitch;
+        unsigned int duration;
+        unsigned int sfont_id;
+        void* data;
+};
+
+struct ledger {
+        fluid_sequencer_t* seq;
+        short pump_id;
+        unsigned int lookahead;
+        pthread_mutex_t lock;
+
+        struct ledger_node* root;
+        struct ledger_node* spare;      // freed nodes, reused by inserts
+        int count;
+        unsigned int order;
+        unsigned int rng;
+
+        fluid_event_t* event;           // used to release held events
+        fluid_event_t* timer;           // wakes the pump
+        int armed;
+        unsigned int armed_tick;
+
+        struct ledger* next;
+};
+
+static struct ledger* ledger_list = NULL;
+
+static struct ledger*
+ledger_find (fluid_sequencer_t* seq)
+{
+        for (struct ledger* lg = ledger_list; lg != NULL; lg = lg->next) {
+                if (lg->seq == seq) { return lg; }
+        }
+        return NULL;
+}
+
+static int
+ledger_node_less (const struct ledger_node* a, const struct ledger_node* b)
+{
+        return a->tick < b->tick || (a->tick == b->tick && a->order < b->order);
+}
+
+// split `t` into the nodes with a tick below `tick` and the rest
+static void
+ledger_split (struct ledger_node* t, unsigned int tick,
+              struct ledger_node** below, struct ledger_node** rest)
+{
+        if (t == NULL) { *below = *rest = NULL; return; }
+
+        if (t->tick < tick) {
+                ledger_split(t->right, tick, &t->right, rest);
+                *below = t;
+        } else {
+                ledger_split(t->left, tick, below, &t->left);
+                *rest = t;
+        }
+}
+
+// split `t` into the nodes with a tick up to `tick` and the rest, so
+// that UINT_MAX needs no tick past it
+static void
+ledger_split_after (struct ledger_node* t, unsigned int tick,
+                    struct ledger_node** upto, struct ledger_node** rest)
+{
+        if (t == NULL) { *upto = *rest = NULL; return; }
+
+        if (t->tick <= tick) {
+                ledger_split_after(t->right, tick, &t->right, rest);
+                *upto = t;
+        } else {
+                ledger_split_after(t->left, tick, upto, &t->left);
+                *rest = t;
+        }
+}
+
+// join two treaps where every node of `a` orders before every node of `b`
+static struct ledger_node*
+ledger_merge (struct ledger_node* a, struct ledger_node* b)
+{
+        if (a == NULL) { return b; }
+        if (b == NULL) { return a; }
+
+        if (a->priority > b->priority) {
+                a->right = ledger_merge(a->right, b);
+                return a;
+        }
+        b->left = ledger_merge(a, b->left);
+        return b;
+}
+
+static struct ledger_node*
+ledger_insert (struct ledger_node* t, struct ledger_node* node)
+{
+        if (t == NULL) { return node; }
+
+        if (node->priority > t->priority) {
+                // the new node orders after every node of its tick
+                struct ledger_node* upto;
+                struct ledger_node* rest;
+                ledger_split_after(t, node->tick, &upto, &rest);
+                node->left = upto;
+                node->right = rest;
+                return node;
+        }
+
+        if (ledger_node_less(node, t)) {
+                t->left = ledger_insert(t->left, node);
+        } else {
+                t->right = ledger_insert(t->right, node);
+        }
+        return t;
+}
+
+static void
+ledger_node_free (struct ledger* lg, struct ledger_node* node)
+{
+        node->left = NULL;
+        node->right = lg->spare;
+        lg->spare = node;
+        lg->count--;
+}
+
+static void
+ledger_capture (struct ledger_node* node, fluid_event_t* event)
+{
+        node->type = fluid_event_get_type(event);
+        node->source = fluid_event_get_source(event);
+        node->dest = fluid_event_get_dest(event);
+        node->channel = fluid_event_get_channel(event);
+        node->key = fluid_event_get_key(event);
+        node->velocity = fluid_event_get_velocity(event);
+        node->control = fluid_event_get_control(event);
+        node->value = fluid_event_get_value(event);
+        node->program = fluid_event_get_program(event);
+        node->bank = fluid_event_get_bank(event);
+        node->pitch = fluid_event_get_pitch(event);
+        node->duration = fluid_event_get_duration(event);
+        node->sfont_id = fluid_event_get_sfont_id(event);
+        node->data = fluid_event_get_data(event);
+}
+
+static void
+ledger_restore (fluid_event_t* event, const struct ledger_node* n)
+{
+        fluid_event_set_source(event, n->source);
+        fluid_event_set_dest(event, n->dest);
+
+        switch (n->type) {
+        case FLUID_SEQ_NOTE:             fluid_event_note(event, n->channel, n->key, n->velocity, n->duration); break;
+        case FLUID_SEQ_NOTEON:           fluid_event_noteon(event, n->channel, n->key, n->velocity); break;
+        case FLUID_SEQ_NOTEOFF:          fluid_event_noteoff(event, n->channel, n->key); break;
+        case FLUID_SEQ_ALLSOUNDSOFF:     fluid_event_all_sounds_off(event, n->channel); break;
+        case FLUID_SEQ_ALLNOTESOFF:      fluid_event_all_notes_off(event, n->channel); break;
+        case FLUID_SEQ_BANKSELECT:       fluid_event_bank_select(event, n->channel, n->bank); break;
+        case FLUID_SEQ_PROGRAMCHANGE:    fluid_event_program_change(event, n->channel, n->program); break;
+        case FLUID_SEQ_PROGRAMSELECT:    fluid_event_program_select(event, n->channel, n->sfont_id, n->bank, n->program); break;
+        case FLUID_SEQ_PITCHBEND:        fluid_event_pitch_bend(event, n->channel, n->pitch); break;
+        case FLUID_SEQ_PITCHWHEELSENS:   fluid_event_pitch_wheelsens(event, n->channel, n->value); break;
+        case FLUID_SEQ_MODULATION:       fluid_event_modulation(event, n->channel, n->value); break;
+        case FLUID_SEQ_SUSTAIN:          fluid_event_sustain(event, n->channel, n->value); break;
+        case FLUID_SEQ_CONTROLCHANGE:    fluid_event_control_change(event, n->channel, n->control, n->value); break;
+        case FLUID_SEQ_PAN:              fluid_event_pan(event, n->channel, n->value); break;
+        case FLUID_SEQ_VOLUME:           fluid_event_volume(event, n->channel, n->value); break;
+        case FLUID_SEQ_REVERBSEND:       fluid_event_reverb_send(event, n->channel, n->value); break;
+        case FLUID_SEQ_CHORUSSEND:       fluid_event_chorus_send(event, n->channel, n->value); break;
+        case FLUID_SEQ_TIMER:            fluid_event_timer(event, n->data); break;
+        case FLUID_SEQ_ANYCONTROLCHANGE: fluid_event_any_control_change(event, n->channel); break;
+        case FLUID_SEQ_CHANNELPRESSURE:  fluid_event_channel_pressure(event, n->channel, n->value); break;
+        case FLUID_SEQ_SYSTEMRESET:      fluid_event_system_reset(event); break;
+        }
+}
+
+/*
+ * Optional fields of the `fluid_sequencer_cancel_range` filter, also
+ * used by `fluid_sequencer_remove_events`, -1 matches anything.
+ *
+ */
+
+struct ledger_filter {
+        int source;
+        int dest;
+        int type;
+        int channel;
+        int key;
+};
+
+static int
+ledger_filter_match (const struct ledger_filter* f, const struct ledger_node* n)
+{
+        return (f->source < 0 || f->source == n->source)
+                && (f->dest < 0 || f->dest == n->dest)
+                && (f->type < 0 || f->type == n->type)
+                && (f->channel < 0 || f->channel == n->channel)
+                && (f->key < 0 || f->key == n->key);
+}
+
+// free the nodes of `t` matching `f`, counting them in `st` as
+// cancelled or, for `fluid_sequencer_remove_events`, removed, and
+// append the others to `kept`
+static struct ledger_node*
+ledger_cancel_tree (struct ledger* lg, struct ledger_node* t,
+                    const struct ledger_filter* f, struct ledger_node* kept,
+                    struct seq_stats* st, int removed, int* cancelled)
+{
+        if (t == NULL) { return kept; }
+
+        struct ledger_node* right = t->right;
+        kept = ledger_cancel_tree(lg, t->left, f, kept, st, removed, cancelled);
+
+        if (f == NULL || ledger_filter_match(f, t)) {
+                seq_stats_dropped(st, t->dest, removed);
+                ledger_node_free(lg, t);
+                (*cancelled)++;
+        } else {
+                t->left = t->right = NULL;
+                kept = ledger_merge(kept, t);
+        }
+
+        return ledger_cancel_tree(lg, right, f, kept, st, removed, cancelled);
+}
+
+// hand the nodes of `t` to the sequencer in tick order and free them
+static void
+ledger_release_tree (struct ledger* lg, struct ledger_node* t)
+{
+        if (t == NULL) { return; }
+
+        struct ledger_node* right = t->right;
+        ledger_release_tree(lg, t->left);
+
+        ledger_restore(lg->event, t);
+        fluid_sequencer_send_at(lg->seq, lg->event, t->tick, 1);
+        ledger_node_free(lg, t);
+
+        ledger_release_tree(lg, right);
+}
+
+// make sure the pump wakes up when the earliest held event is due
+static void
+ledger_arm (struct ledger* lg)
+{
+        if (lg->root == NULL) { return; }
+
+        struct ledger_node* first = lg->root;
+        while (first->left != NULL) { first = first->left; }
+
+        unsigned int wake = first->tick > lg->lookahead ? first->tick - lg->lookahead : 0;
+        if (lg->armed && lg->armed_tick <= wake) { return; }
+
+        fluid_sequencer_send_at(lg->seq, lg->timer, wake, 1);
+        lg->armed = 1;
+        lg->armed_tick = wake;
+}
+
+// release everything due by `now` and rearm, with `lock` held
+static void
+ledger_pump_locked (struct ledger* lg, unsigned int now)
+{
+        struct ledger_node* due;
+        ledger_split(lg->root, now + lg->lookahead + 1, &due, &lg->root);
+        ledger_release_tree(lg, due);
+        ledger_arm(lg);
+}
+
+static void
+ledger_pump (unsigned int time, fluid_event_t* event,
+             fluid_sequencer_t* seq, void* data)
+{
+        struct ledger* lg = (struct ledger*)data;
+        if (fluid_event_get_type(event) != FLUID_SEQ_TIMER) { return; }
+
+        pthread_mutex_lock(&lg->lock);
+        if (lg->armed && time >= lg->armed_tick) { lg->armed = 0; }
+        ledger_pump_locked(lg, fluid_sequencer_get_tick(seq));
+        pthread_mutex_unlock(&lg->lock);
+}
+
+/*
+ * Schedule `event` at `time` through the ledger of its sequencer, or
+ * directly when the sequencer has no ledger (`lg` is NULL) or the
+ * event is already within the lookahead.
+ *
+ */
+
+static int
+ledger_send_at (struct ledger* lg, fluid_sequencer_t* seq,
+                fluid_event_t* event, unsigned int time, int absolute)
+{
+        if (lg == NULL) { return fluid_sequencer_send_at(seq, event, time, absolute); }
+
+        pthread_mutex_lock(&lg->lock);
+
+        unsigned int now = fluid_sequencer_get_tick(seq);
+        unsigned int tick = absolute ? time : now + time;
+
+        if (tick <= now + lg->lookahead) {
+                pthread_mutex_unlock(&lg->lock);
+                return fluid_sequencer_send_at(seq, event, tick, 1);
+        }
+
+        struct ledger_node* node = lg->spare;
+        if (node != NULL) {
+                lg->spare = node->right;
+        } else {
+                node = malloc(sizeof(struct ledger_node));
+                if (node == NULL) {
+                        pthread_mutex_unlock(&lg->lock);
+                        return FLUID_FAILED;
+                }
+        }
+
+        lg->rng ^= lg->rng << 13;
+        lg->rng ^= lg->rng >> 17;
+        lg->rng ^= lg->rng << 5;
+
+        node->tick = tick;
+        node->order = lg->order++;
+        node->priority = lg->rng;
+        node->left = node->right = NULL;
+        ledger_capture(node, event);
+
+        lg->root = ledger_insert(lg->root, node);
+        lg->count++;
+        ledger_arm(lg);
+
+        pthread_mutex_unlock(&lg->lock);
+        return FLUID_OK;
+}
+
+static void
+ledger_free_tree (struct ledger_node* t)
+{
+        if (t == NULL) { return; }
+        ledger_free_tree(t->left);
+        ledger_free_tree(t->right);
+        free(t);
+}
+
+// called once the sequencer, and with it the pump client, is gone
+static void
+ledger_forget (fluid_sequencer_t* seq)
+{
+        for (struct ledger** p = &ledger_list; *p != NULL; p = &(*p)->next) {
+                if ((*p)->seq == seq) {
+                        struct ledger* lg = *p;
+                        *p = lg->next;
+
+                        ledger_free_tree(lg->root);
+                        while (lg->spare != NULL) {
+                                struct ledger_node* node = lg->spare;
+                                lg->spare = node->right;
+                                free(node);
+                        }
+                        delete_fluid_event(lg->event);
+                        delete_fluid_event(lg->timer);
+                        pthread_mutex_destroy(&lg->lock);
+                        free(lg);
+                        return;
+                }
+        }
+}
+
 /*
  * FLUIDSYNTH_API fluid_sequencer_t *
  * new_fluid_sequencer (void)
@@ -41,7 +626,7 @@ static int
 c_new_fluid_sequencer2 (lua_State* L)
 {
         luaL_checktype(L, 1, LUA_TBOOLEAN);
-        int use_system_timer = (int)luaL_checkinteger(L, 1);
+        int use_system_timer = lua_toboolean(L, 1);
 
         fluid_sequencer_t* sequencer = new_fluid_sequencer2(use_system_timer);
 	if ((int)sequencer == FLUID_FAILED) { lua_pushnil(L); return 1; }
@@ -52,6 +637,15 @@ c_new_fluid_sequencer2 (lua_State* L)
         return 1;
 }
 
+// defined with the client callbacks, events, the scheduler, patterns
+// and SoundFont swaps below
+static void cbdata_forget (lua_State* L, fluid_sequencer_t* seq);
+static fluid_event_t* check_event (lua_State* L, int index);
+static void sched_forget (fluid_sequencer_t* seq);
+static lua_Integer sched_dispatch (fluid_sequencer_t* seq, lua_Integer max);
+static void pattern_forget (fluid_sequencer_t* seq);
+static void sfswap_seq_forget (fluid_sequencer_t* seq);
+
 /*
  *  FLUIDSYNTH_API void
  *  delete_fluid_sequencer (fluid_sequencer_t *seq)
@@ -65,6 +659,12 @@ c_delete_fluid_sequencer (lua_State* L)
 {
         fluid_sequencer_t*  sequencer = *(fluid_sequencer_t**)lua_touserdata(L, 1);
         delete_fluid_sequencer(sequencer);
+        cbdata_forget(L, sequencer);
+        seq_stats_forget(sequencer);
+        ledger_forget(sequencer);
+        sched_forget(sequencer);
+        pattern_forget(sequencer);
+        sfswap_seq_forget(sequencer);
         return 0;
 }
 
@@ -96,12 +696,194 @@ c_fluid_sequencer_get_use_system_timer (lua_State* L)
  *
  */
 
+/*
+ * Callback modes, selected by the optional 5th argument:
+ *
+ *   "event"   callback(time, event, seq, data), where `event` and `seq`
+ *             are fresh userdata boxes (the default)
+ *
+ *   "fields"  callback(time, type, channel, key, velocity, control,
+ *             value, seq, data), where every event field is a plain
+ *             integer and `seq` is the userdata passed at registration,
+ *             so a callback allocates nothing in Lua
+ *
+ *   "queued"  the sequencer only copies the event into a lock-free
+ *             single-producer/single-consumer ring and never touches
+ *             the Lua state; `fluid_sequencer_dispatch` later calls the
+ *             callback as in "fields" mode on the thread that owns
+ *             the Lua state. The optional 6th argument is the ring
+ *             capacity, between 1 and 2^24 and rounded up to a power
+ *             of two. Events that
+ *             arrive while the ring is full are counted and dropped.
+ *
+ * In "queued" mode the ring has a single producer, the thread running
+ * the sequencer queue, so events for such a client must be scheduled
+ * with `fluid_sequencer_send_at` rather than sent with
+ * `fluid_sequencer_send_now` from another thread.
+ *
+ */
+
+enum cb_mode {
+        CB_MODE_EVENT = 0,
+        CB_MODE_FIELDS,
+        CB_MODE_QUEUED
+};
+
+static const char* const cb_modes[] = { "event", "fields", "queued", NULL };
+
+#define CB_RING_DEFAULT_SIZE 1024
+#define CB_RING_MAX_SIZE (1 << 24)
+
+struct cb_record {
+        unsigned int time;
+        int type;
+        int channel;
+        short key;
+        short velocity;
+        short control;
+        short value;
+};
+
+struct cb_ring {
+        unsigned int mask;
+        atomic_uint head;       // next record to read, owned by the consumer
+        atomic_uint tail;       // next record to write, owned by the producer
+        atomic_ulong dropped;
+        struct cb_record records[];
+};
+
 struct cbdata {
         lua_State* L;
+        int mode;
         int cb_index;
         int data_index;
+        int seq_index;
+
+        fluid_sequencer_t* seq;
+        short id;
+        struct cb_ring* ring;
+        struct client_stats stats;
+
+        int busy;                       // callbacks currently running
+        int unregistered;               // free once no callback is running
+        struct cbdata** handle;         // box of a "fluid.client" handle
+
+        struct cbdata* next;
 };
 
+// every client registered through `c_fluid_sequencer_register_client`
+static struct cbdata* cbdata_list = NULL;
+
+// release the registry references and memory of an unlinked client
+static void
+cbdata_free (lua_State* L, struct cbdata* cb)
+{
+        luaL_unref(L, LUA_REGISTRYINDEX, cb->cb_index);
+        luaL_unref(L, LUA_REGISTRYINDEX, cb->data_index);
+        luaL_unref(L, LUA_REGISTRYINDEX, cb->seq_index);
+
+        if (cb->handle != NULL) { *cb->handle = NULL; }
+
+        free(cb->ring);
+        free(cb);
+}
+
+/*
+ * Unregister a client and free it, or leave the freeing to
+ * `event_callback_wrapper` when the client is unregistered from its
+ * own callback.
+ *
+ */
+
+static void
+cbdata_unregister (lua_State* L, struct cbdata* cb)
+{
+        for (struct cbdata** p = &cbdata_list; *p != NULL; p = &(*p)->next) {
+                if (*p == cb) { *p = cb->next; break; }
+        }
+
+        cb->busy++;
+        fluid_sequencer_unregister_client(cb->seq, cb->id);
+        cb->busy--;
+
+        if (cb->busy > 0) {
+                cb->unregistered = 1;
+        } else {
+                cbdata_free(L, cb);
+        }
+}
+
+// free the clients of a sequencer that is being deleted
+static void
+cbdata_forget (lua_State* L, fluid_sequencer_t* seq)
+{
+        struct cbdata** p = &cbdata_list;
+        while (*p != NULL) {
+                struct cbdata* cb = *p;
+                if (cb->seq == seq) {
+                        *p = cb->next;
+                        cbdata_free(L, cb);
+                } else {
+                        p = &cb->next;
+                }
+        }
+}
+
+static struct cb_ring*
+cb_ring_new (unsigned int size)
+{
+        unsigned int capacity = 1;
+        while (capacity < size) { capacity <<= 1; }
+
+        struct cb_ring* ring = malloc(sizeof(struct cb_ring)
+                                      + capacity * sizeof(struct cb_record));
+        if (ring == NULL) { return NULL; }
+
+        ring->mask = capacity - 1;
+        atomic_init(&ring->head, 0);
+        atomic_init(&ring->tail, 0);
+        atomic_init(&ring->dropped, 0);
+
+        return ring;
+}
+
+static void
+cb_ring_push (struct cb_ring* ring, unsigned int time, fluid_event_t* event)
+{
+        unsigned int tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+        unsigned int head = atomic_load_explicit(&ring->head, memory_order_acquire);
+
+        if (tail - head > ring->mask) {
+                atomic_fetch_add_explicit(&ring->dropped, 1, memory_order_relaxed);
+                return;
+        }
+
+        struct cb_record* r = &ring->records[tail & ring->mask];
+        r->time = time;
+        r->type = fluid_event_get_type(event);
+        r->channel = fluid_event_get_channel(event);
+        r->key = fluid_event_get_key(event);
+        r->velocity = fluid_event_get_velocity(event);
+        r->control = fluid_event_get_control(event);
+        r->value = fluid_event_get_value(event);
+
+        atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+}
+
+static int
+cb_ring_pop (struct cb_ring* ring, struct cb_record* out)
+{
+        unsigned int head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+        unsigned int tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+
+        if (head == tail) { return 0; }
+
+        *out = ring->records[head & ring->mask];
+        atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+
+        return 1;
+}
+
 static void
 event_callback_wrapper (unsigned int time,
                         fluid_event_t *event,
@@ -110,34 +892,87 @@ event_callback_wrapper (unsigned int time,
 {
         struct cbdata* cb = (struct cbdata*)data;
 
+        if (cb->mode == CB_MODE_QUEUED) {
+                // the client is going away, there is nothing left to
+                // dispatch to
+                if (fluid_event_get_type(event) == FLUID_SEQ_UNREGISTERING) { return; }
+
+                cb_ring_push(cb->ring, time, event);
+                return;
+        }
+
         // push callback function onto stack
         lua_rawgeti(cb->L, LUA_REGISTRYINDEX, cb->cb_index);
 
         // push `time`
         lua_pushinteger(cb->L, time);
-        
-        // push `event`
-        fluid_event_t** event_p = lua_newuserdata(cb->L, sizeof(fluid_event_t*));
-        *event_p = event;
-        
-        // push `seq`
-        fluid_sequencer_t** seq_p = lua_newuserdata(cb->L, sizeof(fluid_sequencer_t*));
-        *seq_p = seq;
-        
-        // push data onto stack
-        lua_rawgeti(cb->L, LUA_REGISTRYINDEX, cb->data_index);
+
+        int nargs;
+        if (cb->mode == CB_MODE_FIELDS) {
+                lua_pushinteger(cb->L, fluid_event_get_type(event));
+                lua_pushinteger(cb->L, fluid_event_get_channel(event));
+                lua_pushinteger(cb->L, fluid_event_get_key(event));
+                lua_pushinteger(cb->L, fluid_event_get_velocity(event));
+                lua_pushinteger(cb->L, fluid_event_get_control(event));
+                lua_pushinteger(cb->L, fluid_event_get_value(event));
+
+                // push the `seq` userdata the client was registered with
+                lua_rawgeti(cb->L, LUA_REGISTRYINDEX, cb->seq_index);
+                lua_rawgeti(cb->L, LUA_REGISTRYINDEX, cb->data_index);
+
+                nargs = 9;
+        } else {
+                // push `event`
+                fluid_event_t** event_p = lua_newuserdata(cb->L, sizeof(fluid_event_t*));
+                *event_p = event;
+
+                // push `seq`
+                fluid_sequencer_t** seq_p = lua_newuserdata(cb->L, sizeof(fluid_sequencer_t*));
+                *seq_p = seq;
+
+                // push data onto stack
+                lua_rawgeti(cb->L, LUA_REGISTRYINDEX, cb->data_index);
+
+                nargs = 4;
+        }
+
+        unsigned int now = fluid_sequencer_get_tick(seq);
+        unsigned long long start = clock_ns();
 
         // apply the lua callback function
-        lua_call(cb->L, 4, 0);
+        cb->busy++;
+        lua_call(cb->L, nargs, 0);
+        cb->busy--;
+
+        if (cb->unregistered) {
+                if (cb->busy == 0) { cbdata_free(cb->L, cb); }
+                return;
+        }
+
+        client_stats_record(&cb->stats, time, now, clock_ns() - start);
 }
 
-static int
-c_fluid_sequencer_register_client (lua_State* L)
+// register the client described by arguments 1 to 6, see the modes above
+static struct cbdata*
+register_client (lua_State* L)
 {
         fluid_sequencer_t* sequencer = *(fluid_sequencer_t**)lua_touserdata(L, 1);
         const char* name = (const char*)luaL_checkstring(L, 2);
         luaL_checktype(L, 3, LUA_TFUNCTION);
         luaL_checktype(L, 4, LUA_TTABLE);
+        int mode = luaL_checkoption(L, 5, "event", cb_modes);
+        lua_Integer n = luaL_optinteger(L, 6, CB_RING_DEFAULT_SIZE);
+        luaL_argcheck(L, n >= 1 && n <= CB_RING_MAX_SIZE, 6, "ring size out of range");
+        unsigned int ring_size = (unsigned int)n;
+        lua_settop(L, 4);
+
+        struct cbdata* cb = calloc(1, sizeof(struct cbdata));
+        if (cb == NULL) { return NULL; }
+
+        if (mode == CB_MODE_QUEUED) {
+                cb->ring = cb_ring_new(ring_size);
+                if (cb->ring == NULL) { free(cb); return NULL; }
+        }
 
         /*
          * `data` is the 4th parameter (top of stack). `luaL_ref` pops
@@ -149,19 +984,39 @@ c_fluid_sequencer_register_client (lua_State* L)
         // `callback` is the 3rd parameter (now at top of stack)
         int callback_index = luaL_ref(L, LUA_REGISTRYINDEX);
 
-        struct cbdata* cb = malloc(sizeof(struct cbdata));
+        // keep a reference to the `seq` userdata for "fields" and
+        // "queued" modes
+        lua_pushvalue(L, 1);
+        int seq_index = luaL_ref(L, LUA_REGISTRYINDEX);
+
         cb->L = L;
+        cb->mode = mode;
         cb->cb_index = callback_index;
         cb->data_index = callback_data_index;
+        cb->seq_index = seq_index;
+        cb->seq = sequencer;
         
         short seqid = fluid_sequencer_register_client(sequencer,
                                                       name,
                                                       event_callback_wrapper,
                                                       (void*)cb);
         
-        if ((int)seqid == FLUID_FAILED) { lua_pushnil(L); return 1; }
+        if ((int)seqid == FLUID_FAILED) { cbdata_free(L, cb); return NULL; }
+
+        cb->id = seqid;
+        cb->next = cbdata_list;
+        cbdata_list = cb;
+
+        return cb;
+}
+
+static int
+c_fluid_sequencer_register_client (lua_State* L)
+{
+        struct cbdata* cb = register_client(L);
+        if (cb == NULL) { lua_pushnil(L); return 1; }
         
-        lua_pushinteger(L, (int)seqid);
+        lua_pushinteger(L, (int)cb->id);
         return 1;
 }
 
@@ -179,42 +1034,183 @@ c_fluid_sequencer_unregister_client (lua_State* L)
 {
         fluid_sequencer_t* sequencer = *(fluid_sequencer_t**)lua_touserdata(L, 1);
         short client_id = (short)luaL_checkinteger(L, 2);
-        
+
+        for (struct cbdata* cb = cbdata_list; cb != NULL; cb = cb->next) {
+                if (cb->seq == sequencer && cb->id == client_id) {
+                        cbdata_unregister(L, cb);
+                        return 0;
+                }
+        }
+
+        // not registered from Lua
         fluid_sequencer_unregister_client(sequencer, client_id);
         
         return 0;
 }
 
 /*
- * FLUIDSYNTH_API int
- * fluid_sequencer_count_clients (fluid_sequencer_t *seq)
- * 
- * Count a sequencers registered clients.
+ * new_fluid_sequencer_client (seq, name, callback, data [, mode [, ring_size]])
+ *
+ * Register a client like `fluid_sequencer_register_client`, but return
+ * a handle that unregisters it and releases its callback state when
+ * it is closed (Lua 5.4 `<close>` variables), deleted or collected.
+ * Use `fluid_sequencer_client_id` to get the id to send events to.
  *
  */
 
 static int
-c_fluid_sequencer_count_clients (lua_State* L)
+c_new_fluid_sequencer_client (lua_State* L)
 {
-        fluid_sequencer_t* sequencer = *(fluid_sequencer_t**)lua_touserdata(L, 1);
-	int num_clients = fluid_sequencer_count_clients(sequencer);
-        
-        lua_pushinteger(L, num_clients);
+        struct cbdata* cb = register_client(L);
+        if (cb == NULL) { lua_pushnil(L); return 1; }
+
+        struct cbdata** cb_p = lua_newuserdata(L, sizeof(struct cbdata*));
+        *cb_p = cb;
+        cb->handle = cb_p;
+        luaL_setmetatable(L, "fluid.client");
 
         return 1;
 }
 
+static int
+gc_delete_fluid_sequencer_client (lua_State* L)
+{
+        struct cbdata** cb_p = (struct cbdata**)lua_touserdata(L, 1);
+        struct cbdata* cb = *cb_p;
+        if (cb == NULL) { return 0; }
+
+        cb->handle = NULL;
+        *cb_p = NULL;
+        cbdata_unregister(L, cb);
+
+        return 0;
+}
+
 /*
- * FLUIDSYNTH_API short
- * fluid_sequencer_get_client_id (fluid_sequencer_t *seq,
- *                                int index)
- * 
- * Get a client ID from its index (order in which it was registered). 
+ * delete_fluid_sequencer_client (client)
+ *
+ * Unregister a client returned by `new_fluid_sequencer_client` now.
+ * Deleting it twice, or after its sequencer, does nothing.
  *
  */
 
 static int
-c_fluid_sequencer_get_client_id (lua_State* L)
+c_delete_fluid_sequencer_client (lua_State* L)
+{
+        luaL_checkudata(L, 1, "fluid.client");
+        return gc_delete_fluid_sequencer_client(L);
+}
+
+/*
+ * fluid_sequencer_client_id (client)
+ *
+ * Get the sequencer id of a client handle, or nil once it has been
+ * unregistered.
+ *
+ */
+
+static int
+c_fluid_sequencer_client_id (lua_State* L)
+{
+        struct cbdata** cb_p = (struct cbdata**)luaL_checkudata(L, 1, "fluid.client");
+        if (*cb_p == NULL) { lua_pushnil(L); return 1; }
+
+        lua_pushinteger(L, (*cb_p)->id);
+        return 1;
+}
+
+/*
+ * fluid_sequencer_dispatch (seq, max)
+ *
+ * Deliver events queued for the "queued" mode clients of a sequencer
+ * by calling their callbacks on the calling thread, after resuming the
+ * due coroutines of schedulers on a sequencer with the system timer.
+ * At most `max` events and wake ups are delivered when given.
+ *
+ * Returns the number of delivered events and resumed coroutines.
+ *
+ */
+
+static int
+c_fluid_sequencer_dispatch (lua_State* L)
+{
+        fluid_sequencer_t* sequencer = *(fluid_sequencer_t**)lua_touserdata(L, 1);
+        lua_Integer max = luaL_optinteger(L, 2, -1);
+
+        lua_Integer count = sched_dispatch(sequencer, max);
+        struct cbdata* cb = cbdata_list;
+
+        while (cb != NULL && (max < 0 || count < max)) {
+                struct cb_record r;
+                if (cb->seq != sequencer || cb->mode != CB_MODE_QUEUED
+                    || !cb_ring_pop(cb->ring, &r)) {
+                        cb = cb->next;
+                        continue;
+                }
+
+                lua_rawgeti(L, LUA_REGISTRYINDEX, cb->cb_index);
+                lua_pushinteger(L, r.time);
+                lua_pushinteger(L, r.type);
+                lua_pushinteger(L, r.channel);
+                lua_pushinteger(L, r.key);
+                lua_pushinteger(L, r.velocity);
+                lua_pushinteger(L, r.control);
+                lua_pushinteger(L, r.value);
+                lua_rawgeti(L, LUA_REGISTRYINDEX, cb->seq_index);
+                lua_rawgeti(L, LUA_REGISTRYINDEX, cb->data_index);
+
+                short id = cb->id;
+                unsigned int now = fluid_sequencer_get_tick(sequencer);
+                unsigned long long start = clock_ns();
+
+                lua_call(L, 9, 0);
+                count++;
+                unsigned long long ns = clock_ns() - start;
+
+                // the callback may have unregistered clients, so look the
+                // current one up again and start over if it is gone
+                for (cb = cbdata_list; cb != NULL; cb = cb->next) {
+                        if (cb->seq == sequencer && cb->id == id) { break; }
+                }
+                if (cb == NULL) { cb = cbdata_list; continue; }
+
+                client_stats_record(&cb->stats, r.time, now, ns);
+        }
+
+        lua_pushinteger(L, count);
+        return 1;
+}
+
+/*
+ * FLUIDSYNTH_API int
+ * fluid_sequencer_count_clients (fluid_sequencer_t *seq)
+ * 
+ * Count a sequencers registered clients.
+ *
+ */
+
+static int
+c_fluid_sequencer_count_clients (lua_State* L)
+{
+        fluid_sequencer_t* sequencer = *(fluid_sequencer_t**)lua_touserdata(L, 1);
+	int num_clients = fluid_sequencer_count_clients(sequencer);
+        
+        lua_pushinteger(L, num_clients);
+
+        return 1;
+}
+
+/*
+ * FLUIDSYNTH_API short
+ * fluid_sequencer_get_client_id (fluid_sequencer_t *seq,
+ *                                int index)
+ * 
+ * Get a client ID from its index (order in which it was registered). 
+ *
+ */
+
+static int
+c_fluid_sequencer_get_client_id (lua_State* L)
 {
         fluid_sequencer_t* sequencer = *(fluid_sequencer_t**)lua_touserdata(L, 1);
         int index = (int)luaL_checkinteger(L, 2);
@@ -305,9 +1301,12 @@ static int
 c_fluid_sequencer_send_now (lua_State* L)
 {
         fluid_sequencer_t* sequencer = *(fluid_sequencer_t**)lua_touserdata(L, 1);
-        fluid_event_t*  event = *(fluid_event_t**)lua_touserdata(L, 2);
+        fluid_event_t*  event = check_event(L, 2);
         
 	fluid_sequencer_send_now(sequencer, event);
+
+        seq_stats_scheduled(seq_stats_get(sequencer), fluid_event_get_dest(event),
+                            fluid_sequencer_get_tick(sequencer));
         
         return 0;
 }
@@ -327,20 +1326,249 @@ static int
 c_fluid_sequencer_send_at (lua_State* L)
 {
         fluid_sequencer_t* sequencer = *(fluid_sequencer_t**)lua_touserdata(L, 1);
-        fluid_event_t*  event = *(fluid_event_t**)lua_touserdata(L, 2);
+        fluid_event_t*  event = check_event(L, 2);
 
         unsigned int time = (unsigned int)luaL_checkinteger(L, 3);
         
         luaL_checktype(L, 4, LUA_TBOOLEAN);
-        int is_absolute = (int)lua_tointeger(L, 4);
+        int is_absolute = lua_toboolean(L, 4);
         
-	int status = fluid_sequencer_send_at(sequencer, event, time, is_absolute);
+	int status = ledger_send_at(ledger_find(sequencer), sequencer, event, time, is_absolute);
         if (status == FLUID_FAILED) { lua_pushnil(L); return 1; }
+
+        unsigned int tick = is_absolute ? time : fluid_sequencer_get_tick(sequencer) + time;
+        seq_stats_scheduled(seq_stats_get(sequencer), fluid_event_get_dest(event), tick);
         
         lua_pushinteger(L, FLUID_OK);
         return 1;
 }
 
+/*
+ * Event kinds understood by the batch and pattern helpers. Each name
+ * is the suffix of the matching `fluid_event_*` setter and its index
+ * is the kind byte of a packed record.
+ *
+ * Parameters `a`, `b` and `c` are, per kind:
+ *
+ *   note              key, velocity, duration
+ *   noteon            key, velocity
+ *   noteoff           key
+ *   control_change    control, value
+ *   program_select    bank, program, sfont_id
+ *   all_*, timer,
+ *   system_reset      (none)
+ *   everything else   value
+ *
+ */
+
+enum seq_event_kind {
+        KIND_NOTE = 0,
+        KIND_NOTEON,
+        KIND_NOTEOFF,
+        KIND_CONTROL_CHANGE,
+        KIND_PITCH_BEND,
+        KIND_PROGRAM_CHANGE,
+        KIND_BANK_SELECT,
+        KIND_CHANNEL_PRESSURE,
+        KIND_PAN,
+        KIND_VOLUME,
+        KIND_SUSTAIN,
+        KIND_MODULATION,
+        KIND_REVERB_SEND,
+        KIND_CHORUS_SEND,
+        KIND_PITCH_WHEELSENS,
+        KIND_ALL_NOTES_OFF,
+        KIND_ALL_SOUNDS_OFF,
+        KIND_TIMER,
+        KIND_PROGRAM_SELECT,
+        KIND_SYSTEM_RESET,
+        KIND_LAST
+};
+
+static const char* const seq_event_kinds[] = {
+        "note", "noteon", "noteoff", "control_change", "pitch_bend",
+        "program_change", "bank_select", "channel_pressure", "pan",
+        "volume", "sustain", "modulation", "reverb_send", "chorus_send",
+        "pitch_wheelsens", "all_notes_off", "all_sounds_off", "timer",
+        "program_select", "system_reset", NULL
+};
+
+static int
+seq_event_kind_from_name (const char* name)
+{
+        for (int i = 0; seq_event_kinds[i] != NULL; i++) {
+                if (strcmp(seq_event_kinds[i], name) == 0) { return i; }
+        }
+        return -1;
+}
+
+static void
+seq_event_fill (fluid_event_t* event, int kind, int channel,
+                int a, int b, unsigned int c)
+{
+        switch (kind) {
+        case KIND_NOTE:             fluid_event_note(event, channel, a, b, c); break;
+        case KIND_NOTEON:           fluid_event_noteon(event, channel, a, b); break;
+        case KIND_NOTEOFF:          fluid_event_noteoff(event, channel, a); break;
+        case KIND_CONTROL_CHANGE:   fluid_event_control_change(event, channel, a, b); break;
+        case KIND_PITCH_BEND:       fluid_event_pitch_bend(event, channel, a); break;
+        case KIND_PROGRAM_CHANGE:   fluid_event_program_change(event, channel, a); break;
+        case KIND_BANK_SELECT:      fluid_event_bank_select(event, channel, a); break;
+        case KIND_CHANNEL_PRESSURE: fluid_event_channel_pressure(event, channel, a); break;
+        case KIND_PAN:              fluid_event_pan(event, channel, a); break;
+        case KIND_VOLUME:           fluid_event_volume(event, channel, a); break;
+        case KIND_SUSTAIN:          fluid_event_sustain(event, channel, a); break;
+        case KIND_MODULATION:       fluid_event_modulation(event, channel, a); break;
+        case KIND_REVERB_SEND:      fluid_event_reverb_send(event, channel, a); break;
+        case KIND_CHORUS_SEND:      fluid_event_chorus_send(event, channel, a); break;
+        case KIND_PITCH_WHEELSENS:  fluid_event_pitch_wheelsens(event, channel, a); break;
+        case KIND_ALL_NOTES_OFF:    fluid_event_all_notes_off(event, channel); break;
+        case KIND_ALL_SOUNDS_OFF:   fluid_event_all_sounds_off(event, channel); break;
+        case KIND_TIMER:            fluid_event_timer(event, NULL); break;
+        case KIND_PROGRAM_SELECT:   fluid_event_program_select(event, channel, c, a, b); break;
+        case KIND_SYSTEM_RESET:     fluid_event_system_reset(event); break;
+        }
+}
+
+static unsigned int
+read_u32le (const unsigned char* p)
+{
+        return (unsigned int)p[0] | ((unsigned int)p[1] << 8)
+                | ((unsigned int)p[2] << 16) | ((unsigned int)p[3] << 24);
+}
+
+static int
+read_i16le (const unsigned char* p)
+{
+        return (short)((unsigned short)p[0] | ((unsigned short)p[1] << 8));
+}
+
+/*
+ * fluid_sequencer_send_batch (seq, events, absolute)
+ *
+ * Schedule many events with a single call. `events` is either an
+ * array of event tables
+ *
+ *   { time, dest, kind, channel, a, b, c }
+ *
+ * where `kind` is one of `seq_event_kinds`, or a string of packed
+ * 16 byte records as produced by
+ *
+ *   string.pack("<I4i2BBi2i2I4", time, dest, kind, channel, a, b, c)
+ *
+ * where `kind` is the zero based index into `seq_event_kinds`. All
+ * events get source -1 and are sent through one internal event
+ * structure, so no event is allocated per note.
+ *
+ * Every event is checked before the first one is sent, so a malformed
+ * event raises an error without scheduling anything.
+ *
+ * Returns the number of scheduled events, or nil and the number of
+ * events scheduled before the sequencer refused one.
+ *
+ */
+
+#define SEQ_BATCH_RECORD_SIZE 16
+
+static fluid_event_t* batch_event = NULL;
+
+static int
+c_fluid_sequencer_send_batch (lua_State* L)
+{
+        fluid_sequencer_t* sequencer = *(fluid_sequencer_t**)lua_touserdata(L, 1);
+        luaL_checktype(L, 3, LUA_TBOOLEAN);
+        int is_absolute = lua_toboolean(L, 3);
+
+        if (batch_event == NULL) {
+                batch_event = new_fluid_event();
+                if (batch_event == NULL) { lua_pushnil(L); return 1; }
+        }
+        fluid_event_t* event = batch_event;
+        fluid_event_set_source(event, -1);
+
+        struct seq_stats* st = seq_stats_get(sequencer);
+        unsigned int now = is_absolute ? 0 : fluid_sequencer_get_tick(sequencer);
+        struct ledger* lg = ledger_find(sequencer);
+
+        int count = 0;
+
+        if (lua_type(L, 2) == LUA_TSTRING) {
+                size_t len;
+                const unsigned char* p = (const unsigned char*)lua_tolstring(L, 2, &len);
+                if (len % SEQ_BATCH_RECORD_SIZE != 0) {
+                        return luaL_argerror(L, 2, "length is not a multiple of the record size");
+                }
+                for (size_t off = 0; off < len; off += SEQ_BATCH_RECORD_SIZE) {
+                        if (p[off + 6] >= KIND_LAST) {
+                                return luaL_error(L, "bad event kind %d in record %d", p[off + 6],
+                                                  (int)(off / SEQ_BATCH_RECORD_SIZE) + 1);
+                        }
+                }
+
+                for (size_t off = 0; off < len; off += SEQ_BATCH_RECORD_SIZE) {
+                        const unsigned char* r = p + off;
+                        unsigned int time = read_u32le(r);
+                        int kind = r[6];
+
+                        fluid_event_set_dest(event, (short)read_i16le(r + 4));
+                        seq_event_fill(event, kind, r[7], read_i16le(r + 8),
+                                       read_i16le(r + 10), read_u32le(r + 12));
+
+                        if (ledger_send_at(lg, sequencer, event, time, is_absolute) == FLUID_FAILED) {
+                                lua_pushnil(L);
+                                lua_pushinteger(L, count);
+                                return 2;
+                        }
+                        seq_stats_scheduled(st, (short)read_i16le(r + 4), now + time);
+                        count++;
+                }
+        } else {
+                luaL_checktype(L, 2, LUA_TTABLE);
+                int n = (int)lua_rawlen(L, 2);
+                for (int i = 1; i <= n; i++) {
+                        lua_rawgeti(L, 2, i);
+                        if (!lua_istable(L, -1)) {
+                                return luaL_error(L, "event %d is not a table", i);
+                        }
+                        lua_rawgeti(L, -1, 3);
+                        const char* name = lua_tostring(L, -1);
+                        if (name == NULL || seq_event_kind_from_name(name) < 0) {
+                                return luaL_error(L, "bad event kind in event %d", i);
+                        }
+                        lua_pop(L, 2);
+                }
+
+                for (int i = 1; i <= n; i++) {
+                        lua_rawgeti(L, 2, i);
+                        for (int f = 1; f <= 7; f++) { lua_rawgeti(L, -f, f); }
+
+                        // stack: ..., entry, time, dest, kind, channel, a, b, c
+                        unsigned int time = (unsigned int)lua_tointeger(L, -7);
+                        short dest = (short)lua_tointeger(L, -6);
+                        int kind = seq_event_kind_from_name(lua_tostring(L, -5));
+
+                        fluid_event_set_dest(event, dest);
+                        seq_event_fill(event, kind,
+                                       (int)lua_tointeger(L, -4),
+                                       (int)lua_tointeger(L, -3),
+                                       (int)lua_tointeger(L, -2),
+                                       (unsigned int)lua_tointeger(L, -1));
+                        lua_pop(L, 8);
+
+                        if (ledger_send_at(lg, sequencer, event, time, is_absolute) == FLUID_FAILED) {
+                                lua_pushnil(L);
+                                lua_pushinteger(L, count);
+                                return 2;
+                        }
+                        seq_stats_scheduled(st, dest, now + time);
+                        count++;
+                }
+        }
+
+        lua_pushinteger(L, count);
+        return 1;
+}
+
 /*
  * FLUIDSYNTH_API void
  * fluid_sequencer_remove_events (fluid_sequencer_t *seq,
@@ -350,6 +1578,11 @@ c_fluid_sequencer_send_at (lua_State* L)
  *                                
  * Remove events from the event queue.
  *
+ * Matching events held in the ledger are dropped too and counted as
+ * `removed` in `fluid_sequencer_get_stats`. libfluidsynth does not say
+ * how many queued events it removed, so for those only the call is
+ * counted, in `remove_calls`.
+ *
  */
 
 static int
@@ -361,10 +1594,176 @@ c_fluid_sequencer_remove_events (lua_State* L)
         int type = (int)luaL_checkinteger(L, 4);
         
         fluid_sequencer_remove_events(sequencer, source, dest, type);
+
+        struct seq_stats* st = seq_stats_get(sequencer);
+
+        struct ledger* lg = ledger_find(sequencer);
+        if (lg != NULL) {
+                struct ledger_filter filter = { source, dest, type, -1, -1 };
+                int removed = 0;
+
+                pthread_mutex_lock(&lg->lock);
+                lg->root = ledger_cancel_tree(lg, lg->root, &filter, NULL, st, 1, &removed);
+
+                // the pump's timer may have been removed as well
+                lg->armed = 0;
+                ledger_arm(lg);
+                pthread_mutex_unlock(&lg->lock);
+        }
+
+        if (st != NULL) {
+                st->remove_calls++;
+                if (dest != -1) {
+                        struct dest_stats* d = seq_stats_dest(st, dest);
+                        if (d != NULL) { d->remove_calls++; }
+                }
+        }
         
         return 0;
 }
 
+/*
+ * fluid_sequencer_enable_ledger (seq, lookahead)
+ *
+ * Keep events scheduled through the binding with
+ * `fluid_sequencer_send_at` and `fluid_sequencer_send_batch` in a
+ * ledger until they are within `lookahead` ticks (default 100) of the
+ * current tick, so that they can be cancelled with
+ * `fluid_sequencer_cancel_range`. Calling it again changes the
+ * lookahead.
+ *
+ * Returns the id of the pump client that releases the held events.
+ *
+ */
+
+#define LEDGER_DEFAULT_LOOKAHEAD 100
+
+static int
+c_fluid_sequencer_enable_ledger (lua_State* L)
+{
+        fluid_sequencer_t* sequencer = *(fluid_sequencer_t**)lua_touserdata(L, 1);
+        unsigned int lookahead = (unsigned int)luaL_optinteger(L, 2, LEDGER_DEFAULT_LOOKAHEAD);
+
+        struct ledger* lg = ledger_find(sequencer);
+        if (lg != NULL) {
+                pthread_mutex_lock(&lg->lock);
+                lg->lookahead = lookahead;
+                ledger_pump_locked(lg, fluid_sequencer_get_tick(sequencer));
+                pthread_mutex_unlock(&lg->lock);
+
+                lua_pushinteger(L, lg->pump_id);
+                return 1;
+        }
+
+        lg = calloc(1, sizeof(struct ledger));
+        if (lg == NULL) { lua_pushnil(L); return 1; }
+
+        lg->seq = sequencer;
+        lg->lookahead = lookahead;
+        lg->rng = 0x9e3779b9u;
+        lg->event = new_fluid_event();
+        lg->timer = new_fluid_event();
+        pthread_mutex_init(&lg->lock, NULL);
+
+        short id = FLUID_FAILED;
+        if (lg->event != NULL && lg->timer != NULL) {
+                id = fluid_sequencer_register_client(sequencer, "ledger", ledger_pump, lg);
+        }
+        if ((int)id == FLUID_FAILED) {
+                if (lg->event != NULL) { delete_fluid_event(lg->event); }
+                if (lg->timer != NULL) { delete_fluid_event(lg->timer); }
+                pthread_mutex_destroy(&lg->lock);
+                free(lg);
+                lua_pushnil(L);
+                return 1;
+        }
+
+        lg->pump_id = id;
+        fluid_event_set_source(lg->timer, -1);
+        fluid_event_set_dest(lg->timer, id);
+        fluid_event_timer(lg->timer, NULL);
+
+        lg->next = ledger_list;
+        ledger_list = lg;
+
+        lua_pushinteger(L, id);
+        return 1;
+}
+
+static int
+ledger_filter_field (lua_State* L, int index, const char* name)
+{
+        lua_getfield(L, index, name);
+        int value = lua_isnil(L, -1) ? -1 : (int)luaL_checkinteger(L, -1);
+        lua_pop(L, 1);
+        return value;
+}
+
+/*
+ * fluid_sequencer_cancel_range (seq, from_tick, to_tick, filter)
+ *
+ * Cancel the events held in the ledger of `seq` whose absolute tick
+ * lies in [from_tick, to_tick]. The optional `filter` table limits
+ * the cancellation to events matching all of its fields `source`,
+ * `dest`, `type` (as passed to "fields" callbacks), `channel` and
+ * `key`. Events already within the lookahead have been handed to the
+ * sequencer and are not affected.
+ *
+ * Without a filter this takes O(k + log n) for k cancelled events out
+ * of n held; a filter adds O(log n) for every event in the range that
+ * it keeps.
+ *
+ * Returns the number of cancelled events, or nil if the sequencer has
+ * no ledger.
+ *
+ */
+
+static int
+c_fluid_sequencer_cancel_range (lua_State* L)
+{
+        fluid_sequencer_t* sequencer = *(fluid_sequencer_t**)lua_touserdata(L, 1);
+        unsigned int from = (unsigned int)luaL_checkinteger(L, 2);
+        unsigned int to = (unsigned int)luaL_checkinteger(L, 3);
+
+        struct ledger_filter filter;
+        struct ledger_filter* f = NULL;
+        if (!lua_isnoneornil(L, 4)) {
+                luaL_checktype(L, 4, LUA_TTABLE);
+                filter.source = ledger_filter_field(L, 4, "source");
+                filter.dest = ledger_filter_field(L, 4, "dest");
+                filter.type = ledger_filter_field(L, 4, "type");
+                filter.channel = ledger_filter_field(L, 4, "channel");
+                filter.key = ledger_filter_field(L, 4, "key");
+                f = &filter;
+        }
+
+        struct ledger* lg = ledger_find(sequencer);
+        if (lg == NULL) { lua_pushnil(L); return 1; }
+        if (to < from) { lua_pushinteger(L, 0); return 1; }
+
+        int cancelled = 0;
+
+        pthread_mutex_lock(&lg->lock);
+
+        struct ledger_node* below;
+        struct ledger_node* range;
+        struct ledger_node* above;
+        ledger_split(lg->root, from, &below, &range);
+        if (to == (unsigned int)-1) {
+                above = NULL;
+        } else {
+                ledger_split(range, to + 1, &range, &above);
+        }
+
+        range = ledger_cancel_tree(lg, range, f, NULL, seq_stats_get(sequencer), 0, &cancelled);
+        lg->root = ledger_merge(ledger_merge(below, range), above);
+
+        pthread_mutex_unlock(&lg->lock);
+
+        lua_pushinteger(L, cancelled);
+        return 1;
+}
+
 /*
  * FLUIDSYNTH_API unsigned int
  * fluid_sequencer_get_tick (fluid_sequencer_t *seq)
@@ -384,6 +1783,131 @@ c_fluid_sequencer_get_tick (lua_State* L)
         return 1;
 }
 
+/*
+ * fluid_sequencer_get_stats (seq)
+ *
+ * Get the statistics of a sequencer as a table:
+ *
+ *   tick            current tick
+ *   scheduled       events sent through the binding
+ *   cancelled       events cancelled from the ledger
+ *   removed         ledger events dropped by
+ *                   `fluid_sequencer_remove_events`
+ *   remove_calls    calls to `fluid_sequencer_remove_events`; how many
+ *                   queued events a call removed is not known
+ *   ahead           ticks between now and the latest scheduled event
+ *   held            events waiting in the ledger, if enabled
+ *   clients         per destination id:
+ *                     scheduled, cancelled, removed, remove_calls,
+ *                     and for clients registered from Lua also name,
+ *                     dispatched, pending (scheduled - cancelled -
+ *                     removed - dispatched, which stays too high after
+ *                     queued events are removed), lateness
+ *                     (histogram array), callback_us, callback_max_us,
+ *                     and for "queued" clients queued and dropped
+ *
+ */
+
+static int
+c_fluid_sequencer_get_stats (lua_State* L)
+{
+        fluid_sequencer_t* sequencer = *(fluid_sequencer_t**)lua_touserdata(L, 1);
+        struct seq_stats* st = seq_stats_get(sequencer);
+        if (st == NULL) { lua_pushnil(L); return 1; }
+
+        unsigned int now = fluid_sequencer_get_tick(sequencer);
+
+        lua_createtable(L, 0, 8);
+        lua_pushinteger(L, now);
+        lua_setfield(L, -2, "tick");
+        lua_pushinteger(L, st->scheduled);
+        lua_setfield(L, -2, "scheduled");
+        lua_pushinteger(L, st->cancelled);
+        lua_setfield(L, -2, "cancelled");
+        lua_pushinteger(L, st->removed);
+        lua_setfield(L, -2, "removed");
+        lua_pushinteger(L, st->remove_calls);
+        lua_setfield(L, -2, "remove_calls");
+        lua_pushinteger(L, st->horizon > now ? st->horizon - now : 0);
+        lua_setfield(L, -2, "ahead");
+
+        struct ledger* lg = ledger_find(sequencer);
+        if (lg != NULL) {
+                pthread_mutex_lock(&lg->lock);
+                lua_pushinteger(L, lg->count);
+                pthread_mutex_unlock(&lg->lock);
+                lua_setfield(L, -2, "held");
+        }
+
+        lua_newtable(L);
+        for (int i = 0; i < st->ndests; i++) {
+                struct dest_stats* d = &st->dests[i];
+                lua_createtable(L, 0, 4);
+                lua_pushinteger(L, d->scheduled);
+                lua_setfield(L, -2, "scheduled");
+                lua_pushinteger(L, d->cancelled);
+                lua_setfield(L, -2, "cancelled");
+                lua_pushinteger(L, d->removed);
+                lua_setfield(L, -2, "removed");
+                lua_pushinteger(L, d->remove_calls);
+                lua_setfield(L, -2, "remove_calls");
+                lua_rawseti(L, -2, d->dest);
+        }
+
+        for (struct cbdata* cb = cbdata_list; cb != NULL; cb = cb->next) {
+                if (cb->seq != sequencer) { continue; }
+
+                if (lua_rawgeti(L, -1, cb->id) == LUA_TNIL) {
+                        lua_pop(L, 1);
+                        lua_createtable(L, 0, 8);
+                        lua_pushvalue(L, -1);
+                        lua_rawseti(L, -3, cb->id);
+                }
+
+                struct dest_stats* d = seq_stats_dest(st, cb->id);
+                // cancelled and removed ledger events never reach the client
+                unsigned long scheduled = d ? d->scheduled - d->cancelled - d->removed : 0;
+                unsigned long dispatched = atomic_load(&cb->stats.dispatched);
+                unsigned long long ns = atomic_load(&cb->stats.callback_ns);
+
+                const char* name = fluid_sequencer_get_client_name(sequencer, cb->id);
+                if (name != NULL) {
+                        lua_pushstring(L, name);
+                        lua_setfield(L, -2, "name");
+                }
+                lua_pushinteger(L, dispatched);
+                lua_setfield(L, -2, "dispatched");
+                lua_pushinteger(L, scheduled > dispatched ? scheduled - dispatched : 0);
+                lua_setfield(L, -2, "pending");
+
+                lua_createtable(L, LATENESS_BUCKETS, 0);
+                for (int b = 0; b < LATENESS_BUCKETS; b++) {
+                        lua_pushinteger(L, atomic_load(&cb->stats.lateness[b]));
+                        lua_rawseti(L, -2, b + 1);
+                }
+                lua_setfield(L, -2, "lateness");
+
+                lua_pushnumber(L, dispatched ? ns / 1000.0 / dispatched : 0.0);
+                lua_setfield(L, -2, "callback_us");
+                lua_pushnumber(L, atomic_load(&cb->stats.callback_max_ns) / 1000.0);
+                lua_setfield(L, -2, "callback_max_us");
+
+                if (cb->mode == CB_MODE_QUEUED) {
+                        unsigned int tail = atomic_load(&cb->ring->tail);
+                        unsigned int head = atomic_load(&cb->ring->head);
+                        lua_pushinteger(L, tail - head);
+                        lua_setfield(L, -2, "queued");
+                        lua_pushinteger(L, atomic_load(&cb->ring->dropped));
+                        lua_setfield(L, -2, "dropped");
+                }
+
+                lua_pop(L, 1);
+        }
+        lua_setfield(L, -2, "clients");
+
+        return 1;
+}
+
 /*
  * FLUIDSYNTH_API void
  * fluid_sequencer_set_time_scale (fluid_sequencer_t *seq,
@@ -474,1811 +1998,7913 @@ c_fluid_sequencer_add_midi_event_to_buffer (lua_State* L)
         return 1;
 }
 
-/*-------------------------------------------------------------------
-  ---=  Events =---
-  ------------------------------------------------------------------*/
+/*
+ * Offline rendering. Stereo float frames from the synth are handed in
+ * blocks to a sink, which writes them to wherever the caller asked.
+ *
+ */
+
+#define RENDER_BLOCK_FRAMES 4096
+
+struct render_sink {
+        int (*write)(void* data, const float* frames, int count);
+        void* data;
+};
 
 static int
-gc_delete_fluid_event (lua_State* L)
+render_sink_file_write (void* data, const float* frames, int count)
 {
-        fluid_event_t* event = *(fluid_event_t**)lua_touserdata(L, 1);
-        delete_fluid_event(event);
-        return 0;
+        FILE* f = (FILE*)data;
+        size_t n = fwrite(frames, 2 * sizeof(float), count, f);
+        return n == (size_t)count ? FLUID_OK : FLUID_FAILED;
+}
+
+static double
+synth_sample_rate (fluid_synth_t* synth)
+{
+        double sample_rate = 44100.0;
+        fluid_settings_getnum(fluid_synth_get_settings(synth), "synth.sample-rate", &sample_rate);
+        return sample_rate;
 }
 
 /*
- * FLUIDSYNTH_API fluid_event_t *
- * new_fluid_event (void)
- *
- * Create a new sequencer event structure.
+ * Sample formats of audio buffers and WAV files. "s24" samples are
+ * packed in 3 bytes, little endian.
  *
  */
 
-static int
-c_new_fluid_event (lua_State* L)
-{
-        fluid_event_t* event = new_fluid_event();
-        if (event == NULL) { lua_pushnil(L); return 1; }
-        
-        fluid_event_t** event_p = lua_newuserdata(L, sizeof(fluid_event_t*));
-        *event_p = event;
+enum audio_format {
+        AUDIO_FORMAT_FLOAT = 0,
+        AUDIO_FORMAT_S16,
+        AUDIO_FORMAT_S24,
+        AUDIO_FORMAT_S32
+};
 
-        luaL_newmetatable(L, "fluid.event");
-        lua_pushstring(L, "__gc");
-        lua_pushcfunction(L, gc_delete_fluid_event);
-        lua_settable(L, -3);
+static const char* const audio_formats[] = { "float", "s16", "s24", "s32", NULL };
 
-        lua_pop(L, 1); // remove the metatable from the stack
-        
-        return 1;
+static size_t
+audio_format_size (int format)
+{
+        static const size_t sizes[] = { sizeof(float), 2, 3, 4 };
+        return sizes[format];
 }
 
 /*
- * FLUIDSYNTH_API void
- * delete_fluid_event (fluid_event_t *evt)
+ * Conversion of float samples to integer formats, with optional
+ * dither. "tpdf" adds triangular noise of +-1 LSB, "shaped" also feeds
+ * the quantization error of each channel back into its next sample,
+ * which moves the noise towards high frequencies.
  *
- * Delete a sequencer event structure.
+ * Plain and "tpdf" conversion have SSE2 and AVX2 kernels chosen at
+ * load time from what the CPU supports. Noise shaping depends on the
+ * previous sample of the channel, so it always runs the scalar code.
  *
  */
 
-static int
-c_delete_fluid_event (lua_State* L)
+enum dither_mode {
+        DITHER_NONE = 0,
+        DITHER_TPDF,
+        DITHER_SHAPED
+};
+
+static const char* const dither_modes[] = { "none", "tpdf", "shaped", NULL };
+
+#define DITHER_LANES 8
+
+struct dither {
+        int mode;
+        unsigned int rng[DITHER_LANES];         // xorshift state per SIMD lane
+        float err[2];                           // last error per channel
+};
+
+static void
+dither_init (struct dither* d, int mode)
 {
-        fluid_event_t* event = *(fluid_event_t**)lua_touserdata(L, 1);
-        if (event == NULL) { lua_pushnil(L); return 1; }
+        d->mode = mode;
+        for (int i = 0; i < DITHER_LANES; i++) { d->rng[i] = 0x9e3779b9u * (i + 1); }
+        d->err[0] = d->err[1] = 0.0f;
+}
 
-        delete_fluid_event(event);
-        
-        return 0;
+// scale, and largest value that still converts, of each integer format
+static const float convert_scale[] = { 1.0f, 32768.0f, 8388608.0f, 2147483648.0f };
+static const float convert_max[] = { 1.0f, 32767.0f, 8388607.0f, 2147483520.0f };
+
+static unsigned int
+xorshift32 (unsigned int* s)
+{
+        unsigned int x = *s;
+        x ^= x << 13;
+        x ^= x >> 17;
+        x ^= x << 5;
+        return *s = x;
+}
+
+// triangular noise in (-1, 1)
+static float
+tpdf_noise (unsigned int* s)
+{
+        float a = (float)(xorshift32(s) >> 8);
+        float b = (float)(xorshift32(s) >> 8);
+        return (a + b) * (1.0f / 16777216.0f) - 1.0f;
+}
+
+static void
+store_sample (int format, void* out, size_t i, long q)
+{
+        switch (format) {
+        case AUDIO_FORMAT_S16:
+                ((short*)out)[i] = (short)q;
+                break;
+        case AUDIO_FORMAT_S24: {
+                unsigned char* p = (unsigned char*)out + 3 * i;
+                p[0] = q & 0xff;
+                p[1] = (q >> 8) & 0xff;
+                p[2] = (q >> 16) & 0xff;
+                break;
+        }
+        case AUDIO_FORMAT_S32:
+                ((int*)out)[i] = (int)q;
+                break;
+        }
 }
 
 /*
- * FLUIDSYNTH_API void
- * fluid_event_set_source (fluid_event_t *evt,
- *                         short src)
- *
- * Set source of a sequencer event (DOCME).
+ * Convert `n` samples. For noise shaping `interleaved` tells whether
+ * the samples alternate between two channels or all belong to channel
+ * `chan`.
  *
  */
 
-static int
-c_fluid_event_set_source (lua_State* L)
+static void
+convert_scalar (int format, const float* in, void* out, size_t n,
+                int interleaved, int chan, struct dither* d)
 {
-        fluid_event_t* event = *(fluid_event_t**)lua_touserdata(L, 1);
-        short src = (short)luaL_checkinteger(L, 2);
+        float scale = convert_scale[format];
+        float hi = convert_max[format];
+        float lo = -scale;
+
+        for (size_t i = 0; i < n; i++) {
+                float v = in[i] * scale;
+                float wanted = v;
+                int c = interleaved ? (int)(i & 1) : chan;
+
+                if (d->mode == DITHER_SHAPED) {
+                        v -= d->err[c];
+                        wanted = v;
+                }
+                if (d->mode != DITHER_NONE) { v += tpdf_noise(&d->rng[0]); }
+
+                if (v > hi) { v = hi; }
+                if (v < lo) { v = lo; }
+                long q = lrintf(v);
+
+                if (d->mode == DITHER_SHAPED) {
+                        // keep the feedback bounded when clipping
+                        float e = (float)q - wanted;
+                        d->err[c] = e > 1.0f ? 1.0f : e < -1.0f ? -1.0f : e;
+                }
+
+                store_sample(format, out, i, q);
+        }
+}
 
-        fluid_event_set_source(event, src);
-        
-        return 0;
+typedef void (*convert_fn) (int format, const float* in, void* out, size_t n, struct dither* d);
+
+static void
+convert_generic (int format, const float* in, void* out, size_t n, struct dither* d)
+{
+        convert_scalar(format, in, out, n, 1, 0, d);
 }
 
-/*
- * FLUIDSYNTH_API void
- * fluid_event_set_dest (fluid_event_t *evt,
- *                       short dest)
- *
- * Set destination of a sequencer event (DOCME).
- *
- */
+#ifdef HAVE_CONVERT_X86
 
-static int
-c_fluid_event_set_dest (lua_State* L)
+__attribute__((target("sse2")))
+static __m128
+tpdf_noise4 (__m128i* s)
 {
-        fluid_event_t* event = *(fluid_event_t**)lua_touserdata(L, 1);
-        short dest = (short)luaL_checkinteger(L, 2);
+        __m128i x = *s;
+        x = _mm_xor_si128(x, _mm_slli_epi32(x, 13));
+        x = _mm_xor_si128(x, _mm_srli_epi32(x, 17));
+        x = _mm_xor_si128(x, _mm_slli_epi32(x, 5));
+        __m128i y = x;
+        y = _mm_xor_si128(y, _mm_slli_epi32(y, 13));
+        y = _mm_xor_si128(y, _mm_srli_epi32(y, 17));
+        y = _mm_xor_si128(y, _mm_slli_epi32(y, 5));
+        *s = y;
+
+        __m128 a = _mm_cvtepi32_ps(_mm_srli_epi32(x, 8));
+        __m128 b = _mm_cvtepi32_ps(_mm_srli_epi32(y, 8));
+        return _mm_sub_ps(_mm_mul_ps(_mm_add_ps(a, b), _mm_set1_ps(1.0f / 16777216.0f)),
+                          _mm_set1_ps(1.0f));
+}
 
-        fluid_event_set_dest(event, dest);
-        
-        return 0;
+__attribute__((target("sse2")))
+static __m128i
+convert_quantize4 (const float* in, __m128 scale, __m128 lo, __m128 hi,
+                   int dither, __m128i* rng)
+{
+        __m128 v = _mm_mul_ps(_mm_loadu_ps(in), scale);
+        if (dither) { v = _mm_add_ps(v, tpdf_noise4(rng)); }
+        v = _mm_min_ps(_mm_max_ps(v, lo), hi);
+        return _mm_cvtps_epi32(v);
 }
 
-/*
- * FLUIDSYNTH_API void
- * fluid_event_timer (fluid_event_t *evt,
- *                    void *data)
- *
- * Set a sequencer event to be a timer event.
- *
- */
+__attribute__((target("sse2")))
+static void
+convert_sse2 (int format, const float* in, void* out, size_t n, struct dither* d)
+{
+        __m128 scale = _mm_set1_ps(convert_scale[format]);
+        __m128 hi = _mm_set1_ps(convert_max[format]);
+        __m128 lo = _mm_set1_ps(-convert_scale[format]);
+        __m128i rng = _mm_loadu_si128((const __m128i*)d->rng);
+        int dither = d->mode != DITHER_NONE;
+
+        size_t i = 0;
+        for (; i + 8 <= n; i += 8) {
+                __m128i a = convert_quantize4(in + i, scale, lo, hi, dither, &rng);
+                __m128i b = convert_quantize4(in + i + 4, scale, lo, hi, dither, &rng);
+
+                if (format == AUDIO_FORMAT_S16) {
+                        _mm_storeu_si128((__m128i*)((short*)out + i), _mm_packs_epi32(a, b));
+                } else if (format == AUDIO_FORMAT_S32) {
+                        _mm_storeu_si128((__m128i*)((int*)out + i), a);
+                        _mm_storeu_si128((__m128i*)((int*)out + i + 4), b);
+                } else {
+                        int q[8];
+                        _mm_storeu_si128((__m128i*)q, a);
+                        _mm_storeu_si128((__m128i*)(q + 4), b);
+                        for (int k = 0; k < 8; k++) { store_sample(format, out, i + k, q[k]); }
+                }
+        }
+
+        _mm_storeu_si128((__m128i*)d->rng, rng);
+
+        // the tail, offset so the scalar code stores at the right index
+        if (i < n) {
+                size_t size = audio_format_size(format);
+                convert_scalar(format, in + i, (char*)out + i * size, n - i, 1, 0, d);
+        }
+}
 
-static int
-c_fluid_event_timer (lua_State* L)
+__attribute__((target("avx2")))
+static __m256
+tpdf_noise8 (__m256i* s)
 {
-        fluid_event_t* event = *(fluid_event_t**)lua_touserdata(L, 1);
-        if (event == NULL) { lua_pushnil(L); return 1; }
-        
-        // Just to satisfy the type system, we need some pointer to
-        // take the place of void* data
-        void* data;
-        
-        fluid_event_timer(event, (void*)data);
-        
-        return 0;
+        __m256i x = *s;
+        x = _mm256_xor_si256(x, _mm256_slli_epi32(x, 13));
+        x = _mm256_xor_si256(x, _mm256_srli_epi32(x, 17));
+        x = _mm256_xor_si256(x, _mm256_slli_epi32(x, 5));
+        __m256i y = x;
+        y = _mm256_xor_si256(y, _mm256_slli_epi32(y, 13));
+        y = _mm256_xor_si256(y, _mm256_srli_epi32(y, 17));
+        y = _mm256_xor_si256(y, _mm256_slli_epi32(y, 5));
+        *s = y;
+
+        __m256 a = _mm256_cvtepi32_ps(_mm256_srli_epi32(x, 8));
+        __m256 b = _mm256_cvtepi32_ps(_mm256_srli_epi32(y, 8));
+        return _mm256_sub_ps(_mm256_mul_ps(_mm256_add_ps(a, b), _mm256_set1_ps(1.0f / 16777216.0f)),
+                             _mm256_set1_ps(1.0f));
 }
 
+__attribute__((target("avx2")))
+static __m256i
+convert_quantize8 (const float* in, __m256 scale, __m256 lo, __m256 hi,
+                   int dither, __m256i* rng)
+{
+        __m256 v = _mm256_mul_ps(_mm256_loadu_ps(in), scale);
+        if (dither) { v = _mm256_add_ps(v, tpdf_noise8(rng)); }
+        v = _mm256_min_ps(_mm256_max_ps(v, lo), hi);
+        return _mm256_cvtps_epi32(v);
+}
 
-/*
- * FLUIDSYNTH_API void
- * fluid_event_note (fluid_event_t *evt,
- *                   int channel,
- *                   short key,
- *                   short vel,
- *                   unsigned int duration)
- *
- * Set a sequencer event to be a note duration event.
- *
- */
+__attribute__((target("avx2")))
+static void
+convert_avx2 (int format, const float* in, void* out, size_t n, struct dither* d)
+{
+        __m256 scale = _mm256_set1_ps(convert_scale[format]);
+        __m256 hi = _mm256_set1_ps(convert_max[format]);
+        __m256 lo = _mm256_set1_ps(-convert_scale[format]);
+        __m256i rng = _mm256_loadu_si256((const __m256i*)d->rng);
+        int dither = d->mode != DITHER_NONE;
+
+        size_t i = 0;
+        for (; i + 16 <= n; i += 16) {
+                __m256i a = convert_quantize8(in + i, scale, lo, hi, dither, &rng);
+                __m256i b = convert_quantize8(in + i + 8, scale, lo, hi, dither, &rng);
+
+                if (format == AUDIO_FORMAT_S16) {
+                        // packs works per 128 bit lane, put the quarters back in order
+                        __m256i s = _mm256_permute4x64_epi64(_mm256_packs_epi32(a, b), 0xd8);
+                        _mm256_storeu_si256((__m256i*)((short*)out + i), s);
+                } else if (format == AUDIO_FORMAT_S32) {
+                        _mm256_storeu_si256((__m256i*)((int*)out + i), a);
+                        _mm256_storeu_si256((__m256i*)((int*)out + i + 8), b);
+                } else {
+                        int q[16];
+                        _mm256_storeu_si256((__m256i*)q, a);
+                        _mm256_storeu_si256((__m256i*)(q + 8), b);
+                        for (int k = 0; k < 16; k++) { store_sample(format, out, i + k, q[k]); }
+                }
+        }
+
+        _mm256_storeu_si256((__m256i*)d->rng, rng);
+
+        if (i < n) {
+                size_t size = audio_format_size(format);
+                convert_scalar(format, in + i, (char*)out + i * size, n - i, 1, 0, d);
+        }
+}
 
 static int
-c_fluid_event_note (lua_State* L)
+cpu_has_sse2 (void)
 {
-        fluid_event_t* event = *(fluid_event_t**)lua_touserdata(L, 1);
-        if (event == NULL) { lua_pushnil(L); return 1; }
-
-        int channel = (int)luaL_checkinteger(L, 2);
-        short key = (short)luaL_checkinteger(L, 3);
-        short vel = (short)luaL_checkinteger(L, 4);
-        unsigned int duration = (unsigned int)luaL_checkinteger(L, 5);
-
-        fluid_event_note(event, channel, key, vel, duration);
-        
-        return 0;
+        return __builtin_cpu_supports("sse2");
 }
 
-/*
- * FLUIDSYNTH_API void
- * fluid_event_noteon (fluid_event_t *evt,
- *                     int channel,
- *                     short key,
- *                     short vel)
- *
- * Set a sequencer event to be a note on event.
- *
- */
-
 static int
-c_fluid_event_noteon (lua_State* L)
+cpu_has_avx2 (void)
 {
-        fluid_event_t* event = *(fluid_event_t**)lua_touserdata(L, 1);
-        if (event == NULL) { lua_pushnil(L); return 1; }
+        return __builtin_cpu_supports("avx2");
+}
+#endif
 
-        int channel = (int)luaL_checkinteger(L, 2);
-        short key = (short)luaL_checkinteger(L, 3);
-        short vel = (short)luaL_checkinteger(L, 4);
+struct convert_isa {
+        const char* name;
+        convert_fn fn;
+        int (*supported) (void);
+};
 
-        fluid_event_noteon(event, channel, key, vel);
-        
-        return 0;
+// from slowest to fastest
+static const struct convert_isa convert_isas[] = {
+        { "scalar", convert_generic, NULL },
+#ifdef HAVE_CONVERT_X86
+        { "sse2",   convert_sse2,    cpu_has_sse2 },
+        { "avx2",   convert_avx2,    cpu_has_avx2 },
+#endif
+        { NULL,     NULL,            NULL }
+};
+
+static const struct convert_isa* convert_current = &convert_isas[0];
+
+// pick a kernel by name, or the fastest one supported when NULL
+static int
+convert_select (const char* name)
+{
+        const struct convert_isa* best = NULL;
+        for (const struct convert_isa* isa = convert_isas; isa->name != NULL; isa++) {
+                if (isa->supported != NULL && !isa->supported()) { continue; }
+                if (name == NULL || strcmp(name, isa->name) == 0) { best = isa; }
+        }
+
+        if (best == NULL) { return FLUID_FAILED; }
+        convert_current = best;
+        return FLUID_OK;
 }
 
 /*
- * FLUIDSYNTH_API void
- * fluid_event_noteoff (fluid_event_t *evt,
- *                      int channel,
- *                      short key)
- * 
- * Set a sequencer event to be a note off event.
+ * Convert `n` float samples to `format`, see `convert_scalar` for
+ * `interleaved` and `chan`.
  *
  */
 
-static int
-c_fluid_event_noteoff (lua_State* L)
+static void
+convert_samples (int format, const float* in, void* out, size_t n,
+                 int interleaved, int chan, struct dither* d)
 {
-        fluid_event_t* event = *(fluid_event_t**)lua_touserdata(L, 1);
-        if (event == NULL) { lua_pushnil(L); return 1; }
+        if (format == AUDIO_FORMAT_FLOAT) {
+                memcpy(out, in, n * sizeof(float));
+        } else if (d->mode == DITHER_SHAPED) {
+                convert_scalar(format, in, out, n, interleaved, chan, d);
+        } else {
+                convert_current->fn(format, in, out, n, d);
+        }
+}
 
-        int channel = (int)luaL_checkinteger(L, 2);
-        short key = (short)luaL_checkinteger(L, 3);
+/*
+ * Level meter fed from the render paths of the binding. Per channel it
+ * tracks the sample peak, the true peak (the peak of the signal
+ * oversampled 4 times with the interpolation filter of ITU-R BS.1770)
+ * and the RMS level, and over both channels the EBU R128 integrated
+ * loudness: K-weighted mean square in 400 ms blocks overlapping by
+ * 75 %, gated at -70 LUFS and then 10 LU below the mean. Block
+ * loudness is kept in a histogram of 0.1 LU bins, which bounds the
+ * memory and the error of the gating.
+ *
+ * The sample peak and RMS run through SSE2 or AVX2 kernels, the true
+ * peak computes the 4 phases of the filter in one SSE vector.
+ *
+ */
+
+#define METER_BINS 1000         // 0.1 LU bins from -70 to +30 LUFS
+#define METER_TAPS 12
+
+static const float true_peak_coefs[4][METER_TAPS] = {
+        {  0.0017089843750f,  0.0109863281250f, -0.0196533203125f,  0.0332031250000f,
+          -0.0594482421875f,  0.1373291015625f,  0.9721679687500f, -0.1022949218750f,
+           0.0476074218750f, -0.0266113281250f,  0.0148925781250f, -0.0083007812500f },
+        { -0.0291748046875f,  0.0292968750000f, -0.0517578125000f,  0.0891113281250f,
+          -0.1665039062500f,  0.4650878906250f,  0.7797851562500f, -0.2003173828125f,
+           0.1015625000000f, -0.0582275390625f,  0.0330810546875f, -0.0189208984375f },
+        { -0.0189208984375f,  0.0330810546875f, -0.0582275390625f,  0.1015625000000f,
+          -0.2003173828125f,  0.7797851562500f,  0.4650878906250f, -0.1665039062500f,
+           0.0891113281250f, -0.0517578125000f,  0.0292968750000f, -0.0291748046875f },
+        { -0.0083007812500f,  0.0148925781250f, -0.0266113281250f,  0.0476074218750f,
+          -0.1022949218750f,  0.9721679687500f,  0.1373291015625f, -0.0594482421875f,
+           0.0332031250000f, -0.0196533203125f,  0.0109863281250f,  0.0017089843750f }
+};
 
-        fluid_event_noteoff(event, channel, key);
-        
-        return 0;
+struct meter_channel {
+        float peak;
+        float true_peak;
+        double sumsq;
+        float history[2 * METER_TAPS];  // every sample is stored twice
+        int pos;
+        double kw[2][2];                // K-weighting filter state
+};
+
+struct meter {
+        pthread_mutex_t lock;
+        double sample_rate;
+        unsigned long long frames;
+        struct meter_channel ch[2];
+
+        double kw_b[2][3];              // K-weighting stages
+        double kw_a[2][3];
+
+        int sub_len;                    // frames in 100 ms
+        int sub_fill;
+        double sub_sum;
+        double sub[4];                  // the last 4 sub-blocks
+        int nsub;
+        unsigned long bins[METER_BINS];
+};
+
+// clear the measurement and compute the biquads of the K-weighting
+// filter for `rate`, as in libebur128; the lock is left alone
+static void
+meter_clear (struct meter* m, double rate)
+{
+        size_t skip = offsetof(struct meter, sample_rate);
+        memset((char*)m + skip, 0, sizeof(struct meter) - skip);
+        m->sample_rate = rate;
+        m->sub_len = (int)(rate / 10.0 + 0.5);
+
+        double f0 = 1681.974450955533;
+        double G = 3.999843853973347;
+        double Q = 0.7071752369554196;
+        double K = tan(M_PI * f0 / rate);
+        double Vh = pow(10.0, G / 20.0);
+        double Vb = pow(Vh, 0.4996667741545416);
+        double a0 = 1.0 + K / Q + K * K;
+
+        m->kw_b[0][0] = (Vh + Vb * K / Q + K * K) / a0;
+        m->kw_b[0][1] = 2.0 * (K * K - Vh) / a0;
+        m->kw_b[0][2] = (Vh - Vb * K / Q + K * K) / a0;
+        m->kw_a[0][1] = 2.0 * (K * K - 1.0) / a0;
+        m->kw_a[0][2] = (1.0 - K / Q + K * K) / a0;
+
+        f0 = 38.13547087602444;
+        Q = 0.5003270373238773;
+        K = tan(M_PI * f0 / rate);
+        a0 = 1.0 + K / Q + K * K;
+
+        m->kw_b[1][0] = 1.0;
+        m->kw_b[1][1] = -2.0;
+        m->kw_b[1][2] = 1.0;
+        m->kw_a[1][1] = 2.0 * (K * K - 1.0) / a0;
+        m->kw_a[1][2] = (1.0 - K / Q + K * K) / a0;
 }
 
-/*
- * FLUIDSYNTH_API void
- * fluid_event_all_sounds_off (fluid_event_t *evt,
- *                             int channel)
- *
- * Set a sequencer event to be an all sounds off event.
- *
- */
+static void
+meter_reset (struct meter* m)
+{
+        pthread_mutex_lock(&m->lock);
+        meter_clear(m, m->sample_rate);
+        pthread_mutex_unlock(&m->lock);
+}
 
-static int
-c_fluid_event_all_sounds_off (lua_State* L)
+// peak and sum of squares of `n` samples, alternating channels when
+// `interleaved`
+static void
+meter_scan_scalar (const float* x, size_t n, int interleaved, float peak[2], double sumsq[2])
 {
-        fluid_event_t* event = *(fluid_event_t**)lua_touserdata(L, 1);
-        if (event == NULL) { lua_pushnil(L); return 1; }
+        for (size_t i = 0; i < n; i++) {
+                int c = interleaved ? (int)(i & 1) : 0;
+                float a = fabsf(x[i]);
+                if (a > peak[c]) { peak[c] = a; }
+                sumsq[c] += (double)x[i] * x[i];
+        }
+}
 
-        int channel = (int)luaL_checkinteger(L, 2);
+typedef void (*meter_scan_fn) (const float* x, size_t n, int interleaved,
+                               float peak[2], double sumsq[2]);
 
-        fluid_event_all_sounds_off(event, channel);
-        
-        return 0;
+#ifdef HAVE_CONVERT_X86
+__attribute__((target("sse2")))
+static void
+meter_scan_sse2 (const float* x, size_t n, int interleaved, float peak[2], double sumsq[2])
+{
+        __m128 mask = _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff));
+        __m128 pk = _mm_setzero_ps();
+        __m128 sq = _mm_setzero_ps();
+
+        size_t i = 0;
+        for (; i + 4 <= n; i += 4) {
+                __m128 v = _mm_loadu_ps(x + i);
+                pk = _mm_max_ps(pk, _mm_and_ps(v, mask));
+                sq = _mm_add_ps(sq, _mm_mul_ps(v, v));
+        }
+
+        float p[4], s[4];
+        _mm_storeu_ps(p, pk);
+        _mm_storeu_ps(s, sq);
+        for (int k = 0; k < 4; k++) {
+                int c = interleaved ? (k & 1) : 0;
+                if (p[k] > peak[c]) { peak[c] = p[k]; }
+                sumsq[c] += s[k];
+        }
+
+        // `i` is even, so the tail keeps its channel order
+        meter_scan_scalar(x + i, n - i, interleaved, peak, sumsq);
 }
 
-/*
- * FLUIDSYNTH_API void
- * fluid_event_all_notes_off (fluid_event_t *evt,
- *                            int channel)
- *
- * Set a sequencer event to be a all notes off event.
- *
- */
+__attribute__((target("avx2")))
+static void
+meter_scan_avx2 (const float* x, size_t n, int interleaved, float peak[2], double sumsq[2])
+{
+        __m256 mask = _mm256_castsi256_ps(_mm256_set1_epi32(0x7fffffff));
+        __m256 pk = _mm256_setzero_ps();
+        __m256 sq = _mm256_setzero_ps();
+
+        size_t i = 0;
+        for (; i + 8 <= n; i += 8) {
+                __m256 v = _mm256_loadu_ps(x + i);
+                pk = _mm256_max_ps(pk, _mm256_and_ps(v, mask));
+                sq = _mm256_add_ps(sq, _mm256_mul_ps(v, v));
+        }
+
+        float p[8], s[8];
+        _mm256_storeu_ps(p, pk);
+        _mm256_storeu_ps(s, sq);
+        for (int k = 0; k < 8; k++) {
+                int c = interleaved ? (k & 1) : 0;
+                if (p[k] > peak[c]) { peak[c] = p[k]; }
+                sumsq[c] += s[k];
+        }
+
+        meter_scan_scalar(x + i, n - i, interleaved, peak, sumsq);
+}
 
-static int
-c_fluid_event_all_notes_off (lua_State* L)
+// the 4 interpolated values between the last samples of `w`
+__attribute__((target("sse2")))
+static float
+true_peak_step (const float* w)
 {
-        fluid_event_t* event = *(fluid_event_t**)lua_touserdata(L, 1);
-        if (event == NULL) { lua_pushnil(L); return 1; }
+        __m128 acc = _mm_setzero_ps();
+        for (int k = 0; k < METER_TAPS; k++) {
+                __m128 c = _mm_setr_ps(true_peak_coefs[0][k], true_peak_coefs[1][k],
+                                       true_peak_coefs[2][k], true_peak_coefs[3][k]);
+                acc = _mm_add_ps(acc, _mm_mul_ps(c, _mm_set1_ps(w[k])));
+        }
+        acc = _mm_and_ps(acc, _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff)));
+        acc = _mm_max_ps(acc, _mm_shuffle_ps(acc, acc, _MM_SHUFFLE(1, 0, 3, 2)));
+        acc = _mm_max_ps(acc, _mm_shuffle_ps(acc, acc, _MM_SHUFFLE(2, 3, 0, 1)));
+        return _mm_cvtss_f32(acc);
+}
+#else
+static float
+true_peak_step (const float* w)
+{
+        float max = 0.0f;
+        for (int p = 0; p < 4; p++) {
+                float acc = 0.0f;
+                for (int k = 0; k < METER_TAPS; k++) { acc += true_peak_coefs[p][k] * w[k]; }
+                if (fabsf(acc) > max) { max = fabsf(acc); }
+        }
+        return max;
+}
+#endif
 
-        int channel = (int)luaL_checkinteger(L, 2);
+static meter_scan_fn meter_scan = meter_scan_scalar;
 
-        fluid_event_all_notes_off(event, channel);
-        
-        return 0;
+static void
+meter_select (void)
+{
+#ifdef HAVE_CONVERT_X86
+        if (cpu_has_avx2()) {
+                meter_scan = meter_scan_avx2;
+        } else if (cpu_has_sse2()) {
+                meter_scan = meter_scan_sse2;
+        }
+#endif
 }
 
-/*
- * FLUIDSYNTH_API void
- * fluid_event_bank_select (fluid_event_t *evt,
- *                          int channel,
- *                          short bank_num)
- *
- * Set a sequencer event to be a bank select event.
- *
- */
+// true peak and K-weighted square of one sample of channel `c`
+static double
+meter_sample (struct meter* m, int c, float x)
+{
+        struct meter_channel* ch = &m->ch[c];
+
+        ch->history[ch->pos] = x;
+        ch->history[ch->pos + METER_TAPS] = x;
+        ch->pos = (ch->pos + 1) % METER_TAPS;
+        float tp = true_peak_step(ch->history + ch->pos);
+        if (tp > ch->true_peak) { ch->true_peak = tp; }
+
+        double y = x;
+        for (int s = 0; s < 2; s++) {
+                double* z = ch->kw[s];
+                double out = m->kw_b[s][0] * y + z[0];
+                z[0] = m->kw_b[s][1] * y - m->kw_a[s][1] * out + z[1];
+                z[1] = m->kw_b[s][2] * y - m->kw_a[s][2] * out;
+                y = out;
+        }
+
+        return y * y;
+}
 
-static int
-c_fluid_event_bank_select (lua_State* L)
+static void
+meter_block_done (struct meter* m)
 {
-        fluid_event_t* event = *(fluid_event_t**)lua_touserdata(L, 1);
-        if (event == NULL) { lua_pushnil(L); return 1; }
+        m->sub[m->nsub % 4] = m->sub_sum;
+        m->nsub++;
+        m->sub_sum = 0.0;
+        m->sub_fill = 0;
+        if (m->nsub < 4) { return; }
 
-        int channel = (int)luaL_checkinteger(L, 2);
-        short bank_num = (short)luaL_checkinteger(L, 3);
+        double z = (m->sub[0] + m->sub[1] + m->sub[2] + m->sub[3]) / (4.0 * m->sub_len);
+        if (z <= 0.0) { return; }
 
-        fluid_event_bank_select(event, channel, bank_num);
-        
-        return 0;
+        double loudness = -0.691 + 10.0 * log10(z);
+        if (loudness < -70.0) { return; }
+
+        int bin = (int)((loudness + 70.0) * 10.0);
+        m->bins[bin < METER_BINS ? bin : METER_BINS - 1]++;
 }
 
 /*
- * FLUIDSYNTH_API void
- * fluid_event_program_change (fluid_event_t *evt,
- *                             int channel,
- *                             short preset_num)
- *
- * Set a sequencer event to be a program change event.
+ * Feed `frames` stereo frames to `m`. The samples of channel 0 are at
+ * `l`, those of channel 1 at `r`, each `incr` floats apart.
  *
  */
 
-static int
-c_fluid_event_program_change (lua_State* L)
+static void
+meter_feed (struct meter* m, const float* l, const float* r, int incr, int frames)
 {
-        fluid_event_t* event = *(fluid_event_t**)lua_touserdata(L, 1);
-        if (event == NULL) { lua_pushnil(L); return 1; }
+        if (m == NULL || frames <= 0) { return; }
+
+        pthread_mutex_lock(&m->lock);
+
+        float peak[2] = { m->ch[0].peak, m->ch[1].peak };
+        double sumsq[2] = { 0.0, 0.0 };
+        if (incr == 2 && r == l + 1) {
+                meter_scan(l, 2 * (size_t)frames, 1, peak, sumsq);
+        } else if (incr == 1) {
+                // planar scans only touch the first slot
+                meter_scan(l, frames, 0, &peak[0], &sumsq[0]);
+                meter_scan(r, frames, 0, &peak[1], &sumsq[1]);
+        } else {
+                for (int i = 0; i < frames; i++) {
+                        meter_scan_scalar(l + (size_t)i * incr, 1, 0, &peak[0], &sumsq[0]);
+                        meter_scan_scalar(r + (size_t)i * incr, 1, 0, &peak[1], &sumsq[1]);
+                }
+        }
+        for (int c = 0; c < 2; c++) {
+                m->ch[c].peak = peak[c];
+                m->ch[c].sumsq += sumsq[c];
+        }
+
+        for (int i = 0; i < frames; i++) {
+                m->sub_sum += meter_sample(m, 0, l[(size_t)i * incr])
+                        + meter_sample(m, 1, r[(size_t)i * incr]);
+                if (++m->sub_fill == m->sub_len) { meter_block_done(m); }
+        }
+        m->frames += frames;
+
+        pthread_mutex_unlock(&m->lock);
+}
 
-        int channel = (int)luaL_checkinteger(L, 2);
-        short preset_num = (short)luaL_checkinteger(L, 3);
+// feed 16 bit samples, converted in blocks
+static void
+meter_feed_s16 (struct meter* m, const short* l, const short* r, int incr, int frames)
+{
+        float block[2 * 256];
+
+        while (m != NULL && frames > 0) {
+                int n = frames < 256 ? frames : 256;
+                for (int i = 0; i < n; i++) {
+                        block[2 * i] = l[(size_t)i * incr] * (1.0f / 32768.0f);
+                        block[2 * i + 1] = r[(size_t)i * incr] * (1.0f / 32768.0f);
+                }
+                meter_feed(m, block, block + 1, 2, n);
+                l += (size_t)n * incr;
+                r += (size_t)n * incr;
+                frames -= n;
+        }
+}
 
-        fluid_event_program_change(event, channel, preset_num);
-        
-        return 0;
+// integrated loudness in LUFS, or -HUGE_VAL before the first block
+static double
+meter_integrated (const struct meter* m)
+{
+        double energy[METER_BINS];
+        double sum = 0.0;
+        unsigned long count = 0;
+        for (int b = 0; b < METER_BINS; b++) {
+                energy[b] = pow(10.0, ((b + 0.5) / 10.0 - 70.0 + 0.691) / 10.0);
+                sum += m->bins[b] * energy[b];
+                count += m->bins[b];
+        }
+        if (count == 0) { return -HUGE_VAL; }
+
+        double gate = -0.691 + 10.0 * log10(sum / count) - 10.0;
+        int first = (int)ceil((gate + 70.0) * 10.0);
+        if (first < 0) { first = 0; }
+
+        sum = 0.0;
+        count = 0;
+        for (int b = first; b < METER_BINS; b++) {
+                sum += m->bins[b] * energy[b];
+                count += m->bins[b];
+        }
+        if (count == 0) { return -HUGE_VAL; }
+
+        return -0.691 + 10.0 * log10(sum / count);
 }
 
 /*
- * FLUIDSYNTH_API void
- * fluid_event_program_select (fluid_event_t *evt,
- *                             int channel,
- *                             unsigned int sfont_id,
- *                             short bank_num,
- *                             short preset_num)
- *
- * Set a sequencer event to be a program select event.
+ * Meters attached to synths with `fluid_synth_set_meter`, each holding
+ * a registry reference to the meter userdata.
  *
  */
 
-static int
-c_fluid_event_program_select (lua_State* L)
-{
-        fluid_event_t* event = *(fluid_event_t**)lua_touserdata(L, 1);
-        if (event == NULL) { lua_pushnil(L); return 1; }
+struct synth_meter {
+        fluid_synth_t* synth;
+        struct meter* meter;
+        int ref;
+        struct synth_meter* next;
+};
 
-        int           channel = (int)luaL_checkinteger(L, 2);
-        unsigned int sfont_id = (unsigned int)luaL_checkinteger(L, 3);
-        short        bank_num = (short)luaL_checkinteger(L, 4);
-        short      preset_num = (short)luaL_checkinteger(L, 5);
+static struct synth_meter* synth_meter_list = NULL;
 
-        fluid_event_program_select(event, channel, sfont_id, bank_num, preset_num);
-        
-        return 0;
+static struct meter*
+synth_meter (fluid_synth_t* synth)
+{
+        for (struct synth_meter* sm = synth_meter_list; sm != NULL; sm = sm->next) {
+                if (sm->synth == synth) { return sm->meter; }
+        }
+        return NULL;
+}
+
+static void
+synth_meter_detach (lua_State* L, fluid_synth_t* synth)
+{
+        for (struct synth_meter** p = &synth_meter_list; *p != NULL; p = &(*p)->next) {
+                if ((*p)->synth == synth) {
+                        struct synth_meter* sm = *p;
+                        *p = sm->next;
+                        luaL_unref(L, LUA_REGISTRYINDEX, sm->ref);
+                        free(sm);
+                        return;
+                }
+        }
 }
 
 /*
- * FLUIDSYNTH_API void
- * fluid_event_control_change (fluid_event_t *evt,
- *                             int channel,
- *                             short control,
- *                             short val)
- *
- * Set a sequencer event to be a MIDI control change event.
- *
- */
+ * Voice statistics of a synth, kept from the first call to
+ * `fluid_synth_get_stats` on. They are sampled after every block the
+ * binding renders and on every read; a synth played by an audio driver
+ * is only sampled on reads.
+ *
+ * FluidSynth does not report stolen voices, so they are estimated
+ * from two consecutive samples: voices that started beyond the slots
+ * that were free must have replaced voices that were still playing.
+ * This is a lower bound, voices that start and end between two samples
+ * are not seen at all.
+ *
+ */
+
+struct synth_stats {
+        fluid_synth_t* synth;
+        int polyphony;
+        int voices;
+        int peak;
+        unsigned long started;
+        unsigned long stolen;
+        unsigned long samples;
+        double cpu_load;
+        double cpu_peak;
+        fluid_voice_t** list;
+        unsigned int* ids;              // sorted ids of the last sample
+        unsigned int* next_ids;
+        int nchannels;
+        int* channels;                  // voices per MIDI channel
+        struct synth_stats* next;
+};
 
-static int
-c_fluid_event_control_change (lua_State* L)
+static struct synth_stats* synth_stats_list = NULL;
+
+static struct synth_stats*
+synth_stats_find (fluid_synth_t* synth)
 {
-        fluid_event_t* event = *(fluid_event_t**)lua_touserdata(L, 1);
-        if (event == NULL) { lua_pushnil(L); return 1; }
+        for (struct synth_stats* st = synth_stats_list; st != NULL; st = st->next) {
+                if (st->synth == synth) { return st; }
+        }
+        return NULL;
+}
 
-        int    channel = (int)luaL_checkinteger(L, 2);
-        short  control = (short)luaL_checkinteger(L, 3);
-        short      val = (short)luaL_checkinteger(L, 4);
+static void
+synth_stats_free (struct synth_stats* st)
+{
+        free(st->list);
+        free(st->ids);
+        free(st->next_ids);
+        free(st->channels);
+        free(st);
+}
 
-        fluid_event_control_change(event, channel, control, val);
-        
-        return 0;
+static void
+synth_stats_forget (fluid_synth_t* synth)
+{
+        for (struct synth_stats** p = &synth_stats_list; *p != NULL; p = &(*p)->next) {
+                if ((*p)->synth == synth) {
+                        struct synth_stats* st = *p;
+                        *p = st->next;
+                        synth_stats_free(st);
+                        return;
+                }
+        }
 }
 
-/*
- * FLUIDSYNTH_API void
- * fluid_event_pitch_bend (fluid_event_t *evt,
- *                         int channel,
- *                         int val)
- *
- * Set a sequencer event to be a pitch bend event.
- *
- */
+static int
+compare_uint (const void* a, const void* b)
+{
+        unsigned int x = *(const unsigned int*)a;
+        unsigned int y = *(const unsigned int*)b;
+        return (x > y) - (x < y);
+}
 
+// size the buffers of `st` for the current polyphony and channels
 static int
-c_fluid_event_pitch_bend (lua_State* L)
+synth_stats_fit (struct synth_stats* st)
 {
-        fluid_event_t* event = *(fluid_event_t**)lua_touserdata(L, 1);
-        if (event == NULL) { lua_pushnil(L); return 1; }
+        int polyphony = fluid_synth_get_polyphony(st->synth);
+        if (polyphony > st->polyphony) {
+                fluid_voice_t** list = realloc(st->list, (polyphony + 1) * sizeof(fluid_voice_t*));
+                if (list != NULL) { st->list = list; }
+                unsigned int* ids = realloc(st->ids, polyphony * sizeof(unsigned int));
+                if (ids != NULL) { st->ids = ids; }
+                unsigned int* next_ids = realloc(st->next_ids, polyphony * sizeof(unsigned int));
+                if (next_ids != NULL) { st->next_ids = next_ids; }
+                if (list == NULL || ids == NULL || next_ids == NULL) { return FLUID_FAILED; }
+        }
+        st->polyphony = polyphony;
+
+        int nchannels = fluid_synth_count_midi_channels(st->synth);
+        if (nchannels != st->nchannels) {
+                int* channels = realloc(st->channels, nchannels * sizeof(int));
+                if (channels == NULL) { return FLUID_FAILED; }
+                st->channels = channels;
+                st->nchannels = nchannels;
+        }
+
+        return FLUID_OK;
+}
 
-        int    channel = (int)luaL_checkinteger(L, 2);
-        short      val = (short)luaL_checkinteger(L, 3);
+static struct synth_stats*
+synth_stats_get (fluid_synth_t* synth)
+{
+        struct synth_stats* st = synth_stats_find(synth);
+        if (st != NULL) { return st; }
 
-        fluid_event_pitch_bend(event, channel, val);
-        
-        return 0;
+        st = calloc(1, sizeof(struct synth_stats));
+        if (st == NULL) { return NULL; }
+        st->synth = synth;
+        if (synth_stats_fit(st) != FLUID_OK) { synth_stats_free(st); return NULL; }
+
+        st->next = synth_stats_list;
+        synth_stats_list = st;
+        return st;
+}
+
+static void
+synth_stats_sample (struct synth_stats* st)
+{
+        if (st == NULL) { return; }
+
+        // voices that played in the last sample
+        int before = st->voices;
+        if (synth_stats_fit(st) != FLUID_OK) { return; }
+        if (before > st->polyphony) { before = st->polyphony; }
+
+        fluid_synth_get_voicelist(st->synth, st->list, st->polyphony + 1, -1);
+
+        int n = 0;
+        while (n < st->polyphony && st->list[n] != NULL) {
+                st->next_ids[n] = fluid_voice_get_id(st->list[n]);
+                n++;
+        }
+        qsort(st->next_ids, n, sizeof(unsigned int), compare_uint);
+
+        // compare both sorted id lists
+        int added = 0, gone = 0;
+        int i = 0, j = 0;
+        while (i < before || j < n) {
+                if (j == n || (i < before && st->ids[i] < st->next_ids[j])) {
+                        gone++;
+                        i++;
+                } else if (i == before || st->next_ids[j] < st->ids[i]) {
+                        added++;
+                        j++;
+                } else {
+                        i++;
+                        j++;
+                }
+        }
+
+        int stolen = added - (st->polyphony - before);
+        if (stolen > gone) { stolen = gone; }
+        if (stolen > 0) { st->stolen += stolen; }
+        st->started += added;
+
+        unsigned int* ids = st->ids;
+        st->ids = st->next_ids;
+        st->next_ids = ids;
+        st->voices = n;
+        if (n > st->peak) { st->peak = n; }
+
+        memset(st->channels, 0, st->nchannels * sizeof(int));
+        for (int k = 0; k < n; k++) {
+                int chan = fluid_voice_get_channel(st->list[k]);
+                if (chan >= 0 && chan < st->nchannels) { st->channels[chan]++; }
+        }
+
+        st->cpu_load = fluid_synth_get_cpu_load(st->synth);
+        if (st->cpu_load > st->cpu_peak) { st->cpu_peak = st->cpu_load; }
+        st->samples++;
 }
 
 /*
- * FLUIDSYNTH_API void
- * fluid_event_pitch_wheelsens (fluid_event_t *evt,
- *                              int channel,
- *                              short val)
+ * Streaming WAV writer. Samples are collected in a large aligned
+ * buffer that is written out with one `write` when full, and the
+ * header is filled in on close. Files whose data would not fit the 32
+ * bit RIFF sizes become RF64: the JUNK chunk reserved after the RIFF
+ * header turns into the ds64 chunk holding the 64 bit sizes.
  *
- * Set a sequencer event to be a pitch wheel sensitivity event.
+ * Only 16 bit PCM uses the plain "fmt " chunk. Samples wider than 16
+ * bits need WAVE_FORMAT_EXTENSIBLE, and float data is not PCM, so it
+ * also gets a "fact" chunk with the number of frames.
  *
  */
 
-static int
-c_fluid_event_pitch_wheelsens (lua_State* L)
-{
-        fluid_event_t* event = *(fluid_event_t**)lua_touserdata(L, 1);
-        if (event == NULL) { lua_pushnil(L); return 1; }
+#define WAV_BUFFER_SIZE (4 << 20)
+#define WAV_BUFFER_ALIGN 4096
+#define WAV_HEADER_MAX 116
 
-        int    channel = (int)luaL_checkinteger(L, 2);
-        short      val = (short)luaL_checkinteger(L, 3);
+#define WAVE_FORMAT_PCM 1
+#define WAVE_FORMAT_IEEE_FLOAT 3
+#define WAVE_FORMAT_EXTENSIBLE 0xfffe
 
-        fluid_event_pitch_wheelsens(event, channel, val);
-        
-        return 0;
+struct wav_writer {
+        int fd;
+        int format;
+        int sample_rate;
+        unsigned char* buf;
+        size_t fill;
+        unsigned long long data_bytes;
+        int failed;
+        struct dither dither;   // used for integer formats
+};
+
+static void
+put_u16le (unsigned char* p, unsigned int v)
+{
+        p[0] = v & 0xff;
+        p[1] = (v >> 8) & 0xff;
 }
 
-/*
- * FLUIDSYNTH_API void
- * fluid_event_modulation (fluid_event_t *evt,
- *                         int channel,
- *                         short val)
- *
- * Set a sequencer event to be a modulation event.
- *
- */
+static void
+put_u32le (unsigned char* p, unsigned int v)
+{
+        put_u16le(p, v & 0xffff);
+        put_u16le(p + 2, v >> 16);
+}
+
+static void
+put_u64le (unsigned char* p, unsigned long long v)
+{
+        put_u32le(p, (unsigned int)v);
+        put_u32le(p + 4, (unsigned int)(v >> 32));
+}
+
+static unsigned int
+get_u16le (const unsigned char* p)
+{
+        return p[0] | (p[1] << 8);
+}
+
+static unsigned int
+get_u32le (const unsigned char* p)
+{
+        return p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned int)p[3] << 24);
+}
+
+static size_t
+wav_header_size (int format)
+{
+        size_t size = 12 + 36 + 8 + 8;         // RIFF, JUNK or ds64, fmt and data headers
+        size += format == AUDIO_FORMAT_S16 ? 16 : 40;
+        if (format == AUDIO_FORMAT_FLOAT) { size += 12; }
+        return size;
+}
 
+// fill in the wav_header_size(format) bytes of the header
+static void
+wav_header (unsigned char* h, int format, int sample_rate, unsigned long long data_bytes)
+{
+        unsigned int sample_size = (unsigned int)audio_format_size(format);
+        unsigned long long frames = data_bytes / (2 * sample_size);
+        unsigned long long riff_size = data_bytes + wav_header_size(format) - 8;
+        int rf64 = riff_size > 0xffffffffull;
+
+        memcpy(h, rf64 ? "RF64" : "RIFF", 4);
+        put_u32le(h + 4, rf64 ? 0xffffffffu : (unsigned int)riff_size);
+        memcpy(h + 8, "WAVE", 4);
+
+        memcpy(h + 12, rf64 ? "ds64" : "JUNK", 4);
+        put_u32le(h + 16, 28);
+        memset(h + 20, 0, 28);
+        if (rf64) {
+                put_u64le(h + 20, riff_size);
+                put_u64le(h + 28, data_bytes);
+                put_u64le(h + 36, frames);
+        }
+
+        int tag = format == AUDIO_FORMAT_FLOAT ? WAVE_FORMAT_IEEE_FLOAT : WAVE_FORMAT_PCM;
+        int extensible = format != AUDIO_FORMAT_S16;
+
+        memcpy(h + 48, "fmt ", 4);
+        put_u32le(h + 52, extensible ? 40 : 16);
+        put_u16le(h + 56, extensible ? WAVE_FORMAT_EXTENSIBLE : tag);
+        put_u16le(h + 58, 2);
+        put_u32le(h + 60, sample_rate);
+        put_u32le(h + 64, sample_rate * 2 * sample_size);
+        put_u16le(h + 68, 2 * sample_size);
+        put_u16le(h + 70, 8 * sample_size);
+        unsigned char* p = h + 72;
+
+        if (extensible) {
+                // KSDATAFORMAT_SUBTYPE_PCM or _IEEE_FLOAT
+                static const unsigned char guid[14] = {
+                        0x00, 0x00, 0x00, 0x00, 0x10, 0x00, 0x80, 0x00,
+                        0x00, 0xaa, 0x00, 0x38, 0x9b, 0x71
+                };
+                put_u16le(p, 22);
+                put_u16le(p + 2, 8 * sample_size);      // valid bits
+                put_u32le(p + 4, 0x3);                  // front left and right
+                put_u16le(p + 8, tag);
+                memcpy(p + 10, guid, sizeof(guid));
+                p += 24;
+        }
+
+        if (format == AUDIO_FORMAT_FLOAT) {
+                memcpy(p, "fact", 4);
+                put_u32le(p + 4, 4);
+                put_u32le(p + 8, rf64 || frames > 0xffffffffull ? 0xffffffffu : (unsigned int)frames);
+                p += 12;
+        }
+
+        memcpy(p, "data", 4);
+        put_u32le(p + 4, rf64 ? 0xffffffffu : (unsigned int)data_bytes);
+}
+
+// write all of `buf` at `offset`, or at the file position if negative,
+// through interrupted and short writes
 static int
-c_fluid_event_modulation (lua_State* L)
+wav_write_all (int fd, const unsigned char* buf, size_t len, off_t offset)
 {
-        fluid_event_t* event = *(fluid_event_t**)lua_touserdata(L, 1);
-        if (event == NULL) { lua_pushnil(L); return 1; }
+        size_t done = 0;
+        while (done < len) {
+                ssize_t n = offset < 0
+                        ? write(fd, buf + done, len - done)
+                        : pwrite(fd, buf + done, len - done, offset + done);
+                if (n < 0 && errno == EINTR) { continue; }
+                if (n <= 0) { return FLUID_FAILED; }
+                done += n;
+        }
+        return FLUID_OK;
+}
 
-        int    channel = (int)luaL_checkinteger(L, 2);
-        short      val = (short)luaL_checkinteger(L, 3);
+static int
+wav_writer_flush (struct wav_writer* w)
+{
+        if (wav_write_all(w->fd, w->buf, w->fill, -1) != FLUID_OK) {
+                w->failed = 1;
+                return FLUID_FAILED;
+        }
+        w->fill = 0;
+        return FLUID_OK;
+}
 
-        fluid_event_modulation(event, channel, val);
-        
-        return 0;
+static int
+wav_writer_open (struct wav_writer* w, const char* path, int format, int sample_rate)
+{
+        memset(w, 0, sizeof(struct wav_writer));
+        w->format = format;
+        w->sample_rate = sample_rate;
+        dither_init(&w->dither, DITHER_NONE);
+
+        w->buf = aligned_alloc(WAV_BUFFER_ALIGN, WAV_BUFFER_SIZE);
+        if (w->buf == NULL) { return FLUID_FAILED; }
+
+        w->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (w->fd < 0) { free(w->buf); return FLUID_FAILED; }
+
+        // a placeholder until the sizes are known
+        wav_header(w->buf, format, sample_rate, 0);
+        w->fill = wav_header_size(format);
+
+        return FLUID_OK;
+}
+
+// room for `bytes` more bytes, at most WAV_BUFFER_SIZE, in the buffer
+static unsigned char*
+wav_writer_reserve (struct wav_writer* w, size_t bytes)
+{
+        if (w->fill + bytes > WAV_BUFFER_SIZE && wav_writer_flush(w) != FLUID_OK) { return NULL; }
+        return w->buf + w->fill;
+}
+
+static void
+wav_writer_commit (struct wav_writer* w, size_t bytes)
+{
+        w->fill += bytes;
+        w->data_bytes += bytes;
+}
+
+static int
+wav_writer_close (struct wav_writer* w)
+{
+        int status = w->failed ? FLUID_FAILED : wav_writer_flush(w);
+
+        if (status == FLUID_OK) {
+                unsigned char header[WAV_HEADER_MAX];
+                wav_header(header, w->format, w->sample_rate, w->data_bytes);
+                status = wav_write_all(w->fd, header, wav_header_size(w->format), 0);
+        }
+
+        if (close(w->fd) != 0) { status = FLUID_FAILED; }
+        free(w->buf);
+
+        return status;
+}
+
+// render sink appending interleaved float frames to a WAV writer
+static int
+render_sink_wav_write (void* data, const float* frames, int count)
+{
+        struct wav_writer* w = (struct wav_writer*)data;
+        size_t bytes = 2 * (size_t)count * audio_format_size(w->format);
+
+        unsigned char* out = wav_writer_reserve(w, bytes);
+        if (out == NULL) { return FLUID_FAILED; }
+
+        convert_samples(w->format, frames, out, 2 * (size_t)count, 1, 0, &w->dither);
+
+        wav_writer_commit(w, bytes);
+        return FLUID_OK;
 }
 
 /*
- * FLUIDSYNTH_API void
- * fluid_event_sustain (fluid_event_t *evt,
- *                      int channel,
- *                      short val)
+ * Advance `seq` one millisecond at a time from its current position
+ * and render exactly the frames that belong to each millisecond, so
+ * events reach the synth at the same sample position no matter how
+ * fast the render runs. The synth itself applies events at the start
+ * of its next internal block of 64 frames.
  *
- * Set a sequencer event to be a MIDI sustain event.
+ * Returns the number of frames rendered, or -1 if the sink failed.
  *
  */
 
-static int
-c_fluid_event_sustain (lua_State* L)
+static long long
+render_lockstep (fluid_sequencer_t* seq, fluid_synth_t* synth,
+                 unsigned int msec, struct render_sink* sink)
 {
-        fluid_event_t* event = *(fluid_event_t**)lua_touserdata(L, 1);
-        if (event == NULL) { lua_pushnil(L); return 1; }
+        float block[2 * RENDER_BLOCK_FRAMES];
+        struct meter* meter = synth_meter(synth);
+        struct synth_stats* stats = synth_stats_find(synth);
 
-        int    channel = (int)luaL_checkinteger(L, 2);
-        short      val = (short)luaL_checkinteger(L, 3);
+        double sample_rate = synth_sample_rate(synth);
+        double scale = fluid_sequencer_get_time_scale(seq);
+        unsigned int start = (unsigned int)(fluid_sequencer_get_tick(seq) * 1000.0 / scale);
 
-        fluid_event_sustain(event, channel, val);
-        
-        return 0;
+        long long rendered = 0;
+        int fill = 0;
+
+        for (unsigned int ms = 0; ms < msec; ms++) {
+                fluid_sequencer_process(seq, start + ms);
+
+                long long end = (long long)((ms + 1) * sample_rate / 1000.0);
+                int frames = (int)(end - rendered);
+
+                while (frames > 0) {
+                        int n = RENDER_BLOCK_FRAMES - fill;
+                        if (n > frames) { n = frames; }
+
+                        fluid_synth_write_float(synth, n, block, 2 * fill, 2, block, 2 * fill + 1, 2);
+                        meter_feed(meter, block + 2 * fill, block + 2 * fill + 1, 2, n);
+                        synth_stats_sample(stats);
+                        fill += n;
+                        frames -= n;
+                        rendered += n;
+
+                        if (fill == RENDER_BLOCK_FRAMES) {
+                                if (sink->write(sink->data, block, fill) != FLUID_OK) { return -1; }
+                                fill = 0;
+                        }
+                }
+        }
+
+        if (fill > 0 && sink->write(sink->data, block, fill) != FLUID_OK) { return -1; }
+
+        return rendered;
 }
 
 /*
- * FLUIDSYNTH_API void
- * fluid_event_pan (fluid_event_t *evt,
- *                  int channel,
- *                  short val)
+ * fluid_sequencer_render (seq, synth, msec, out, format, dither)
  *
- * Set a sequencer event to be a stereo pan event.
+ * Render `msec` milliseconds of `synth` while driving `seq`, which
+ * must not use the system timer, in lockstep with the rendered
+ * samples. `out` is a file name or an open Lua file, and receives
+ * interleaved stereo 32 bit floats in native byte order. When a
+ * `format` (one of `audio_formats`) is given, `out` must be a file
+ * name and is written as a WAV file of that sample format instead,
+ * converted with `dither` ("none", "tpdf" or "shaped") if integer.
+ *
+ * Returns the number of frames rendered.
  *
  */
 
 static int
-c_fluid_event_pan (lua_State* L)
+c_fluid_sequencer_render (lua_State* L)
 {
-        fluid_event_t* event = *(fluid_event_t**)lua_touserdata(L, 1);
-        if (event == NULL) { lua_pushnil(L); return 1; }
-
-        int    channel = (int)luaL_checkinteger(L, 2);
-        short      val = (short)luaL_checkinteger(L, 3);
-
-        fluid_event_pan(event, channel, val);
-        
-        return 0;
+        fluid_sequencer_t* seq = *(fluid_sequencer_t**)lua_touserdata(L, 1);
+        fluid_synth_t* synth = *(fluid_synth_t**)lua_touserdata(L, 2);
+        unsigned int msec = (unsigned int)luaL_checkinteger(L, 3);
+
+        if (fluid_sequencer_get_use_system_timer(seq)) { lua_pushnil(L); return 1; }
+
+        if (!lua_isnoneornil(L, 5)) {
+                const char* path = luaL_checkstring(L, 4);
+                int format = luaL_checkoption(L, 5, NULL, audio_formats);
+                int mode = luaL_checkoption(L, 6, "none", dither_modes);
+
+                struct wav_writer w;
+                if (wav_writer_open(&w, path, format, (int)synth_sample_rate(synth)) != FLUID_OK) {
+                        lua_pushnil(L);
+                        return 1;
+                }
+                w.dither.mode = mode;
+
+                struct render_sink sink = { render_sink_wav_write, &w };
+                long long frames = render_lockstep(seq, synth, msec, &sink);
+                if (wav_writer_close(&w) != FLUID_OK) { frames = -1; }
+                if (frames < 0) { lua_pushnil(L); return 1; }
+
+                lua_pushinteger(L, frames);
+                return 1;
+        }
+
+        FILE* f;
+        int owned = 0;
+        luaL_Stream* stream = (luaL_Stream*)luaL_testudata(L, 4, LUA_FILEHANDLE);
+        if (stream != NULL) {
+                f = stream->f;
+        } else {
+                f = fopen(luaL_checkstring(L, 4), "wb");
+                owned = 1;
+        }
+        if (f == NULL) { lua_pushnil(L); return 1; }
+
+        struct render_sink sink = { render_sink_file_write, f };
+        long long frames = render_lockstep(seq, synth, msec, &sink);
+
+        if (owned && fclose(f) != 0) { frames = -1; }
+        if (frames < 0) { lua_pushnil(L); return 1; }
+
+        lua_pushinteger(L, frames);
+        return 1;
 }
 
+/*-------------------------------------------------------------------
+  ---=  Events =---
+  ------------------------------------------------------------------*/
+
 /*
- * FLUIDSYNTH_API void
- * fluid_event_volume (fluid_event_t *evt,
- *                     int channel,
- *                     short val)
+ * Events created from Lua are recycled through a small module-level
+ * pool instead of going back to libfluidsynth's allocator. An event
+ * returns to the pool when `delete_fluid_event` is called on it or
+ * when its userdata is collected, whichever comes first; a deleted
+ * event raises an error when used again.
  *
- * Set a sequencer event to be a volume event.
+ * The pool is a process global without locking, so events may only be
+ * created and deleted from one Lua state, or from states that never
+ * run at the same time.
  *
  */
 
+#define EVENT_POOL_SIZE 256
+
+static fluid_event_t* event_pool[EVENT_POOL_SIZE];
+static int event_pool_count = 0;
+
+static struct {
+        unsigned long hits;
+        unsigned long misses;
+        unsigned long releases;
+        unsigned long frees;
+} event_pool_stats;
+
+static fluid_event_t*
+event_pool_acquire (void)
+{
+        if (event_pool_count == 0) {
+                event_pool_stats.misses++;
+                return new_fluid_event();
+        }
+
+        event_pool_stats.hits++;
+        fluid_event_t* event = event_pool[--event_pool_count];
+
+        // clear every field the public setters reach; the type cannot be
+        // set back to none, so it ends as a timer without data, which the
+        // synth ignores
+        fluid_event_note(event, 0, 0, 0, 0);
+        fluid_event_program_select(event, 0, 0, 0, 0);
+        fluid_event_control_change(event, 0, 0, 0);
+        fluid_event_pitch_bend(event, 0, 0);
+        fluid_event_timer(event, NULL);
+        fluid_event_set_source(event, -1);
+        fluid_event_set_dest(event, -1);
+
+        return event;
+}
+
+static void
+event_pool_release (fluid_event_t* event)
+{
+        event_pool_stats.releases++;
+
+        if (event_pool_count == EVENT_POOL_SIZE) {
+                event_pool_stats.frees++;
+                delete_fluid_event(event);
+                return;
+        }
+
+        event_pool[event_pool_count++] = event;
+}
+
+static fluid_event_t*
+check_event (lua_State* L, int index)
+{
+        luaL_checktype(L, index, LUA_TUSERDATA);
+        fluid_event_t* event = *(fluid_event_t**)lua_touserdata(L, index);
+        if (event == NULL) { luaL_argerror(L, index, "deleted event"); }
+        return event;
+}
+
 static int
-c_fluid_event_volume (lua_State* L)
+gc_delete_fluid_event (lua_State* L)
 {
-        fluid_event_t* event = *(fluid_event_t**)lua_touserdata(L, 1);
-        if (event == NULL) { lua_pushnil(L); return 1; }
+        fluid_event_t** event_p = (fluid_event_t**)lua_touserdata(L, 1);
+        if (*event_p == NULL) { return 0; }
 
-        int    channel = (int)luaL_checkinteger(L, 2);
-        short      val = (short)luaL_checkinteger(L, 3);
+        event_pool_release(*event_p);
+        *event_p = NULL;
 
-        fluid_event_volume(event, channel, val);
-        
         return 0;
 }
 
 /*
- * FLUIDSYNTH_API void
- * fluid_event_reverb_send (fluid_event_t *evt,
- *                          int channel,
- *                          short val)
+ * FLUIDSYNTH_API fluid_event_t *
+ * new_fluid_event (void)
  *
- * Set a sequencer event to be a reverb send event.
+ * Create a new sequencer event structure.
  *
  */
 
 static int
-c_fluid_event_reverb_send (lua_State* L)
+c_new_fluid_event (lua_State* L)
 {
-        fluid_event_t* event = *(fluid_event_t**)lua_touserdata(L, 1);
+        fluid_event_t* event = event_pool_acquire();
         if (event == NULL) { lua_pushnil(L); return 1; }
+        
+        fluid_event_t** event_p = lua_newuserdata(L, sizeof(fluid_event_t*));
+        *event_p = event;
 
-        int    channel = (int)luaL_checkinteger(L, 2);
-        short      val = (short)luaL_checkinteger(L, 3);
-
-        fluid_event_reverb_send(event, channel, val);
+        // the metatable is created once in `luaopen_cfluidsynth`
+        luaL_setmetatable(L, "fluid.event");
         
-        return 0;
+        return 1;
 }
 
 /*
  * FLUIDSYNTH_API void
- * fluid_event_chorus_send (fluid_event_t *evt,
- *                          int channel,
- *                          short val)
+ * delete_fluid_event (fluid_event_t *evt)
  *
- * Set a sequencer event to be a chorus send event.
+ * Delete a sequencer event structure.
  *
  */
 
 static int
-c_fluid_event_chorus_send (lua_State* L)
+c_delete_fluid_event (lua_State* L)
 {
-        fluid_event_t* event = *(fluid_event_t**)lua_touserdata(L, 1);
-        if (event == NULL) { lua_pushnil(L); return 1; }
-
-        int    channel = (int)luaL_checkinteger(L, 2);
-        short      val = (short)luaL_checkinteger(L, 3);
+        fluid_event_t** event_p = (fluid_event_t**)lua_touserdata(L, 1);
+        if (*event_p == NULL) { lua_pushnil(L); return 1; }
 
-        fluid_event_chorus_send(event, channel, val);
+        // the userdata stays around until collected, so clear it to
+        // keep `__gc` from releasing the event a second time
+        event_pool_release(*event_p);
+        *event_p = NULL;
         
         return 0;
 }
 
 /*
- * FLUIDSYNTH_API void
- * fluid_event_channel_pressure (fluid_event_t *evt,
- *                               int channel,
- *                               short val)
+ * fluid_event_pool_stats ()
  *
- * Set a sequencer event to be a channel-wide aftertouch event.
+ * Get the counters of the event pool used by `new_fluid_event` and
+ * `delete_fluid_event`.
  *
  */
 
 static int
-c_fluid_event_channel_pressure (lua_State* L)
+c_fluid_event_pool_stats (lua_State* L)
 {
-        fluid_event_t* event = *(fluid_event_t**)lua_touserdata(L, 1);
-        if (event == NULL) { lua_pushnil(L); return 1; }
-
-        int    channel = (int)luaL_checkinteger(L, 2);
-        short      val = (short)luaL_checkinteger(L, 3);
+        lua_createtable(L, 0, 6);
+
+        lua_pushinteger(L, event_pool_stats.hits);
+        lua_setfield(L, -2, "hits");
+        lua_pushinteger(L, event_pool_stats.misses);
+        lua_setfield(L, -2, "misses");
+        lua_pushinteger(L, event_pool_stats.releases);
+        lua_setfield(L, -2, "releases");
+        lua_pushinteger(L, event_pool_stats.frees);
+        lua_setfield(L, -2, "frees");
+        lua_pushinteger(L, event_pool_count);
+        lua_setfield(L, -2, "pooled");
+        lua_pushinteger(L, EVENT_POOL_SIZE);
+        lua_setfield(L, -2, "capacity");
 
-        fluid_event_channel_pressure(event, channel, val);
-        
-        return 0;
+        return 1;
 }
 
 /*
  * FLUIDSYNTH_API void
- * fluid_event_system_reset (fluid_event_t *evt)
+ * fluid_event_set_source (fluid_event_t *evt,
+ *                         short src)
  *
- * Set a sequencer event to be a midi system reset event.
+ * Set source of a sequencer event (DOCME).
  *
  */
 
 static int
-c_fluid_event_system_reset (lua_State* L)
+c_fluid_event_set_source (lua_State* L)
 {
-        fluid_event_t* event = *(fluid_event_t**)lua_touserdata(L, 1);
-        if (event == NULL) { lua_pushnil(L); return 1; }
+        fluid_event_t* event = check_event(L, 1);
+        short src = (short)luaL_checkinteger(L, 2);
 
-        fluid_event_system_reset(event);
+        fluid_event_set_source(event, src);
         
         return 0;
 }
 
 /*
  * FLUIDSYNTH_API void
- * fluid_event_any_control_change (fluid_event_t *evt,
- *                                 int channel)
+ * fluid_event_set_dest (fluid_event_t *evt,
+ *                       short dest)
  *
- * Set a sequencer event to be an any control change event.
+ * Set destination of a sequencer event (DOCME).
  *
  */
 
 static int
-c_fluid_event_any_control_change (lua_State* L)
+c_fluid_event_set_dest (lua_State* L)
 {
-        fluid_event_t* event = *(fluid_event_t**)lua_touserdata(L, 1);
-        if (event == NULL) { lua_pushnil(L); return 1; }
-
-        int    channel = (int)luaL_checkinteger(L, 2);
+        fluid_event_t* event = check_event(L, 1);
+        short dest = (short)luaL_checkinteger(L, 2);
 
-        fluid_event_any_control_change(event, channel);
+        fluid_event_set_dest(event, dest);
         
         return 0;
 }
 
 /*
  * FLUIDSYNTH_API void
- * fluid_event_unregistering (fluid_event_t *evt)
+ * fluid_event_timer (fluid_event_t *evt,
+ *                    void *data)
  *
- * Set a sequencer event to be an unregistering event.
+ * Set a sequencer event to be a timer event.
  *
  */
 
 static int
-c_fluid_event_unregistering (lua_State* L)
+c_fluid_event_timer (lua_State* L)
 {
-        fluid_event_t* event = *(fluid_event_t**)lua_touserdata(L, 1);
+        fluid_event_t* event = check_event(L, 1);
         if (event == NULL) { lua_pushnil(L); return 1; }
-
-        fluid_event_unregistering(event);
+        
+        // Just to satisfy the type system, we need some pointer to
+        // take the place of void* data
+        void* data;
+        
+        fluid_event_timer(event, (void*)data);
         
         return 0;
 }
 
+
 /*
- * FLUIDSYNTH_API int
- * fluid_event_get_type (fluid_event_t *evt)
+ * FLUIDSYNTH_API void
+ * fluid_event_note (fluid_event_t *evt,
+ *                   int channel,
+ *                   short key,
+ *                   short vel,
+ *                   unsigned int duration)
  *
- * Get the event type (fluid_seq_event_type) field from a sequencer event structure.
+ * Set a sequencer event to be a note duration event.
  *
  */
 
 static int
-c_fluid_event_get_type (lua_State* L)
+c_fluid_event_note (lua_State* L)
 {
-        fluid_event_t* event = *(fluid_event_t**)lua_touserdata(L, 1);
+        fluid_event_t* event = check_event(L, 1);
         if (event == NULL) { lua_pushnil(L); return 1; }
 
-        int type = fluid_event_get_type(event);
+        int channel = (int)luaL_checkinteger(L, 2);
+        short key = (short)luaL_checkinteger(L, 3);
+        short vel = (short)luaL_checkinteger(L, 4);
+        unsigned int duration = (unsigned int)luaL_checkinteger(L, 5);
 
-        lua_pushinteger(L, type);
+        fluid_event_note(event, channel, key, vel, duration);
         
-        return 1;
+        return 0;
 }
 
 /*
- * FLUIDSYNTH_API short
- * fluid_event_get_source (fluid_event_t *evt)
+ * FLUIDSYNTH_API void
+ * fluid_event_noteon (fluid_event_t *evt,
+ *                     int channel,
+ *                     short key,
+ *                     short vel)
  *
- * Get the source field from a sequencer event structure.
+ * Set a sequencer event to be a note on event.
  *
  */
 
 static int
-c_fluid_event_get_source (lua_State* L)
+c_fluid_event_noteon (lua_State* L)
 {
-        fluid_event_t* event = *(fluid_event_t**)lua_touserdata(L, 1);
+        fluid_event_t* event = check_event(L, 1);
         if (event == NULL) { lua_pushnil(L); return 1; }
 
-        short src = fluid_event_get_source(event);
-
-        lua_pushinteger(L, src);
+        int channel = (int)luaL_checkinteger(L, 2);
+        short key = (short)luaL_checkinteger(L, 3);
+        short vel = (short)luaL_checkinteger(L, 4);
+
+        fluid_event_noteon(event, channel, key, vel);
         
-        return 1;
+        return 0;
 }
 
 /*
- * FLUIDSYNTH_API short
- * fluid_event_get_dest (fluid_event_t *evt)
- *
- * Get the dest field from a sequencer event structure.
+ * FLUIDSYNTH_API void
+ * fluid_event_noteoff (fluid_event_t *evt,
+ *                      int channel,
+ *                      short key)
+ * 
+ * Set a sequencer event to be a note off event.
  *
  */
 
 static int
-c_fluid_event_get_dest (lua_State* L)
+c_fluid_event_noteoff (lua_State* L)
 {
-        fluid_event_t* event = *(fluid_event_t**)lua_touserdata(L, 1);
+        fluid_event_t* event = check_event(L, 1);
         if (event == NULL) { lua_pushnil(L); return 1; }
 
-        short dest = fluid_event_get_dest(event);
+        int channel = (int)luaL_checkinteger(L, 2);
+        short key = (short)luaL_checkinteger(L, 3);
 
-        lua_pushinteger(L, dest);
+        fluid_event_noteoff(event, channel, key);
         
-        return 1;
+        return 0;
 }
 
 /*
- * FLUIDSYNTH_API int
- * fluid_event_get_channel (fluid_event_t *evt)
+ * FLUIDSYNTH_API void
+ * fluid_event_all_sounds_off (fluid_event_t *evt,
+ *                             int channel)
  *
- * Get the MIDI channel field from a sequencer event structure.
+ * Set a sequencer event to be an all sounds off event.
  *
  */
 
 static int
-c_fluid_event_get_channel (lua_State* L)
+c_fluid_event_all_sounds_off (lua_State* L)
 {
-        fluid_event_t* event = *(fluid_event_t**)lua_touserdata(L, 1);
+        fluid_event_t* event = check_event(L, 1);
         if (event == NULL) { lua_pushnil(L); return 1; }
 
-        int channel = fluid_event_get_channel(event);
+        int channel = (int)luaL_checkinteger(L, 2);
 
-        lua_pushinteger(L, channel);
+        fluid_event_all_sounds_off(event, channel);
         
-        return 1;
+        return 0;
 }
 
 /*
- * FLUIDSYNTH_API short
- * fluid_event_get_key (fluid_event_t *evt)
+ * FLUIDSYNTH_API void
+ * fluid_event_all_notes_off (fluid_event_t *evt,
+ *                            int channel)
  *
- * Get the MIDI note field from a sequencer event structure.
+ * Set a sequencer event to be a all notes off event.
  *
  */
 
 static int
-c_fluid_event_get_key (lua_State* L)
+c_fluid_event_all_notes_off (lua_State* L)
 {
-        fluid_event_t* event = *(fluid_event_t**)lua_touserdata(L, 1);
+        fluid_event_t* event = check_event(L, 1);
         if (event == NULL) { lua_pushnil(L); return 1; }
 
-        short key = fluid_event_get_key(event);
+        int channel = (int)luaL_checkinteger(L, 2);
 
-        lua_pushinteger(L, key);
+        fluid_event_all_notes_off(event, channel);
         
-        return 1;
+        return 0;
 }
 
 /*
- * FLUIDSYNTH_API short
- * fluid_event_get_velocity (fluid_event_t *evt)
+ * FLUIDSYNTH_API void
+ * fluid_event_bank_select (fluid_event_t *evt,
+ *                          int channel,
+ *                          short bank_num)
  *
- * Get the MIDI velocity field from a sequencer event structure.
+ * Set a sequencer event to be a bank select event.
  *
  */
 
 static int
-c_fluid_event_get_velocity (lua_State* L)
+c_fluid_event_bank_select (lua_State* L)
 {
-        fluid_event_t* event = *(fluid_event_t**)lua_touserdata(L, 1);
+        fluid_event_t* event = check_event(L, 1);
         if (event == NULL) { lua_pushnil(L); return 1; }
 
-        short vel = fluid_event_get_velocity(event);
+        int channel = (int)luaL_checkinteger(L, 2);
+        short bank_num = (short)luaL_checkinteger(L, 3);
 
-        lua_pushinteger(L, vel);
+        fluid_event_bank_select(event, channel, bank_num);
         
-        return 1;
+        return 0;
 }
 
 /*
- * FLUIDSYNTH_API short
- * fluid_event_get_control (fluid_event_t *evt)
+ * FLUIDSYNTH_API void
+ * fluid_event_program_change (fluid_event_t *evt,
+ *                             int channel,
+ *                             short preset_num)
  *
- * Get the MIDI control number field from a sequencer event structure.
+ * Set a sequencer event to be a program change event.
  *
  */
 
 static int
-c_fluid_event_get_control (lua_State* L)
+c_fluid_event_program_change (lua_State* L)
 {
-        fluid_event_t* event = *(fluid_event_t**)lua_touserdata(L, 1);
+        fluid_event_t* event = check_event(L, 1);
         if (event == NULL) { lua_pushnil(L); return 1; }
 
-        short control = fluid_event_get_control(event);
+        int channel = (int)luaL_checkinteger(L, 2);
+        short preset_num = (short)luaL_checkinteger(L, 3);
 
-        lua_pushinteger(L, control);
+        fluid_event_program_change(event, channel, preset_num);
         
-        return 1;
+        return 0;
 }
 
 /*
- * FLUIDSYNTH_API short
- * fluid_event_get_value (fluid_event_t *evt)
+ * FLUIDSYNTH_API void
+ * fluid_event_program_select (fluid_event_t *evt,
+ *                             int channel,
+ *                             unsigned int sfont_id,
+ *                             short bank_num,
+ *                             short preset_num)
  *
- * Get the value field from a sequencer event structure.
+ * Set a sequencer event to be a program select event.
  *
  */
 
 static int
-c_fluid_event_get_value (lua_State* L)
+c_fluid_event_program_select (lua_State* L)
 {
-        fluid_event_t* event = *(fluid_event_t**)lua_touserdata(L, 1);
+        fluid_event_t* event = check_event(L, 1);
         if (event == NULL) { lua_pushnil(L); return 1; }
 
-        short val = fluid_event_get_value(event);
+        int           channel = (int)luaL_checkinteger(L, 2);
+        unsigned int sfont_id = (unsigned int)luaL_checkinteger(L, 3);
+        short        bank_num = (short)luaL_checkinteger(L, 4);
+        short      preset_num = (short)luaL_checkinteger(L, 5);
 
-        lua_pushinteger(L, val);
+        fluid_event_program_select(event, channel, sfont_id, bank_num, preset_num);
         
-        return 1;
+        return 0;
 }
 
 /*
- * FLUIDSYNTH_API short
- * fluid_event_get_program (fluid_event_t *evt)
+ * FLUIDSYNTH_API void
+ * fluid_event_control_change (fluid_event_t *evt,
+ *                             int channel,
+ *                             short control,
+ *                             short val)
  *
- * Get the MIDI program field from a sequencer event structure.
+ * Set a sequencer event to be a MIDI control change event.
  *
  */
 
 static int
-c_fluid_event_get_program (lua_State* L)
+c_fluid_event_control_change (lua_State* L)
 {
-        fluid_event_t* event = *(fluid_event_t**)lua_touserdata(L, 1);
+        fluid_event_t* event = check_event(L, 1);
         if (event == NULL) { lua_pushnil(L); return 1; }
 
-        short program = fluid_event_get_program(event);
+        int    channel = (int)luaL_checkinteger(L, 2);
+        short  control = (short)luaL_checkinteger(L, 3);
+        short      val = (short)luaL_checkinteger(L, 4);
 
-        lua_pushinteger(L, program);
+        fluid_event_control_change(event, channel, control, val);
         
-        return 1;
+        return 0;
 }
 
 /*
- * FLUIDSYNTH_API void *
- * fluid_event_get_data (fluid_event_t *evt)
+ * FLUIDSYNTH_API void
+ * fluid_event_pitch_bend (fluid_event_t *evt,
+ *                         int channel,
+ *                         int val)
  *
- * Get the data field from a sequencer event structure.
+ * Set a sequencer event to be a pitch bend event.
  *
  */
 
 static int
-c_fluid_event_get_data (lua_State* L)
+c_fluid_event_pitch_bend (lua_State* L)
 {
-        fluid_event_t* event = *(fluid_event_t**)lua_touserdata(L, 1);
+        fluid_event_t* event = check_event(L, 1);
         if (event == NULL) { lua_pushnil(L); return 1; }
 
-        void* data = fluid_event_get_data(event);
+        int    channel = (int)luaL_checkinteger(L, 2);
+        short      val = (short)luaL_checkinteger(L, 3);
 
-        void** data_p = lua_newuserdata(L, sizeof(void*));
-        *data_p = data;
-                
-        return 1;
+        fluid_event_pitch_bend(event, channel, val);
+        
+        return 0;
 }
 
 /*
- * FLUIDSYNTH_API unsigned int
- * fluid_event_get_duration (fluid_event_t *evt)
+ * FLUIDSYNTH_API void
+ * fluid_event_pitch_wheelsens (fluid_event_t *evt,
+ *                              int channel,
+ *                              short val)
  *
- * Get the duration field from a sequencer event structure.
+ * Set a sequencer event to be a pitch wheel sensitivity event.
  *
  */
 
 static int
-c_fluid_event_get_duration (lua_State* L)
+c_fluid_event_pitch_wheelsens (lua_State* L)
 {
-        fluid_event_t* event = *(fluid_event_t**)lua_touserdata(L, 1);
+        fluid_event_t* event = check_event(L, 1);
         if (event == NULL) { lua_pushnil(L); return 1; }
 
-        unsigned int duration = fluid_event_get_duration(event);
+        int    channel = (int)luaL_checkinteger(L, 2);
+        short      val = (short)luaL_checkinteger(L, 3);
 
-        lua_pushinteger(L, duration);
+        fluid_event_pitch_wheelsens(event, channel, val);
         
-        return 1;
+        return 0;
 }
 
 /*
- * FLUIDSYNTH_API short
- * fluid_event_get_bank (fluid_event_t *evt)
+ * FLUIDSYNTH_API void
+ * fluid_event_modulation (fluid_event_t *evt,
+ *                         int channel,
+ *                         short val)
  *
- * Get the MIDI bank field from a sequencer event structure.
+ * Set a sequencer event to be a modulation event.
  *
  */
 
 static int
-c_fluid_event_get_bank (lua_State* L)
+c_fluid_event_modulation (lua_State* L)
 {
-        fluid_event_t* event = *(fluid_event_t**)lua_touserdata(L, 1);
+        fluid_event_t* event = check_event(L, 1);
         if (event == NULL) { lua_pushnil(L); return 1; }
 
-        short bank = fluid_event_get_bank(event);
+        int    channel = (int)luaL_checkinteger(L, 2);
+        short      val = (short)luaL_checkinteger(L, 3);
 
-        lua_pushinteger(L, bank);
+        fluid_event_modulation(event, channel, val);
         
-        return 1;
+        return 0;
 }
 
 /*
- * FLUIDSYNTH_API int
- * fluid_event_get_pitch (fluid_event_t *evt)
+ * FLUIDSYNTH_API void
+ * fluid_event_sustain (fluid_event_t *evt,
+ *                      int channel,
+ *                      short val)
  *
- * Get the pitch field from a sequencer event structure.
+ * Set a sequencer event to be a MIDI sustain event.
  *
  */
 
 static int
-c_fluid_event_get_pitch (lua_State* L)
+c_fluid_event_sustain (lua_State* L)
 {
-        fluid_event_t* event = *(fluid_event_t**)lua_touserdata(L, 1);
+        fluid_event_t* event = check_event(L, 1);
         if (event == NULL) { lua_pushnil(L); return 1; }
 
-        int pitch = fluid_event_get_pitch(event);
+        int    channel = (int)luaL_checkinteger(L, 2);
+        short      val = (short)luaL_checkinteger(L, 3);
 
-        lua_pushinteger(L, pitch);
+        fluid_event_sustain(event, channel, val);
         
-        return 1;
+        return 0;
 }
 
 /*
- * FLUIDSYNTH_API unsigned int
- * fluid_event_get_sfont_id (fluid_event_t *evt)
+ * FLUIDSYNTH_API void
+ * fluid_event_pan (fluid_event_t *evt,
+ *                  int channel,
+ *                  short val)
  *
- * Get the SoundFont ID field from a sequencer event structure.
+ * Set a sequencer event to be a stereo pan event.
  *
  */
 
 static int
-c_fluid_event_get_sfont_id (lua_State* L)
+c_fluid_event_pan (lua_State* L)
 {
-        fluid_event_t* event = *(fluid_event_t**)lua_touserdata(L, 1);
+        fluid_event_t* event = check_event(L, 1);
         if (event == NULL) { lua_pushnil(L); return 1; }
 
-        unsigned int sfont_id = fluid_event_get_sfont_id(event);
+        int    channel = (int)luaL_checkinteger(L, 2);
+        short      val = (short)luaL_checkinteger(L, 3);
 
-        lua_pushinteger(L, sfont_id);
+        fluid_event_pan(event, channel, val);
         
-        return 1;
+        return 0;
 }
 
-
-/*-------------------------------------------------------------------
-  ---=  Synth =---
-  ------------------------------------------------------------------*/
-
 /*
- * FLUIDSYNTH_API fluid_synth_t *
- * new_fluid_synth (fluid_settings_t *settings)
+ * FLUIDSYNTH_API void
+ * fluid_event_volume (fluid_event_t *evt,
+ *                     int channel,
+ *                     short val)
  *
- * Create new FluidSynth instance.
+ * Set a sequencer event to be a volume event.
  *
  */
 
 static int
-c_new_fluid_synth (lua_State* L)
+c_fluid_event_volume (lua_State* L)
 {
-        fluid_settings_t* settings = *(fluid_settings_t**)lua_touserdata(L, 1);
-        if (settings == NULL) { lua_pushnil(L); return 1; }
+        fluid_event_t* event = check_event(L, 1);
+        if (event == NULL) { lua_pushnil(L); return 1; }
 
-        fluid_synth_t* synth = new_fluid_synth(settings);
-        if (synth == NULL) { lua_pushnil(L); return 1; }
+        int    channel = (int)luaL_checkinteger(L, 2);
+        short      val = (short)luaL_checkinteger(L, 3);
 
-        fluid_synth_t** synth_p = lua_newuserdata(L, sizeof(fluid_synth_t*));
-        *synth_p = synth;
+        fluid_event_volume(event, channel, val);
         
-        return 1;
+        return 0;
 }
 
 /*
- * FLUIDSYNTH_API int
- * delete_fluid_synth (fluid_synth_t *synth)
+ * FLUIDSYNTH_API void
+ * fluid_event_reverb_send (fluid_event_t *evt,
+ *                          int channel,
+ *                          short val)
  *
- * Delete a FluidSynth instance.
+ * Set a sequencer event to be a reverb send event.
  *
  */
 
 static int
-c_delete_fluid_synth (lua_State* L)
+c_fluid_event_reverb_send (lua_State* L)
 {
-        fluid_synth_t* synth = *(fluid_synth_t**)lua_touserdata(L, 1);
-        if (synth == NULL) { lua_pushnil(L); return 1; }
+        fluid_event_t* event = check_event(L, 1);
+        if (event == NULL) { lua_pushnil(L); return 1; }
 
-        int status = delete_fluid_synth(synth);
+        int    channel = (int)luaL_checkinteger(L, 2);
+        short      val = (short)luaL_checkinteger(L, 3);
 
-        lua_pushinteger(L, status);
-        return 1;
+        fluid_event_reverb_send(event, channel, val);
+        
+        return 0;
 }
 
 /*
- * FLUIDSYNTH_API fluid_settings_t * 	fluid_synth_get_settings (fluid_synth_t *synth)
+ * FLUIDSYNTH_API void
+ * fluid_event_chorus_send (fluid_event_t *evt,
+ *                          int channel,
+ *                          short val)
  *
- * Get settings assigned to a synth.
+ * Set a sequencer event to be a chorus send event.
  *
  */
 
-/*
- * FLUIDSYNTH_API int
- * fluid_synth_noteon (fluid_synth_t *synth,
- *                     int chan,
- *                     int key,
- *                     int vel)
- *
- * Send a note-on event to a FluidSynth object.
- *
- */
+static int
+c_fluid_event_chorus_send (lua_State* L)
+{
+        fluid_event_t* event = check_event(L, 1);
+        if (event == NULL) { lua_pushnil(L); return 1; }
 
-/*
- * FLUIDSYNTH_API int
- * fluid_synth_noteoff (fluid_synth_t *synth,
- *                      int chan,
- *                      int key)
- *
- * Send a note-off event to a FluidSynth object.
- *
- */
+        int    channel = (int)luaL_checkinteger(L, 2);
+        short      val = (short)luaL_checkinteger(L, 3);
+
+        fluid_event_chorus_send(event, channel, val);
+        
+        return 0;
+}
 
 /*
- * FLUIDSYNTH_API int
- * fluid_synth_cc (fluid_synth_t *synth, int chan, int ctrl, int val)
+ * FLUIDSYNTH_API void
+ * fluid_event_channel_pressure (fluid_event_t *evt,
+ *                               int channel,
+ *                               short val)
  *
- * Send a MIDI controller event on a MIDI channel.
+ * Set a sequencer event to be a channel-wide aftertouch event.
  *
  */
 
+static int
+c_fluid_event_channel_pressure (lua_State* L)
+{
+        fluid_event_t* event = check_event(L, 1);
+        if (event == NULL) { lua_pushnil(L); return 1; }
+
+        int    channel = (int)luaL_checkinteger(L, 2);
+        short      val = (short)luaL_checkinteger(L, 3);
+
+        fluid_event_channel_pressure(event, channel, val);
+        
+        return 0;
+}
+
 /*
- * FLUIDSYNTH_API int
- * fluid_synth_get_cc (fluid_synth_t *synth,
- *                     int chan,
- *                     int ctrl,
- *                     int *pval)
+ * FLUIDSYNTH_API void
+ * fluid_event_system_reset (fluid_event_t *evt)
  *
- * Get current MIDI controller value on a MIDI channel.
+ * Set a sequencer event to be a midi system reset event.
  *
  */
 
+static int
+c_fluid_event_system_reset (lua_State* L)
+{
+        fluid_event_t* event = check_event(L, 1);
+        if (event == NULL) { lua_pushnil(L); return 1; }
+
+        fluid_event_system_reset(event);
+        
+        return 0;
+}
+
 /*
- * FLUIDSYNTH_API int
- * fluid_synth_sysex (fluid_synth_t *synth,
- *                    const char *data,
- *                    int len,
- *                    char *response,
- *                    int *response_len,
- *                    int *handled,
- *                    int dryrun)
+ * FLUIDSYNTH_API void
+ * fluid_event_any_control_change (fluid_event_t *evt,
+ *                                 int channel)
  *
- * Process a MIDI SYSEX (system exclusive) message.
+ * Set a sequencer event to be an any control change event.
  *
  */
 
+static int
+c_fluid_event_any_control_change (lua_State* L)
+{
+        fluid_event_t* event = check_event(L, 1);
+        if (event == NULL) { lua_pushnil(L); return 1; }
+
+        int    channel = (int)luaL_checkinteger(L, 2);
+
+        fluid_event_any_control_change(event, channel);
+        
+        return 0;
+}
+
 /*
- * FLUIDSYNTH_API int
- * fluid_synth_pitch_bend (fluid_synth_t *synth,
- *                         int chan,
- *                         int val)
+ * FLUIDSYNTH_API void
+ * fluid_event_unregistering (fluid_event_t *evt)
  *
- * Set the MIDI pitch bend controller value on a MIDI channel.
+ * Set a sequencer event to be an unregistering event.
  *
  */
 
+static int
+c_fluid_event_unregistering (lua_State* L)
+{
+        fluid_event_t* event = check_event(L, 1);
+        if (event == NULL) { lua_pushnil(L); return 1; }
+
+        fluid_event_unregistering(event);
+        
+        return 0;
+}
+
 /*
  * FLUIDSYNTH_API int
- * fluid_synth_get_pitch_bend (fluid_synth_t *synth,
- *                             int chan,
- *                             int *ppitch_bend)
+ * fluid_event_get_type (fluid_event_t *evt)
  *
- * Get the MIDI pitch bend controller value on a MIDI channel.
+ * Get the event type (fluid_seq_event_type) field from a sequencer event structure.
  *
  */
 
+static int
+c_fluid_event_get_type (lua_State* L)
+{
+        fluid_event_t* event = check_event(L, 1);
+        if (event == NULL) { lua_pushnil(L); return 1; }
+
+        int type = fluid_event_get_type(event);
+
+        lua_pushinteger(L, type);
+        
+        return 1;
+}
+
 /*
- * FLUIDSYNTH_API int
- * fluid_synth_pitch_wheel_sens (fluid_synth_t *synth,
- *                               int chan,
- *                               int val)
+ * FLUIDSYNTH_API short
+ * fluid_event_get_source (fluid_event_t *evt)
  *
- * Set MIDI pitch wheel sensitivity on a MIDI channel.
+ * Get the source field from a sequencer event structure.
  *
  */
 
+static int
+c_fluid_event_get_source (lua_State* L)
+{
+        fluid_event_t* event = check_event(L, 1);
+        if (event == NULL) { lua_pushnil(L); return 1; }
+
+        short src = fluid_event_get_source(event);
+
+        lua_pushinteger(L, src);
+        
+        return 1;
+}
+
 /*
- * FLUIDSYNTH_API int
- * fluid_synth_get_pitch_wheel_sens (fluid_synth_t *synth,
- *                                   int chan,
- *                                   int *pval)
+ * FLUIDSYNTH_API short
+ * fluid_event_get_dest (fluid_event_t *evt)
  *
- * Get MIDI pitch wheel sensitivity on a MIDI channel.
+ * Get the dest field from a sequencer event structure.
  *
  */
 
+static int
+c_fluid_event_get_dest (lua_State* L)
+{
+        fluid_event_t* event = check_event(L, 1);
+        if (event == NULL) { lua_pushnil(L); return 1; }
+
+        short dest = fluid_event_get_dest(event);
+
+        lua_pushinteger(L, dest);
+        
+        return 1;
+}
+
 /*
  * FLUIDSYNTH_API int
- * fluid_synth_program_change (fluid_synth_t *synth,
- *                             int chan,
- *                             int program)
+ * fluid_event_get_channel (fluid_event_t *evt)
  *
- * Send a program change event on a MIDI channel.
+ * Get the MIDI channel field from a sequencer event structure.
  *
  */
 
+static int
+c_fluid_event_get_channel (lua_State* L)
+{
+        fluid_event_t* event = check_event(L, 1);
+        if (event == NULL) { lua_pushnil(L); return 1; }
+
+        int channel = fluid_event_get_channel(event);
+
+        lua_pushinteger(L, channel);
+        
+        return 1;
+}
+
 /*
- * FLUIDSYNTH_API int
- * fluid_synth_channel_pressure (fluid_synth_t *synth,
- *                               int chan,
- *                               int val)
+ * FLUIDSYNTH_API short
+ * fluid_event_get_key (fluid_event_t *evt)
  *
- * Set the MIDI channel pressure controller value.
+ * Get the MIDI note field from a sequencer event structure.
  *
  */
 
+static int
+c_fluid_event_get_key (lua_State* L)
+{
+        fluid_event_t* event = check_event(L, 1);
+        if (event == NULL) { lua_pushnil(L); return 1; }
+
+        short key = fluid_event_get_key(event);
+
+        lua_pushinteger(L, key);
+        
+        return 1;
+}
+
 /*
- * FLUIDSYNTH_API int
- * fluid_synth_bank_select (fluid_synth_t *synth,
- *                          int chan,
- *                          unsigned int bank)
+ * FLUIDSYNTH_API short
+ * fluid_event_get_velocity (fluid_event_t *evt)
  *
- * Set instrument bank number on a MIDI channel.
+ * Get the MIDI velocity field from a sequencer event structure.
  *
  */
 
+static int
+c_fluid_event_get_velocity (lua_State* L)
+{
+        fluid_event_t* event = check_event(L, 1);
+        if (event == NULL) { lua_pushnil(L); return 1; }
+
+        short vel = fluid_event_get_velocity(event);
+
+        lua_pushinteger(L, vel);
+        
+        return 1;
+}
+
 /*
- * FLUIDSYNTH_API int
- * fluid_synth_sfont_select (fluid_synth_t *synth,
- *                           int chan,
- *                           unsigned int sfont_id)
+ * FLUIDSYNTH_API short
+ * fluid_event_get_control (fluid_event_t *evt)
  *
- * Set SoundFont ID on a MIDI channel.
+ * Get the MIDI control number field from a sequencer event structure.
  *
  */
 
-/*
- * FLUIDSYNTH_API int
- * fluid_synth_program_select (fluid_synth_t *synth,
- *                             int chan,
- *                             unsigned int sfont_id,
- *                             unsigned int bank_num,
- *                             unsigned int preset_num)
- *
- * Select an instrument on a MIDI channel by SoundFont ID, bank and
- * program numbers.
- *
- */
+static int
+c_fluid_event_get_control (lua_State* L)
+{
+        fluid_event_t* event = check_event(L, 1);
+        if (event == NULL) { lua_pushnil(L); return 1; }
 
-/*
- * FLUIDSYNTH_API int
- * fluid_synth_program_select_by_sfont_name (fluid_synth_t *synth,
- *                                           int chan,
- *                                           const char *sfont_name,
- *                                           unsigned int bank_num,
- *                                           unsigned int preset_num)
- *
- * Select an instrument on a MIDI channel by SoundFont name, bank and
- * program numbers.
- *
- */
+        short control = fluid_event_get_control(event);
 
-/*
- * FLUIDSYNTH_API int
- * fluid_synth_get_program (fluid_synth_t *synth,
- *                          int chan,
- *                          unsigned int *sfont_id,
- *                          unsigned int *bank_num,
- *                          unsigned int *preset_num)
- *
- * Get current SoundFont ID, bank number and program number for a MIDI
- * channel.
- *
- */
+        lua_pushinteger(L, control);
+        
+        return 1;
+}
 
 /*
- * FLUIDSYNTH_API int
- * fluid_synth_unset_program (fluid_synth_t *synth,
- *                            int chan)
+ * FLUIDSYNTH_API short
+ * fluid_event_get_value (fluid_event_t *evt)
  *
- * Set the preset of a MIDI channel to an unassigned state.
+ * Get the value field from a sequencer event structure.
  *
  */
 
-/*
- * FLUIDSYNTH_API int
- * fluid_synth_get_channel_info (fluid_synth_t *synth,
- *                               int chan,
- *                               fluid_synth_channel_info_t *info)
- *
- * Get information on the currently selected preset on a MIDI channel.
- *
- */
+static int
+c_fluid_event_get_value (lua_State* L)
+{
+        fluid_event_t* event = check_event(L, 1);
+        if (event == NULL) { lua_pushnil(L); return 1; }
 
-/*
- * FLUIDSYNTH_API int
- * fluid_synth_program_reset (fluid_synth_t *synth)
- *
- * Resend a bank select and a program change for every channel.
- *
- */
+        short val = fluid_event_get_value(event);
 
-/*
- * FLUIDSYNTH_API int
- * fluid_synth_system_reset (fluid_synth_t *synth)
- *
- * Send MIDI system reset command (big red 'panic' button), turns off
- * notes and resets controllers.
- *
- */
+        lua_pushinteger(L, val);
+        
+        return 1;
+}
 
 /*
- * FLUIDSYNTH_API fluid_preset_t *
- * fluid_synth_get_channel_preset (fluid_synth_t *synth,
- *                                 int chan)
+ * FLUIDSYNTH_API short
+ * fluid_event_get_program (fluid_event_t *evt)
  *
- * Get active preset on a MIDI channel.
+ * Get the MIDI program field from a sequencer event structure.
  *
  */
 
-/*
- * FLUIDSYNTH_API int
- * fluid_synth_start (fluid_synth_t *synth,
- *                    unsigned int id,
- *                    fluid_preset_t *preset,
- *                    int audio_chan,
- *                    int midi_chan,
- *                    int key,
- *                    int vel)
- *
- * Create and start voices using a preset and a MIDI note on event.
- *
- */
+static int
+c_fluid_event_get_program (lua_State* L)
+{
+        fluid_event_t* event = check_event(L, 1);
+        if (event == NULL) { lua_pushnil(L); return 1; }
+
+        short program = fluid_event_get_program(event);
+
+        lua_pushinteger(L, program);
+        
+        return 1;
+}
 
 /*
- * FLUIDSYNTH_API int
- * fluid_synth_stop (fluid_synth_t *synth,
- *                   unsigned int id)
+ * FLUIDSYNTH_API void *
+ * fluid_event_get_data (fluid_event_t *evt)
  *
- * Stop notes for a given note event voice ID.
+ * Get the data field from a sequencer event structure.
  *
  */
 
+static int
+c_fluid_event_get_data (lua_State* L)
+{
+        fluid_event_t* event = check_event(L, 1);
+        if (event == NULL) { lua_pushnil(L); return 1; }
+
+        void* data = fluid_event_get_data(event);
+
+        void** data_p = lua_newuserdata(L, sizeof(void*));
+        *data_p = data;
+                
+        return 1;
+}
+
 /*
- * FLUIDSYNTH_API int
- * fluid_synth_sfload (fluid_synth_t *synth,
- *                     const char *filename,
- *                     int reset_presets)
+ * FLUIDSYNTH_API unsigned int
+ * fluid_event_get_duration (fluid_event_t *evt)
  *
- * Load a SoundFont file (filename is interpreted by SoundFont loaders).
+ * Get the duration field from a sequencer event structure.
  *
  */
 
 static int
-c_fluid_synth_sfload (lua_State* L)
+c_fluid_event_get_duration (lua_State* L)
 {
-        fluid_synth_t* synth = *(fluid_synth_t**)lua_touserdata(L, 1);
-        const char* filename = (const char*)luaL_checkstring(L, 2);
-        int reset_presets = (int)luaL_checkinteger(L, 3);
+        fluid_event_t* event = check_event(L, 1);
+        if (event == NULL) { lua_pushnil(L); return 1; }
 
-        int sfid = fluid_synth_sfload(synth, filename, reset_presets);
-        if (sfid == FLUID_FAILED) { lua_pushnil(L); return 1; }
+        unsigned int duration = fluid_event_get_duration(event);
 
-        lua_pushinteger(L, sfid);
+        lua_pushinteger(L, duration);
         
         return 1;
 }
 
 /*
- * FLUIDSYNTH_API int
- * fluid_synth_sfreload (fluid_synth_t *synth,
- *                       unsigned int id)
+ * FLUIDSYNTH_API short
+ * fluid_event_get_bank (fluid_event_t *evt)
  *
- * Reload a SoundFont.
+ * Get the MIDI bank field from a sequencer event structure.
  *
  */
 
-/*
- * FLUIDSYNTH_API int
- * fluid_synth_sfunload (fluid_synth_t *synth,
- *                       unsigned int id,
- *                       int reset_presets)
- *
- * Unload a SoundFont.
- *
- */
+static int
+c_fluid_event_get_bank (lua_State* L)
+{
+        fluid_event_t* event = check_event(L, 1);
+        if (event == NULL) { lua_pushnil(L); return 1; }
 
-/*
- * FLUIDSYNTH_API int
- * fluid_synth_add_sfont (fluid_synth_t *synth,
- *                        fluid_sfont_t *sfont)
- *
- * Add a SoundFont.
- *
- */
+        short bank = fluid_event_get_bank(event);
 
-/*
- * FLUIDSYNTH_API void
- * fluid_synth_remove_sfont (fluid_synth_t *synth,
- *                           fluid_sfont_t *sfont)
- *
- * Remove a SoundFont from the SoundFont stack without deleting it.
- *
- */
+        lua_pushinteger(L, bank);
+        
+        return 1;
+}
 
 /*
  * FLUIDSYNTH_API int
- * fluid_synth_sfcount (fluid_synth_t *synth)
+ * fluid_event_get_pitch (fluid_event_t *evt)
  *
- * Count number of loaded SoundFont files.
+ * Get the pitch field from a sequencer event structure.
  *
  */
 
-/*
- * FLUIDSYNTH_API fluid_sfont_t *
- * fluid_synth_get_sfont (fluid_synth_t *synth,
- *                        unsigned int num)
- *
- * Get SoundFont by index.
- *
- */
+static int
+c_fluid_event_get_pitch (lua_State* L)
+{
+        fluid_event_t* event = check_event(L, 1);
+        if (event == NULL) { lua_pushnil(L); return 1; }
 
-/*
- * FLUIDSYNTH_API fluid_sfont_t *
- * fluid_synth_get_sfont_by_id (fluid_synth_t *synth,
- *                              unsigned int id)
- *
- * Get SoundFont by ID.
- *
- */
+        int pitch = fluid_event_get_pitch(event);
+
+        lua_pushinteger(L, pitch);
+        
+        return 1;
+}
 
 /*
- * FLUIDSYNTH_API fluid_sfont_t *
- * fluid_synth_get_sfont_by_name (fluid_synth_t *synth,
- *                                const char *name)
+ * FLUIDSYNTH_API unsigned int
+ * fluid_event_get_sfont_id (fluid_event_t *evt)
  *
- * Get SoundFont by name.
+ * Get the SoundFont ID field from a sequencer event structure.
  *
  */
 
+static int
+c_fluid_event_get_sfont_id (lua_State* L)
+{
+        fluid_event_t* event = check_event(L, 1);
+        if (event == NULL) { lua_pushnil(L); return 1; }
+
+        unsigned int sfont_id = fluid_event_get_sfont_id(event);
+
+        lua_pushinteger(L, sfont_id);
+        
+        return 1;
+}
+
+
+/*-------------------------------------------------------------------
+  ---=  Scheduler =---
+  ------------------------------------------------------------------*/
+
 /*
- * FLUIDSYNTH_API int
- * fluid_synth_set_bank_offset (fluid_synth_t *synth,
- *                              int sfont_id,
- *                              int offset)
+ * A scheduler multiplexes any number of coroutines onto a single
+ * sequencer client. A coroutine sleeps with
+ * `fluid_scheduler_wait(ticks)`; the scheduler keeps the wake times
+ * in a min-heap and only ever has one timer event queued in the
+ * sequencer, for the earliest wake time.
  *
- * Offset the bank numbers of a loaded SoundFont.
+ * Without the system timer coroutines are resumed from the sequencer
+ * callback, on the thread calling `fluid_sequencer_process`. With it
+ * that thread runs alongside the Lua state, so the callback only notes
+ * the tick of the timer and `fluid_sequencer_dispatch` resumes the
+ * coroutines, as for "queued" clients. The callback then only touches
+ * a scheduler still listed in `sched_list`, checked with `sched_lock`
+ * held.
+ *
+ * A coroutine may delete its own scheduler: the scheduler is only
+ * marked dead while coroutines run and freed after the last one
+ * returns. Errors raised by coroutines are kept for
+ * `fluid_scheduler_count`.
  *
  */
 
-/*
- * FLUIDSYNTH_API int
- * fluid_synth_get_bank_offset (fluid_synth_t *synth,
- *                              int sfont_id)
- *
- * Get bank offset of a loaded SoundFont.
- *
- */
+struct sched_entry {
+        unsigned int wake;
+        unsigned int order;     // keeps coroutines with equal wake times FIFO
+        lua_State* co;
+        int co_index;
+};
 
-/*
- * FLUIDSYNTH_API void
- * fluid_synth_set_reverb (fluid_synth_t *synth,
- *                         double roomsize,
- *                         double damping,
- *                         double width,
- *                         double level)
- *
- * Set reverb parameters.
- *
- */
+struct scheduler {
+        lua_State* L;
+        fluid_sequencer_t* seq;
+        short id;
+        fluid_event_t* timer;
+        int errors_index;       // table of error messages not read yet
 
-/*
- * FLUIDSYNTH_API void
- * fluid_synth_set_reverb_on (fluid_synth_t *synth,
- *                            int on)
- *
- * Enable or disable reverb effect.
- *
- */
+        struct sched_entry* heap;
+        int count;
+        int capacity;
+        unsigned int order;
 
-/*
- * FLUIDSYNTH_API double
- * fluid_synth_get_reverb_roomsize (fluid_synth_t *synth)
- *
- * Get reverb room size.
- *
- */
+        int armed;
+        unsigned int armed_tick;
 
-/*
- * FLUIDSYNTH_API double
- * fluid_synth_get_reverb_damp (fluid_synth_t *synth)
- *
- * Get reverb damping.
- *
- */
+        int queued;             // wake ups wait for fluid_sequencer_dispatch
+        atomic_uint fired;      // tick + 1 of the last timer, 0 if none
+        int running;            // coroutines being resumed
+        int dead;               // deleted while running
+
+        struct scheduler* next;
+};
+
+static pthread_mutex_t sched_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct scheduler* sched_list = NULL;
+
+// the sequencer of these schedulers is deleted, and their client with it
+static void
+sched_forget (fluid_sequencer_t* seq)
+{
+        for (struct scheduler* s = sched_list; s != NULL; s = s->next) {
+                if (s->seq == seq) { s->seq = NULL; }
+        }
+}
+
+static int
+sched_entry_before (const struct sched_entry* a, const struct sched_entry* b)
+{
+        if (a->wake != b->wake) { return a->wake < b->wake; }
+        return a->order < b->order;
+}
+
+static int
+sched_heap_push (struct scheduler* s, unsigned int wake, lua_State* co, int co_index)
+{
+        if (s->count == s->capacity) {
+                int capacity = s->capacity ? s->capacity * 2 : 64;
+                struct sched_entry* heap = realloc(s->heap, capacity * sizeof(struct sched_entry));
+                if (heap == NULL) { return FLUID_FAILED; }
+                s->heap = heap;
+                s->capacity = capacity;
+        }
+
+        struct sched_entry e = { wake, s->order++, co, co_index };
+        int i = s->count++;
+        while (i > 0) {
+                int parent = (i - 1) / 2;
+                if (!sched_entry_before(&e, &s->heap[parent])) { break; }
+                s->heap[i] = s->heap[parent];
+                i = parent;
+        }
+        s->heap[i] = e;
+
+        return FLUID_OK;
+}
+
+static struct sched_entry
+sched_heap_pop (struct scheduler* s)
+{
+        struct sched_entry top = s->heap[0];
+        struct sched_entry last = s->heap[--s->count];
+
+        int i = 0;
+        for (;;) {
+                int child = 2 * i + 1;
+                if (child >= s->count) { break; }
+                if (child + 1 < s->count
+                    && sched_entry_before(&s->heap[child + 1], &s->heap[child])) {
+                        child++;
+                }
+                if (!sched_entry_before(&s->heap[child], &last)) { break; }
+                s->heap[i] = s->heap[child];
+                i = child;
+        }
+        if (s->count > 0) { s->heap[i] = last; }
+
+        return top;
+}
+
+static void
+sched_arm (struct scheduler* s)
+{
+        if (s->count == 0 || s->seq == NULL) { return; }
+
+        unsigned int wake = s->heap[0].wake;
+        if (s->armed && s->armed_tick <= wake) { return; }
+
+        if (fluid_sequencer_send_at(s->seq, s->timer, wake, 1) == FLUID_OK) {
+                s->armed = 1;
+                s->armed_tick = wake;
+        }
+}
+
+static int
+sched_resume (lua_State* co, lua_State* from, int nargs)
+{
+#if LUA_VERSION_NUM >= 504
+        int nresults;
+        return lua_resume(co, from, nargs, &nresults);
+#else
+        return lua_resume(co, from, nargs);
+#endif
+}
 
 /*
- * FLUIDSYNTH_API double
- * fluid_synth_get_reverb_level (fluid_synth_t *synth)
- *
- * Get reverb level.
+ * Resume `co`, whose arguments are already on its stack, and put it
+ * back to sleep if it waits again. If it fails, the error message goes
+ * onto the stack of `report`, or into the scheduler's errors when
+ * `report` is NULL, and FLUID_FAILED is returned.
  *
  */
 
+static int
+sched_run (struct scheduler* s, lua_State* co, int co_index, int nargs, unsigned int now,
+           lua_State* report)
+{
+        s->running++;
+        int status = sched_resume(co, s->L, nargs);
+        s->running--;
+
+        if (status == LUA_YIELD) {
+                lua_Integer ticks = lua_tointeger(co, -1);
+                lua_settop(co, 0);
+                if (ticks < 1) { ticks = 1; }
+
+                if (sched_heap_push(s, now + (unsigned int)ticks, co, co_index) == FLUID_OK) {
+                        return FLUID_OK;
+                }
+        }
+
+        int result = FLUID_OK;
+        if (status != LUA_OK && status != LUA_YIELD) {
+                if (report != NULL) {
+                        lua_xmove(co, report, 1);
+                } else {
+                        lua_rawgeti(s->L, LUA_REGISTRYINDEX, s->errors_index);
+                        lua_xmove(co, s->L, 1);
+                        lua_rawseti(s->L, -2, (lua_Integer)lua_rawlen(s->L, -2) + 1);
+                        lua_pop(s->L, 1);
+                }
+                result = FLUID_FAILED;
+        }
+
+        // finished, failed or could not be queued again
+        luaL_unref(s->L, LUA_REGISTRYINDEX, co_index);
+        return result;
+}
+
+static void sched_delete (struct scheduler* s);
+
+// resume the coroutines due at `time`; returns how many ran
+static int
+sched_wake (struct scheduler* s, unsigned int time)
+{
+        if (s->armed && time >= s->armed_tick) { s->armed = 0; }
+
+        int n = 0;
+        while (!s->dead && s->count > 0 && s->heap[0].wake <= time) {
+                struct sched_entry e = sched_heap_pop(s);
+
+                // `fluid_scheduler_wait` returns the current tick
+                lua_pushinteger(e.co, time);
+                sched_run(s, e.co, e.co_index, 1, time, NULL);
+                n++;
+        }
+
+        if (s->dead) {
+                sched_delete(s);
+        } else {
+                sched_arm(s);
+        }
+        return n;
+}
+
+static void
+sched_callback (unsigned int time,
+                fluid_event_t *event,
+                fluid_sequencer_t *seq,
+                void *data)
+{
+        struct scheduler* s = (struct scheduler*)data;
+
+        if (fluid_event_get_type(event) != FLUID_SEQ_TIMER) { return; }
+
+        pthread_mutex_lock(&sched_lock);
+        struct scheduler* t = sched_list;
+        while (t != NULL && t != s) { t = t->next; }
+        int queued = t != NULL && s->queued;
+        if (queued) { atomic_store(&s->fired, time + 1); }
+        pthread_mutex_unlock(&sched_lock);
+
+        if (t != NULL && !queued) { sched_wake(s, time); }
+}
+
+// run the wake ups noted for the schedulers of `seq` until `max`
+// coroutines ran, unless `max` is negative
+static lua_Integer
+sched_dispatch (fluid_sequencer_t* seq, lua_Integer max)
+{
+        lua_Integer count = 0;
+        struct scheduler* s = sched_list;
+        while (s != NULL && (max < 0 || count < max)) {
+                unsigned int fired = s->seq == seq && s->queued ? atomic_exchange(&s->fired, 0) : 0;
+                if (fired == 0) { s = s->next; continue; }
+
+                // the coroutines may delete schedulers, start over after
+                count += sched_wake(s, fired - 1);
+                s = sched_list;
+        }
+        return count;
+}
+
+static void
+sched_delete (struct scheduler* s)
+{
+        if (s->running > 0) { s->dead = 1; return; }
+
+        pthread_mutex_lock(&sched_lock);
+        for (struct scheduler** p = &sched_list; *p != NULL; p = &(*p)->next) {
+                if (*p == s) { *p = s->next; break; }
+        }
+        pthread_mutex_unlock(&sched_lock);
+
+        if (s->seq != NULL) {
+                fluid_sequencer_remove_events(s->seq, -1, s->id, -1);
+                fluid_sequencer_unregister_client(s->seq, s->id);
+        }
+
+        while (s->count > 0) {
+                struct sched_entry e = sched_heap_pop(s);
+                luaL_unref(s->L, LUA_REGISTRYINDEX, e.co_index);
+        }
+        luaL_unref(s->L, LUA_REGISTRYINDEX, s->errors_index);
+
+        delete_fluid_event(s->timer);
+        free(s->heap);
+        free(s);
+}
+
+static int
+gc_delete_fluid_scheduler (lua_State* L)
+{
+        struct scheduler** s_p = (struct scheduler**)lua_touserdata(L, 1);
+        if (*s_p == NULL) { return 0; }
+
+        sched_delete(*s_p);
+        *s_p = NULL;
+
+        return 0;
+}
+
 /*
- * FLUIDSYNTH_API double
- * fluid_synth_get_reverb_width (fluid_synth_t *synth)
+ * new_fluid_scheduler (seq)
  *
- * Get reverb width.
+ * Create a coroutine scheduler driven by a new client of `seq`. The
+ * scheduler is deleted with `delete_fluid_scheduler` or when it is
+ * collected. If `seq` uses the system timer, coroutines only wake up
+ * in `fluid_sequencer_dispatch`.
  *
  */
 
+static int
+c_new_fluid_scheduler (lua_State* L)
+{
+        fluid_sequencer_t* sequencer = *(fluid_sequencer_t**)lua_touserdata(L, 1);
+
+        struct scheduler* s = calloc(1, sizeof(struct scheduler));
+        if (s == NULL) { lua_pushnil(L); return 1; }
+
+        s->L = L;
+        s->seq = sequencer;
+        s->queued = fluid_sequencer_get_use_system_timer(sequencer);
+        s->timer = new_fluid_event();
+        if (s->timer == NULL) { free(s); lua_pushnil(L); return 1; }
+
+        short id = fluid_sequencer_register_client(sequencer, "scheduler",
+                                                   sched_callback, (void*)s);
+        if ((int)id == FLUID_FAILED) {
+                delete_fluid_event(s->timer);
+                free(s);
+                lua_pushnil(L);
+                return 1;
+        }
+        s->id = id;
+
+        fluid_event_set_source(s->timer, -1);
+        fluid_event_set_dest(s->timer, id);
+        fluid_event_timer(s->timer, NULL);
+
+        lua_newtable(L);
+        s->errors_index = luaL_ref(L, LUA_REGISTRYINDEX);
+
+        pthread_mutex_lock(&sched_lock);
+        s->next = sched_list;
+        sched_list = s;
+        pthread_mutex_unlock(&sched_lock);
+
+        struct scheduler** s_p = lua_newuserdata(L, sizeof(struct scheduler*));
+        *s_p = s;
+        luaL_setmetatable(L, "fluid.scheduler");
+
+        return 1;
+}
+
 /*
- * FLUIDSYNTH_API void
- * fluid_synth_set_chorus (fluid_synth_t *synth,
- *                         int nr,
- *                         double level,
- *                         double speed,
- *                         double depth_ms,
- *                         int type)
+ * delete_fluid_scheduler (sched)
  *
- * Set chorus parameters.
+ * Unregister the scheduler's client and drop all sleeping coroutines.
  *
  */
 
+static int
+c_delete_fluid_scheduler (lua_State* L)
+{
+        return gc_delete_fluid_scheduler(L);
+}
+
 /*
- * FLUIDSYNTH_API void
- * fluid_synth_set_chorus_on (fluid_synth_t *synth,
- *                            int on)
+ * fluid_scheduler_spawn (sched, func, ...)
  *
- * Enable or disable chorus effect.
+ * Run `func(...)` in a new coroutine of the scheduler. It runs right
+ * away until it first waits or returns.
+ *
+ * Returns FLUID_OK, or nil and the error message if the coroutine
+ * failed before it first waited.
  *
  */
 
+static int
+c_fluid_scheduler_spawn (lua_State* L)
+{
+        struct scheduler* s = *(struct scheduler**)lua_touserdata(L, 1);
+        if (s == NULL || s->seq == NULL) { lua_pushnil(L); return 1; }
+        luaL_checktype(L, 2, LUA_TFUNCTION);
+
+        int nargs = lua_gettop(L) - 2;
+
+        lua_State* co = lua_newthread(L);
+        lua_pushvalue(L, -1);
+        int co_index = luaL_ref(L, LUA_REGISTRYINDEX);
+        lua_pop(L, 1);
+
+        // move `func` and its arguments onto the new coroutine
+        lua_xmove(L, co, nargs + 1);
+
+        int status = sched_run(s, co, co_index, nargs, fluid_sequencer_get_tick(s->seq), L);
+
+        // the coroutine may have deleted the scheduler
+        if (s->dead) {
+                sched_delete(s);
+        } else {
+                sched_arm(s);
+        }
+
+        if (status != FLUID_OK) {
+                lua_pushnil(L);
+                lua_insert(L, -2);
+                return 2;
+        }
+        lua_pushinteger(L, FLUID_OK);
+        return 1;
+}
+
 /*
- * FLUIDSYNTH_API int
- * fluid_synth_get_chorus_nr (fluid_synth_t *synth)
+ * fluid_scheduler_wait (ticks)
  *
- * Get chorus voice number (delay line count) value.
+ * Suspend the calling scheduler coroutine for at least one tick.
+ * Returns the tick at which it was resumed.
  *
  */
 
+static int
+c_fluid_scheduler_wait (lua_State* L)
+{
+        luaL_checkinteger(L, 1);
+        lua_settop(L, 1);
+        return lua_yield(L, 1);
+}
+
 /*
- * FLUIDSYNTH_API double
- * fluid_synth_get_chorus_level (fluid_synth_t *synth)
+ * fluid_scheduler_count (sched)
  *
- * Get chorus level.
+ * Get the number of sleeping coroutines, followed by an array of the
+ * error messages of coroutines that failed after they first waited,
+ * since the previous call.
  *
  */
 
+static int
+c_fluid_scheduler_count (lua_State* L)
+{
+        struct scheduler* s = *(struct scheduler**)lua_touserdata(L, 1);
+        if (s == NULL) { lua_pushnil(L); return 1; }
+
+        lua_pushinteger(L, s->count);
+        lua_rawgeti(L, LUA_REGISTRYINDEX, s->errors_index);
+        luaL_unref(L, LUA_REGISTRYINDEX, s->errors_index);
+        lua_newtable(L);
+        s->errors_index = luaL_ref(L, LUA_REGISTRYINDEX);
+        return 2;
+}
+
+/*-------------------------------------------------------------------
+  ---=  Pattern =---
+  ------------------------------------------------------------------*/
+
 /*
- * FLUIDSYNTH_API double
- * fluid_synth_get_chorus_speed_Hz (fluid_synth_t *synth)
+ * A pattern is an immutable list of events at offsets within a loop
+ * of `length` ticks. It registers its own sequencer client, and each
+ * cycle its timer queues the next cycle from C, so a looping pattern
+ * never calls into Lua.
  *
- * Get chorus speed in Hz.
+ * `fluid_pattern_swap` replaces the events and length in one atomic
+ * step; the new pattern starts with the next cycle that has not been
+ * queued yet.
+ *
+ * Starting a pattern only sends a kick timer: the first cycle is
+ * queued by the callback like every other one. Timers carry the
+ * generation of the pattern they were sent for, and starting or
+ * stopping begins a new generation, so a timer that escaped removal
+ * while the callback ran does not keep an old loop going.
  *
  */
 
+struct pattern_entry {
+        unsigned int offset;
+        short dest;
+        unsigned char kind;
+        unsigned char channel;
+        short a;
+        short b;
+        unsigned int c;
+};
+
+struct pattern_data {
+        unsigned int length;
+        int count;
+        struct pattern_entry entries[];
+};
+
+struct pattern {
+        fluid_sequencer_t* seq;
+        short id;
+        int playing;
+        unsigned int length;    // loop length last given from Lua
+
+        // only touched by the thread processing the sequencer queue
+        // once the pattern plays
+        fluid_event_t* event;
+        fluid_event_t* timer;
+        struct pattern_data* current;
+
+        fluid_event_t* kick;            // sent from the Lua thread
+        atomic_uint generation;
+        atomic_uint start_tick;
+
+        _Atomic(struct pattern_data*) pending;
+        struct pattern* next;
+};
+
+static struct pattern* pattern_list = NULL;
+
+// the sequencer of these patterns is deleted, and their client with it
+static void
+pattern_forget (fluid_sequencer_t* seq)
+{
+        for (struct pattern* p = pattern_list; p != NULL; p = p->next) {
+                if (p->seq == seq) { p->seq = NULL; }
+        }
+}
+
+// timer data: the generation, and whether the timer is a kick
+#define PATTERN_TAG(generation, kick) \
+        ((void*)(((uintptr_t)(generation) << 1) | (kick)))
+
 /*
- * FLUIDSYNTH_API double
- * fluid_synth_get_chorus_depth_ms (fluid_synth_t *synth)
- *
- * Get chorus depth.
+ * Read pattern entries from the table or packed string at `index`,
+ * in the same formats as `fluid_sequencer_send_batch` with the time
+ * being the offset within the loop.
  *
  */
 
+static struct pattern_data*
+pattern_data_from_lua (lua_State* L, int index, unsigned int length)
+{
+        if (length == 0) {
+                luaL_argerror(L, index + 1, "loop length must be positive");
+                return NULL;
+        }
+
+        if (lua_type(L, index) == LUA_TSTRING) {
+                size_t len;
+                const unsigned char* p = (const unsigned char*)lua_tolstring(L, index, &len);
+                if (len % SEQ_BATCH_RECORD_SIZE != 0) {
+                        luaL_argerror(L, index, "length is not a multiple of the record size");
+                        return NULL;
+                }
+
+                int n = (int)(len / SEQ_BATCH_RECORD_SIZE);
+                struct pattern_data* data = malloc(sizeof(struct pattern_data)
+                                                   + n * sizeof(struct pattern_entry));
+                if (data == NULL) { return NULL; }
+                data->length = length;
+                data->count = n;
+
+                for (int i = 0; i < n; i++) {
+                        const unsigned char* r = p + i * SEQ_BATCH_RECORD_SIZE;
+                        struct pattern_entry* e = &data->entries[i];
+                        e->offset = read_u32le(r);
+                        e->dest = (short)read_i16le(r + 4);
+                        e->kind = r[6];
+                        e->channel = r[7];
+                        e->a = (short)read_i16le(r + 8);
+                        e->b = (short)read_i16le(r + 10);
+                        e->c = read_u32le(r + 12);
+                        if (e->kind >= KIND_LAST) {
+                                free(data);
+                                luaL_error(L, "bad event kind %d in record %d", e->kind, i + 1);
+                                return NULL;
+                        }
+                }
+
+                return data;
+        }
+
+        luaL_checktype(L, index, LUA_TTABLE);
+        int n = (int)lua_rawlen(L, index);
+
+        /*
+         * Allocate the result as userdata first, so nothing leaks when
+         * a malformed entry raises an error, then copy it out.
+         *
+         */
+        size_t size = sizeof(struct pattern_data) + n * sizeof(struct pattern_entry);
+        struct pattern_data* tmp = lua_newuserdata(L, size);
+        tmp->length = length;
+        tmp->count = n;
+
+        for (int i = 1; i <= n; i++) {
+                lua_rawgeti(L, index, i);
+                if (!lua_istable(L, -1)) {
+                        luaL_error(L, "event %d is not a table", i);
+                        return NULL;
+                }
+                for (int f = 1; f <= 7; f++) { lua_rawgeti(L, -f, f); }
+
+                const char* name = lua_tostring(L, -5);
+                int kind = name ? seq_event_kind_from_name(name) : -1;
+                if (kind < 0) {
+                        luaL_error(L, "bad event kind in event %d", i);
+                        return NULL;
+                }
+
+                struct pattern_entry* e = &tmp->entries[i - 1];
+                e->offset = (unsigned int)lua_tointeger(L, -7);
+                e->dest = (short)lua_tointeger(L, -6);
+                e->kind = (unsigned char)kind;
+                e->channel = (unsigned char)lua_tointeger(L, -4);
+                e->a = (short)lua_tointeger(L, -3);
+                e->b = (short)lua_tointeger(L, -2);
+                e->c = (unsigned int)lua_tointeger(L, -1);
+                lua_pop(L, 8);
+        }
+
+        struct pattern_data* data = malloc(size);
+        if (data != NULL) { memcpy(data, tmp, size); }
+        lua_pop(L, 1);
+
+        return data;
+}
+
+static void
+pattern_queue_cycle (struct pattern* p, unsigned int start, unsigned int generation)
+{
+        struct pattern_data* data = p->current;
+
+        for (int i = 0; i < data->count; i++) {
+                struct pattern_entry* e = &data->entries[i];
+                fluid_event_set_dest(p->event, e->dest);
+                seq_event_fill(p->event, e->kind, e->channel, e->a, e->b, e->c);
+                fluid_sequencer_send_at(p->seq, p->event, start + e->offset, 1);
+        }
+
+        // wakes us up to queue the cycle after this one
+        fluid_event_timer(p->timer, PATTERN_TAG(generation, 0));
+        fluid_sequencer_send_at(p->seq, p->timer, start, 1);
+}
+
+static void
+pattern_callback (unsigned int time,
+                  fluid_event_t *event,
+                  fluid_sequencer_t *seq,
+                  void *data)
+{
+        struct pattern* p = (struct pattern*)data;
+
+        if (fluid_event_get_type(event) != FLUID_SEQ_TIMER) { return; }
+
+        uintptr_t tag = (uintptr_t)fluid_event_get_data(event);
+        unsigned int generation = atomic_load(&p->generation);
+        if ((void*)(tag & ~(uintptr_t)1) != PATTERN_TAG(generation, 0)) { return; }
+
+        unsigned int next = (tag & 1) ? atomic_load(&p->start_tick)
+                                      : time + p->current->length;
+
+        struct pattern_data* swapped = atomic_exchange(&p->pending, NULL);
+        if (swapped != NULL) {
+                free(p->current);
+                p->current = swapped;
+        }
+
+        pattern_queue_cycle(p, next, generation);
+}
+
+static void
+pattern_stop (struct pattern* p)
+{
+        if (!p->playing || p->seq == NULL) { return; }
+
+        // every event of the pattern, including its timers, has the
+        // pattern's client as source
+        atomic_fetch_add(&p->generation, 1);
+        fluid_sequencer_remove_events(p->seq, p->id, -1, -1);
+        p->playing = 0;
+}
+
+static int
+gc_delete_fluid_pattern (lua_State* L)
+{
+        struct pattern** p_p = (struct pattern**)lua_touserdata(L, 1);
+        struct pattern* p = *p_p;
+        if (p == NULL) { return 0; }
+
+        for (struct pattern** q = &pattern_list; *q != NULL; q = &(*q)->next) {
+                if (*q == p) { *q = p->next; break; }
+        }
+
+        if (p->seq != NULL) {
+                pattern_stop(p);
+                fluid_sequencer_unregister_client(p->seq, p->id);
+        }
+
+        free(atomic_exchange(&p->pending, NULL));
+        free(p->current);
+        delete_fluid_event(p->event);
+        delete_fluid_event(p->timer);
+        delete_fluid_event(p->kick);
+        free(p);
+
+        *p_p = NULL;
+        return 0;
+}
+
 /*
- * FLUIDSYNTH_API int
- * fluid_synth_get_chorus_type (fluid_synth_t *synth)
+ * new_fluid_pattern (seq, events, length)
  *
- * Get chorus waveform type.
+ * Create a looping pattern of `length` ticks from `events`, given in
+ * the formats of `fluid_sequencer_send_batch` with offsets into the
+ * loop as times. The pattern is deleted with `delete_fluid_pattern`
+ * or when it is collected.
  *
  */
 
+static int
+c_new_fluid_pattern (lua_State* L)
+{
+        fluid_sequencer_t* sequencer = *(fluid_sequencer_t**)lua_touserdata(L, 1);
+        unsigned int length = (unsigned int)luaL_checkinteger(L, 3);
+
+        struct pattern_data* data = pattern_data_from_lua(L, 2, length);
+        if (data == NULL) { lua_pushnil(L); return 1; }
+
+        struct pattern* p = calloc(1, sizeof(struct pattern));
+        if (p == NULL) { free(data); lua_pushnil(L); return 1; }
+
+        p->seq = sequencer;
+        p->length = length;
+        p->current = data;
+        atomic_init(&p->pending, NULL);
+        atomic_init(&p->generation, 0);
+        atomic_init(&p->start_tick, 0);
+        p->event = new_fluid_event();
+        p->timer = new_fluid_event();
+        p->kick = new_fluid_event();
+
+        short id = FLUID_FAILED;
+        if (p->event != NULL && p->timer != NULL && p->kick != NULL) {
+                id = fluid_sequencer_register_client(sequencer, "pattern",
+                                                     pattern_callback, (void*)p);
+        }
+        if ((int)id == FLUID_FAILED) {
+                if (p->event) { delete_fluid_event(p->event); }
+                if (p->timer) { delete_fluid_event(p->timer); }
+                if (p->kick) { delete_fluid_event(p->kick); }
+                free(data);
+                free(p);
+                lua_pushnil(L);
+                return 1;
+        }
+        p->id = id;
+
+        fluid_event_set_source(p->event, id);
+        fluid_event_set_source(p->timer, id);
+        fluid_event_set_dest(p->timer, id);
+        fluid_event_set_source(p->kick, id);
+        fluid_event_set_dest(p->kick, id);
+
+        p->next = pattern_list;
+        pattern_list = p;
+
+        struct pattern** p_p = lua_newuserdata(L, sizeof(struct pattern*));
+        *p_p = p;
+        luaL_setmetatable(L, "fluid.pattern");
+
+        return 1;
+}
+
 /*
- * FLUIDSYNTH_API int
- * fluid_synth_count_midi_channels (fluid_synth_t *synth)
+ * delete_fluid_pattern (pattern)
  *
- * Get the total count of MIDI channels.
+ * Stop a pattern and unregister its client.
  *
  */
 
+static int
+c_delete_fluid_pattern (lua_State* L)
+{
+        return gc_delete_fluid_pattern(L);
+}
+
 /*
- * FLUIDSYNTH_API int
- * fluid_synth_count_audio_channels (fluid_synth_t *synth)
+ * fluid_pattern_start (pattern, tick)
  *
- * Get the total count of audio channels.
+ * Start looping at the absolute `tick`, or at the current tick when
+ * omitted.
  *
  */
 
+static int
+c_fluid_pattern_start (lua_State* L)
+{
+        struct pattern* p = *(struct pattern**)lua_touserdata(L, 1);
+        if (p == NULL || p->seq == NULL) { lua_pushnil(L); return 1; }
+
+        unsigned int now = fluid_sequencer_get_tick(p->seq);
+        unsigned int tick = (unsigned int)luaL_optinteger(L, 2, now);
+
+        pattern_stop(p);
+
+        // the callback queues the first cycle, picking up a pending swap
+        unsigned int generation = atomic_fetch_add(&p->generation, 1) + 1;
+        atomic_store(&p->start_tick, tick);
+        fluid_event_timer(p->kick, PATTERN_TAG(generation, 1));
+        if (fluid_sequencer_send_at(p->seq, p->kick, now, 1) != FLUID_OK) {
+                lua_pushnil(L);
+                return 1;
+        }
+
+        p->playing = 1;
+
+        lua_pushinteger(L, FLUID_OK);
+        return 1;
+}
+
 /*
- * FLUIDSYNTH_API int
- * fluid_synth_count_audio_groups (fluid_synth_t *synth)
+ * fluid_pattern_stop (pattern)
  *
- * Get the total number of allocated audio channels.
+ * Stop looping and remove the pattern's queued events.
  *
  */
 
+static int
+c_fluid_pattern_stop (lua_State* L)
+{
+        struct pattern* p = *(struct pattern**)lua_touserdata(L, 1);
+        if (p == NULL) { return 0; }
+
+        pattern_stop(p);
+        return 0;
+}
+
 /*
- * FLUIDSYNTH_API int
- * fluid_synth_count_effects_channels (fluid_synth_t *synth)
+ * fluid_pattern_swap (pattern, events, length)
  *
- * Get the total number of allocated effects channels.
+ * Replace the events and loop length of a pattern from the next
+ * cycle on. `length` defaults to the current length.
  *
  */
 
-/*
- * FLUIDSYNTH_API void
- * fluid_synth_set_sample_rate (fluid_synth_t *synth,
- *                              float sample_rate)
- *
- * Set sample rate of the synth.
- *
- */
+static int
+c_fluid_pattern_swap (lua_State* L)
+{
+        struct pattern* p = *(struct pattern**)lua_touserdata(L, 1);
+        if (p == NULL || p->seq == NULL) { lua_pushnil(L); return 1; }
+
+        unsigned int length = (unsigned int)luaL_optinteger(L, 3, p->length);
+
+        struct pattern_data* data = pattern_data_from_lua(L, 2, length);
+        if (data == NULL) { lua_pushnil(L); return 1; }
+        p->length = length;
+
+        // a pattern swapped in before and never picked up is ours to free
+        free(atomic_exchange(&p->pending, data));
+
+        lua_pushinteger(L, FLUID_OK);
+        return 1;
+}
+
+/*-------------------------------------------------------------------
+  ---=  Synth =---
+  ------------------------------------------------------------------*/
 
 /*
- * FLUIDSYNTH_API void
- * fluid_synth_set_gain (fluid_synth_t *synth,
- *                       float gain)
- *
- * Set synth output gain value.
+ * Shared SoundFont cache. Fonts loaded with
+ * `fluid_synth_sfload_shared` or `fluid_synth_sfload_async` are parsed
+ * once, each by its own hidden loader synth, so all synths play from
+ * the same sample data. Entries are keyed by the resolved path,
+ * modification time and size of the file: after the file changes on
+ * disk, new loads get a fresh copy while synths attached to the old
+ * one keep it.
+ *
+ * `fluid_synth_add_sfont` stores the synth's id in the font, so every
+ * synth gets its own proxy font that hands out the presets of the
+ * cached one. FluidSynth 2 shares the sample data of fonts loaded from
+ * the same file itself, so there every synth loads its own font object
+ * while the entry keeps the samples cached.
+ *
+ * Known limitation on FluidSynth 1: voices count their references to a
+ * sample with plain increments and decrements, on the thread of the
+ * synth playing them, so synths playing the same entry at once race on
+ * these counts. The counts are only read when the loader synth unloads
+ * the font, after every synth has detached, so a lost update does not
+ * free samples early; at worst the font is leaked when the entry is
+ * freed.
+ *
+ * Fonts are parsed without holding the cache lock, so a slow load on
+ * one thread does not hold up the others. An entry is freed when the
+ * last synth detaches from it; removing its proxy from a synth, or
+ * deleting the synth, detaches it.
+ *
+ */
+
+struct sfont_entry {
+        char* path;
+        struct timespec mtime;
+        off_t size;
+        fluid_settings_t* settings;     // of the loader synth
+        fluid_synth_t* loader;          // owns the font
+        fluid_sfont_t* sfont;
+        atomic_int refs;                // changed from 0 only with the cache locked
+        struct sfont_entry* next;
+};
+
+struct sfont_attachment {
+        fluid_synth_t* synth;
+        struct sfont_entry* entry;
+        fluid_sfont_t* sfont;           // the font added to `synth`
+        int id;                         // id in `synth`
+        struct sfont_attachment* next;
+};
+
+// the first new_fluid_synth initializes tables shared by all synths,
+// so synths created off the Lua thread are created one at a time
+static pthread_mutex_t synth_init_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static pthread_mutex_t sfont_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct sfont_entry* sfont_entries = NULL;
+static struct sfont_attachment* sfont_attachments = NULL;
+
+static void
+sfont_entry_free (struct sfont_entry* e)
+{
+        if (e->loader != NULL) { delete_fluid_synth(e->loader); }
+        if (e->settings != NULL) { delete_fluid_settings(e->settings); }
+        free(e->path);
+        free(e);
+}
+
+// macOS names the modification time of a stat differently
+static struct timespec
+stat_mtime (const struct stat* sb)
+{
+#if defined(__APPLE__)
+        return sb->st_mtimespec;
+#else
+        return sb->st_mtim;
+#endif
+}
+
+// called with the cache locked
+static struct sfont_entry*
+sfont_cache_find (const char* path, const struct stat* sb)
+{
+        struct timespec mtime = stat_mtime(sb);
+
+        for (struct sfont_entry* e = sfont_entries; e != NULL; e = e->next) {
+                // an entry whose last reference is being dropped is gone
+                if (atomic_load(&e->refs) == 0) { continue; }
+                if (strcmp(e->path, path) == 0
+                    && e->mtime.tv_sec == mtime.tv_sec
+                    && e->mtime.tv_nsec == mtime.tv_nsec
+                    && e->size == sb->st_size) {
+                        return e;
+                }
+        }
+        return NULL;
+}
+
+/*
+ * Loader synths read their files through these callbacks, which raise
+ * the progress of the load running on the same thread, if any, to the
+ * furthest position read or skipped to. The parser comes back for the
+ * sample data after the headers, so bytes read are not simply added. FluidSynth 1 has no per loader file callbacks,
+ * so there they are installed as the default ones when the module is
+ * opened.
  *
  */
 
+// the file callback types changed from int and long counts and
+// offsets in 2.2
+#if FLUIDSYNTH_VERSION_MAJOR > 2 \
+    || (FLUIDSYNTH_VERSION_MAJOR == 2 && FLUIDSYNTH_VERSION_MINOR >= 2)
+typedef fluid_long_long_t sfont_count_t;
+typedef fluid_long_long_t sfont_off_t;
+#else
+typedef int sfont_count_t;
+typedef long sfont_off_t;
+#endif
+
+static __thread _Atomic long long* sfont_read_progress = NULL;
+
+// only the loading thread writes the progress
+static void
+sfont_file_reached (FILE* file)
+{
+        if (sfont_read_progress == NULL) { return; }
+
+        long long pos = ftello(file);
+        if (pos > atomic_load(sfont_read_progress)) { atomic_store(sfont_read_progress, pos); }
+}
+
+static void*
+sfont_file_open (const char* filename)
+{
+        return fopen(filename, "rb");
+}
+
+static int
+sfont_file_read (void* buf, sfont_count_t count, void* handle)
+{
+        if (count < 0 || fread(buf, 1, count, handle) != (size_t)count) { return FLUID_FAILED; }
+        sfont_file_reached(handle);
+        return FLUID_OK;
+}
+
+static int
+sfont_file_seek (void* handle, sfont_off_t offset, int origin)
+{
+        if (fseeko(handle, offset, origin) != 0) { return FLUID_FAILED; }
+        sfont_file_reached(handle);
+        return FLUID_OK;
+}
+
+static sfont_off_t
+sfont_file_tell (void* handle)
+{
+        return ftello(handle);
+}
+
+static int
+sfont_file_close (void* handle)
+{
+        return fclose(handle) == 0 ? FLUID_OK : FLUID_FAILED;
+}
+
+static pthread_once_t sfont_fileapi_once = PTHREAD_ONCE_INIT;
+
+#if FLUIDSYNTH_VERSION_MAJOR < 2
+
+static fluid_fileapi_t sfont_fileapi;
+
+static void*
+sfont_fileapi_open (fluid_fileapi_t* fileapi, const char* filename)
+{
+        return sfont_file_open(filename);
+}
+
+// before any synth of the module exists, so no loader holds the old one
+static void
+sfont_fileapi_install (void)
+{
+        fluid_init_default_fileapi(&sfont_fileapi);
+        sfont_fileapi.free = NULL;
+        sfont_fileapi.fopen = sfont_fileapi_open;
+        sfont_fileapi.fread = sfont_file_read;
+        sfont_fileapi.fseek = sfont_file_seek;
+        sfont_fileapi.fclose = sfont_file_close;
+        sfont_fileapi.ftell = sfont_file_tell;
+        fluid_set_default_fileapi(&sfont_fileapi);
+}
+
+#else
+
+static void
+sfont_fileapi_install (void)
+{
+}
+
+#endif
+
+// a synth to parse a cached font with, reading through the callbacks
+static fluid_synth_t*
+sfont_loader_new (fluid_settings_t* settings)
+{
+        pthread_mutex_lock(&synth_init_lock);
+        fluid_synth_t* synth = new_fluid_synth(settings);
+        pthread_mutex_unlock(&synth_init_lock);
+        if (synth == NULL) { return NULL; }
+
+#if FLUIDSYNTH_VERSION_MAJOR >= 2
+        fluid_sfloader_t* loader = new_fluid_defsfloader(settings);
+        if (loader == NULL) { delete_fluid_synth(synth); return NULL; }
+        fluid_sfloader_set_callbacks(loader, sfont_file_open, sfont_file_read, sfont_file_seek,
+                                     sfont_file_tell, sfont_file_close);
+        fluid_synth_add_sfloader(synth, loader);
+#endif
+        return synth;
+}
+
 /*
- * FLUIDSYNTH_API float
- * fluid_synth_get_gain (fluid_synth_t *synth)
- *
- * Get synth output gain value.
+ * Get a reference to the entry for the current version of `filename`,
+ * loading it if needed. With `progress` the furthest position the
+ * parser has read to is kept there; a cached file counts as read at
+ * once.
  *
  */
 
+static struct sfont_entry*
+sfont_cache_acquire (const char* filename, _Atomic long long* progress)
+{
+        char* path = realpath(filename, NULL);
+        if (path == NULL) { return NULL; }
+
+        struct stat sb;
+        if (stat(path, &sb) != 0) { free(path); return NULL; }
+
+        pthread_mutex_lock(&sfont_cache_lock);
+        struct sfont_entry* e = sfont_cache_find(path, &sb);
+        if (e != NULL) { atomic_fetch_add(&e->refs, 1); }
+        pthread_mutex_unlock(&sfont_cache_lock);
+
+        if (e != NULL) {
+                free(path);
+                if (progress != NULL) { atomic_store(progress, sb.st_size); }
+                return e;
+        }
+
+        e = calloc(1, sizeof(struct sfont_entry));
+        if (e == NULL) { free(path); return NULL; }
+        e->path = path;
+        e->mtime = stat_mtime(&sb);
+        e->size = sb.st_size;
+        atomic_init(&e->refs, 1);
+
+        e->settings = new_fluid_settings();
+        if (e->settings != NULL) {
+                fluid_settings_setint(e->settings, "synth.polyphony", 16);
+                e->loader = sfont_loader_new(e->settings);
+        }
+
+        sfont_read_progress = progress;
+        int id = e->loader != NULL ? fluid_synth_sfload(e->loader, path, 0) : FLUID_FAILED;
+        sfont_read_progress = NULL;
+        if (id == FLUID_FAILED) { sfont_entry_free(e); return NULL; }
+        e->sfont = fluid_synth_get_sfont_by_id(e->loader, id);
+
+        // another thread may have loaded the same file meanwhile
+        pthread_mutex_lock(&sfont_cache_lock);
+        struct sfont_entry* other = sfont_cache_find(path, &sb);
+        if (other != NULL) {
+                atomic_fetch_add(&other->refs, 1);
+        } else {
+                e->next = sfont_entries;
+                sfont_entries = e;
+        }
+        pthread_mutex_unlock(&sfont_cache_lock);
+
+        if (other != NULL) { sfont_entry_free(e); return other; }
+        return e;
+}
+
+static void
+sfont_cache_release (struct sfont_entry* entry)
+{
+        if (atomic_fetch_sub(&entry->refs, 1) != 1) { return; }
+
+        // lookups skip the entry from now on, so it only needs unlinking
+        pthread_mutex_lock(&sfont_cache_lock);
+        for (struct sfont_entry** p = &sfont_entries; *p != NULL; p = &(*p)->next) {
+                if (*p == entry) { *p = entry->next; break; }
+        }
+        pthread_mutex_unlock(&sfont_cache_lock);
+
+        sfont_entry_free(entry);
+}
+
+static void
+sfont_attachment_unlink (struct sfont_attachment* a)
+{
+        pthread_mutex_lock(&sfont_cache_lock);
+        for (struct sfont_attachment** p = &sfont_attachments; *p != NULL; p = &(*p)->next) {
+                if (*p == a) { *p = a->next; break; }
+        }
+        pthread_mutex_unlock(&sfont_cache_lock);
+}
+
+#if FLUIDSYNTH_VERSION_MAJOR < 2
+
+struct sfont_proxy_preset {
+        fluid_preset_t preset;
+        fluid_preset_t* inner;
+};
+
+static char*
+sfont_proxy_preset_get_name (fluid_preset_t* preset)
+{
+        fluid_preset_t* inner = ((struct sfont_proxy_preset*)preset->data)->inner;
+        return inner->get_name(inner);
+}
+
+static int
+sfont_proxy_preset_get_banknum (fluid_preset_t* preset)
+{
+        fluid_preset_t* inner = ((struct sfont_proxy_preset*)preset->data)->inner;
+        return inner->get_banknum(inner);
+}
+
+static int
+sfont_proxy_preset_get_num (fluid_preset_t* preset)
+{
+        fluid_preset_t* inner = ((struct sfont_proxy_preset*)preset->data)->inner;
+        return inner->get_num(inner);
+}
+
+static int
+sfont_proxy_preset_noteon (fluid_preset_t* preset, fluid_synth_t* synth, int chan, int key, int vel)
+{
+        fluid_preset_t* inner = ((struct sfont_proxy_preset*)preset->data)->inner;
+        return inner->noteon(inner, synth, chan, key, vel);
+}
+
+static int
+sfont_proxy_preset_notify (fluid_preset_t* preset, int reason, int chan)
+{
+        fluid_preset_t* inner = ((struct sfont_proxy_preset*)preset->data)->inner;
+        return inner->notify != NULL ? inner->notify(inner, reason, chan) : FLUID_OK;
+}
+
+static int
+sfont_proxy_preset_free (fluid_preset_t* preset)
+{
+        struct sfont_proxy_preset* p = preset->data;
+        if (p->inner->free != NULL) { p->inner->free(p->inner); }
+        free(p);
+        return 0;
+}
+
+static fluid_preset_t*
+sfont_proxy_get_preset (fluid_sfont_t* sfont, unsigned int bank, unsigned int prenum)
+{
+        struct sfont_attachment* a = sfont->data;
+        fluid_sfont_t* cached = a->entry->sfont;
+
+        fluid_preset_t* inner = cached->get_preset(cached, bank, prenum);
+        if (inner == NULL) { return NULL; }
+
+        struct sfont_proxy_preset* p = calloc(1, sizeof(struct sfont_proxy_preset));
+        if (p == NULL) {
+                if (inner->free != NULL) { inner->free(inner); }
+                return NULL;
+        }
+        p->inner = inner;
+        p->preset.data = p;
+        p->preset.sfont = sfont;
+        p->preset.free = sfont_proxy_preset_free;
+        p->preset.get_name = sfont_proxy_preset_get_name;
+        p->preset.get_banknum = sfont_proxy_preset_get_banknum;
+        p->preset.get_num = sfont_proxy_preset_get_num;
+        p->preset.noteon = sfont_proxy_preset_noteon;
+        p->preset.notify = sfont_proxy_preset_notify;
+        return &p->preset;
+}
+
+static char*
+sfont_proxy_get_name (fluid_sfont_t* sfont)
+{
+        fluid_sfont_t* cached = ((struct sfont_attachment*)sfont->data)->entry->sfont;
+        return cached->get_name(cached);
+}
+
+static void
+sfont_proxy_iteration_start (fluid_sfont_t* sfont)
+{
+        fluid_sfont_t* cached = ((struct sfont_attachment*)sfont->data)->entry->sfont;
+        cached->iteration_start(cached);
+}
+
+static int
+sfont_proxy_iteration_next (fluid_sfont_t* sfont, fluid_preset_t* preset)
+{
+        fluid_sfont_t* cached = ((struct sfont_attachment*)sfont->data)->entry->sfont;
+        if (!cached->iteration_next(cached, preset)) { return 0; }
+        preset->sfont = sfont;
+        return 1;
+}
+
+// the synth unloaded the proxy, or is being deleted
+static int
+sfont_proxy_free (fluid_sfont_t* sfont)
+{
+        struct sfont_attachment* a = sfont->data;
+        sfont_attachment_unlink(a);
+        sfont_cache_release(a->entry);
+        free(a);
+        free(sfont);
+        return 0;
+}
+
+static fluid_sfont_t*
+sfont_proxy_new (struct sfont_attachment* a)
+{
+        fluid_sfont_t* sfont = calloc(1, sizeof(fluid_sfont_t));
+        if (sfont == NULL) { return NULL; }
+
+        sfont->data = a;
+        sfont->free = sfont_proxy_free;
+        sfont->get_name = sfont_proxy_get_name;
+        sfont->get_preset = sfont_proxy_get_preset;
+        sfont->iteration_start = sfont_proxy_iteration_start;
+        sfont->iteration_next = sfont_proxy_iteration_next;
+        return sfont;
+}
+
+// the cached font behind `sfont` if it is a proxy
+static fluid_sfont_t*
+sfont_cache_unwrap (fluid_sfont_t* sfont)
+{
+        if (sfont == NULL || sfont->free != sfont_proxy_free) { return sfont; }
+        return ((struct sfont_attachment*)sfont->data)->entry->sfont;
+}
+
+#else
+
+static fluid_sfont_t*
+sfont_cache_unwrap (fluid_sfont_t* sfont)
+{
+        return sfont;
+}
+
+#endif
+
 /*
- * FLUIDSYNTH_API int
- * fluid_synth_set_polyphony (fluid_synth_t *synth,
- *                            int polyphony)
+ * Add the font of `entry` to `synth`, taking over the reference.
+ * `fluid_synth_add_sfont` resets the presets of all channels; unless
+ * `reset` is set the presets selected before are selected again.
  *
- * Set synthesizer polyphony (max number of voices).
+ * Returns the id of the font in `synth`, or FLUID_FAILED.
  *
  */
 
+static int
+sfont_cache_attach (fluid_synth_t* synth, struct sfont_entry* entry, int reset)
+{
+        struct sfont_attachment* a = malloc(sizeof(struct sfont_attachment));
+        int nchannels = fluid_synth_count_midi_channels(synth);
+        unsigned int* programs = reset ? NULL : malloc(3 * nchannels * sizeof(unsigned int));
+        if (a == NULL || (!reset && programs == NULL)) {
+                free(a);
+                free(programs);
+                sfont_cache_release(entry);
+                return FLUID_FAILED;
+        }
+
+        for (int chan = 0; programs != NULL && chan < nchannels; chan++) {
+                unsigned int* p = programs + 3 * chan;
+                fluid_synth_get_program(synth, chan, &p[0], &p[1], &p[2]);
+        }
+
+        a->synth = synth;
+        a->entry = entry;
+
+#if FLUIDSYNTH_VERSION_MAJOR < 2
+        a->sfont = sfont_proxy_new(a);
+        int id = a->sfont != NULL ? fluid_synth_add_sfont(synth, a->sfont) : FLUID_FAILED;
+        if (id == FLUID_FAILED) { free(a->sfont); }
+#else
+        // the samples come from FluidSynth's cache, filled by the loader
+        int id = fluid_synth_sfload(synth, entry->path, 0);
+        a->sfont = id != FLUID_FAILED ? fluid_synth_get_sfont_by_id(synth, id) : NULL;
+#endif
+
+        for (int chan = 0; programs != NULL && chan < nchannels; chan++) {
+                unsigned int* p = programs + 3 * chan;
+                fluid_synth_program_select(synth, chan, p[0], p[1], p[2]);
+        }
+        free(programs);
+
+        if (id == FLUID_FAILED) {
+                free(a);
+                sfont_cache_release(entry);
+                return FLUID_FAILED;
+        }
+
+        a->id = id;
+
+        pthread_mutex_lock(&sfont_cache_lock);
+        a->next = sfont_attachments;
+        sfont_attachments = a;
+        pthread_mutex_unlock(&sfont_cache_lock);
+
+        return id;
+}
+
+// remove the shared font `id` from `synth`, or all of them when `id`
+// is -1; returns the number of fonts removed
+static int
+sfont_cache_detach (fluid_synth_t* synth, int id)
+{
+        struct sfont_attachment* removed = NULL;
+
+        pthread_mutex_lock(&sfont_cache_lock);
+        struct sfont_attachment** p = &sfont_attachments;
+        while (*p != NULL) {
+                struct sfont_attachment* a = *p;
+                if (a->synth != synth || (id != -1 && a->id != id)) {
+                        p = &a->next;
+                        continue;
+                }
+                *p = a->next;
+                a->next = removed;
+                removed = a;
+        }
+        pthread_mutex_unlock(&sfont_cache_lock);
+
+        int count = 0;
+        while (removed != NULL) {
+                struct sfont_attachment* a = removed;
+                removed = a->next;
+                fluid_synth_remove_sfont(synth, a->sfont);
+#if FLUIDSYNTH_VERSION_MAJOR < 2
+                free(a->sfont);
+#else
+                delete_fluid_sfont(a->sfont);
+#endif
+                sfont_cache_release(a->entry);
+                free(a);
+                count++;
+        }
+
+        return count;
+}
+
 /*
- * FLUIDSYNTH_API int
- * fluid_synth_get_polyphony (fluid_synth_t *synth)
+ * FLUIDSYNTH_API fluid_synth_t *
+ * new_fluid_synth (fluid_settings_t *settings)
  *
- * Get current synthesizer polyphony (max number of voices).
+ * Create new FluidSynth instance.
  *
  */
 
+static int
+c_new_fluid_synth (lua_State* L)
+{
+        fluid_settings_t* settings = *(fluid_settings_t**)lua_touserdata(L, 1);
+        if (settings == NULL) { lua_pushnil(L); return 1; }
+
+        fluid_synth_t* synth = new_fluid_synth(settings);
+        if (synth == NULL) { lua_pushnil(L); return 1; }
+
+        fluid_synth_t** synth_p = lua_newuserdata(L, sizeof(fluid_synth_t*));
+        *synth_p = synth;
+        
+        return 1;
+}
+
+// defined with the preset catalogs and asynchronous loads below
+static void catalog_drop (fluid_synth_t* synth, int sfont_id);
+static void sfload_forget (fluid_synth_t* synth);
+static void sfswap_forget (fluid_synth_t* synth);
+static void param_select_forget (fluid_synth_t* synth);
+static void mmsf_synth_closing (fluid_synth_t* synth);
+
 /*
  * FLUIDSYNTH_API int
- * fluid_synth_get_active_voice_count (fluid_synth_t *synth)
+ * delete_fluid_synth (fluid_synth_t *synth)
  *
- * Get current number of active voices.
+ * Delete a FluidSynth instance.
  *
  */
 
+static int
+c_delete_fluid_synth (lua_State* L)
+{
+        fluid_synth_t* synth = *(fluid_synth_t**)lua_touserdata(L, 1);
+        if (synth == NULL) { lua_pushnil(L); return 1; }
+
+        synth_meter_detach(L, synth);
+        synth_stats_forget(synth);
+        sfont_cache_detach(synth, -1);
+        sfload_forget(synth);
+        sfswap_forget(synth);
+        catalog_drop(synth, -1);
+        param_select_forget(synth);
+        mmsf_synth_closing(synth);
+        int status = delete_fluid_synth(synth);
+
+        lua_pushinteger(L, status);
+        return 1;
+}
+
 /*
- * FLUIDSYNTH_API int
- * fluid_synth_get_internal_bufsize (fluid_synth_t *synth)
+ * FLUIDSYNTH_API fluid_settings_t * 	fluid_synth_get_settings (fluid_synth_t *synth)
  *
- * Get the internal synthesis buffer size value.
+ * Get settings assigned to a synth.
  *
  */
 
 /*
  * FLUIDSYNTH_API int
- * fluid_synth_set_interp_method (fluid_synth_t *synth,
- *                                int chan,
- *                                int interp_method)
+ * fluid_synth_noteon (fluid_synth_t *synth,
+ *                     int chan,
+ *                     int key,
+ *                     int vel)
  *
- * Set synthesis interpolation method on one or all MIDI channels.
+ * Send a note-on event to a FluidSynth object.
  *
  */
 
 /*
  * FLUIDSYNTH_API int
- * fluid_synth_set_gen (fluid_synth_t *synth,
+ * fluid_synth_noteoff (fluid_synth_t *synth,
  *                      int chan,
- *                      int param,
- *                      float value)
+ *                      int key)
  *
- * Set a SoundFont generator (effect) value on a MIDI channel in
- * real-time.
+ * Send a note-off event to a FluidSynth object.
  *
  */
 
 /*
  * FLUIDSYNTH_API int
- * fluid_synth_set_gen2 (fluid_synth_t *synth,
- *                       int chan,
- *                       int param,
- *                       float value,
- *                       int absolute,
- *                       int normalized)
+ * fluid_synth_cc (fluid_synth_t *synth, int chan, int ctrl, int val)
  *
- * Set a SoundFont generator (effect) value on a MIDI channel in
- * real-time.
+ * Send a MIDI controller event on a MIDI channel.
  *
  */
 
 /*
- * FLUIDSYNTH_API float
- * fluid_synth_get_gen (fluid_synth_t *synth,
- *                      int chan,
- *                      int param)
+ * FLUIDSYNTH_API int
+ * fluid_synth_get_cc (fluid_synth_t *synth,
+ *                     int chan,
+ *                     int ctrl,
+ *                     int *pval)
  *
- * Get generator value assigned to a MIDI channel.
+ * Get current MIDI controller value on a MIDI channel.
  *
  */
 
 /*
  * FLUIDSYNTH_API int
- * fluid_synth_create_key_tuning (fluid_synth_t *synth,
- *                                int bank,
- *                                int prog,
- *                                const char *name,
- *                                const double *pitch)
- *
- * Set the tuning of the entire MIDI note scale.
+ * fluid_synth_sysex (fluid_synth_t *synth,
+ *                    const char *data,
+ *                    int len,
+ *                    char *response,
+ *                    int *response_len,
+ *                    int *handled,
+ *                    int dryrun)
+ *
+ * Process a MIDI SYSEX (system exclusive) message.
  *
  */
 
 /*
  * FLUIDSYNTH_API int
- * fluid_synth_activate_key_tuning (fluid_synth_t *synth,
- *                                  int bank,
- *                                  int prog,
- *                                  const char *name,
- *                                  const double *pitch,
- *                                  int apply)
+ * fluid_synth_pitch_bend (fluid_synth_t *synth,
+ *                         int chan,
+ *                         int val)
  *
- * Set the tuning of the entire MIDI note scale.
+ * Set the MIDI pitch bend controller value on a MIDI channel.
  *
  */
 
 /*
  * FLUIDSYNTH_API int
- * fluid_synth_create_octave_tuning (fluid_synth_t *synth,
- *                                   int bank,
- *                                   int prog,
- *                                   const char *name,
- *                                   const double *pitch)
+ * fluid_synth_get_pitch_bend (fluid_synth_t *synth,
+ *                             int chan,
+ *                             int *ppitch_bend)
  *
- * Apply an octave tuning to every octave in the MIDI note scale.
+ * Get the MIDI pitch bend controller value on a MIDI channel.
  *
  */
 
-
 /*
  * FLUIDSYNTH_API int
- * fluid_synth_activate_octave_tuning (fluid_synth_t *synth,
- *                                     int bank,
- *                                     int prog,
- *                                     const char *name,
- *                                     const double *pitch,
- *                                     int apply)
+ * fluid_synth_pitch_wheel_sens (fluid_synth_t *synth,
+ *                               int chan,
+ *                               int val)
  *
- * Activate an octave tuning on every octave in the MIDI note scale.
+ * Set MIDI pitch wheel sensitivity on a MIDI channel.
  *
  */
 
 /*
  * FLUIDSYNTH_API int
- * fluid_synth_tune_notes (fluid_synth_t *synth,
- *                         int bank,
- *                         int prog,
- *                         int len,
- *                         const int *keys,
- *                         const double *pitch,
- *                         int apply)
+ * fluid_synth_get_pitch_wheel_sens (fluid_synth_t *synth,
+ *                                   int chan,
+ *                                   int *pval)
  *
- * Set tuning values for one or more MIDI notes for an existing
- * tuning.
+ * Get MIDI pitch wheel sensitivity on a MIDI channel.
  *
  */
 
 /*
  * FLUIDSYNTH_API int
- * fluid_synth_select_tuning (fluid_synth_t *synth,
- *                            int chan,
- *                            int bank,
- *                            int prog)
+ * fluid_synth_program_change (fluid_synth_t *synth,
+ *                             int chan,
+ *                             int program)
  *
- * Select a tuning scale on a MIDI channel.
+ * Send a program change event on a MIDI channel.
  *
  */
 
 /*
  * FLUIDSYNTH_API int
- * fluid_synth_activate_tuning (fluid_synth_t *synth,
- *                              int chan,
- *                              int bank,
- *                              int prog,
- *                              int apply)
+ * fluid_synth_channel_pressure (fluid_synth_t *synth,
+ *                               int chan,
+ *                               int val)
  *
- * Activate a tuning scale on a MIDI channel.
+ * Set the MIDI channel pressure controller value.
  *
  */
 
 /*
  * FLUIDSYNTH_API int
- * fluid_synth_reset_tuning (fluid_synth_t *synth,
- *                           int chan)
+ * fluid_synth_bank_select (fluid_synth_t *synth,
+ *                          int chan,
+ *                          unsigned int bank)
  *
- * Clear tuning scale on a MIDI channel (set it to the default
- * well-tempered scale).
+ * Set instrument bank number on a MIDI channel.
  *
  */
 
 /*
  * FLUIDSYNTH_API int
- * fluid_synth_deactivate_tuning (fluid_synth_t *synth,
- *                                int chan,
- *                                int apply)
+ * fluid_synth_sfont_select (fluid_synth_t *synth,
+ *                           int chan,
+ *                           unsigned int sfont_id)
  *
- * Clear tuning scale on a MIDI channel (use default equal tempered
- * scale).
+ * Set SoundFont ID on a MIDI channel.
  *
  */
 
 /*
- * FLUIDSYNTH_API void
- * fluid_synth_tuning_iteration_start (fluid_synth_t *synth)
+ * FLUIDSYNTH_API int
+ * fluid_synth_program_select (fluid_synth_t *synth,
+ *                             int chan,
+ *                             unsigned int sfont_id,
+ *                             unsigned int bank_num,
+ *                             unsigned int preset_num)
  *
- * Start tuning iteration.
+ * Select an instrument on a MIDI channel by SoundFont ID, bank and
+ * program numbers.
  *
  */
 
 /*
  * FLUIDSYNTH_API int
- * fluid_synth_tuning_iteration_next (fluid_synth_t *synth,
- *                                    int *bank,
- *                                    int *prog)
+ * fluid_synth_program_select_by_sfont_name (fluid_synth_t *synth,
+ *                                           int chan,
+ *                                           const char *sfont_name,
+ *                                           unsigned int bank_num,
+ *                                           unsigned int preset_num)
  *
- * Advance to next tuning.
+ * Select an instrument on a MIDI channel by SoundFont name, bank and
+ * program numbers.
  *
  */
 
 /*
  * FLUIDSYNTH_API int
- * fluid_synth_tuning_dump (fluid_synth_t *synth,
- *                          int bank,
- *                          int prog,
- *                          char *name,
- *                          int len,
- *                          double *pitch)
+ * fluid_synth_get_program (fluid_synth_t *synth,
+ *                          int chan,
+ *                          unsigned int *sfont_id,
+ *                          unsigned int *bank_num,
+ *                          unsigned int *preset_num)
  *
- * Get the entire note tuning for a given MIDI bank and program.
+ * Get current SoundFont ID, bank number and program number for a MIDI
+ * channel.
  *
  */
 
 /*
- * FLUIDSYNTH_API double
- * fluid_synth_get_cpu_load (fluid_synth_t *synth)
+ * FLUIDSYNTH_API int
+ * fluid_synth_unset_program (fluid_synth_t *synth,
+ *                            int chan)
  *
- * Get the synth CPU load value.
+ * Set the preset of a MIDI channel to an unassigned state.
  *
  */
 
 /*
- * FLUIDSYNTH_API char *
- * fluid_synth_error (fluid_synth_t *synth)
+ * FLUIDSYNTH_API int
+ * fluid_synth_get_channel_info (fluid_synth_t *synth,
+ *                               int chan,
+ *                               fluid_synth_channel_info_t *info)
  *
- * Get a textual representation of the last error.
+ * Get information on the currently selected preset on a MIDI channel.
  *
  */
 
 /*
  * FLUIDSYNTH_API int
- * fluid_synth_write_s16 (fluid_synth_t *synth,
- *                        int len,
- *                        void *lout,
- *                        int loff,
- *                        int lincr,
- *                        void *rout,
- *                        int roff,
- *                        int rincr)
+ * fluid_synth_program_reset (fluid_synth_t *synth)
  *
- * Synthesize a block of 16 bit audio samples to audio buffers.
+ * Resend a bank select and a program change for every channel.
  *
  */
 
 /*
  * FLUIDSYNTH_API int
- * fluid_synth_write_float (fluid_synth_t *synth,
- *                          int len,
- *                          void *lout,
- *                          int loff,
- *                          int lincr,
- *                          void *rout,
- *                          int roff,
- *                          int rincr)
+ * fluid_synth_system_reset (fluid_synth_t *synth)
  *
- * Synthesize a block of floating point audio samples to audio
- * buffers.
+ * Send MIDI system reset command (big red 'panic' button), turns off
+ * notes and resets controllers.
  *
  */
 
 /*
- * FLUIDSYNTH_API int
- * fluid_synth_nwrite_float (fluid_synth_t *synth,
- *                           int len,
- *                           float **left,
- *                           float **right,
- *                           float **fx_left,
- *                           float **fx_right)
+ * FluidSynth keeps to itself whether a channel last selected an RPN or
+ * an NRPN, which decides what data entry changes. Messages applied
+ * through the binding record it here for snapshots.
  *
- * Synthesize a block of floating point audio to audio buffers.
+ */
+
+struct param_select {
+        fluid_synth_t* synth;
+        int nchannels;
+        unsigned char* nrpn;            // per channel, 1 if an NRPN was selected last
+        struct param_select* next;
+};
+
+static struct param_select* param_select_list = NULL;
+
+static struct param_select*
+param_select_find (fluid_synth_t* synth)
+{
+        for (struct param_select* ps = param_select_list; ps != NULL; ps = ps->next) {
+                if (ps->synth == synth) { return ps; }
+        }
+        return NULL;
+}
+
+static int
+param_select_get (fluid_synth_t* synth, int chan)
+{
+        struct param_select* ps = param_select_find(synth);
+        return ps != NULL && chan < ps->nchannels ? ps->nrpn[chan] : 0;
+}
+
+static void
+param_select_set (fluid_synth_t* synth, int chan, int nrpn)
+{
+        struct param_select* ps = param_select_find(synth);
+        if (ps == NULL) {
+                if (!nrpn) { return; }
+                ps = calloc(1, sizeof(struct param_select));
+                if (ps == NULL) { return; }
+                ps->synth = synth;
+                ps->next = param_select_list;
+                param_select_list = ps;
+        }
+
+        if (chan >= ps->nchannels) {
+                int nchannels = fluid_synth_count_midi_channels(synth);
+                if (chan >= nchannels) { return; }
+                unsigned char* p = realloc(ps->nrpn, nchannels);
+                if (p == NULL) { return; }
+                memset(p + ps->nchannels, 0, nchannels - ps->nchannels);
+                ps->nrpn = p;
+                ps->nchannels = nchannels;
+        }
+        ps->nrpn[chan] = nrpn;
+}
+
+static void
+param_select_forget (fluid_synth_t* synth)
+{
+        for (struct param_select** p = &param_select_list; *p != NULL; p = &(*p)->next) {
+                if ((*p)->synth == synth) {
+                        struct param_select* ps = *p;
+                        *p = ps->next;
+                        free(ps->nrpn);
+                        free(ps);
+                        return;
+                }
+        }
+}
+
+/*
+ * fluid_synth_apply_midi (synth, bytes)
+ *
+ * Apply a string of raw MIDI messages to `synth` in one call. Channel
+ * messages may use running status, a note-on with velocity 0 is a
+ * note-off, system exclusive messages go to `fluid_synth_sysex` and
+ * 0xFF resets the synth. Other system messages are skipped, and
+ * polyphonic key pressure is only applied with FluidSynth 2. A status
+ * byte other than a real-time one in the middle of a message abandons
+ * that message.
+ *
+ * Returns the number of messages applied, or nil and that number if
+ * the string ends in the middle of a message or has data bytes
+ * without a status.
+ *
+ */
+
+// data bytes following each channel message status, by high nibble
+static const unsigned char midi_data_length[8] = { 2, 2, 2, 2, 1, 1, 2, 0 };
+
+static void
+apply_midi_message (fluid_synth_t* synth, int status, const unsigned char* data)
+{
+        int chan = status & 0x0f;
+
+        switch (status & 0xf0) {
+        case 0x80:
+                fluid_synth_noteoff(synth, chan, data[0]);
+                break;
+        case 0x90:
+                if (data[1] == 0) {
+                        fluid_synth_noteoff(synth, chan, data[0]);
+                } else {
+                        fluid_synth_noteon(synth, chan, data[0], data[1]);
+                }
+                break;
+        case 0xa0:
+#if FLUIDSYNTH_VERSION_MAJOR >= 2
+                fluid_synth_key_pressure(synth, chan, data[0], data[1]);
+#endif
+                break;
+        case 0xb0:
+                if (data[0] >= 98 && data[0] <= 101) { param_select_set(synth, chan, data[0] < 100); }
+                fluid_synth_cc(synth, chan, data[0], data[1]);
+                break;
+        case 0xc0:
+                fluid_synth_program_change(synth, chan, data[0]);
+                break;
+        case 0xd0:
+                fluid_synth_channel_pressure(synth, chan, data[0]);
+                break;
+        case 0xe0:
+                fluid_synth_pitch_bend(synth, chan, data[0] | (data[1] << 7));
+                break;
+        }
+}
+
+// returns the number of messages applied, 1 for a reset
+static int
+apply_midi_realtime (fluid_synth_t* synth, int status)
+{
+        if (status != 0xff) { return 0; }
+
+        fluid_synth_system_reset(synth);
+        param_select_forget(synth);
+        return 1;
+}
+
+static int
+c_fluid_synth_apply_midi (lua_State* L)
+{
+        fluid_synth_t* synth = *(fluid_synth_t**)lua_touserdata(L, 1);
+        size_t len;
+        const unsigned char* p = (const unsigned char*)luaL_checklstring(L, 2, &len);
+        const unsigned char* end = p + len;
+
+        int running = 0;        // running status, 0 when there is none
+        int count = 0;
+
+        while (p < end) {
+                int status = *p;
+
+                if (status >= 0xf8) {
+                        count += apply_midi_realtime(synth, status);
+                        p++;
+                        continue;
+                }
+
+                if (status == 0xf0) {
+                        const unsigned char* eox = memchr(p + 1, 0xf7, end - p - 1);
+                        if (eox == NULL) { break; }
+                        fluid_synth_sysex(synth, (const char*)p + 1, (int)(eox - p - 1),
+                                          NULL, NULL, NULL, 0);
+                        count++;
+                        running = 0;
+                        p = eox + 1;
+                        continue;
+                }
+
+                if (status >= 0xf1) {
+                        // system common, or a stray EOX: skip it, it cancels running status
+                        static const unsigned char common_length[8] = { 0, 1, 2, 1, 0, 0, 0, 0 };
+                        size_t n = 1 + common_length[status - 0xf0];
+                        if ((size_t)(end - p) < n) { break; }
+                        running = 0;
+                        p += n;
+                        continue;
+                }
+
+                const unsigned char* start = p;
+                if (status >= 0x80) {
+                        running = status;
+                        p++;
+                } else if (running == 0) {
+                        break;
+                }
+
+                // real-time bytes may come between the data bytes, any
+                // other status byte abandons the message and starts its own
+                unsigned char data[2];
+                size_t n = midi_data_length[(running >> 4) & 0x07];
+                size_t got = 0;
+                while (got < n && p < end && (*p < 0x80 || *p >= 0xf8)) {
+                        if (*p >= 0xf8) {
+                                count += apply_midi_realtime(synth, *p++);
+                        } else {
+                                data[got++] = *p++;
+                        }
+                }
+                if (got < n) {
+                        if (p == end) { p = start; break; }
+                        continue;
+                }
+
+                apply_midi_message(synth, running, data);
+                count++;
+        }
+
+        if (p < end) {
+                lua_pushnil(L);
+                lua_pushinteger(L, count);
+                return 2;
+        }
+
+        lua_pushinteger(L, count);
+        return 1;
+}
+
+/*
+ * Channel snapshots. A snapshot is a string holding a header
+ * ("FSNP", a version and the number of channels) followed by one
+ * record per channel, all little endian:
+ *
+ *      u32     sfont id
+ *      u32     bank
+ *      u8      program
+ *      u8      pitch wheel sensitivity
+ *      u16     pitch bend
+ *      u8[128] controller values
+ *      u8      flags (SNAPSHOT_NO_PROGRAM, SNAPSHOT_NRPN_LAST)
+ *
+ * Version 1 snapshots have no flags byte.
+ *
+ */
+
+#define SNAPSHOT_MAGIC          "FSNP"
+#define SNAPSHOT_VERSION        2
+#define SNAPSHOT_HEADER         8
+#define SNAPSHOT_CHANNEL        141
+#define SNAPSHOT_CHANNEL_V1     140
+
+#define SNAPSHOT_NO_PROGRAM     0x01    // the channel has no preset
+#define SNAPSHOT_NRPN_LAST      0x02    // an NRPN was selected after the RPN
+
+// controllers that act when they are sent rather than hold a value
+// (bank select, data entry, channel mode messages) are not restored,
+// and the RPN and NRPN selections are restored last, in the order
+// they were made
+static int
+snapshot_skip_cc (int num)
+{
+        return num == 0 || num == 32 || num == 6 || num == 38 || num == 96 || num == 97
+                || (num >= 98 && num <= 101) || num >= 120;
+}
+
+/*
+ * fluid_synth_snapshot (synth)
+ *
+ * Capture the state of every MIDI channel of `synth`: controllers,
+ * pitch bend, pitch wheel sensitivity and the selected font, bank and
+ * program. Returns the snapshot as a string for `fluid_synth_restore`.
+ *
+ */
+
+static int
+c_fluid_synth_snapshot (lua_State* L)
+{
+        fluid_synth_t* synth = *(fluid_synth_t**)lua_touserdata(L, 1);
+        int channels = fluid_synth_count_midi_channels(synth);
+
+        luaL_Buffer b;
+        size_t size = SNAPSHOT_HEADER + (size_t)channels * SNAPSHOT_CHANNEL;
+        unsigned char* blob = (unsigned char*)luaL_buffinitsize(L, &b, size);
+
+        memcpy(blob, SNAPSHOT_MAGIC, 4);
+        put_u16le(blob + 4, SNAPSHOT_VERSION);
+        put_u16le(blob + 6, channels);
+
+        for (int chan = 0; chan < channels; chan++) {
+                unsigned char* r = blob + SNAPSHOT_HEADER + chan * SNAPSHOT_CHANNEL;
+                memset(r, 0, SNAPSHOT_CHANNEL);
+
+                unsigned int sfont_id = 0, bank = 0, program = 0;
+                fluid_synth_get_program(synth, chan, &sfont_id, &bank, &program);
+                int sens = 2, bend = 8192;
+                fluid_synth_get_pitch_wheel_sens(synth, chan, &sens);
+                fluid_synth_get_pitch_bend(synth, chan, &bend);
+
+                put_u32le(r, sfont_id);
+                put_u32le(r + 4, bank);
+                r[8] = program & 0x7f;
+                r[9] = sens & 0x7f;
+                put_u16le(r + 10, bend & 0x3fff);
+                for (int num = 0; num < 128; num++) {
+                        int value = 0;
+                        fluid_synth_get_cc(synth, chan, num, &value);
+                        r[12 + num] = value & 0x7f;
+                }
+                r[140] = (sfont_id == 0 ? SNAPSHOT_NO_PROGRAM : 0)
+                        | (param_select_get(synth, chan) ? SNAPSHOT_NRPN_LAST : 0);
+        }
+
+        luaL_pushresultsize(&b, size);
+        return 1;
+}
+
+/*
+ * fluid_synth_restore (synth, snapshot)
+ *
+ * Apply a snapshot taken with `fluid_synth_snapshot`, possibly from
+ * another synth. A channel whose font is not loaded in `synth` selects
+ * its bank and program from whatever fonts are. Channels beyond those
+ * of the synth are ignored.
+ *
+ * Returns the number of channels restored, or nil if `snapshot` is not
+ * a valid snapshot.
+ *
+ */
+
+static int
+c_fluid_synth_restore (lua_State* L)
+{
+        fluid_synth_t* synth = *(fluid_synth_t**)lua_touserdata(L, 1);
+        size_t len;
+        const unsigned char* blob = (const unsigned char*)luaL_checklstring(L, 2, &len);
+
+        if (len < SNAPSHOT_HEADER || memcmp(blob, SNAPSHOT_MAGIC, 4) != 0
+            || get_u16le(blob + 4) < 1 || get_u16le(blob + 4) > SNAPSHOT_VERSION) {
+                lua_pushnil(L);
+                return 1;
+        }
+        size_t record = get_u16le(blob + 4) == 1 ? SNAPSHOT_CHANNEL_V1 : SNAPSHOT_CHANNEL;
+        int channels = get_u16le(blob + 6);
+        if (len != SNAPSHOT_HEADER + (size_t)channels * record) {
+                lua_pushnil(L);
+                return 1;
+        }
+
+        int nchannels = fluid_synth_count_midi_channels(synth);
+        if (channels > nchannels) { channels = nchannels; }
+
+        for (int chan = 0; chan < channels; chan++) {
+                const unsigned char* r = blob + SNAPSHOT_HEADER + chan * record;
+                const unsigned char* cc = r + 12;
+                int flags = record > SNAPSHOT_CHANNEL_V1 ? r[140] : 0;
+
+                unsigned int sfont_id = get_u32le(r);
+                unsigned int bank = get_u32le(r + 4);
+                if (flags & SNAPSHOT_NO_PROGRAM) {
+                        fluid_synth_bank_select(synth, chan, bank);
+                        fluid_synth_unset_program(synth, chan);
+                } else if (fluid_synth_get_sfont_by_id(synth, sfont_id) == NULL
+                           || fluid_synth_program_select(synth, chan, sfont_id, bank, r[8]) != FLUID_OK) {
+                        fluid_synth_bank_select(synth, chan, bank);
+                        fluid_synth_program_change(synth, chan, r[8]);
+                }
+
+                for (int num = 0; num < 128; num++) {
+                        if (snapshot_skip_cc(num)) { continue; }
+                        fluid_synth_cc(synth, chan, num, cc[num]);
+                }
+                fluid_synth_pitch_wheel_sens(synth, chan, r[9]);
+                fluid_synth_pitch_bend(synth, chan, get_u16le(r + 10));
+
+                // MSB before LSB, as selecting an NRPN MSB clears the LSB
+                int nrpn = (flags & SNAPSHOT_NRPN_LAST) != 0;
+                int first = nrpn ? 100 : 98;
+                int last = nrpn ? 98 : 100;
+                fluid_synth_cc(synth, chan, first + 1, cc[first + 1]);
+                fluid_synth_cc(synth, chan, first, cc[first]);
+                fluid_synth_cc(synth, chan, last + 1, cc[last + 1]);
+                fluid_synth_cc(synth, chan, last, cc[last]);
+                param_select_set(synth, chan, nrpn);
+        }
+
+        lua_pushinteger(L, channels);
+        return 1;
+}
+
+/*
+ * Preset catalogs. When a SoundFont is loaded through the binding its
+ * presets are listed once into a catalog hashed both by name and by
+ * bank and program, so presets are found by name without walking the
+ * font. Catalogs are kept per synth, newest font first, which is the
+ * order in which FluidSynth searches fonts for a program.
+ *
+ */
+
+struct catalog_preset {
+        char* name;
+        int bank;
+        int program;
+        int next_by_name;
+        int next_by_program;
+};
+
+struct preset_catalog {
+        int sfont_id;
+        struct catalog_preset* presets;
+        int count;
+        int capacity;
+        unsigned int mask;              // hash buckets - 1
+        int* by_name;
+        int* by_program;
+        struct preset_catalog* next;
+};
+
+// the catalogs of one synth
+struct synth_catalogs {
+        fluid_synth_t* synth;
+        struct preset_catalog* fonts;
+        struct synth_catalogs* next;
+};
+
+static struct synth_catalogs* catalog_synths = NULL;
+
+static struct synth_catalogs*
+catalog_synth_find (fluid_synth_t* synth)
+{
+        for (struct synth_catalogs* sc = catalog_synths; sc != NULL; sc = sc->next) {
+                if (sc->synth == synth) { return sc; }
+        }
+        return NULL;
+}
+
+static unsigned int
+catalog_hash (const char* s)
+{
+        unsigned int h = 2166136261u;
+        while (*s) { h = (h ^ (unsigned char)*s++) * 16777619u; }
+        return h;
+}
+
+static unsigned int
+catalog_program_hash (int bank, int program)
+{
+        return ((unsigned int)bank * 128 + program) * 2654435761u;
+}
+
+static void
+catalog_free (struct preset_catalog* cat)
+{
+        for (int i = 0; i < cat->count; i++) { free(cat->presets[i].name); }
+        free(cat->presets);
+        free(cat->by_name);
+        free(cat->by_program);
+        free(cat);
+}
+
+static int
+catalog_add (struct preset_catalog* cat, const char* name, int bank, int program)
+{
+        if (cat->count == cat->capacity) {
+                int capacity = cat->capacity ? 2 * cat->capacity : 128;
+                struct catalog_preset* presets =
+                        realloc(cat->presets, capacity * sizeof(struct catalog_preset));
+                if (presets == NULL) { return FLUID_FAILED; }
+                cat->presets = presets;
+                cat->capacity = capacity;
+        }
+
+        struct catalog_preset* p = &cat->presets[cat->count];
+        p->name = farm_strdup(name != NULL ? name : "");
+        if (p->name == NULL) { return FLUID_FAILED; }
+        p->bank = bank;
+        p->program = program;
+        cat->count++;
+        return FLUID_OK;
+}
+
+// hash the listed presets; the first of several with one name wins
+static int
+catalog_index (struct preset_catalog* cat)
+{
+        unsigned int buckets = 16;
+        while (buckets < 2 * (unsigned int)cat->count) { buckets *= 2; }
+        cat->mask = buckets - 1;
+
+        cat->by_name = malloc(buckets * sizeof(int));
+        cat->by_program = malloc(buckets * sizeof(int));
+        if (cat->by_name == NULL || cat->by_program == NULL) { return FLUID_FAILED; }
+        memset(cat->by_name, 0xff, buckets * sizeof(int));
+        memset(cat->by_program, 0xff, buckets * sizeof(int));
+
+        for (int i = cat->count - 1; i >= 0; i--) {
+                struct catalog_preset* p = &cat->presets[i];
+                unsigned int h = catalog_hash(p->name) & cat->mask;
+                p->next_by_name = cat->by_name[h];
+                cat->by_name[h] = i;
+
+                h = catalog_program_hash(p->bank, p->program) & cat->mask;
+                p->next_by_program = cat->by_program[h];
+                cat->by_program[h] = i;
+        }
+
+        return FLUID_OK;
+}
+
+static struct catalog_preset*
+catalog_find_name (const struct preset_catalog* cat, const char* name)
+{
+        int i = cat->by_name[catalog_hash(name) & cat->mask];
+        while (i >= 0 && strcmp(cat->presets[i].name, name) != 0) {
+                i = cat->presets[i].next_by_name;
+        }
+        return i >= 0 ? &cat->presets[i] : NULL;
+}
+
+static struct catalog_preset*
+catalog_find_program (const struct preset_catalog* cat, int bank, int program)
+{
+        int i = cat->by_program[catalog_program_hash(bank, program) & cat->mask];
+        while (i >= 0 && (cat->presets[i].bank != bank || cat->presets[i].program != program)) {
+                i = cat->presets[i].next_by_program;
+        }
+        return i >= 0 ? &cat->presets[i] : NULL;
+}
+
+// drop the catalog of font `sfont_id` of `synth`, or all of them if -1
+static void
+catalog_drop (fluid_synth_t* synth, int sfont_id)
+{
+        struct synth_catalogs** s = &catalog_synths;
+        while (*s != NULL && (*s)->synth != synth) { s = &(*s)->next; }
+        if (*s == NULL) { return; }
+        struct synth_catalogs* sc = *s;
+
+        struct preset_catalog** p = &sc->fonts;
+        while (*p != NULL) {
+                struct preset_catalog* cat = *p;
+                if (sfont_id == -1 || cat->sfont_id == sfont_id) {
+                        *p = cat->next;
+                        catalog_free(cat);
+                } else {
+                        p = &cat->next;
+                }
+        }
+
+        if (sc->fonts == NULL) {
+                *s = sc->next;
+                free(sc);
+        }
+}
+
+// list the presets of font `sfont_id` of `synth`
+static void
+catalog_build (fluid_synth_t* synth, int sfont_id)
+{
+        fluid_sfont_t* sfont = fluid_synth_get_sfont_by_id(synth, sfont_id);
+        if (sfont == NULL) { return; }
+
+        struct preset_catalog* cat = calloc(1, sizeof(struct preset_catalog));
+        if (cat == NULL) { return; }
+        cat->sfont_id = sfont_id;
+
+        int status = FLUID_OK;
+#if FLUIDSYNTH_VERSION_MAJOR >= 2
+        fluid_sfont_iteration_start(sfont);
+        fluid_preset_t* preset;
+        while (status == FLUID_OK && (preset = fluid_sfont_iteration_next(sfont)) != NULL) {
+                status = catalog_add(cat, fluid_preset_get_name(preset),
+                                     fluid_preset_get_banknum(preset),
+                                     fluid_preset_get_num(preset));
+        }
+#else
+        fluid_preset_t preset;
+        sfont->iteration_start(sfont);
+        while (status == FLUID_OK && sfont->iteration_next(sfont, &preset)) {
+                status = catalog_add(cat, preset.get_name(&preset),
+                                     preset.get_banknum(&preset), preset.get_num(&preset));
+        }
+#endif
+        if (status != FLUID_OK || catalog_index(cat) != FLUID_OK) {
+                catalog_free(cat);
+                return;
+        }
+
+        catalog_drop(synth, sfont_id);
+        struct synth_catalogs* sc = catalog_synth_find(synth);
+        if (sc == NULL) {
+                sc = calloc(1, sizeof(struct synth_catalogs));
+                if (sc == NULL) { catalog_free(cat); return; }
+                sc->synth = synth;
+                sc->next = catalog_synths;
+                catalog_synths = sc;
+        }
+        cat->next = sc->fonts;
+        sc->fonts = cat;
+}
+
+/*
+ * Find preset `name` in the fonts of `synth`, or the preset at `bank`
+ * and `program` when `name` is NULL. With `sfont_id` -1 the newest font
+ * holding it is taken.
+ *
+ */
+
+static struct catalog_preset*
+catalog_lookup (fluid_synth_t* synth, int sfont_id, const char* name, int bank, int program,
+                int* found_id)
+{
+        struct synth_catalogs* sc = catalog_synth_find(synth);
+        for (struct preset_catalog* cat = sc ? sc->fonts : NULL; cat != NULL; cat = cat->next) {
+                if (sfont_id != -1 && cat->sfont_id != sfont_id) { continue; }
+
+                struct catalog_preset* p = name != NULL
+                        ? catalog_find_name(cat, name)
+                        : catalog_find_program(cat, bank, program);
+                if (p != NULL) {
+                        *found_id = cat->sfont_id;
+                        return p;
+                }
+        }
+        return NULL;
+}
+
+/*
+ * FLUIDSYNTH_API fluid_preset_t *
+ * fluid_synth_get_channel_preset (fluid_synth_t *synth,
+ *                                 int chan)
+ *
+ * Get active preset on a MIDI channel.
+ *
+ */
+
+/*
+ * fluid_synth_get_channel_preset (synth, chan)
+ *
+ * Get the preset selected on `chan` as its name, bank, program and
+ * font id, or nil if there is none. The name is only known for fonts
+ * loaded through the binding.
+ *
+ */
+
+static int
+c_fluid_synth_get_channel_preset (lua_State* L)
+{
+        fluid_synth_t* synth = *(fluid_synth_t**)lua_touserdata(L, 1);
+        int chan = (int)luaL_checkinteger(L, 2);
+
+        unsigned int sfont_id, bank, program;
+        if (fluid_synth_get_program(synth, chan, &sfont_id, &bank, &program) != FLUID_OK
+            || fluid_synth_get_sfont_by_id(synth, sfont_id) == NULL) {
+                lua_pushnil(L);
+                return 1;
+        }
+
+        int found_id;
+        struct catalog_preset* p = catalog_lookup(synth, sfont_id, NULL, bank, program, &found_id);
+        if (p != NULL) { lua_pushstring(L, p->name); } else { lua_pushnil(L); }
+        lua_pushinteger(L, bank);
+        lua_pushinteger(L, program);
+        lua_pushinteger(L, sfont_id);
+        return 4;
+}
+
+/*
+ * FLUIDSYNTH_API int
+ * fluid_synth_start (fluid_synth_t *synth,
+ *                    unsigned int id,
+ *                    fluid_preset_t *preset,
+ *                    int audio_chan,
+ *                    int midi_chan,
+ *                    int key,
+ *                    int vel)
+ *
+ * Create and start voices using a preset and a MIDI note on event.
+ *
+ */
+
+/*
+ * FLUIDSYNTH_API int
+ * fluid_synth_stop (fluid_synth_t *synth,
+ *                   unsigned int id)
+ *
+ * Stop notes for a given note event voice ID.
+ *
+ */
+
+/*
+ * FLUIDSYNTH_API int
+ * fluid_synth_sfload (fluid_synth_t *synth,
+ *                     const char *filename,
+ *                     int reset_presets)
+ *
+ * Load a SoundFont file (filename is interpreted by SoundFont loaders).
+ *
+ */
+
+static int
+c_fluid_synth_sfload (lua_State* L)
+{
+        fluid_synth_t* synth = *(fluid_synth_t**)lua_touserdata(L, 1);
+        const char* filename = (const char*)luaL_checkstring(L, 2);
+        int reset_presets = (int)luaL_checkinteger(L, 3);
+
+        int sfid = fluid_synth_sfload(synth, filename, reset_presets);
+        if (sfid == FLUID_FAILED) { lua_pushnil(L); return 1; }
+        catalog_build(synth, sfid);
+
+        lua_pushinteger(L, sfid);
+        
+        return 1;
+}
+
+/*
+ * fluid_synth_find_preset (synth, name, sfont_id)
+ *
+ * Find a preset by name in the fonts loaded through the binding, or
+ * only in font `sfont_id`. Returns its bank, program and font id, or
+ * nil if there is none.
+ *
+ */
+
+static int
+c_fluid_synth_find_preset (lua_State* L)
+{
+        fluid_synth_t* synth = *(fluid_synth_t**)lua_touserdata(L, 1);
+        const char* name = luaL_checkstring(L, 2);
+        int sfont_id = (int)luaL_optinteger(L, 3, -1);
+
+        int found_id;
+        struct catalog_preset* p = catalog_lookup(synth, sfont_id, name, 0, 0, &found_id);
+        if (p == NULL) { lua_pushnil(L); return 1; }
+
+        lua_pushinteger(L, p->bank);
+        lua_pushinteger(L, p->program);
+        lua_pushinteger(L, found_id);
+        return 3;
+}
+
+/*
+ * fluid_synth_get_preset_name (synth, bank, program, sfont_id)
+ *
+ * Get the name and font id of the preset at `bank` and `program`,
+ * searching the fonts like `fluid_synth_find_preset`.
+ *
+ */
+
+static int
+c_fluid_synth_get_preset_name (lua_State* L)
+{
+        fluid_synth_t* synth = *(fluid_synth_t**)lua_touserdata(L, 1);
+        int bank = (int)luaL_checkinteger(L, 2);
+        int program = (int)luaL_checkinteger(L, 3);
+        int sfont_id = (int)luaL_optinteger(L, 4, -1);
+
+        int found_id;
+        struct catalog_preset* p = catalog_lookup(synth, sfont_id, NULL, bank, program, &found_id);
+        if (p == NULL) { lua_pushnil(L); return 1; }
+
+        lua_pushstring(L, p->name);
+        lua_pushinteger(L, found_id);
+        return 2;
+}
+
+/*
+ * fluid_synth_program_select_by_name (synth, chan, name)
+ *
+ * Select the preset called `name` on `chan`.
+ *
+ */
+
+static int
+c_fluid_synth_program_select_by_name (lua_State* L)
+{
+        fluid_synth_t* synth = *(fluid_synth_t**)lua_touserdata(L, 1);
+        int chan = (int)luaL_checkinteger(L, 2);
+        const char* name = luaL_checkstring(L, 3);
+
+        int sfont_id;
+        struct catalog_preset* p = catalog_lookup(synth, -1, name, 0, 0, &sfont_id);
+        if (p == NULL
+            || fluid_synth_program_select(synth, chan, sfont_id, p->bank, p->program) != FLUID_OK) {
+                lua_pushnil(L);
+                return 1;
+        }
+
+        lua_pushinteger(L, FLUID_OK);
+        return 1;
+}
+
+/*
+ * fluid_synth_get_presets (synth)
+ *
+ * List the presets of all fonts loaded through the binding as an
+ * array of tables with `name`, `bank`, `program` and `sfont_id`,
+ * newest font first.
+ *
+ */
+
+static int
+c_fluid_synth_get_presets (lua_State* L)
+{
+        fluid_synth_t* synth = *(fluid_synth_t**)lua_touserdata(L, 1);
+
+        lua_newtable(L);
+        int n = 0;
+        struct synth_catalogs* sc = catalog_synth_find(synth);
+        for (struct preset_catalog* cat = sc ? sc->fonts : NULL; cat != NULL; cat = cat->next) {
+                for (int i = 0; i < cat->count; i++) {
+                        struct catalog_preset* p = &cat->presets[i];
+                        lua_createtable(L, 0, 4);
+                        lua_pushstring(L, p->name);
+                        lua_setfield(L, -2, "name");
+                        lua_pushinteger(L, p->bank);
+                        lua_setfield(L, -2, "bank");
+                        lua_pushinteger(L, p->program);
+                        lua_setfield(L, -2, "program");
+                        lua_pushinteger(L, cat->sfont_id);
+                        lua_setfield(L, -2, "sfont_id");
+                        lua_rawseti(L, -2, ++n);
+                }
+        }
+
+        return 1;
+}
+
+/*
+ * fluid_synth_sfload_shared (synth, filename, reset)
+ *
+ * Load a SoundFont through the shared cache and add it to `synth`.
+ * The first synth to ask for a file loads it, the others reuse the
+ * loaded font. Presets of all channels are reset if `reset` is true
+ * (the default), otherwise each channel keeps its preset.
+ *
+ * Returns the id of the font in `synth`, or nil on failure.
+ *
+ */
+
+static int
+c_fluid_synth_sfload_shared (lua_State* L)
+{
+        fluid_synth_t* synth = *(fluid_synth_t**)lua_touserdata(L, 1);
+        const char* filename = luaL_checkstring(L, 2);
+        int reset = lua_isnoneornil(L, 3) || lua_toboolean(L, 3);
+
+        struct sfont_entry* entry = sfont_cache_acquire(filename, NULL);
+        int id = entry != NULL ? sfont_cache_attach(synth, entry, reset) : FLUID_FAILED;
+        if (id == FLUID_FAILED) { lua_pushnil(L); return 1; }
+        catalog_build(synth, id);
+
+        lua_pushinteger(L, id);
+        return 1;
+}
+
+/*
+ * fluid_synth_sfunload_shared (synth, id)
+ *
+ * Remove a font loaded with `fluid_synth_sfload_shared` from `synth`.
+ * The font is freed when no other synth holds it, so no voice of
+ * `synth` should be playing from it any more.
+ *
+ */
+
+static int
+c_fluid_synth_sfunload_shared (lua_State* L)
+{
+        fluid_synth_t* synth = *(fluid_synth_t**)lua_touserdata(L, 1);
+        int id = (int)luaL_checkinteger(L, 2);
+
+        if (sfont_cache_detach(synth, id) == 0) { lua_pushnil(L); return 1; }
+        catalog_drop(synth, id);
+
+        lua_pushinteger(L, FLUID_OK);
+        return 1;
+}
+
+/*
+ * fluid_sfont_cache_info ()
+ *
+ * List the fonts in the shared cache, as an array of tables with the
+ * `path` of the file and the number of synths (`refs`) holding it.
+ *
+ */
+
+static int
+c_fluid_sfont_cache_info (lua_State* L)
+{
+        lua_newtable(L);
+
+        pthread_mutex_lock(&sfont_cache_lock);
+        int i = 1;
+        for (struct sfont_entry* e = sfont_entries; e != NULL; e = e->next) {
+                lua_createtable(L, 0, 2);
+                lua_pushstring(L, e->path);
+                lua_setfield(L, -2, "path");
+                lua_pushinteger(L, atomic_load(&e->refs));
+                lua_setfield(L, -2, "refs");
+                lua_rawseti(L, -2, i++);
+        }
+        pthread_mutex_unlock(&sfont_cache_lock);
+
+        return 1;
+}
+
+/*
+ * Asynchronous SoundFont loads. A detached thread takes the font from
+ * the shared cache, loading it if needed, and the Lua thread adds it
+ * to the synth when it polls the finished load. A handle collected
+ * while its thread still runs is marked abandoned, and the thread
+ * cleans up after itself.
+ *
+ */
+
+struct sfload_job {
+        fluid_synth_t* synth;           // NULL once the synth is deleted
+        char* path;
+        int reset;
+        _Atomic long long bytes;
+        long long total;
+
+        pthread_mutex_t lock;
+        pthread_cond_t done;
+        int finished;
+        int abandoned;
+        struct sfont_entry* entry;      // NULL if the load failed
+
+        int result;                     // 0 pending, 1 attached, -1 failed
+        int id;
+        struct sfload_job* next;        // pending on the Lua thread
+};
+
+static struct sfload_job* sfload_jobs = NULL;
+
+static void
+sfload_job_free (struct sfload_job* job)
+{
+        pthread_mutex_destroy(&job->lock);
+        pthread_cond_destroy(&job->done);
+        free(job->path);
+        free(job);
+}
+
+static void
+sfload_unlink (struct sfload_job* job)
+{
+        for (struct sfload_job** p = &sfload_jobs; *p != NULL; p = &(*p)->next) {
+                if (*p == job) { *p = job->next; return; }
+        }
+}
+
+// loads of `synth` that have not been attached yet will fail
+static void
+sfload_forget (fluid_synth_t* synth)
+{
+        for (struct sfload_job* job = sfload_jobs; job != NULL; job = job->next) {
+                if (job->synth == synth) { job->synth = NULL; }
+        }
+}
+
+static void*
+sfload_thread (void* data)
+{
+        struct sfload_job* job = data;
+
+        struct sfont_entry* entry = sfont_cache_acquire(job->path, &job->bytes);
+        if (entry != NULL) { atomic_store(&job->bytes, job->total); }
+
+        pthread_mutex_lock(&job->lock);
+        int abandoned = job->abandoned;
+        job->entry = entry;
+        job->finished = 1;
+        pthread_cond_signal(&job->done);
+        pthread_mutex_unlock(&job->lock);
+
+        if (abandoned) {
+                if (entry != NULL) { sfont_cache_release(entry); }
+                sfload_job_free(job);
+        }
+        return NULL;
+}
+
+// start loading `filename` for `synth` on a detached thread
+static struct sfload_job*
+sfload_begin (fluid_synth_t* synth, const char* filename, int reset)
+{
+        struct stat sb;
+        if (stat(filename, &sb) != 0) { return NULL; }
+
+        struct sfload_job* job = calloc(1, sizeof(struct sfload_job));
+        if (job == NULL) { return NULL; }
+        job->path = farm_strdup(filename);
+        if (job->path == NULL) { free(job); return NULL; }
+        job->synth = synth;
+        job->reset = reset;
+        job->total = sb.st_size;
+        pthread_mutex_init(&job->lock, NULL);
+        pthread_cond_init(&job->done, NULL);
+
+        pthread_attr_t attr;
+        pthread_attr_init(&attr);
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+        pthread_t thread;
+        int err = pthread_create(&thread, &attr, sfload_thread, job);
+        pthread_attr_destroy(&attr);
+        if (err != 0) { sfload_job_free(job); return NULL; }
+
+        job->next = sfload_jobs;
+        sfload_jobs = job;
+        return job;
+}
+
+// give up a job; the thread frees it if it is still running
+static void
+sfload_abandon (struct sfload_job* job)
+{
+        sfload_unlink(job);
+
+        pthread_mutex_lock(&job->lock);
+        int finished = job->finished;
+        job->abandoned = 1;
+        pthread_mutex_unlock(&job->lock);
+        if (!finished) { return; }
+
+        // finished but never attached
+        if (job->result == 0 && job->entry != NULL) { sfont_cache_release(job->entry); }
+        sfload_job_free(job);
+}
+
+// wait up to `timeout` milliseconds (negative waits forever) for the
+// thread, then add a loaded font to the synth; returns `job->result`
+static int
+sfload_finish (struct sfload_job* job, lua_Integer timeout)
+{
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        if (timeout > 0) {
+                deadline.tv_sec += timeout / 1000;
+                deadline.tv_nsec += (timeout % 1000) * 1000000;
+                if (deadline.tv_nsec >= 1000000000) {
+                        deadline.tv_sec++;
+                        deadline.tv_nsec -= 1000000000;
+                }
+        }
+
+        pthread_mutex_lock(&job->lock);
+        while (!job->finished && timeout != 0) {
+                if (timeout < 0) {
+                        pthread_cond_wait(&job->done, &job->lock);
+                } else if (pthread_cond_timedwait(&job->done, &job->lock, &deadline) != 0) {
+                        break;
+                }
+        }
+        int finished = job->finished;
+        pthread_mutex_unlock(&job->lock);
+
+        if (finished && job->result == 0) {
+                sfload_unlink(job);
+                if (job->entry == NULL) {
+                        job->result = -1;
+                } else if (job->synth == NULL) {
+                        sfont_cache_release(job->entry);
+                        job->result = -1;
+                } else {
+                        job->id = sfont_cache_attach(job->synth, job->entry, job->reset);
+                        job->result = job->id == FLUID_FAILED ? -1 : 1;
+                        if (job->result == 1) { catalog_build(job->synth, job->id); }
+                }
+                job->entry = NULL;
+        }
+
+        return job->result;
+}
+
+/*
+ * fluid_synth_sfload_async (synth, filename, reset)
+ *
+ * Start loading a SoundFont through the shared cache on a background
+ * thread. The font is added to `synth` by the `fluid_sfload_poll` call
+ * that finds the load finished, resetting the presets of all channels
+ * if `reset` is true (the default).
+ *
+ * Returns a handle for `fluid_sfload_poll`, or nil on failure.
+ *
+ */
+
+static int
+c_fluid_synth_sfload_async (lua_State* L)
+{
+        fluid_synth_t* synth = *(fluid_synth_t**)lua_touserdata(L, 1);
+        const char* filename = luaL_checkstring(L, 2);
+        int reset = lua_isnoneornil(L, 3) || lua_toboolean(L, 3);
+
+        struct sfload_job** handle = lua_newuserdata(L, sizeof(struct sfload_job*));
+        *handle = NULL;
+        luaL_setmetatable(L, "fluid.sfload");
+
+        *handle = sfload_begin(synth, filename, reset);
+        if (*handle == NULL) { lua_pushnil(L); return 1; }
+
+        return 1;
+}
+
+static struct sfload_job*
+check_sfload (lua_State* L, int index)
+{
+        struct sfload_job** handle = luaL_checkudata(L, index, "fluid.sfload");
+        if (*handle == NULL) { luaL_argerror(L, index, "invalid load handle"); }
+        return *handle;
+}
+
+static int
+gc_fluid_sfload (lua_State* L)
+{
+        struct sfload_job** handle = luaL_checkudata(L, 1, "fluid.sfload");
+        if (*handle != NULL) {
+                sfload_abandon(*handle);
+                *handle = NULL;
+        }
+        return 0;
+}
+
+/*
+ * fluid_sfload_poll (handle, timeout)
+ *
+ * Check on a load started with `fluid_synth_sfload_async`, waiting up
+ * to `timeout` milliseconds for it to finish (default 0, negative
+ * waits until it does).
+ *
+ * Returns the id of the font in the synth once it is added, false
+ * while it is loading or nil if it failed, followed by the number of
+ * bytes read so far and the size of the file.
+ *
+ */
+
+static int
+c_fluid_sfload_poll (lua_State* L)
+{
+        struct sfload_job* job = check_sfload(L, 1);
+        lua_Integer timeout = luaL_optinteger(L, 2, 0);
+
+        int result = sfload_finish(job, timeout);
+        if (result == 1) {
+                lua_pushinteger(L, job->id);
+        } else if (result == -1) {
+                lua_pushnil(L);
+        } else {
+                lua_pushboolean(L, 0);
+        }
+        lua_pushinteger(L, atomic_load(&job->bytes));
+        lua_pushinteger(L, job->total);
+        return 3;
+}
+
+/*
+ * SoundFont hot swaps. The new font is loaded by an asynchronous load
+ * and added without touching the channels. At the chosen tick (or as
+ * soon as it is added) every channel playing a preset of the old font
+ * is retargeted to the same bank and program of the new one, while
+ * voices already playing keep their samples from the old font. The old
+ * font is removed once all of those voices have ended.
+ *
+ * The retarget runs on the sequencer's thread. The callback only
+ * touches a swap that is still listed in `sfswaps`, checked with
+ * `sfswap_lock` held, and a swap is unlisted under the same lock
+ * before it is freed.
+ *
+ */
+
+enum sfswap_state {
+        SFSWAP_LOADING,
+        SFSWAP_ARMED,
+        SFSWAP_DRAINING,
+        SFSWAP_DONE,
+        SFSWAP_FAILED
+};
+
+static const char* const sfswap_states[] = {
+        "loading", "armed", "draining", "done", "failed"
+};
+
+struct sfswap {
+        fluid_synth_t* synth;           // NULL once the synth is deleted
+        int old_id;
+        fluid_sfont_t* old_sfont;
+        int new_id;
+        struct sfload_job* job;         // while loading
+        _Atomic int state;
+
+        fluid_sequencer_t* seq;         // NULL to retarget once added, or
+                                        // once the sequencer is deleted
+        unsigned int tick;
+        short client;
+        fluid_event_t* timer;
+
+        // voices playing when the channels were retargeted
+        unsigned int* voices;
+        int count;
+        int retargeted;                 // channels moved to the new font
+
+        struct sfswap* next;
+};
+
+static pthread_mutex_t sfswap_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct sfswap* sfswaps = NULL;
+
+// move the channels playing from the old font to the new one and
+// remember which voices may still be using the old samples
+static void
+sfswap_retarget (struct sfswap* w)
+{
+        fluid_synth_t* synth = w->synth;
+
+        int polyphony = fluid_synth_get_polyphony(synth);
+        fluid_voice_t** list = calloc(polyphony + 1, sizeof(fluid_voice_t*));
+        w->voices = calloc(polyphony + 1, sizeof(unsigned int));
+        if (list != NULL && w->voices != NULL) {
+                fluid_synth_get_voicelist(synth, list, polyphony + 1, -1);
+                while (w->count < polyphony && list[w->count] != NULL) {
+                        w->voices[w->count] = fluid_voice_get_id(list[w->count]);
+                        w->count++;
+                }
+        }
+        free(list);
+
+        int channels = fluid_synth_count_midi_channels(synth);
+        for (int chan = 0; chan < channels; chan++) {
+                unsigned int sfont_id, bank, program;
+                if (fluid_synth_get_program(synth, chan, &sfont_id, &bank, &program) != FLUID_OK) { continue; }
+                if ((int)sfont_id != w->old_id
+                    || fluid_synth_get_sfont_by_id(synth, sfont_id) != w->old_sfont) {
+                        continue;
+                }
+
+                // fall back to the General MIDI bank when the new font
+                // has no such variation
+                unsigned int fallback = bank == 128 ? 128 : 0;
+                if (fluid_synth_program_select(synth, chan, w->new_id, bank, program) == FLUID_OK ||
+                    fluid_synth_program_select(synth, chan, w->new_id, fallback, program) == FLUID_OK) {
+                        w->retargeted++;
+                } else {
+                        fluid_synth_unset_program(synth, chan);
+                }
+        }
+
+        atomic_store(&w->state, SFSWAP_DRAINING);
+}
+
+static void
+sfswap_callback (unsigned int time,
+                 fluid_event_t *event,
+                 fluid_sequencer_t *seq,
+                 void *data)
+{
+        struct sfswap* w = (struct sfswap*)data;
+
+        if (fluid_event_get_type(event) != FLUID_SEQ_TIMER) { return; }
+
+        // `w` may be freed already, compare it before reading it
+        pthread_mutex_lock(&sfswap_lock);
+        struct sfswap* live = sfswaps;
+        while (live != NULL && live != w) { live = live->next; }
+        if (live != NULL && atomic_load(&w->state) == SFSWAP_ARMED && w->synth != NULL) {
+                sfswap_retarget(w);
+        }
+        pthread_mutex_unlock(&sfswap_lock);
+}
+
+// unregistering calls the callback, so `sfswap_lock` must not be held
+static void
+sfswap_disarm (struct sfswap* w)
+{
+        if (w->timer == NULL) { return; }
+
+        if (w->seq != NULL) {
+                fluid_sequencer_remove_events(w->seq, w->client, -1, -1);
+                fluid_sequencer_unregister_client(w->seq, w->client);
+        }
+        delete_fluid_event(w->timer);
+        w->timer = NULL;
+}
+
+// schedule the retarget at the swap's tick
+static int
+sfswap_arm (struct sfswap* w)
+{
+        w->timer = new_fluid_event();
+        if (w->timer == NULL) { return FLUID_FAILED; }
+
+        short id = fluid_sequencer_register_client(w->seq, "sfswap",
+                                                   sfswap_callback, (void*)w);
+        if ((int)id == FLUID_FAILED) {
+                delete_fluid_event(w->timer);
+                w->timer = NULL;
+                return FLUID_FAILED;
+        }
+        w->client = id;
+
+        fluid_event_set_source(w->timer, id);
+        fluid_event_set_dest(w->timer, id);
+        fluid_event_timer(w->timer, NULL);
+
+        atomic_store(&w->state, SFSWAP_ARMED);
+        // straight to the sequencer, where disarming can remove it
+        if (fluid_sequencer_send_at(w->seq, w->timer, w->tick, 1) != FLUID_OK) {
+                sfswap_disarm(w);
+                return FLUID_FAILED;
+        }
+        return FLUID_OK;
+}
+
+// true once none of the remembered voices is playing
+static int
+sfswap_drained (struct sfswap* w)
+{
+        int polyphony = fluid_synth_get_polyphony(w->synth);
+        fluid_voice_t** list = calloc(polyphony + 1, sizeof(fluid_voice_t*));
+        if (list == NULL) { return 0; }
+        fluid_synth_get_voicelist(w->synth, list, polyphony + 1, -1);
+
+        int playing = 0;
+        for (int n = 0; n < polyphony && list[n] != NULL; n++) {
+                unsigned int id = fluid_voice_get_id(list[n]);
+                for (int i = 0; i < w->count; i++) {
+                        if (w->voices[i] == id) { playing++; break; }
+                }
+        }
+        free(list);
+
+        return playing == 0;
+}
+
+// remove the old font, whether it was shared or loaded by the synth
+static int
+sfswap_release (struct sfswap* w)
+{
+        if (sfont_cache_detach(w->synth, w->old_id) == 0 &&
+            fluid_synth_sfunload(w->synth, w->old_id, 0) != FLUID_OK) {
+                return FLUID_FAILED;
+        }
+        catalog_drop(w->synth, w->old_id);
+        return FLUID_OK;
+}
+
+// advance the swap as far as it can go without blocking the audio
+static void
+sfswap_step (struct sfswap* w, lua_Integer timeout)
+{
+        if (w->synth == NULL && atomic_load(&w->state) < SFSWAP_DONE) {
+                atomic_store(&w->state, SFSWAP_FAILED);
+        }
+
+        // the tick will never come without the sequencer
+        if (atomic_load(&w->state) == SFSWAP_ARMED && w->seq == NULL) {
+                sfswap_retarget(w);
+        }
+
+        if (atomic_load(&w->state) == SFSWAP_LOADING) {
+                int result = sfload_finish(w->job, timeout);
+                if (result == 0) { return; }
+
+                w->new_id = w->job->id;
+                sfload_abandon(w->job);
+                w->job = NULL;
+
+                if (result == -1) {
+                        atomic_store(&w->state, SFSWAP_FAILED);
+                } else if (w->seq == NULL) {
+                        sfswap_retarget(w);
+                } else if (sfswap_arm(w) != FLUID_OK) {
+                        atomic_store(&w->state, SFSWAP_FAILED);
+                }
+        }
+
+        if (atomic_load(&w->state) == SFSWAP_DRAINING) {
+                sfswap_disarm(w);
+                if (!sfswap_drained(w)) { return; }
+                atomic_store(&w->state, sfswap_release(w) == FLUID_OK ? SFSWAP_DONE : SFSWAP_FAILED);
+        }
+}
+
+static void
+sfswap_unlink (struct sfswap* w)
+{
+        pthread_mutex_lock(&sfswap_lock);
+        for (struct sfswap** p = &sfswaps; *p != NULL; p = &(*p)->next) {
+                if (*p == w) { *p = w->next; break; }
+        }
+        pthread_mutex_unlock(&sfswap_lock);
+}
+
+// swaps of `synth` stop where they are
+static void
+sfswap_forget (fluid_synth_t* synth)
+{
+        pthread_mutex_lock(&sfswap_lock);
+        for (struct sfswap* w = sfswaps; w != NULL; w = w->next) {
+                if (w->synth == synth) { w->synth = NULL; }
+        }
+        pthread_mutex_unlock(&sfswap_lock);
+
+        // only the Lua thread adds and removes swaps
+        for (struct sfswap* w = sfswaps; w != NULL; w = w->next) {
+                if (w->synth == NULL) { sfswap_disarm(w); }
+        }
+}
+
+// the sequencer is deleted, and the swaps' clients with it; armed
+// swaps retarget on their next poll
+static void
+sfswap_seq_forget (fluid_sequencer_t* seq)
+{
+        for (struct sfswap* w = sfswaps; w != NULL; w = w->next) {
+                if (w->seq != seq) { continue; }
+                w->seq = NULL;
+                if (w->timer != NULL) {
+                        delete_fluid_event(w->timer);
+                        w->timer = NULL;
+                }
+        }
+}
+
+static int
+gc_fluid_sfswap (lua_State* L)
+{
+        struct sfswap** handle = luaL_checkudata(L, 1, "fluid.sfswap");
+        struct sfswap* w = *handle;
+        if (w == NULL) { return 0; }
+
+        // a swap dropped early leaves both fonts in the synth; once it
+        // is unlisted the callback leaves it alone
+        sfswap_unlink(w);
+        sfswap_disarm(w);
+        if (w->job != NULL) { sfload_abandon(w->job); }
+        free(w->voices);
+        free(w);
+
+        *handle = NULL;
+        return 0;
+}
+
+/*
+ * fluid_synth_sfswap (synth, old_id, filename, seq, tick)
+ *
+ * Replace the font `old_id` of `synth` with the SoundFont `filename`
+ * without cutting off notes. The new font is loaded on a background
+ * thread; once `fluid_sfswap_poll` has added it, channels playing the
+ * old font switch to the same bank and program of the new one at
+ * `tick` of `seq` (or right away without a sequencer). Voices already
+ * sounding finish on the old font, which is removed when the last of
+ * them ends.
+ *
+ * Returns a handle for `fluid_sfswap_poll`, or nil on failure.
+ *
+ */
+
+static int
+c_fluid_synth_sfswap (lua_State* L)
+{
+        fluid_synth_t* synth = *(fluid_synth_t**)lua_touserdata(L, 1);
+        int old_id = (int)luaL_checkinteger(L, 2);
+        const char* filename = luaL_checkstring(L, 3);
+        fluid_sequencer_t* sequencer = NULL;
+        unsigned int tick = 0;
+        if (!lua_isnoneornil(L, 4)) {
+                sequencer = *(fluid_sequencer_t**)lua_touserdata(L, 4);
+                tick = (unsigned int)luaL_optinteger(L, 5, fluid_sequencer_get_tick(sequencer));
+        }
+
+        if (fluid_synth_get_sfont_by_id(synth, old_id) == NULL) { lua_pushnil(L); return 1; }
+
+        struct sfswap** handle = lua_newuserdata(L, sizeof(struct sfswap*));
+        *handle = NULL;
+        luaL_setmetatable(L, "fluid.sfswap");
+
+        struct sfswap* w = calloc(1, sizeof(struct sfswap));
+        if (w == NULL) { lua_pushnil(L); return 1; }
+        w->synth = synth;
+        w->old_id = old_id;
+        w->old_sfont = fluid_synth_get_sfont_by_id(synth, old_id);
+        w->new_id = -1;
+        w->seq = sequencer;
+        w->tick = tick;
+        atomic_init(&w->state, SFSWAP_LOADING);
+
+        // keep the channels on the old font until the retarget
+        w->job = sfload_begin(synth, filename, 0);
+        if (w->job == NULL) { free(w); lua_pushnil(L); return 1; }
+
+        pthread_mutex_lock(&sfswap_lock);
+        w->next = sfswaps;
+        sfswaps = w;
+        pthread_mutex_unlock(&sfswap_lock);
+        *handle = w;
+        return 1;
+}
+
+/*
+ * fluid_sfswap_poll (handle, timeout)
+ *
+ * Advance a swap started with `fluid_synth_sfswap`, waiting up to
+ * `timeout` milliseconds for the new font to load (default 0). Call it
+ * regularly until the swap is done: it adds the new font, arms the
+ * retarget and removes the old font once its voices have ended.
+ *
+ * Returns the state ("loading", "armed", "draining", "done" or
+ * "failed"), the id of the new font (nil until it is added) and the
+ * number of channels retargeted.
+ *
+ */
+
+static int
+c_fluid_sfswap_poll (lua_State* L)
+{
+        struct sfswap** handle = luaL_checkudata(L, 1, "fluid.sfswap");
+        struct sfswap* w = *handle;
+        if (w == NULL) { return luaL_argerror(L, 1, "invalid swap handle"); }
+        lua_Integer timeout = luaL_optinteger(L, 2, 0);
+
+        sfswap_step(w, timeout);
+
+        int state = atomic_load(&w->state);
+        lua_pushstring(L, sfswap_states[state]);
+        if (w->new_id >= 0) { lua_pushinteger(L, w->new_id); } else { lua_pushnil(L); }
+        lua_pushinteger(L, state >= SFSWAP_DRAINING ? w->retargeted : 0);
+        return 3;
+}
+
+/*
+ * FLUIDSYNTH_API int
+ * fluid_synth_sfreload (fluid_synth_t *synth,
+ *                       unsigned int id)
+ *
+ * Reload a SoundFont.
+ *
+ */
+
+/*
+ * FLUIDSYNTH_API int
+ * fluid_synth_sfunload (fluid_synth_t *synth,
+ *                       unsigned int id,
+ *                       int reset_presets)
+ *
+ * Unload a SoundFont.
+ *
+ */
+
+/*
+ * FLUIDSYNTH_API int
+ * fluid_synth_add_sfont (fluid_synth_t *synth,
+ *                        fluid_sfont_t *sfont)
+ *
+ * Add a SoundFont.
+ *
+ */
+
+/*
+ * FLUIDSYNTH_API void
+ * fluid_synth_remove_sfont (fluid_synth_t *synth,
+ *                           fluid_sfont_t *sfont)
+ *
+ * Remove a SoundFont from the SoundFont stack without deleting it.
+ *
+ */
+
+/*
+ * FLUIDSYNTH_API int
+ * fluid_synth_sfcount (fluid_synth_t *synth)
+ *
+ * Count number of loaded SoundFont files.
+ *
+ */
+
+/*
+ * FLUIDSYNTH_API fluid_sfont_t *
+ * fluid_synth_get_sfont (fluid_synth_t *synth,
+ *                        unsigned int num)
+ *
+ * Get SoundFont by index.
+ *
+ */
+
+/*
+ * FLUIDSYNTH_API fluid_sfont_t *
+ * fluid_synth_get_sfont_by_id (fluid_synth_t *synth,
+ *                              unsigned int id)
+ *
+ * Get SoundFont by ID.
+ *
+ */
+
+/*
+ * FLUIDSYNTH_API fluid_sfont_t *
+ * fluid_synth_get_sfont_by_name (fluid_synth_t *synth,
+ *                                const char *name)
+ *
+ * Get SoundFont by name.
+ *
+ */
+
+/*
+ * FLUIDSYNTH_API int
+ * fluid_synth_set_bank_offset (fluid_synth_t *synth,
+ *                              int sfont_id,
+ *                              int offset)
+ *
+ * Offset the bank numbers of a loaded SoundFont.
+ *
+ */
+
+/*
+ * FLUIDSYNTH_API int
+ * fluid_synth_get_bank_offset (fluid_synth_t *synth,
+ *                              int sfont_id)
+ *
+ * Get bank offset of a loaded SoundFont.
+ *
+ */
+
+/*
+ * FLUIDSYNTH_API void
+ * fluid_synth_set_reverb (fluid_synth_t *synth,
+ *                         double roomsize,
+ *                         double damping,
+ *                         double width,
+ *                         double level)
+ *
+ * Set reverb parameters.
+ *
+ */
+
+/*
+ * FLUIDSYNTH_API void
+ * fluid_synth_set_reverb_on (fluid_synth_t *synth,
+ *                            int on)
+ *
+ * Enable or disable reverb effect.
+ *
+ */
+
+/*
+ * FLUIDSYNTH_API double
+ * fluid_synth_get_reverb_roomsize (fluid_synth_t *synth)
+ *
+ * Get reverb room size.
+ *
+ */
+
+/*
+ * FLUIDSYNTH_API double
+ * fluid_synth_get_reverb_damp (fluid_synth_t *synth)
+ *
+ * Get reverb damping.
+ *
+ */
+
+/*
+ * FLUIDSYNTH_API double
+ * fluid_synth_get_reverb_level (fluid_synth_t *synth)
+ *
+ * Get reverb level.
+ *
+ */
+
+/*
+ * FLUIDSYNTH_API double
+ * fluid_synth_get_reverb_width (fluid_synth_t *synth)
+ *
+ * Get reverb width.
+ *
+ */
+
+/*
+ * FLUIDSYNTH_API void
+ * fluid_synth_set_chorus (fluid_synth_t *synth,
+ *                         int nr,
+ *                         double level,
+ *                         double speed,
+ *                         double depth_ms,
+ *                         int type)
+ *
+ * Set chorus parameters.
+ *
+ */
+
+/*
+ * FLUIDSYNTH_API void
+ * fluid_synth_set_chorus_on (fluid_synth_t *synth,
+ *                            int on)
+ *
+ * Enable or disable chorus effect.
+ *
+ */
+
+/*
+ * FLUIDSYNTH_API int
+ * fluid_synth_get_chorus_nr (fluid_synth_t *synth)
+ *
+ * Get chorus voice number (delay line count) value.
+ *
+ */
+
+/*
+ * FLUIDSYNTH_API double
+ * fluid_synth_get_chorus_level (fluid_synth_t *synth)
+ *
+ * Get chorus level.
+ *
+ */
+
+/*
+ * FLUIDSYNTH_API double
+ * fluid_synth_get_chorus_speed_Hz (fluid_synth_t *synth)
+ *
+ * Get chorus speed in Hz.
+ *
+ */
+
+/*
+ * FLUIDSYNTH_API double
+ * fluid_synth_get_chorus_depth_ms (fluid_synth_t *synth)
+ *
+ * Get chorus depth.
+ *
+ */
+
+/*
+ * FLUIDSYNTH_API int
+ * fluid_synth_get_chorus_type (fluid_synth_t *synth)
+ *
+ * Get chorus waveform type.
+ *
+ */
+
+/*
+ * FLUIDSYNTH_API int
+ * fluid_synth_count_midi_channels (fluid_synth_t *synth)
+ *
+ * Get the total count of MIDI channels.
+ *
+ */
+
+/*
+ * FLUIDSYNTH_API int
+ * fluid_synth_count_audio_channels (fluid_synth_t *synth)
+ *
+ * Get the total count of audio channels.
+ *
+ */
+
+/*
+ * FLUIDSYNTH_API int
+ * fluid_synth_count_audio_groups (fluid_synth_t *synth)
+ *
+ * Get the total number of allocated audio channels.
+ *
+ */
+
+/*
+ * FLUIDSYNTH_API int
+ * fluid_synth_count_effects_channels (fluid_synth_t *synth)
+ *
+ * Get the total number of allocated effects channels.
+ *
+ */
+
+/*
+ * FLUIDSYNTH_API void
+ * fluid_synth_set_sample_rate (fluid_synth_t *synth,
+ *                              float sample_rate)
+ *
+ * Set sample rate of the synth.
+ *
+ */
+
+/*
+ * FLUIDSYNTH_API void
+ * fluid_synth_set_gain (fluid_synth_t *synth,
+ *                       float gain)
+ *
+ * Set synth output gain value.
+ *
+ */
+
+/*
+ * FLUIDSYNTH_API float
+ * fluid_synth_get_gain (fluid_synth_t *synth)
+ *
+ * Get synth output gain value.
+ *
+ */
+
+/*
+ * FLUIDSYNTH_API int
+ * fluid_synth_set_polyphony (fluid_synth_t *synth,
+ *                            int polyphony)
+ *
+ * Set synthesizer polyphony (max number of voices).
+ *
+ */
+
+static int
+c_fluid_synth_set_polyphony (lua_State* L)
+{
+        fluid_synth_t* synth = *(fluid_synth_t**)lua_touserdata(L, 1);
+        int polyphony = (int)luaL_checkinteger(L, 2);
+
+        int status = fluid_synth_set_polyphony(synth, polyphony);
+        if (status == FLUID_FAILED) { lua_pushnil(L); return 1; }
+
+        lua_pushinteger(L, status);
+        return 1;
+}
+
+/*
+ * FLUIDSYNTH_API int
+ * fluid_synth_get_polyphony (fluid_synth_t *synth)
+ *
+ * Get current synthesizer polyphony (max number of voices).
+ *
+ */
+
+static int
+c_fluid_synth_get_polyphony (lua_State* L)
+{
+        fluid_synth_t* synth = *(fluid_synth_t**)lua_touserdata(L, 1);
+
+        lua_pushinteger(L, fluid_synth_get_polyphony(synth));
+        return 1;
+}
+
+/*
+ * FLUIDSYNTH_API int
+ * fluid_synth_get_active_voice_count (fluid_synth_t *synth)
+ *
+ * Get current number of active voices.
+ *
+ */
+
+static int
+c_fluid_synth_get_active_voice_count (lua_State* L)
+{
+        fluid_synth_t* synth = *(fluid_synth_t**)lua_touserdata(L, 1);
+
+        lua_pushinteger(L, fluid_synth_get_active_voice_count(synth));
+        return 1;
+}
+
+/*
+ * FLUIDSYNTH_API int
+ * fluid_synth_get_internal_bufsize (fluid_synth_t *synth)
+ *
+ * Get the internal synthesis buffer size value.
+ *
+ */
+
+/*
+ * FLUIDSYNTH_API int
+ * fluid_synth_set_interp_method (fluid_synth_t *synth,
+ *                                int chan,
+ *                                int interp_method)
+ *
+ * Set synthesis interpolation method on one or all MIDI channels.
+ *
+ */
+
+/*
+ * FLUIDSYNTH_API int
+ * fluid_synth_set_gen (fluid_synth_t *synth,
+ *                      int chan,
+ *                      int param,
+ *                      float value)
+ *
+ * Set a SoundFont generator (effect) value on a MIDI channel in
+ * real-time.
+ *
+ */
+
+/*
+ * FLUIDSYNTH_API int
+ * fluid_synth_set_gen2 (fluid_synth_t *synth,
+ *                       int chan,
+ *                       int param,
+ *                       float value,
+ *                       int absolute,
+ *                       int normalized)
+ *
+ * Set a SoundFont generator (effect) value on a MIDI channel in
+ * real-time.
+ *
+ */
+
+/*
+ * FLUIDSYNTH_API float
+ * fluid_synth_get_gen (fluid_synth_t *synth,
+ *                      int chan,
+ *                      int param)
+ *
+ * Get generator value assigned to a MIDI channel.
+ *
+ */
+
+/*
+ * FLUIDSYNTH_API int
+ * fluid_synth_create_key_tuning (fluid_synth_t *synth,
+ *                                int bank,
+ *                                int prog,
+ *                                const char *name,
+ *                                const double *pitch)
+ *
+ * Set the tuning of the entire MIDI note scale.
+ *
+ */
+
+/*
+ * FLUIDSYNTH_API int
+ * fluid_synth_activate_key_tuning (fluid_synth_t *synth,
+ *                                  int bank,
+ *                                  int prog,
+ *                                  const char *name,
+ *                                  const double *pitch,
+ *                                  int apply)
+ *
+ * Set the tuning of the entire MIDI note scale.
+ *
+ */
+
+/*
+ * FLUIDSYNTH_API int
+ * fluid_synth_create_octave_tuning (fluid_synth_t *synth,
+ *                                   int bank,
+ *                                   int prog,
+ *                                   const char *name,
+ *                                   const double *pitch)
+ *
+ * Apply an octave tuning to every octave in the MIDI note scale.
+ *
+ */
+
+
+/*
+ * FLUIDSYNTH_API int
+ * fluid_synth_activate_octave_tuning (fluid_synth_t *synth,
+ *                                     int bank,
+ *                                     int prog,
+ *                                     const char *name,
+ *                                     const double *pitch,
+ *                                     int apply)
+ *
+ * Activate an octave tuning on every octave in the MIDI note scale.
+ *
+ */
+
+/*
+ * FLUIDSYNTH_API int
+ * fluid_synth_tune_notes (fluid_synth_t *synth,
+ *                         int bank,
+ *                         int prog,
+ *                         int len,
+ *                         const int *keys,
+ *                         const double *pitch,
+ *                         int apply)
+ *
+ * Set tuning values for one or more MIDI notes for an existing
+ * tuning.
+ *
+ */
+
+/*
+ * FLUIDSYNTH_API int
+ * fluid_synth_select_tuning (fluid_synth_t *synth,
+ *                            int chan,
+ *                            int bank,
+ *                            int prog)
+ *
+ * Select a tuning scale on a MIDI channel.
+ *
+ */
+
+/*
+ * FLUIDSYNTH_API int
+ * fluid_synth_activate_tuning (fluid_synth_t *synth,
+ *                              int chan,
+ *                              int bank,
+ *                              int prog,
+ *                              int apply)
+ *
+ * Activate a tuning scale on a MIDI channel.
+ *
+ */
+
+/*
+ * FLUIDSYNTH_API int
+ * fluid_synth_reset_tuning (fluid_synth_t *synth,
+ *                           int chan)
+ *
+ * Clear tuning scale on a MIDI channel (set it to the default
+ * well-tempered scale).
+ *
+ */
+
+/*
+ * FLUIDSYNTH_API int
+ * fluid_synth_deactivate_tuning (fluid_synth_t *synth,
+ *                                int chan,
+ *                                int apply)
+ *
+ * Clear tuning scale on a MIDI channel (use default equal tempered
+ * scale).
+ *
+ */
+
+/*
+ * FLUIDSYNTH_API void
+ * fluid_synth_tuning_iteration_start (fluid_synth_t *synth)
+ *
+ * Start tuning iteration.
+ *
+ */
+
+/*
+ * FLUIDSYNTH_API int
+ * fluid_synth_tuning_iteration_next (fluid_synth_t *synth,
+ *                                    int *bank,
+ *                                    int *prog)
+ *
+ * Advance to next tuning.
+ *
+ */
+
+/*
+ * FLUIDSYNTH_API int
+ * fluid_synth_tuning_dump (fluid_synth_t *synth,
+ *                          int bank,
+ *                          int prog,
+ *                          char *name,
+ *                          int len,
+ *                          double *pitch)
+ *
+ * Get the entire note tuning for a given MIDI bank and program.
+ *
+ */
+
+/*
+ * FLUIDSYNTH_API double
+ * fluid_synth_get_cpu_load (fluid_synth_t *synth)
+ *
+ * Get the synth CPU load value.
+ *
+ */
+
+static int
+c_fluid_synth_get_cpu_load (lua_State* L)
+{
+        fluid_synth_t* synth = *(fluid_synth_t**)lua_touserdata(L, 1);
+
+        lua_pushnumber(L, fluid_synth_get_cpu_load(synth));
+        return 1;
+}
+
+/*
+ * fluid_synth_get_stats (synth, reset)
+ *
+ * Sample the voices of a synth and get its statistics as a table:
+ *
+ *   cpu_load        CPU load in percent, as reported by the synth
+ *   cpu_peak        highest CPU load sampled
+ *   polyphony       maximum number of voices
+ *   voices          voices playing now
+ *   peak_voices     most voices sampled playing at once
+ *   voices_started  voices seen starting
+ *   voices_stolen   estimated voices stolen to start new ones
+ *   samples         number of samples taken
+ *   channels        voices playing per MIDI channel, channel 0
+ *                   at index 1
+ *
+ * With `reset` the peaks and counters start over after the read.
+ *
+ */
+
+static int
+c_fluid_synth_get_stats (lua_State* L)
+{
+        fluid_synth_t* synth = *(fluid_synth_t**)lua_touserdata(L, 1);
+        int reset = lua_toboolean(L, 2);
+
+        struct synth_stats* st = synth_stats_get(synth);
+        if (st == NULL) { lua_pushnil(L); return 1; }
+        synth_stats_sample(st);
+
+        lua_createtable(L, 0, 9);
+        lua_pushnumber(L, st->cpu_load);
+        lua_setfield(L, -2, "cpu_load");
+        lua_pushnumber(L, st->cpu_peak);
+        lua_setfield(L, -2, "cpu_peak");
+        lua_pushinteger(L, st->polyphony);
+        lua_setfield(L, -2, "polyphony");
+        lua_pushinteger(L, st->voices);
+        lua_setfield(L, -2, "voices");
+        lua_pushinteger(L, st->peak);
+        lua_setfield(L, -2, "peak_voices");
+        lua_pushinteger(L, st->started);
+        lua_setfield(L, -2, "voices_started");
+        lua_pushinteger(L, st->stolen);
+        lua_setfield(L, -2, "voices_stolen");
+        lua_pushinteger(L, st->samples);
+        lua_setfield(L, -2, "samples");
+
+        lua_createtable(L, st->nchannels, 0);
+        for (int chan = 0; chan < st->nchannels; chan++) {
+                lua_pushinteger(L, st->channels[chan]);
+                lua_rawseti(L, -2, chan + 1);
+        }
+        lua_setfield(L, -2, "channels");
+
+        if (reset) {
+                st->peak = st->voices;
+                st->cpu_peak = st->cpu_load;
+                st->started = 0;
+                st->stolen = 0;
+                st->samples = 0;
+        }
+
+        return 1;
+}
+
+/*
+ * FLUIDSYNTH_API char *
+ * fluid_synth_error (fluid_synth_t *synth)
+ *
+ * Get a textual representation of the last error.
+ *
+ */
+
+/*
+ * Audio buffers hold rendered stereo audio outside of the Lua heap.
+ * The samples are in one of the `audio_formats`, either
+ * interleaved (L R L R ...) or planar (all of L, then all of R, each
+ * plane `capacity` frames long), in memory aligned to
+ * AUDIO_BUFFER_ALIGN bytes.
+ *
+ */
+
+#define AUDIO_BUFFER_ALIGN 64
+
+static const char* const audio_layouts[] = { "interleaved", "planar", NULL };
+
+struct audio_buffer {
+        int format;
+        int planar;
+        int capacity;           // frames
+        int frames;             // frames rendered so far
+        size_t sample_size;
+        void* data;
+        struct dither dither;   // state of conversions into this buffer
+};
+
+static size_t
+audio_buffer_bytes (const struct audio_buffer* buf)
+{
+        return 2 * (size_t)buf->capacity * buf->sample_size;
+}
+
+// the address of sample `frame` of channel `chan` (0 left, 1 right)
+static void*
+audio_buffer_at (const struct audio_buffer* buf, int chan, int frame)
+{
+        size_t index = buf->planar
+                ? (size_t)chan * buf->capacity + frame
+                : 2 * (size_t)frame + chan;
+        return (char*)buf->data + index * buf->sample_size;
+}
+
+static struct audio_buffer*
+check_audio_buffer (lua_State* L, int index)
+{
+        struct audio_buffer* buf = luaL_checkudata(L, index, "fluid.audiobuffer");
+        if (buf->data == NULL) { luaL_argerror(L, index, "deleted audio buffer"); }
+        return buf;
+}
+
+/*
+ * new_fluid_audio_buffer (capacity, format, layout)
+ *
+ * Create a stereo buffer of `capacity` frames. `format` is "float"
+ * (the default), "s16", "s24" or "s32", `layout` is "interleaved" (the
+ * default) or "planar". The synth renders into "float" and "s16"
+ * buffers, the others are filled by `fluid_audio_buffer_convert`.
+ *
+ */
+
+static int
+c_new_fluid_audio_buffer (lua_State* L)
+{
+        lua_Integer capacity = luaL_checkinteger(L, 1);
+        int format = luaL_checkoption(L, 2, "float", audio_formats);
+        int planar = luaL_checkoption(L, 3, "interleaved", audio_layouts);
+        luaL_argcheck(L, capacity > 0 && capacity <= 0x7fffffff / 2, 1, "bad capacity");
+
+        struct audio_buffer* buf = lua_newuserdata(L, sizeof(struct audio_buffer));
+        buf->format = format;
+        buf->planar = planar;
+        buf->capacity = (int)capacity;
+        buf->frames = 0;
+        buf->sample_size = audio_format_size(format);
+        buf->data = NULL;
+        dither_init(&buf->dither, DITHER_NONE);
+        luaL_setmetatable(L, "fluid.audiobuffer");
+
+        size_t bytes = audio_buffer_bytes(buf);
+        bytes = (bytes + AUDIO_BUFFER_ALIGN - 1) & ~(size_t)(AUDIO_BUFFER_ALIGN - 1);
+        buf->data = aligned_alloc(AUDIO_BUFFER_ALIGN, bytes);
+        if (buf->data == NULL) { lua_pushnil(L); return 1; }
+        memset(buf->data, 0, bytes);
+
+        return 1;
+}
+
+static int
+gc_delete_fluid_audio_buffer (lua_State* L)
+{
+        struct audio_buffer* buf = (struct audio_buffer*)lua_touserdata(L, 1);
+        free(buf->data);
+        buf->data = NULL;
+        return 0;
+}
+
+/*
+ * delete_fluid_audio_buffer (buffer)
+ *
+ * Free the samples of a buffer now instead of when it is collected.
+ *
+ */
+
+static int
+c_delete_fluid_audio_buffer (lua_State* L)
+{
+        luaL_checkudata(L, 1, "fluid.audiobuffer");
+        return gc_delete_fluid_audio_buffer(L);
+}
+
+/*
+ * fluid_audio_buffer_pointer (buffer)
+ *
+ * Get the address of the samples as a light userdata, the size of the
+ * sample memory in bytes and the number of rendered frames, to hand
+ * the buffer to other C modules.
+ *
+ */
+
+static int
+c_fluid_audio_buffer_pointer (lua_State* L)
+{
+        struct audio_buffer* buf = check_audio_buffer(L, 1);
+
+        lua_pushlightuserdata(L, buf->data);
+        lua_pushinteger(L, audio_buffer_bytes(buf));
+        lua_pushinteger(L, buf->frames);
+        return 3;
+}
+
+/*
+ * fluid_audio_buffer_frames (buffer)
+ *
+ * Get the number of rendered frames and the capacity of a buffer.
+ *
+ */
+
+static int
+c_fluid_audio_buffer_frames (lua_State* L)
+{
+        struct audio_buffer* buf = check_audio_buffer(L, 1);
+
+        lua_pushinteger(L, buf->frames);
+        lua_pushinteger(L, buf->capacity);
+        return 2;
+}
+
+/*
+ * fluid_audio_buffer_get (buffer, frame, channel)
+ *
+ * Get one sample, `frame` counting from 0 and `channel` 0 or 1.
+ * Integer samples are returned as integers.
+ *
+ */
+
+static int
+c_fluid_audio_buffer_get (lua_State* L)
+{
+        struct audio_buffer* buf = check_audio_buffer(L, 1);
+        lua_Integer frame = luaL_checkinteger(L, 2);
+        lua_Integer chan = luaL_checkinteger(L, 3);
+        luaL_argcheck(L, frame >= 0 && frame < buf->capacity, 2, "frame out of range");
+        luaL_argcheck(L, chan == 0 || chan == 1, 3, "channel must be 0 or 1");
+
+        void* sample = audio_buffer_at(buf, (int)chan, (int)frame);
+        const unsigned char* p = (const unsigned char*)sample;
+        switch (buf->format) {
+        case AUDIO_FORMAT_FLOAT:
+                lua_pushnumber(L, *(float*)sample);
+                break;
+        case AUDIO_FORMAT_S16:
+                lua_pushinteger(L, *(short*)sample);
+                break;
+        case AUDIO_FORMAT_S24:
+                // sign extend from the top byte
+                lua_pushinteger(L, (int)((unsigned int)p[0] << 8 | (unsigned int)p[1] << 16
+                                         | (unsigned int)p[2] << 24) >> 8);
+                break;
+        case AUDIO_FORMAT_S32:
+                lua_pushinteger(L, *(int*)sample);
+                break;
+        }
+        return 1;
+}
+
+/*
+ * fluid_audio_buffer_set (buffer, frame, channel, value)
+ *
+ * Set one sample, `frame` counting from 0 and `channel` 0 or 1. Integer
+ * samples are truncated to the width of the format. The frames up to
+ * `frame` count as rendered.
+ *
+ */
+
+static int
+c_fluid_audio_buffer_set (lua_State* L)
+{
+        struct audio_buffer* buf = check_audio_buffer(L, 1);
+        lua_Integer frame = luaL_checkinteger(L, 2);
+        lua_Integer chan = luaL_checkinteger(L, 3);
+        luaL_argcheck(L, frame >= 0 && frame < buf->capacity, 2, "frame out of range");
+        luaL_argcheck(L, chan == 0 || chan == 1, 3, "channel must be 0 or 1");
+
+        void* sample = audio_buffer_at(buf, (int)chan, (int)frame);
+        if (buf->format == AUDIO_FORMAT_FLOAT) {
+                *(float*)sample = (float)luaL_checknumber(L, 4);
+        } else {
+                store_sample(buf->format, sample, 0, (long)luaL_checkinteger(L, 4));
+        }
+        if (frame >= buf->frames) { buf->frames = (int)frame + 1; }
+
+        return 0;
+}
+
+/*
+ * fluid_audio_buffer_write (buffer, file)
+ *
+ * Write the rendered frames of a buffer to an open Lua file as they
+ * are in memory: interleaved, or the left plane followed by the right
+ * one.
+ *
+ * Returns true, or nil if writing failed.
+ *
+ */
+
+static int
+c_fluid_audio_buffer_write (lua_State* L)
+{
+        struct audio_buffer* buf = check_audio_buffer(L, 1);
+        luaL_Stream* stream = (luaL_Stream*)luaL_checkudata(L, 2, LUA_FILEHANDLE);
+        luaL_argcheck(L, stream->closef != NULL, 2, "attempt to use a closed file");
+
+        size_t n = (size_t)buf->frames;
+        int ok;
+        if (buf->planar) {
+                ok = fwrite(audio_buffer_at(buf, 0, 0), buf->sample_size, n, stream->f) == n
+                        && fwrite(audio_buffer_at(buf, 1, 0), buf->sample_size, n, stream->f) == n;
+        } else {
+                ok = fwrite(buf->data, 2 * buf->sample_size, n, stream->f) == n;
+        }
+
+        if (!ok) { lua_pushnil(L); return 1; }
+        lua_pushboolean(L, 1);
+        return 1;
+}
+
+/*
+ * fluid_audio_buffer_convert (src, dst, dither)
+ *
+ * Convert the rendered frames of the "float" buffer `src` into the
+ * integer buffer `dst` of the same layout, with `dither` "none" (the
+ * default), "tpdf" or "shaped". The dither state is kept in `dst`, so
+ * converting consecutive blocks into it continues the noise shaping.
+ *
+ */
+
+static int
+c_fluid_audio_buffer_convert (lua_State* L)
+{
+        struct audio_buffer* src = check_audio_buffer(L, 1);
+        struct audio_buffer* dst = check_audio_buffer(L, 2);
+        int mode = luaL_checkoption(L, 3, "none", dither_modes);
+
+        luaL_argcheck(L, src->format == AUDIO_FORMAT_FLOAT, 1, "not a float buffer");
+        luaL_argcheck(L, dst->format != AUDIO_FORMAT_FLOAT, 2, "not an integer buffer");
+        luaL_argcheck(L, dst->planar == src->planar, 2, "layouts differ");
+        luaL_argcheck(L, dst->capacity >= src->frames, 2, "buffer too small");
+
+        dst->dither.mode = mode;
+        if (src->planar) {
+                for (int chan = 0; chan < 2; chan++) {
+                        convert_samples(dst->format, audio_buffer_at(src, chan, 0),
+                                        audio_buffer_at(dst, chan, 0), src->frames,
+                                        0, chan, &dst->dither);
+                }
+        } else {
+                convert_samples(dst->format, src->data, dst->data, 2 * (size_t)src->frames,
+                                1, 0, &dst->dither);
+        }
+        dst->frames = src->frames;
+
+        return 0;
+}
+
+/*
+ * fluid_convert_isa (name)
+ *
+ * Get the name of the instruction set used for sample conversion, or
+ * switch to "scalar", "sse2" or "avx2". Returns nil if the requested
+ * one is not available.
+ *
+ */
+
+static int
+c_fluid_convert_isa (lua_State* L)
+{
+        const char* name = luaL_optstring(L, 1, NULL);
+        if (name != NULL && convert_select(name) != FLUID_OK) { lua_pushnil(L); return 1; }
+
+        lua_pushstring(L, convert_current->name);
+        return 1;
+}
+
+/*
+ * new_fluid_meter (sample_rate)
+ *
+ * Create a stereo level and loudness meter for audio at `sample_rate`
+ * (default 44100). Feed it with `fluid_meter_feed`, or attach it to a
+ * synth with `fluid_synth_set_meter` to measure everything the synth
+ * renders through the binding.
+ *
+ */
+
+static int
+c_new_fluid_meter (lua_State* L)
+{
+        lua_Number rate = luaL_optnumber(L, 1, 44100.0);
+        luaL_argcheck(L, rate >= 8000.0 && rate <= 384000.0, 1, "sample rate out of range");
+
+        struct meter* m = lua_newuserdata(L, sizeof(struct meter));
+        pthread_mutex_init(&m->lock, NULL);
+        meter_clear(m, rate);
+        luaL_setmetatable(L, "fluid.meter");
+        return 1;
+}
+
+static int
+gc_delete_fluid_meter (lua_State* L)
+{
+        struct meter* m = lua_touserdata(L, 1);
+        pthread_mutex_destroy(&m->lock);
+        return 0;
+}
+
+static double
+to_db (double x)
+{
+        return x > 0.0 ? 20.0 * log10(x) : -HUGE_VAL;
+}
+
+/*
+ * fluid_meter_read (meter)
+ *
+ * Get what `meter` measured since it was created or reset: a table
+ * with `frames`, the sample peak `peak`/`peak_db`, the true peak
+ * `true_peak`/`true_peak_db` and the RMS level `rms`/`rms_db`, each an
+ * array of the two channels, and the integrated loudness `integrated`
+ * in LUFS (-inf before the first 400 ms).
+ *
+ */
+
+static void
+set_channel_pair (lua_State* L, const char* name, double left, double right)
+{
+        lua_createtable(L, 2, 0);
+        lua_pushnumber(L, left);
+        lua_rawseti(L, -2, 1);
+        lua_pushnumber(L, right);
+        lua_rawseti(L, -2, 2);
+        lua_setfield(L, -2, name);
+}
+
+static int
+c_fluid_meter_read (lua_State* L)
+{
+        struct meter* m = luaL_checkudata(L, 1, "fluid.meter");
+
+        pthread_mutex_lock(&m->lock);
+        unsigned long long frames = m->frames;
+        double peak[2], true_peak[2], rms[2];
+        for (int c = 0; c < 2; c++) {
+                peak[c] = m->ch[c].peak;
+                true_peak[c] = m->ch[c].true_peak > m->ch[c].peak
+                        ? m->ch[c].true_peak : m->ch[c].peak;
+                rms[c] = frames > 0 ? sqrt(m->ch[c].sumsq / frames) : 0.0;
+        }
+        double integrated = meter_integrated(m);
+        pthread_mutex_unlock(&m->lock);
+
+        lua_createtable(L, 0, 8);
+        lua_pushinteger(L, (lua_Integer)frames);
+        lua_setfield(L, -2, "frames");
+        set_channel_pair(L, "peak", peak[0], peak[1]);
+        set_channel_pair(L, "peak_db", to_db(peak[0]), to_db(peak[1]));
+        set_channel_pair(L, "true_peak", true_peak[0], true_peak[1]);
+        set_channel_pair(L, "true_peak_db", to_db(true_peak[0]), to_db(true_peak[1]));
+        set_channel_pair(L, "rms", rms[0], rms[1]);
+        set_channel_pair(L, "rms_db", to_db(rms[0]), to_db(rms[1]));
+        lua_pushnumber(L, integrated);
+        lua_setfield(L, -2, "integrated");
+        return 1;
+}
+
+/*
+ * fluid_meter_reset (meter)
+ *
+ * Start a new measurement.
+ *
+ */
+
+static int
+c_fluid_meter_reset (lua_State* L)
+{
+        meter_reset(luaL_checkudata(L, 1, "fluid.meter"));
+        return 0;
+}
+
+/*
+ * fluid_meter_feed (meter, buffer)
+ *
+ * Measure the rendered frames of a "float" or "s16" audio buffer.
+ *
+ */
+
+static int
+c_fluid_meter_feed (lua_State* L)
+{
+        struct meter* m = luaL_checkudata(L, 1, "fluid.meter");
+        struct audio_buffer* buf = check_audio_buffer(L, 2);
+        luaL_argcheck(L, buf->format == AUDIO_FORMAT_FLOAT || buf->format == AUDIO_FORMAT_S16,
+                      2, "not a float or s16 buffer");
+
+        int incr = buf->planar ? 1 : 2;
+        if (buf->format == AUDIO_FORMAT_FLOAT) {
+                meter_feed(m, audio_buffer_at(buf, 0, 0), audio_buffer_at(buf, 1, 0),
+                           incr, buf->frames);
+        } else {
+                meter_feed_s16(m, audio_buffer_at(buf, 0, 0), audio_buffer_at(buf, 1, 0),
+                               incr, buf->frames);
+        }
+        return 0;
+}
+
+/*
+ * fluid_synth_set_meter (synth, meter)
+ *
+ * Attach `meter` to `synth`, or detach the current one when `meter` is
+ * nil. An attached meter measures `fluid_synth_write_float`,
+ * `fluid_synth_write_s16`, `fluid_synth_render_wav` and
+ * `fluid_sequencer_render` on the synth; audio drivers and the file
+ * renderer render outside the binding and are not seen.
+ *
+ */
+
+static int
+c_fluid_synth_set_meter (lua_State* L)
+{
+        fluid_synth_t* synth = *(fluid_synth_t**)lua_touserdata(L, 1);
+        struct meter* m = lua_isnoneornil(L, 2) ? NULL : luaL_checkudata(L, 2, "fluid.meter");
+
+        synth_meter_detach(L, synth);
+        if (m == NULL) { return 0; }
+
+        struct synth_meter* sm = malloc(sizeof(struct synth_meter));
+        if (sm == NULL) { return luaL_error(L, "out of memory"); }
+
+        lua_pushvalue(L, 2);
+        sm->ref = luaL_ref(L, LUA_REGISTRYINDEX);
+        sm->synth = synth;
+        sm->meter = m;
+        sm->next = synth_meter_list;
+        synth_meter_list = sm;
+        return 0;
+}
+
+// render `len` frames at frame `offset` of `buf` with the write call
+// matching its format
+static int
+synth_write_buffer (fluid_synth_t* synth, struct audio_buffer* buf, int offset, int len)
+{
+        int status;
+        int incr = buf->planar ? 1 : 2;
+        int loff = buf->planar ? offset : 2 * offset;
+        int roff = buf->planar ? buf->capacity + offset : 2 * offset + 1;
+
+        if (buf->format == AUDIO_FORMAT_FLOAT) {
+                float* data = buf->data;
+                status = fluid_synth_write_float(synth, len, data, loff, incr,
+                                                 data, roff, incr);
+                if (status == FLUID_OK) {
+                        meter_feed(synth_meter(synth), data + loff, data + roff, incr, len);
+                }
+        } else {
+                short* data = buf->data;
+                status = fluid_synth_write_s16(synth, len, data, loff, incr,
+                                               data, roff, incr);
+                if (status == FLUID_OK) {
+                        meter_feed_s16(synth_meter(synth), data + loff, data + roff, incr, len);
+                }
+        }
+
+        if (status == FLUID_OK) { buf->frames = offset + len; }
+        synth_stats_sample(synth_stats_find(synth));
+        return status;
+}
+
+static int
+synth_write_checked (lua_State* L, int format)
+{
+        fluid_synth_t* synth = *(fluid_synth_t**)lua_touserdata(L, 1);
+        lua_Integer len = luaL_checkinteger(L, 2);
+        struct audio_buffer* buf = check_audio_buffer(L, 3);
+        lua_Integer offset = luaL_optinteger(L, 4, 0);
+
+        luaL_argcheck(L, buf->format == format, 3, "wrong sample format");
+        luaL_argcheck(L, offset >= 0 && offset <= buf->capacity, 4, "offset out of range");
+        luaL_argcheck(L, len >= 0 && len <= buf->capacity - offset, 2, "buffer too small");
+
+        if (synth_write_buffer(synth, buf, (int)offset, (int)len) != FLUID_OK) {
+                lua_pushnil(L);
+                return 1;
+        }
+
+        lua_pushinteger(L, FLUID_OK);
+        return 1;
+}
+
+/*
+ * FLUIDSYNTH_API int
+ * fluid_synth_write_s16 (fluid_synth_t *synth,
+ *                        int len,
+ *                        void *lout,
+ *                        int loff,
+ *                        int lincr,
+ *                        void *rout,
+ *                        int roff,
+ *                        int rincr)
+ *
+ * Synthesize a block of 16 bit audio samples to audio buffers.
+ *
+ */
+
+/*
+ * fluid_synth_write_s16 (synth, len, buffer, offset)
+ *
+ * Render `len` frames into an "s16" audio buffer, starting at frame
+ * `offset` (default 0), which then holds `offset + len` frames.
+ *
+ */
+
+static int
+c_fluid_synth_write_s16 (lua_State* L)
+{
+        return synth_write_checked(L, AUDIO_FORMAT_S16);
+}
+
+/*
+ * FLUIDSYNTH_API int
+ * fluid_synth_write_float (fluid_synth_t *synth,
+ *                          int len,
+ *                          void *lout,
+ *                          int loff,
+ *                          int lincr,
+ *                          void *rout,
+ *                          int roff,
+ *                          int rincr)
+ *
+ * Synthesize a block of floating point audio samples to audio
+ * buffers.
+ *
+ */
+
+/*
+ * fluid_synth_write_float (synth, len, buffer, offset)
+ *
+ * Render `len` frames into a "float" audio buffer, like
+ * `fluid_synth_write_s16`.
+ *
+ */
+
+static int
+c_fluid_synth_write_float (lua_State* L)
+{
+        return synth_write_checked(L, AUDIO_FORMAT_FLOAT);
+}
+
+/*
+ * fluid_synth_render_wav (synth, path, frames, format, dither)
+ *
+ * Render `frames` frames of `synth` into a WAV file, or an RF64 file
+ * past 4 GB, of "float" (the default), "s16", "s24" or "s32" samples.
+ * The synth renders in chunks of WAV_RENDER_CHUNK frames without
+ * returning to Lua. Float samples, and "s16" without `dither`, go
+ * straight into the write buffer of the file; otherwise the chunk is
+ * converted with `dither` ("none", "tpdf" or "shaped").
+ *
+ * Returns the number of frames written, or nil on failure.
+ *
+ */
+
+#define WAV_RENDER_CHUNK 16384
+
+static int
+c_fluid_synth_render_wav (lua_State* L)
+{
+        fluid_synth_t* synth = *(fluid_synth_t**)lua_touserdata(L, 1);
+        const char* path = luaL_checkstring(L, 2);
+        lua_Integer frames = luaL_checkinteger(L, 3);
+        int format = luaL_checkoption(L, 4, "float", audio_formats);
+        int convert = format != AUDIO_FORMAT_FLOAT
+                && (format != AUDIO_FORMAT_S16 || !lua_isnoneornil(L, 5));
+        int mode = luaL_checkoption(L, 5, "none", dither_modes);
+        luaL_argcheck(L, frames >= 0, 3, "negative frame count");
+
+        struct wav_writer w;
+        if (wav_writer_open(&w, path, format, (int)synth_sample_rate(synth)) != FLUID_OK) {
+                lua_pushnil(L);
+                return 1;
+        }
+        w.dither.mode = mode;
+
+        float chunk[2 * RENDER_BLOCK_FRAMES];
+        struct meter* meter = synth_meter(synth);
+        struct synth_stats* stats = synth_stats_find(synth);
+
+        size_t frame_size = 2 * audio_format_size(format);
+        lua_Integer done = 0;
+        int status = FLUID_OK;
+
+        while (done < frames && status == FLUID_OK) {
+                int max = convert ? RENDER_BLOCK_FRAMES : WAV_RENDER_CHUNK;
+                int n = frames - done < max ? (int)(frames - done) : max;
+
+                unsigned char* out = wav_writer_reserve(&w, n * frame_size);
+                if (out == NULL) { status = FLUID_FAILED; break; }
+
+                if (convert) {
+                        status = fluid_synth_write_float(synth, n, chunk, 0, 2, chunk, 1, 2);
+                        convert_samples(format, chunk, out, 2 * (size_t)n, 1, 0, &w.dither);
+                        meter_feed(meter, chunk, chunk + 1, 2, n);
+                } else if (format == AUDIO_FORMAT_FLOAT) {
+                        status = fluid_synth_write_float(synth, n, out, 0, 2, out, 1, 2);
+                        meter_feed(meter, (float*)out, (float*)out + 1, 2, n);
+                } else {
+                        status = fluid_synth_write_s16(synth, n, out, 0, 2, out, 1, 2);
+                        meter_feed_s16(meter, (short*)out, (short*)out + 1, 2, n);
+                }
+
+                wav_writer_commit(&w, n * frame_size);
+                synth_stats_sample(stats);
+                done += n;
+        }
+
+        if (wav_writer_close(&w) != FLUID_OK) { status = FLUID_FAILED; }
+        if (status != FLUID_OK) { lua_pushnil(L); return 1; }
+
+        lua_pushinteger(L, done);
+        return 1;
+}
+
+/*
+ * FLUIDSYNTH_API int
+ * fluid_synth_nwrite_float (fluid_synth_t *synth,
+ *                           int len,
+ *                           float **left,
+ *                           float **right,
+ *                           float **fx_left,
+ *                           float **fx_right)
+ *
+ * Synthesize a block of floating point audio to audio buffers.
+ *
+ */
+
+/*
+ * FLUIDSYNTH_API int
+ * fluid_synth_process (fluid_synth_t *synth,
+ *                      int len,
+ *                      int nin,
+ *                      float **in,
+ *                      int nout,
+ *                      float **out)
+ *
+ * Synthesize floating point audio to audio buffers.
+ *
+ */
+
+/*
+ * Memory mapped SoundFont loader. The default loader reads all sample
+ * data of a SoundFont into memory. This one maps the file read-only
+ * and points the samples into the map, so sample data is paged in when
+ * a voice first plays it and is shared through the page cache with
+ * every other process mapping the same file. Only the preset data is
+ * parsed into memory.
+ *
+ * FluidSynth 1 lets a loader build its own presets, and the note-on
+ * below follows the rules of the default loader (SoundFont 2.01
+ * sections 8 and 9). FluidSynth 2 hides the sample and preset types,
+ * so there the default loader reads through the map instead. It copies
+ * all sample data out of the map unless "synth.dynamic-sample-loading"
+ * was set before the synth was created, so the loader is only added
+ * to synths that load samples on demand.
+ *
+ */
+
+#define MMSF_MAX_MODS 64
+
+#if FLUIDSYNTH_VERSION_MAJOR < 2
+
+struct mmsf_gen {
+        unsigned char id;
+        short amount;
+};
+
+struct mmsf_zone {
+        int gen_first;
+        int ngens;
+        int mod_first;
+        int nmods;
+        unsigned char keylo, keyhi, vello, velhi;
+        int link;                       // instrument or sample, -1 if global
+        unsigned long long gens_set;
+};
+
+struct mmsf_list {                      // the zones of a preset or instrument
+        int zone_first;
+        int nzones;
+        int global;                     // zone index, or -1
+};
+
+struct mmsf_font;
+
+struct mmsf_preset {
+        char name[21];
+        int bank;
+        int num;
+        struct mmsf_list zones;
+        struct mmsf_font* font;
+};
+
+struct mmsf_font {
+        char* path;
+        const unsigned char* map;
+        size_t map_size;
+
+        struct mmsf_preset* presets;    // sorted by bank and number
+        int npresets;
+        int iter;
+        struct mmsf_list* insts;
+        int ninsts;
+        struct mmsf_zone* zones;
+        int nzones;
+        struct mmsf_gen* gens;
+        int ngens;
+        fluid_mod_t** mods;
+        int nmods;
+        fluid_sample_t* samples;
+        int nsamples;
+        atomic_int pins;                // prewarms using the map
+        int closing;                    // the owning synth is being deleted
+        fluid_sfont_t* orphan;          // freed by the last prewarm
+};
+
+// the records of one pdta sub-chunk
+struct mmsf_chunk {
+        const unsigned char* data;
+        int count;
+};
+
+static int
+mmsf_gen_valid (int id, int preset)
+{
+        switch (id) {
+        case GEN_UNUSED1: case GEN_UNUSED2: case GEN_UNUSED3: case GEN_UNUSED4:
+        case GEN_RESERVED1: case GEN_RESERVED2: case GEN_RESERVED3:
+        case GEN_INSTRUMENT: case GEN_SAMPLEID: case GEN_KEYRANGE: case GEN_VELRANGE:
+                return 0;
+
+        // sample generators are only valid in instruments
+        case GEN_STARTADDROFS: case GEN_ENDADDROFS: case GEN_STARTLOOPADDROFS:
+        case GEN_ENDLOOPADDROFS: case GEN_STARTADDRCOARSEOFS: case GEN_ENDADDRCOARSEOFS:
+        case GEN_STARTLOOPADDRCOARSEOFS: case GEN_ENDLOOPADDRCOARSEOFS: case GEN_KEYNUM:
+        case GEN_VELOCITY: case GEN_SAMPLEMODE: case GEN_EXCLUSIVECLASS:
+        case GEN_OVERRIDEROOTKEY:
+                return !preset;
+        }
+        return id < GEN_PITCH;
+}
+
+// the flags of a SoundFont modulator source, or -1 for unknown types
+static int
+mmsf_mod_flags (unsigned int src)
+{
+        static const int types[4] = {
+                FLUID_MOD_LINEAR, FLUID_MOD_CONCAVE, FLUID_MOD_CONVEX, FLUID_MOD_SWITCH
+        };
+
+        unsigned int type = (src >> 10) & 63;
+        if (type > 3) { return -1; }
+
+        return ((src & (1 << 7)) ? FLUID_MOD_CC : FLUID_MOD_GC)
+                | ((src & (1 << 8)) ? FLUID_MOD_NEGATIVE : FLUID_MOD_POSITIVE)
+                | ((src & (1 << 9)) ? FLUID_MOD_BIPOLAR : FLUID_MOD_UNIPOLAR)
+                | types[type];
+}
+
+static fluid_mod_t*
+mmsf_mod (const unsigned char* rec)
+{
+        fluid_mod_t* mod = fluid_mod_new();
+        if (mod == NULL) { return NULL; }
+
+        unsigned int src = get_u16le(rec);
+        unsigned int amtsrc = get_u16le(rec + 6);
+        int flags1 = mmsf_mod_flags(src);
+        int flags2 = mmsf_mod_flags(amtsrc);
+
+        fluid_mod_set_source1(mod, src & 127, flags1 < 0 ? 0 : flags1);
+        fluid_mod_set_source2(mod, amtsrc & 127, flags2 < 0 ? 0 : flags2);
+        fluid_mod_set_dest(mod, get_u16le(rec + 2));
+
+        // unknown source types and transforms disable the modulator
+        short amount = (short)get_u16le(rec + 4);
+        int disabled = flags1 < 0 || flags2 < 0 || get_u16le(rec + 8) != 0;
+        fluid_mod_set_amount(mod, disabled ? 0.0 : amount);
+        return mod;
+}
+
+/*
+ * Parse the zones in bags [first, last) of a preset or instrument.
+ * `bags` are the pbag or ibag records, `link` the generator that ends
+ * a zone and `nlinks` the number of instruments or samples it may
+ * point at. Zones after the first without a link are dropped.
+ *
+ */
+
+static int
+mmsf_parse_zones (struct mmsf_font* font, struct mmsf_list* list, int first, int last,
+                  struct mmsf_chunk bags, struct mmsf_chunk gens, struct mmsf_chunk mods,
+                  int link, int nlinks, int preset)
+{
+        list->zone_first = font->nzones;
+        list->nzones = 0;
+        list->global = -1;
+
+        for (int b = first; b < last; b++) {
+                int gen_first = get_u16le(bags.data + 4 * b);
+                int gen_last = get_u16le(bags.data + 4 * (b + 1));
+                int mod_first = get_u16le(bags.data + 4 * b + 2);
+                int mod_last = get_u16le(bags.data + 4 * (b + 1) + 2);
+                if (gen_first > gen_last || gen_last > gens.count
+                    || mod_first > mod_last || mod_last > mods.count) {
+                        return FLUID_FAILED;
+                }
+
+                struct mmsf_zone* z = &font->zones[font->nzones];
+                z->gen_first = font->ngens;
+                z->ngens = 0;
+                z->mod_first = font->nmods;
+                z->nmods = 0;
+                z->keylo = 0;
+                z->keyhi = 127;
+                z->vello = 0;
+                z->velhi = 127;
+                z->link = -1;
+                z->gens_set = 0;
+
+                for (int g = gen_first; g < gen_last; g++) {
+                        const unsigned char* rec = gens.data + 4 * g;
+                        int id = get_u16le(rec);
+
+                        if (id == GEN_KEYRANGE) {
+                                z->keylo = rec[2];
+                                z->keyhi = rec[3];
+                        } else if (id == GEN_VELRANGE) {
+                                z->vello = rec[2];
+                                z->velhi = rec[3];
+                        } else if (id == link) {
+                                // the link ends the zone
+                                int target = get_u16le(rec + 2);
+                                z->link = target < nlinks ? target : -2;
+                                break;
+                        } else if (mmsf_gen_valid(id, preset)) {
+                                // a repeated generator replaces the earlier one
+                                struct mmsf_gen* gen = font->gens + z->gen_first;
+                                int k = 0;
+                                while (k < z->ngens && gen[k].id != id) { k++; }
+                                gen[k].id = id;
+                                gen[k].amount = (short)get_u16le(rec + 2);
+                                if (k == z->ngens) { z->ngens++; }
+                                z->gens_set |= 1ULL << id;
+                        }
+                }
+
+                if (z->link == -2 || (z->link == -1 && b != first)) { continue; }
+
+                for (int m = mod_first; m < mod_last && z->nmods < MMSF_MAX_MODS; m++) {
+                        fluid_mod_t* mod = mmsf_mod(mods.data + 10 * m);
+                        if (mod == NULL) { return FLUID_FAILED; }
+                        font->mods[font->nmods++] = mod;
+                        z->nmods++;
+                }
+
+                font->ngens += z->ngens;
+                if (z->link == -1) { list->global = font->nzones; }
+                font->nzones++;
+                list->nzones++;
+        }
+
+        return FLUID_OK;
+}
+
+static int
+mmsf_parse_samples (struct mmsf_font* font, struct mmsf_chunk shdr,
+                    const unsigned char* smpl, unsigned int smpl_frames)
+{
+        font->nsamples = shdr.count - 1;
+        font->samples = calloc(font->nsamples > 0 ? font->nsamples : 1, sizeof(fluid_sample_t));
+        if (font->samples == NULL) { return FLUID_FAILED; }
+
+        for (int i = 0; i < font->nsamples; i++) {
+                const unsigned char* rec = shdr.data + 46 * i;
+                fluid_sample_t* s = &font->samples[i];
+
+                memcpy(s->name, rec, 20);
+                s->data = (short*)smpl;
+                s->start = get_u32le(rec + 20);
+                s->end = get_u32le(rec + 24) - 1;       // last sample, as FluidSynth expects
+                s->loopstart = get_u32le(rec + 28);
+                s->loopend = get_u32le(rec + 32);
+                s->samplerate = get_u32le(rec + 36);
+                s->origpitch = rec[40];
+                s->pitchadj = (signed char)rec[41];
+                s->sampletype = get_u16le(rec + 44);
+
+                s->valid = get_u32le(rec + 24) > s->start
+                        && get_u32le(rec + 24) <= smpl_frames
+                        && !(s->sampletype & FLUID_SAMPLETYPE_ROM);
+                if (!s->valid) { continue; }
+
+                // repair broken loops like the default loader
+                if (s->loopend > s->end || s->loopstart >= s->loopend
+                    || s->loopstart <= s->start) {
+                        int pad = s->end - s->start >= 20 ? 8 : 1;
+                        s->loopstart = s->start + pad;
+                        s->loopend = s->end - pad;
+                }
+        }
+
+        return FLUID_OK;
+}
+
+static int
+compare_mmsf_preset (const void* a, const void* b)
+{
+        const struct mmsf_preset* x = a;
+        const struct mmsf_preset* y = b;
+        if (x->bank != y->bank) { return x->bank - y->bank; }
+        return x->num - y->num;
+}
+
+// find the sdta and pdta lists and parse the preset data
+static int
+mmsf_parse (struct mmsf_font* font)
+{
+        const unsigned char* map = font->map;
+        size_t size = font->map_size;
+
+        if (size < 12 || memcmp(map, "RIFF", 4) != 0 || memcmp(map + 8, "sfbk", 4) != 0) {
+                return FLUID_FAILED;
+        }
+        if ((size_t)get_u32le(map + 4) + 8 < size) { size = (size_t)get_u32le(map + 4) + 8; }
+
+        const unsigned char* smpl = NULL;
+        unsigned int smpl_size = 0;
+        struct mmsf_chunk pdta[9] = { { NULL, 0 } };
+        static const char pdta_ids[9][5] = {
+                "phdr", "pbag", "pmod", "pgen", "inst", "ibag", "imod", "igen", "shdr"
+        };
+        static const int pdta_sizes[9] = { 38, 4, 10, 4, 22, 4, 10, 4, 46 };
+
+        for (size_t pos = 12; pos + 12 <= size; ) {
+                size_t len = get_u32le(map + pos + 4);
+                if (len > size - pos - 8) { return FLUID_FAILED; }
+
+                if (memcmp(map + pos, "LIST", 4) == 0) {
+                        // too short to hold its own list type
+                        if (len < 4) { return FLUID_FAILED; }
+
+                        const unsigned char* list = map + pos + 12;
+                        size_t list_len = len - 4;
+                        int is_sdta = memcmp(map + pos + 8, "sdta", 4) == 0;
+                        int is_pdta = memcmp(map + pos + 8, "pdta", 4) == 0;
+
+                        for (size_t sub = 0; sub + 8 <= list_len; ) {
+                                size_t sub_len = get_u32le(list + sub + 4);
+                                if (sub_len > list_len - sub - 8) { return FLUID_FAILED; }
+
+                                if (is_sdta && memcmp(list + sub, "smpl", 4) == 0) {
+                                        smpl = list + sub + 8;
+                                        smpl_size = sub_len;
+                                }
+                                for (int k = 0; is_pdta && k < 9; k++) {
+                                        if (memcmp(list + sub, pdta_ids[k], 4) == 0) {
+                                                pdta[k].data = list + sub + 8;
+                                                pdta[k].count = sub_len / pdta_sizes[k];
+                                        }
+                                }
+                                sub += 8 + sub_len + (sub_len & 1);
+                        }
+                }
+                pos += 8 + len + (len & 1);
+        }
+
+        // every list ends with a terminal record
+        for (int k = 0; k < 9; k++) {
+                if (pdta[k].count < 1) { return FLUID_FAILED; }
+        }
+        if (smpl == NULL || ((size_t)(smpl - map) & 1)) { return FLUID_FAILED; }
+
+        struct mmsf_chunk phdr = pdta[0], pbag = pdta[1], pmod = pdta[2], pgen = pdta[3];
+        struct mmsf_chunk inst = pdta[4], ibag = pdta[5], imod = pdta[6], igen = pdta[7];
+
+        font->zones = malloc((pbag.count + ibag.count) * sizeof(struct mmsf_zone));
+        font->gens = malloc((pgen.count + igen.count) * sizeof(struct mmsf_gen));
+        font->mods = malloc((pmod.count + imod.count) * sizeof(fluid_mod_t*));
+        font->insts = calloc(inst.count, sizeof(struct mmsf_list));
+        font->presets = calloc(phdr.count, sizeof(struct mmsf_preset));
+        if (font->zones == NULL || font->gens == NULL || font->mods == NULL
+            || font->insts == NULL || font->presets == NULL) {
+                return FLUID_FAILED;
+        }
+
+        if (mmsf_parse_samples(font, pdta[8], smpl, smpl_size / 2) != FLUID_OK) {
+                return FLUID_FAILED;
+        }
+
+        font->ninsts = inst.count - 1;
+        for (int i = 0; i < font->ninsts; i++) {
+                int first = get_u16le(inst.data + 22 * i + 20);
+                int last = get_u16le(inst.data + 22 * (i + 1) + 20);
+                if (first > last || last >= ibag.count) { return FLUID_FAILED; }
+                if (mmsf_parse_zones(font, &font->insts[i], first, last, ibag, igen, imod,
+                                     GEN_SAMPLEID, font->nsamples, 0) != FLUID_OK) {
+                        return FLUID_FAILED;
+                }
+        }
+
+        font->npresets = phdr.count - 1;
+        for (int i = 0; i < font->npresets; i++) {
+                const unsigned char* rec = phdr.data + 38 * i;
+                struct mmsf_preset* p = &font->presets[i];
+                int first = get_u16le(rec + 24);
+                int last = get_u16le(rec + 38 + 24);
+                if (first > last || last >= pbag.count) { return FLUID_FAILED; }
+
+                memcpy(p->name, rec, 20);
+                p->num = get_u16le(rec + 20);
+                p->bank = get_u16le(rec + 22);
+                p->font = font;
+                if (mmsf_parse_zones(font, &p->zones, first, last, pbag, pgen, pmod,
+                                     GEN_INSTRUMENT, font->ninsts, 1) != FLUID_OK) {
+                        return FLUID_FAILED;
+                }
+        }
+        qsort(font->presets, font->npresets, sizeof(struct mmsf_preset), compare_mmsf_preset);
+
+        return FLUID_OK;
+}
+
+static void
+mmsf_font_free (struct mmsf_font* font)
+{
+        for (int i = 0; i < font->nmods; i++) { fluid_mod_delete(font->mods[i]); }
+        if (font->map != NULL) { munmap((void*)font->map, font->map_size); }
+        free(font->path);
+        free(font->presets);
+        free(font->insts);
+        free(font->zones);
+        free(font->gens);
+        free(font->mods);
+        free(font->samples);
+        free(font);
+}
+
+static int
+mmsf_zone_inside (const struct mmsf_zone* z, int key, int vel)
+{
+        return key >= z->keylo && key <= z->keyhi && vel >= z->vello && vel <= z->velhi;
+}
+
+/*
+ * Collect the modulators of a zone and its global zone into `list`:
+ * local modulators replace identical global ones (SoundFont 2.01
+ * section 9.5.1).
+ *
+ */
+
+static int
+mmsf_zone_mods (const struct mmsf_font* font, const struct mmsf_zone* global,
+                const struct mmsf_zone* z, fluid_mod_t** list)
+{
+        int n = 0;
+        for (int i = 0; global != NULL && i < global->nmods; i++) {
+                list[n++] = font->mods[global->mod_first + i];
+        }
+
+        int nglobal = n;
+        for (int i = 0; i < z->nmods && n < 2 * MMSF_MAX_MODS; i++) {
+                fluid_mod_t* mod = font->mods[z->mod_first + i];
+                for (int k = 0; k < nglobal; k++) {
+                        if (list[k] != NULL && fluid_mod_test_identity(mod, list[k])) {
+                                list[k] = NULL;
+                        }
+                }
+                list[n++] = mod;
+        }
+
+        return n;
+}
+
+static int
+mmsf_noteon (fluid_preset_t* preset, fluid_synth_t* synth, int chan, int key, int vel)
+{
+        struct mmsf_preset* p = preset->data;
+        struct mmsf_font* font = p->font;
+        fluid_mod_t* mods[2 * MMSF_MAX_MODS];
+
+        const struct mmsf_zone* pglobal =
+                p->zones.global >= 0 ? &font->zones[p->zones.global] : NULL;
+
+        for (int i = 0; i < p->zones.nzones; i++) {
+                const struct mmsf_zone* pz = &font->zones[p->zones.zone_first + i];
+                if (pz->link < 0 || !mmsf_zone_inside(pz, key, vel)) { continue; }
+
+                const struct mmsf_list* inst = &font->insts[pz->link];
+                const struct mmsf_zone* iglobal =
+                        inst->global >= 0 ? &font->zones[inst->global] : NULL;
+
+                for (int j = 0; j < inst->nzones; j++) {
+                        const struct mmsf_zone* iz = &font->zones[inst->zone_first + j];
+                        if (iz->link < 0 || !mmsf_zone_inside(iz, key, vel)) { continue; }
+
+                        fluid_sample_t* sample = &font->samples[iz->link];
+                        if (!sample->valid) { continue; }
+
+                        fluid_voice_t* voice = fluid_synth_alloc_voice(synth, sample, chan, key, vel);
+                        if (voice == NULL) { return FLUID_FAILED; }
+
+                        // instrument generators are absolute, local ones override global ones
+                        for (int k = 0; iglobal != NULL && k < iglobal->ngens; k++) {
+                                const struct mmsf_gen* g = &font->gens[iglobal->gen_first + k];
+                                fluid_voice_gen_set(voice, g->id, g->amount);
+                        }
+                        for (int k = 0; k < iz->ngens; k++) {
+                                const struct mmsf_gen* g = &font->gens[iz->gen_first + k];
+                                fluid_voice_gen_set(voice, g->id, g->amount);
+                        }
+
+                        int n = mmsf_zone_mods(font, iglobal, iz, mods);
+                        for (int k = 0; k < n; k++) {
+                                if (mods[k] != NULL) {
+                                        fluid_voice_add_mod(voice, mods[k], FLUID_VOICE_OVERWRITE);
+                                }
+                        }
+
+                        // preset generators add to them, again local before global
+                        for (int k = 0; pglobal != NULL && k < pglobal->ngens; k++) {
+                                const struct mmsf_gen* g = &font->gens[pglobal->gen_first + k];
+                                if (!(pz->gens_set & (1ULL << g->id))) {
+                                        fluid_voice_gen_incr(voice, g->id, g->amount);
+                                }
+                        }
+                        for (int k = 0; k < pz->ngens; k++) {
+                                const struct mmsf_gen* g = &font->gens[pz->gen_first + k];
+                                fluid_voice_gen_incr(voice, g->id, g->amount);
+                        }
+
+                        n = mmsf_zone_mods(font, pglobal, pz, mods);
+                        for (int k = 0; k < n; k++) {
+                                if (mods[k] != NULL) {
+                                        fluid_voice_add_mod(voice, mods[k], FLUID_VOICE_ADD);
+                                }
+                        }
+
+                        fluid_synth_start_voice(synth, voice);
+                }
+        }
+
+        return FLUID_OK;
+}
+
+static char*
+mmsf_preset_get_name (fluid_preset_t* preset)
+{
+        return ((struct mmsf_preset*)preset->data)->name;
+}
+
+static int
+mmsf_preset_get_banknum (fluid_preset_t* preset)
+{
+        return ((struct mmsf_preset*)preset->data)->bank;
+}
+
+static int
+mmsf_preset_get_num (fluid_preset_t* preset)
+{
+        return ((struct mmsf_preset*)preset->data)->num;
+}
+
+static int
+mmsf_preset_free (fluid_preset_t* preset)
+{
+        free(preset);
+        return 0;
+}
+
+static void
+mmsf_preset_init (fluid_preset_t* preset, fluid_sfont_t* sfont, struct mmsf_preset* p)
+{
+        memset(preset, 0, sizeof(fluid_preset_t));
+        preset->data = p;
+        preset->sfont = sfont;
+        preset->free = mmsf_preset_free;
+        preset->get_name = mmsf_preset_get_name;
+        preset->get_banknum = mmsf_preset_get_banknum;
+        preset->get_num = mmsf_preset_get_num;
+        preset->noteon = mmsf_noteon;
+}
+
+static fluid_preset_t*
+mmsf_get_preset (fluid_sfont_t* sfont, unsigned int bank, unsigned int num)
+{
+        struct mmsf_font* font = sfont->data;
+        struct mmsf_preset key;
+        key.bank = bank;
+        key.num = num;
+
+        struct mmsf_preset* p = bsearch(&key, font->presets, font->npresets,
+                                        sizeof(struct mmsf_preset), compare_mmsf_preset);
+        if (p == NULL) { return NULL; }
+
+        fluid_preset_t* preset = malloc(sizeof(fluid_preset_t));
+        if (preset == NULL) { return NULL; }
+        mmsf_preset_init(preset, sfont, p);
+        return preset;
+}
+
+static void
+mmsf_iteration_start (fluid_sfont_t* sfont)
+{
+        ((struct mmsf_font*)sfont->data)->iter = 0;
+}
+
+static int
+mmsf_iteration_next (fluid_sfont_t* sfont, fluid_preset_t* preset)
+{
+        struct mmsf_font* font = sfont->data;
+        if (font->iter >= font->npresets) { return 0; }
+
+        mmsf_preset_init(preset, sfont, &font->presets[font->iter++]);
+        preset->free = NULL;
+        return 1;
+}
+
+static char*
+mmsf_get_name (fluid_sfont_t* sfont)
+{
+        return ((struct mmsf_font*)sfont->data)->path;
+}
+
+// fails while voices still play samples of the font or a prewarm
+// holds it, the synth retries. A synth being deleted ignores the
+// failure, so then the font is left to the last prewarm instead.
+static int
+mmsf_free (fluid_sfont_t* sfont)
+{
+        struct mmsf_font* font = sfont->data;
+        if (font->closing) {
+                if (atomic_load(&font->pins) > 0) { font->orphan = sfont; return 0; }
+                mmsf_font_free(font);
+                free(sfont);
+                return 0;
+        }
+
+        if (atomic_load(&font->pins) > 0) { return -1; }
+        for (int i = 0; i < font->nsamples; i++) {
+                if (font->samples[i].refcount != 0) { return -1; }
+        }
+
+        mmsf_font_free(font);
+        free(sfont);
+        return 0;
+}
+
+static fluid_sfont_t*
+mmsf_load (fluid_sfloader_t* loader, const char* filename)
+{
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+        // samples are little endian, leave them to the default loader
+        return NULL;
+#endif
+        int fd = open(filename, O_RDONLY);
+        if (fd < 0) { return NULL; }
+
+        struct stat sb;
+        void* map = MAP_FAILED;
+        if (fstat(fd, &sb) == 0 && sb.st_size > 0) {
+                map = mmap(NULL, sb.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        }
+        close(fd);
+        if (map == MAP_FAILED) { return NULL; }
+
+        struct mmsf_font* font = calloc(1, sizeof(struct mmsf_font));
+        fluid_sfont_t* sfont = calloc(1, sizeof(fluid_sfont_t));
+        if (font == NULL || sfont == NULL) {
+                munmap(map, sb.st_size);
+                free(font);
+                free(sfont);
+                return NULL;
+        }
+        font->map = map;
+        font->map_size = sb.st_size;
+        font->path = farm_strdup(filename);
+
+        if (font->path == NULL || mmsf_parse(font) != FLUID_OK) {
+                mmsf_font_free(font);
+                free(sfont);
+                return NULL;
+        }
+
+        sfont->data = font;
+        sfont->free = mmsf_free;
+        sfont->get_name = mmsf_get_name;
+        sfont->get_preset = mmsf_get_preset;
+        sfont->iteration_start = mmsf_iteration_start;
+        sfont->iteration_next = mmsf_iteration_next;
+        return sfont;
+}
+
+// mark the memory mapped fonts of `synth` before it is deleted: its
+// voices go with it, so only prewarms can still hold a font
+static void
+mmsf_synth_closing (fluid_synth_t* synth)
+{
+        int n = fluid_synth_sfcount(synth);
+        for (int i = 0; i < n; i++) {
+                fluid_sfont_t* sfont = fluid_synth_get_sfont(synth, i);
+                if (sfont != NULL && sfont->free == mmsf_free) {
+                        ((struct mmsf_font*)sfont->data)->closing = 1;
+                }
+        }
+}
+
+static int
+mmsf_loader_free (fluid_sfloader_t* loader)
+{
+        free(loader);
+        return 0;
+}
+
+static fluid_sfloader_t*
+new_mmap_sfloader (fluid_settings_t* settings)
+{
+        fluid_sfloader_t* loader = calloc(1, sizeof(fluid_sfloader_t));
+        if (loader == NULL) { return NULL; }
+
+        loader->free = mmsf_loader_free;
+        loader->load = mmsf_load;
+        return loader;
+}
+
+#else
+
+struct mmsf_file {
+        const unsigned char* map;
+        size_t size;
+        size_t pos;
+};
+
+static void*
+mmsf_open (const char* filename)
+{
+        int fd = open(filename, O_RDONLY);
+        if (fd < 0) { return NULL; }
+
+        struct stat sb;
+        void* map = MAP_FAILED;
+        if (fstat(fd, &sb) == 0 && sb.st_size > 0) {
+                map = mmap(NULL, sb.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        }
+        close(fd);
+        if (map == MAP_FAILED) { return NULL; }
+
+        struct mmsf_file* file = malloc(sizeof(struct mmsf_file));
+        if (file == NULL) { munmap(map, sb.st_size); return NULL; }
+        file->map = map;
+        file->size = sb.st_size;
+        file->pos = 0;
+        return file;
+}
+
+static int
+mmsf_read (void* buf, sfont_count_t count, void* handle)
+{
+        struct mmsf_file* file = handle;
+        if (count < 0 || (size_t)count > file->size - file->pos) { return FLUID_FAILED; }
+
+        memcpy(buf, file->map + file->pos, count);
+        file->pos += count;
+        return FLUID_OK;
+}
+
+static int
+mmsf_seek (void* handle, sfont_off_t offset, int origin)
+{
+        struct mmsf_file* file = handle;
+        long long base = origin == SEEK_CUR ? (long long)file->pos
+                : origin == SEEK_END ? (long long)file->size : 0;
+        if (base + offset < 0 || base + offset > (long long)file->size) { return FLUID_FAILED; }
+
+        file->pos = base + offset;
+        return FLUID_OK;
+}
+
+static sfont_off_t
+mmsf_tell (void* handle)
+{
+        return ((struct mmsf_file*)handle)->pos;
+}
+
+static int
+mmsf_close (void* handle)
+{
+        struct mmsf_file* file = handle;
+        munmap((void*)file->map, file->size);
+        free(file);
+        return FLUID_OK;
+}
+
+static fluid_sfloader_t*
+new_mmap_sfloader (fluid_settings_t* settings)
+{
+        fluid_sfloader_t* loader = new_fluid_defsfloader(settings);
+        if (loader == NULL) { return NULL; }
+
+        fluid_sfloader_set_callbacks(loader, mmsf_open, mmsf_read, mmsf_seek,
+                                     mmsf_tell, mmsf_close);
+        return loader;
+}
+
+// the default loader unloads its own fonts, which never point into a map
+static void
+mmsf_synth_closing (fluid_synth_t* synth)
+{
+}
+
+#endif
+
+/*
+ * FLUIDSYNTH_API void
+ * fluid_synth_add_sfloader (fluid_synth_t *synth,
+ *                           fluid_sfloader_t *loader)
+ *
+ * Add a SoundFont loader interface.
+ *
+ */
+
+/*
+ * fluid_synth_add_mmap_sfloader (synth)
+ *
+ * Add the memory mapped SoundFont loader to `synth`. SoundFonts loaded
+ * into the synth afterwards keep their sample data in a read-only map
+ * of the file, paged in as voices play it; files it cannot parse are
+ * left to the default loader.
+ *
+ * With FluidSynth 2 the synth must have been created with
+ * "synth.dynamic-sample-loading" set, otherwise returns nil and a
+ * message.
+ *
+ */
+
+static int
+c_fluid_synth_add_mmap_sfloader (lua_State* L)
+{
+        fluid_synth_t* synth = *(fluid_synth_t**)lua_touserdata(L, 1);
+        fluid_settings_t* settings = fluid_synth_get_settings(synth);
+
+#if FLUIDSYNTH_VERSION_MAJOR >= 2
+        int dynamic = 0;
+        fluid_settings_getint(settings, "synth.dynamic-sample-loading", &dynamic);
+        if (!dynamic) {
+                lua_pushnil(L);
+                lua_pushstring(L, "synth.dynamic-sample-loading is off");
+                return 2;
+        }
+#endif
+
+        fluid_sfloader_t* loader = new_mmap_sfloader(settings);
+        if (loader == NULL) { lua_pushnil(L); return 1; }
+
+        fluid_synth_add_sfloader(synth, loader);
+
+        lua_pushinteger(L, FLUID_OK);
+        return 1;
+}
+
+/*
+ * Prewarming. The first note on a preset of a memory mapped font
+ * faults in the pages of its samples from the audio thread. A prewarm
+ * collects the sample data a preset plays in a key range and, on a
+ * background thread, asks the kernel to read it ahead, touches every
+ * page and optionally locks the pages in memory until the prewarm is
+ * released. The font cannot be freed while a prewarm holds it.
+ *
+ */
+
+struct prewarm_range {
+        size_t start;                   // page aligned offsets in the map
+        size_t end;
+};
+
+struct prewarm {
+        void* font;                     // the struct mmsf_font it pins
+        const unsigned char* map;
+        struct prewarm_range* ranges;
+        int nranges;
+        size_t page;
+        size_t total;
+        int lock;
+
+        pthread_t thread;
+        atomic_size_t done;
+        atomic_int finished;
+        atomic_int locked;
+        atomic_int cancel;
+};
+
+static void*
+prewarm_thread (void* data)
+{
+        struct prewarm* pw = data;
+        int locked = pw->lock;
+
+        for (int i = 0; i < pw->nranges && !atomic_load(&pw->cancel); i++) {
+                const unsigned char* start = pw->map + pw->ranges[i].start;
+                size_t len = pw->ranges[i].end - pw->ranges[i].start;
+
+                madvise((void*)start, len, MADV_WILLNEED);
+
+                // one read per page faults it in
+                for (size_t off = 0; off < len && !atomic_load(&pw->cancel); off += pw->page) {
+                        (void)((volatile const unsigned char*)start)[off];
+                        atomic_fetch_add(&pw->done, pw->page);
+                }
+
+                if (pw->lock && mlock(start, len) != 0) { locked = 0; }
+        }
+
+        atomic_store(&pw->locked, locked && !atomic_load(&pw->cancel));
+        atomic_store(&pw->finished, 1);
+        return NULL;
+}
+
+#if FLUIDSYNTH_VERSION_MAJOR < 2
+
+static int
+compare_prewarm_range (const void* a, const void* b)
+{
+        const struct prewarm_range* x = a;
+        const struct prewarm_range* y = b;
+        return (x->start > y->start) - (x->start < y->start);
+}
+
+// the sample data of the zones of preset `p` in keys [keylo, keyhi],
+// as sorted and merged page ranges
+static int
+prewarm_collect (struct prewarm* pw, struct mmsf_font* font, struct mmsf_preset* p,
+                 int keylo, int keyhi)
+{
+        int capacity = 16;
+        pw->ranges = malloc(capacity * sizeof(struct prewarm_range));
+        if (pw->ranges == NULL) { return FLUID_FAILED; }
+
+        for (int i = 0; i < p->zones.nzones; i++) {
+                const struct mmsf_zone* pz = &font->zones[p->zones.zone_first + i];
+                if (pz->link < 0 || pz->keyhi < keylo || pz->keylo > keyhi) { continue; }
+
+                const struct mmsf_list* inst = &font->insts[pz->link];
+                for (int j = 0; j < inst->nzones; j++) {
+                        const struct mmsf_zone* iz = &font->zones[inst->zone_first + j];
+                        if (iz->link < 0 || iz->keyhi < keylo || iz->keylo > keyhi) { continue; }
+
+                        fluid_sample_t* s = &font->samples[iz->link];
+                        if (!s->valid) { continue; }
+
+                        if (pw->nranges == capacity) {
+                                capacity *= 2;
+                                struct prewarm_range* r =
+                                        realloc(pw->ranges, capacity * sizeof(struct prewarm_range));
+                                if (r == NULL) { return FLUID_FAILED; }
+                                pw->ranges = r;
+                        }
+
+                        size_t base = (const unsigned char*)s->data - font->map;
+                        size_t start = base + 2 * (size_t)s->start;
+                        size_t end = base + 2 * ((size_t)s->end + 1);
+                        pw->ranges[pw->nranges].start = start & ~(pw->page - 1);
+                        pw->ranges[pw->nranges].end = (end + pw->page - 1) & ~(pw->page - 1);
+                        if (pw->ranges[pw->nranges].end > font->map_size) {
+                                pw->ranges[pw->nranges].end = font->map_size;
+                        }
+                        pw->nranges++;
+                }
+        }
+
+        qsort(pw->ranges, pw->nranges, sizeof(struct prewarm_range), compare_prewarm_range);
+
+        int n = 0;
+        for (int i = 0; i < pw->nranges; i++) {
+                if (n > 0 && pw->ranges[i].start <= pw->ranges[n - 1].end) {
+                        if (pw->ranges[i].end > pw->ranges[n - 1].end) {
+                                pw->ranges[n - 1].end = pw->ranges[i].end;
+                        }
+                } else {
+                        pw->ranges[n++] = pw->ranges[i];
+                }
+        }
+        pw->nranges = n;
+
+        for (int i = 0; i < n; i++) { pw->total += pw->ranges[i].end - pw->ranges[i].start; }
+        return FLUID_OK;
+}
+
+/*
+ * Start prewarming preset `bank`:`program` of `sfont`. Returns NULL
+ * with `error` set if the font is not memory mapped or has no such
+ * preset.
  *
  */
 
+static struct prewarm*
+prewarm_start (fluid_sfont_t* sfont, int bank, int program, int keylo, int keyhi, int lock,
+               const char** error)
+{
+        if (sfont->free != mmsf_free) { *error = "not a memory mapped font"; return NULL; }
+
+        struct mmsf_font* font = sfont->data;
+        struct mmsf_preset key;
+        key.bank = bank;
+        key.num = program;
+        struct mmsf_preset* p = bsearch(&key, font->presets, font->npresets,
+                                        sizeof(struct mmsf_preset), compare_mmsf_preset);
+        if (p == NULL) { *error = "no such preset"; return NULL; }
+
+        *error = "out of memory";
+        struct prewarm* pw = calloc(1, sizeof(struct prewarm));
+        if (pw == NULL) { return NULL; }
+        pw->page = sysconf(_SC_PAGESIZE);
+        pw->map = font->map;
+        pw->lock = lock;
+
+        if (prewarm_collect(pw, font, p, keylo, keyhi) != FLUID_OK) {
+                free(pw->ranges);
+                free(pw);
+                return NULL;
+        }
+
+        atomic_fetch_add(&font->pins, 1);
+        pw->font = font;
+
+        if (pthread_create(&pw->thread, NULL, prewarm_thread, pw) != 0) {
+                atomic_fetch_sub(&font->pins, 1);
+                free(pw->ranges);
+                free(pw);
+                *error = "cannot start thread";
+                return NULL;
+        }
+
+        return pw;
+}
+
+#else
+
+static struct prewarm*
+prewarm_start (fluid_sfont_t* sfont, int bank, int program, int keylo, int keyhi, int lock,
+               const char** error)
+{
+        *error = "not a memory mapped font";
+        return NULL;
+}
+
+#endif
+
+// stop the thread, unlock the pages and unpin the font
+static void
+prewarm_release (struct prewarm* pw)
+{
+        atomic_store(&pw->cancel, 1);
+        pthread_join(pw->thread, NULL);
+
+        for (int i = 0; pw->lock && i < pw->nranges; i++) {
+                munlock(pw->map + pw->ranges[i].start, pw->ranges[i].end - pw->ranges[i].start);
+        }
+
+#if FLUIDSYNTH_VERSION_MAJOR < 2
+        struct mmsf_font* font = pw->font;
+        if (atomic_fetch_sub(&font->pins, 1) == 1 && font->orphan != NULL) {
+                free(font->orphan);
+                mmsf_font_free(font);
+        }
+#endif
+        free(pw->ranges);
+        free(pw);
+}
+
 /*
- * FLUIDSYNTH_API int
- * fluid_synth_process (fluid_synth_t *synth,
- *                      int len,
- *                      int nin,
- *                      float **in,
- *                      int nout,
- *                      float **out)
+ * fluid_synth_prewarm (synth, sfont_id, bank, program, key_range, lock)
  *
- * Synthesize floating point audio to audio buffers.
+ * Bring the sample data of a preset of a memory mapped font into
+ * memory on a background thread, for the keys in `key_range` ({low,
+ * high}, default all). With `lock` the pages stay locked in memory
+ * until the prewarm is released.
+ *
+ * Returns a handle for `fluid_prewarm_poll`, or nil and a message.
  *
  */
 
+static int
+c_fluid_synth_prewarm (lua_State* L)
+{
+        fluid_synth_t* synth = *(fluid_synth_t**)lua_touserdata(L, 1);
+        int sfont_id = (int)luaL_checkinteger(L, 2);
+        int bank = (int)luaL_checkinteger(L, 3);
+        int program = (int)luaL_checkinteger(L, 4);
+        int keylo = 0, keyhi = 127;
+        if (!lua_isnoneornil(L, 5)) {
+                luaL_checktype(L, 5, LUA_TTABLE);
+                lua_rawgeti(L, 5, 1);
+                lua_rawgeti(L, 5, 2);
+                keylo = (int)luaL_checkinteger(L, -2);
+                keyhi = (int)luaL_checkinteger(L, -1);
+                lua_pop(L, 2);
+        }
+        int lock = lua_toboolean(L, 6);
+
+        fluid_sfont_t* sfont = sfont_cache_unwrap(fluid_synth_get_sfont_by_id(synth, sfont_id));
+        if (sfont == NULL) { lua_pushnil(L); lua_pushstring(L, "no such font"); return 2; }
+
+        struct prewarm** handle = lua_newuserdata(L, sizeof(struct prewarm*));
+        *handle = NULL;
+        luaL_setmetatable(L, "fluid.prewarm");
+
+        const char* error;
+        *handle = prewarm_start(sfont, bank, program, keylo, keyhi, lock, &error);
+        if (*handle == NULL) { lua_pushnil(L); lua_pushstring(L, error); return 2; }
+
+        return 1;
+}
+
+static int
+c_fluid_prewarm_release (lua_State* L)
+{
+        struct prewarm** handle = luaL_checkudata(L, 1, "fluid.prewarm");
+        if (*handle != NULL) {
+                prewarm_release(*handle);
+                *handle = NULL;
+        }
+        return 0;
+}
+
 /*
- * FLUIDSYNTH_API void
- * fluid_synth_add_sfloader (fluid_synth_t *synth,
- *                           fluid_sfloader_t *loader)
+ * fluid_prewarm_poll (handle)
  *
- * Add a SoundFont loader interface.
+ * Returns whether the prewarm finished, the bytes touched so far, the
+ * bytes it covers and whether all of them are locked.
  *
  */
 
+static int
+c_fluid_prewarm_poll (lua_State* L)
+{
+        struct prewarm** handle = luaL_checkudata(L, 1, "fluid.prewarm");
+        struct prewarm* pw = *handle;
+        if (pw == NULL) { luaL_argerror(L, 1, "released prewarm"); }
+
+        size_t done = atomic_load(&pw->done);
+        lua_pushboolean(L, atomic_load(&pw->finished));
+        lua_pushinteger(L, done < pw->total ? done : pw->total);
+        lua_pushinteger(L, pw->total);
+        lua_pushboolean(L, atomic_load(&pw->locked));
+        return 4;
+}
+
 /*
  * FLUIDSYNTH_API fluid_voice_t *
  * fluid_synth_alloc_voice (fluid_synth_t *synth,
@@ -2955,196 +10581,1305 @@ c_delete_fluid_settings (lua_State* L)
  *                        const char *name,
  *                        double *val)
  *
- * Get the numeric value of a named setting.
+ * Get the numeric value of a named setting.
+ *
+ */
+
+/*
+ * FLUIDSYNTH_API double
+ * fluid_settings_getnum_default (fluid_settings_t *settings,
+ *                                const char *name)
+ *
+ * Get the default value of a named numeric (double) setting.
+ *
+ */
+
+/*
+ * FLUIDSYNTH_API void
+ * fluid_settings_getnum_range (fluid_settings_t *settings,
+ *                              const char *name,
+ *                              double *min,
+ *                              double *max)
+ *
+ * Get the range of values of a numeric setting.
+ *
+ */
+
+/*
+ * FLUIDSYNTH_API int
+ * fluid_settings_setint (fluid_settings_t *settings,
+ *                        const char *name,
+ *                        int val)
+ *
+ * Set an integer value for a setting.
+ *
+ */
+
+/*
+ * FLUIDSYNTH_API int
+ * fluid_settings_getint (fluid_settings_t *settings,
+ *                        const char *name,
+ *                        int *val)
+ *
+ * Get an integer value setting.
+ *
+ */
+
+/*
+ * FLUIDSYNTH_API int
+ * fluid_settings_getint_default (fluid_settings_t *settings,
+ *                                const char *name)
+ *
+ * Get the default value of an integer setting.
+ *
+ */
+
+/*
+ * FLUIDSYNTH_API void
+ * fluid_settings_getint_range (fluid_settings_t *settings,
+ *                              const char *name,
+ *                              int *min,
+ *                              int *max)
+ *
+ * Get the range of values of an integer setting.
+ *
+ */
+
+/*
+ * FLUIDSYNTH_API void
+ * fluid_settings_foreach_option (fluid_settings_t *settings,
+ *                                const char *name,
+ *                                void *data,
+ *                                fluid_settings_foreach_option_t func)
+ *
+ * Iterate the available options for a named string setting, calling
+ * the provided callback function for each existing option.
+ *
+ */
+
+/*
+ * FLUIDSYNTH_API int
+ * fluid_settings_option_count (fluid_settings_t *settings,
+ *                              const char *name)
+ * 
+ * Count option string values for a string setting.
+ * 
+ */
+
+/*
+ * FLUIDSYNTH_API char *
+ * fluid_settings_option_concat (fluid_settings_t *settings,
+ *                               const char *name,
+ *                               const char *separator)
+ *
+ * Concatenate options for a string setting together with a separator
+ * between.
+ * 
+ */
+
+/*
+ * FLUIDSYNTH_API void
+ * fluid_settings_foreach (fluid_settings_t *settings,
+ *                         void *data,
+ *                         fluid_settings_foreach_t func)
+ *
+ * Iterate the existing settings defined in a settings object, calling
+ * the provided callback function for each setting.
+ *
+ */
+
+
+/*-------------------------------------------------------------------
+  ---=  Audio =---
+  ------------------------------------------------------------------*/
+
+/*
+ * FLUIDSYNTH_API fluid_audio_driver_t *
+ * new_fluid_audio_driver (fluid_settings_t *settings,
+ *                         fluid_synth_t *synth)
+ *
+ * Create a new audio driver.
+ *
+ */
+
+static int
+c_new_fluid_audio_driver (lua_State* L)
+{
+        fluid_settings_t* settings = *(fluid_settings_t**)lua_touserdata(L, 1);
+        if (settings == NULL) { lua_pushnil(L); return 1; }
+
+        fluid_synth_t* synth = *(fluid_synth_t**)lua_touserdata(L, 2);
+        if (synth == NULL) { lua_pushnil(L); return 1; }
+
+        fluid_audio_driver_t** driver_p =
+                lua_newuserdata(L, sizeof(fluid_audio_driver_t*));
+        *driver_p = new_fluid_audio_driver(settings, synth);
+        
+        return 1;
+}
+
+/*
+ * DSP inserts. Drivers created with `new_fluid_audio_driver2` render
+ * the synth from a C callback and run the output through a chain of
+ * built-in inserts on the audio thread. A chain is built on the Lua
+ * thread and handed over through `pending`; the audio thread picks it
+ * up at the start of a block, carries the state of matching inserts
+ * over so filters do not click, and pushes the chain it replaced onto
+ * `retired` for the Lua thread to free.
+ *
+ */
+
+enum dsp_kind {
+        DSP_GAIN,
+        DSP_BIQUAD,
+        DSP_LIMITER,
+        DSP_DC_BLOCKER
+};
+
+static const char* const dsp_kinds[] = {
+        "gain", "biquad", "limiter", "dc_blocker", NULL
+};
+
+enum dsp_shape {
+        DSP_LOWPASS,
+        DSP_HIGHPASS,
+        DSP_BANDPASS,
+        DSP_NOTCH,
+        DSP_PEAK,
+        DSP_LOWSHELF,
+        DSP_HIGHSHELF
+};
+
+static const char* const dsp_shapes[] = {
+        "lowpass", "highpass", "bandpass", "notch", "peak", "lowshelf", "highshelf", NULL
+};
+
+struct dsp_insert {
+        int kind;
+
+        float gain;                     // gain: linear
+        double b0, b1, b2, a1, a2;      // biquad
+        float threshold;                // limiter: linear
+        float release;                  // limiter: envelope decay per sample
+        double pole;                    // dc blocker
+
+        // state, carried over to the next chain
+        float level;                    // gain: current gain, limiter: envelope
+        double z[2][2];                 // biquad: delays, dc blocker: last x and y
+};
+
+struct dsp_chain {
+        struct dsp_chain* next;         // on the retired list
+        int count;
+        struct dsp_insert inserts[];
+};
+
+struct dsp_driver {
+        fluid_audio_driver_t* driver;   // first, like the boxes of other drivers
+        fluid_synth_t* synth;
+        double sample_rate;
+
+        struct dsp_chain* current;      // owned by the audio thread
+        struct dsp_chain* _Atomic pending;
+        struct dsp_chain* _Atomic retired;
+};
+
+typedef void (*dsp_scale_fn) (float* x, size_t n, float gain);
+
+static void
+dsp_scale_scalar (float* x, size_t n, float gain)
+{
+        for (size_t i = 0; i < n; i++) { x[i] *= gain; }
+}
+
+#ifdef HAVE_CONVERT_X86
+__attribute__((target("sse2")))
+static void
+dsp_scale_sse2 (float* x, size_t n, float gain)
+{
+        __m128 g = _mm_set1_ps(gain);
+        size_t i = 0;
+        for (; i + 4 <= n; i += 4) {
+                _mm_storeu_ps(x + i, _mm_mul_ps(_mm_loadu_ps(x + i), g));
+        }
+        dsp_scale_scalar(x + i, n - i, gain);
+}
+
+__attribute__((target("avx2")))
+static void
+dsp_scale_avx2 (float* x, size_t n, float gain)
+{
+        __m256 g = _mm256_set1_ps(gain);
+        size_t i = 0;
+        for (; i + 8 <= n; i += 8) {
+                _mm256_storeu_ps(x + i, _mm256_mul_ps(_mm256_loadu_ps(x + i), g));
+        }
+        dsp_scale_scalar(x + i, n - i, gain);
+}
+#endif
+
+static dsp_scale_fn dsp_scale = dsp_scale_scalar;
+
+static void
+dsp_select (void)
+{
+#ifdef HAVE_CONVERT_X86
+        if (cpu_has_avx2()) {
+                dsp_scale = dsp_scale_avx2;
+        } else if (cpu_has_sse2()) {
+                dsp_scale = dsp_scale_sse2;
+        }
+#endif
+}
+
+static void
+dsp_gain (struct dsp_insert* d, float* ch[2], int len)
+{
+        if (d->level == d->gain) {
+                dsp_scale(ch[0], len, d->gain);
+                dsp_scale(ch[1], len, d->gain);
+                return;
+        }
+
+        // ramp to a changed gain over the block
+        float step = (d->gain - d->level) / len;
+        for (int i = 0; i < len; i++) {
+                float g = d->level + step * (i + 1);
+                ch[0][i] *= g;
+                ch[1][i] *= g;
+        }
+        d->level = d->gain;
+}
+
+// transposed direct form II, in double so low shelves stay stable
+static void
+dsp_biquad (struct dsp_insert* d, float* ch[2], int len)
+{
+        for (int c = 0; c < 2; c++) {
+                double z1 = d->z[c][0], z2 = d->z[c][1];
+                float* x = ch[c];
+                for (int i = 0; i < len; i++) {
+                        double in = x[i];
+                        double y = d->b0 * in + z1;
+                        z1 = d->b1 * in - d->a1 * y + z2;
+                        z2 = d->b2 * in - d->a2 * y;
+                        x[i] = (float)y;
+                }
+                d->z[c][0] = z1;
+                d->z[c][1] = z2;
+        }
+}
+
+// stereo linked peak limiter with instant attack
+static void
+dsp_limiter (struct dsp_insert* d, float* ch[2], int len)
+{
+        float peak[2] = { 0.0f, 0.0f };
+        double sumsq[2] = { 0.0, 0.0 };
+        meter_scan(ch[0], len, 0, peak, sumsq);
+        meter_scan(ch[1], len, 0, peak, sumsq);
+
+        // nothing to limit: the envelope after the block is at most
+        // the larger of its peak and the decayed envelope
+        if (peak[0] <= d->threshold && d->level <= d->threshold) {
+                float decayed = d->level * powf(d->release, len);
+                d->level = peak[0] > decayed ? peak[0] : decayed;
+                return;
+        }
+
+        float env = d->level;
+        for (int i = 0; i < len; i++) {
+                float a = fmaxf(fabsf(ch[0][i]), fabsf(ch[1][i]));
+                env *= d->release;
+                if (a > env) { env = a; }
+                if (env > d->threshold) {
+                        float g = d->threshold / env;
+                        ch[0][i] *= g;
+                        ch[1][i] *= g;
+                }
+        }
+        d->level = env;
+}
+
+static void
+dsp_dc_blocker (struct dsp_insert* d, float* ch[2], int len)
+{
+        for (int c = 0; c < 2; c++) {
+                double x1 = d->z[c][0], y1 = d->z[c][1];
+                float* x = ch[c];
+                for (int i = 0; i < len; i++) {
+                        double y = x[i] - x1 + d->pole * y1;
+                        x1 = x[i];
+                        y1 = y;
+                        x[i] = (float)y;
+                }
+                d->z[c][0] = x1;
+                d->z[c][1] = y1;
+        }
+}
+
+static void
+dsp_chain_run (struct dsp_chain* chain, float* ch[2], int len)
+{
+        if (chain == NULL || len <= 0) { return; }
+
+        for (int i = 0; i < chain->count; i++) {
+                struct dsp_insert* d = &chain->inserts[i];
+                switch (d->kind) {
+                case DSP_GAIN:       dsp_gain(d, ch, len); break;
+                case DSP_BIQUAD:     dsp_biquad(d, ch, len); break;
+                case DSP_LIMITER:    dsp_limiter(d, ch, len); break;
+                case DSP_DC_BLOCKER: dsp_dc_blocker(d, ch, len); break;
+                }
+        }
+}
+
+// take over the state of inserts of the same kind at the same position
+static void
+dsp_chain_carry (struct dsp_chain* to, const struct dsp_chain* from)
+{
+        if (from == NULL) { return; }
+
+        for (int i = 0; i < to->count && i < from->count; i++) {
+                struct dsp_insert* d = &to->inserts[i];
+                const struct dsp_insert* s = &from->inserts[i];
+                if (d->kind != s->kind) { continue; }
+                d->level = s->level;
+                memcpy(d->z, s->z, sizeof(d->z));
+        }
+}
+
+static void
+dsp_chain_free (struct dsp_chain* chain)
+{
+        while (chain != NULL) {
+                struct dsp_chain* next = chain->next;
+                free(chain);
+                chain = next;
+        }
+}
+
+static int
+dsp_driver_callback (void* data, int len, int nin, float** in, int nout, float** out)
+{
+        struct dsp_driver* d = (struct dsp_driver*)data;
+        if (nout < 2) { return FLUID_FAILED; }
+
+        struct dsp_chain* swapped = atomic_exchange(&d->pending, NULL);
+        if (swapped != NULL) {
+                dsp_chain_carry(swapped, d->current);
+                struct dsp_chain* old = d->current;
+                d->current = swapped;
+                if (old != NULL) {
+                        old->next = atomic_load(&d->retired);
+                        while (!atomic_compare_exchange_weak(&d->retired, &old->next, old)) {}
+                }
+        }
+
+        fluid_synth_write_float(d->synth, len, out[0], 0, 1, out[1], 0, 1);
+        for (int c = 2; c < nout; c++) { memset(out[c], 0, len * sizeof(float)); }
+
+        dsp_chain_run(d->current, out, len);
+        return FLUID_OK;
+}
+
+// read the number `name` of the insert table on top of the stack
+static double
+dsp_field (lua_State* L, int n, const char* name, double def)
+{
+        lua_getfield(L, -1, name);
+        int isnum;
+        double v = lua_tonumberx(L, -1, &isnum);
+        if (!isnum) {
+                if (!lua_isnil(L, -1)) { luaL_error(L, "insert %d: %s must be a number", n, name); }
+                v = def;
+        }
+        lua_pop(L, 1);
+        return v;
+}
+
+// RBJ audio EQ cookbook coefficients, normalized by a0
+static void
+dsp_biquad_design (struct dsp_insert* d, int shape, double freq, double q,
+                   double db, double sample_rate)
+{
+        double w0 = 2 * M_PI * freq / sample_rate;
+        double cw = cos(w0), alpha = sin(w0) / (2 * q);
+        double A = pow(10, db / 40);
+        double sa = 2 * sqrt(A) * alpha;
+        double b0, b1, b2, a0, a1, a2;
+
+        switch (shape) {
+        case DSP_LOWPASS:
+                b0 = (1 - cw) / 2; b1 = 1 - cw; b2 = b0;
+                a0 = 1 + alpha; a1 = -2 * cw; a2 = 1 - alpha;
+                break;
+        case DSP_HIGHPASS:
+                b0 = (1 + cw) / 2; b1 = -(1 + cw); b2 = b0;
+                a0 = 1 + alpha; a1 = -2 * cw; a2 = 1 - alpha;
+                break;
+        case DSP_BANDPASS:
+                b0 = alpha; b1 = 0; b2 = -alpha;
+                a0 = 1 + alpha; a1 = -2 * cw; a2 = 1 - alpha;
+                break;
+        case DSP_NOTCH:
+                b0 = 1; b1 = -2 * cw; b2 = 1;
+                a0 = 1 + alpha; a1 = -2 * cw; a2 = 1 - alpha;
+                break;
+        case DSP_PEAK:
+                b0 = 1 + alpha * A; b1 = -2 * cw; b2 = 1 - alpha * A;
+                a0 = 1 + alpha / A; a1 = -2 * cw; a2 = 1 - alpha / A;
+                break;
+        case DSP_LOWSHELF:
+                b0 = A * ((A + 1) - (A - 1) * cw + sa);
+                b1 = 2 * A * ((A - 1) - (A + 1) * cw);
+                b2 = A * ((A + 1) - (A - 1) * cw - sa);
+                a0 = (A + 1) + (A - 1) * cw + sa;
+                a1 = -2 * ((A - 1) + (A + 1) * cw);
+                a2 = (A + 1) + (A - 1) * cw - sa;
+                break;
+        default:
+                b0 = A * ((A + 1) + (A - 1) * cw + sa);
+                b1 = -2 * A * ((A - 1) + (A + 1) * cw);
+                b2 = A * ((A + 1) + (A - 1) * cw - sa);
+                a0 = (A + 1) - (A - 1) * cw + sa;
+                a1 = 2 * ((A - 1) - (A + 1) * cw);
+                a2 = (A + 1) - (A - 1) * cw - sa;
+                break;
+        }
+
+        d->b0 = b0 / a0; d->b1 = b1 / a0; d->b2 = b2 / a0;
+        d->a1 = a1 / a0; d->a2 = a2 / a0;
+}
+
+/*
+ * Build a chain from the array of insert tables at `index`. Each
+ * table names its kind first, followed by its parameters:
+ *
+ *      { "gain", db = 0 }
+ *      { "biquad", shape = "peak", freq = 1000, q = 0.707, db = 0 }
+ *      { "limiter", threshold = -1, release = 50 }     -- dBFS, ms
+ *      { "dc_blocker", freq = 10 }
+ *
+ * Raises an error for a malformed chain.
  *
  */
 
+static struct dsp_chain*
+dsp_chain_from_lua (lua_State* L, int index, double sample_rate)
+{
+        luaL_checktype(L, index, LUA_TTABLE);
+        int count = (int)lua_rawlen(L, index);
+        size_t size = sizeof(struct dsp_chain) + count * sizeof(struct dsp_insert);
+
+        // built in a userdata so a Lua error leaves nothing to free
+        struct dsp_chain* chain = lua_newuserdata(L, size);
+        memset(chain, 0, size);
+        chain->count = count;
+
+        for (int n = 1; n <= count; n++) {
+                struct dsp_insert* d = &chain->inserts[n - 1];
+                if (lua_rawgeti(L, index, n) != LUA_TTABLE) {
+                        luaL_error(L, "insert %d: table expected", n);
+                }
+                lua_rawgeti(L, -1, 1);
+                const char* kind = lua_tostring(L, -1);
+                d->kind = -1;
+                for (int k = 0; kind != NULL && dsp_kinds[k] != NULL; k++) {
+                        if (strcmp(kind, dsp_kinds[k]) == 0) { d->kind = k; }
+                }
+                lua_pop(L, 1);
+                if (d->kind < 0) { luaL_error(L, "insert %d: unknown kind", n); }
+
+                double freq, q, db;
+                const char* name;
+                int shape = -1;
+                switch (d->kind) {
+                case DSP_GAIN:
+                        d->gain = (float)pow(10, dsp_field(L, n, "db", 0) / 20);
+                        d->level = d->gain;
+                        break;
+                case DSP_BIQUAD:
+                        lua_getfield(L, -1, "shape");
+                        name = lua_isnil(L, -1) ? "peak" : lua_tostring(L, -1);
+                        for (int k = 0; name != NULL && dsp_shapes[k] != NULL; k++) {
+                                if (strcmp(name, dsp_shapes[k]) == 0) { shape = k; }
+                        }
+                        lua_pop(L, 1);
+                        if (shape < 0) { luaL_error(L, "insert %d: unknown shape", n); }
+                        freq = dsp_field(L, n, "freq", 1000);
+                        q = dsp_field(L, n, "q", M_SQRT1_2);
+                        db = dsp_field(L, n, "db", 0);
+                        if (freq <= 0 || freq >= sample_rate / 2 || q <= 0) {
+                                luaL_error(L, "insert %d: freq or q out of range", n);
+                        }
+                        dsp_biquad_design(d, shape, freq, q, db, sample_rate);
+                        break;
+                case DSP_LIMITER:
+                        d->threshold = (float)pow(10, dsp_field(L, n, "threshold", -1) / 20);
+                        d->release = (float)exp(-1000 / (fmax(dsp_field(L, n, "release", 50), 1) * sample_rate));
+                        break;
+                case DSP_DC_BLOCKER:
+                        freq = dsp_field(L, n, "freq", 10);
+                        if (freq <= 0 || freq >= sample_rate / 2) {
+                                luaL_error(L, "insert %d: freq out of range", n);
+                        }
+                        d->pole = exp(-2 * M_PI * freq / sample_rate);
+                        break;
+                }
+                lua_pop(L, 1);
+        }
+
+        struct dsp_chain* copy = malloc(size);
+        if (copy != NULL) { memcpy(copy, chain, size); }
+        lua_pop(L, 1);
+        return copy;
+}
+
+// free the chains the audio thread is done with, then queue `chain`
+static void
+dsp_driver_set_chain (struct dsp_driver* d, struct dsp_chain* chain)
+{
+        dsp_chain_free(atomic_exchange(&d->retired, NULL));
+
+        // a chain still pending was never seen by the audio thread
+        struct dsp_chain* unused = atomic_exchange(&d->pending, chain);
+        free(unused);
+}
+
+static int
+gc_delete_fluid_audio_driver2 (lua_State* L)
+{
+        struct dsp_driver* d = luaL_checkudata(L, 1, "fluid.audiodriver2");
+        if (d->driver == NULL) { return 0; }
+
+        delete_fluid_audio_driver(d->driver);
+        d->driver = NULL;
+
+        dsp_chain_free(d->current);
+        free(atomic_exchange(&d->pending, NULL));
+        dsp_chain_free(atomic_exchange(&d->retired, NULL));
+        d->current = NULL;
+        return 0;
+}
+
 /*
- * FLUIDSYNTH_API double
- * fluid_settings_getnum_default (fluid_settings_t *settings,
- *                                const char *name)
+ * FLUIDSYNTH_API fluid_audio_driver_t *
+ * new_fluid_audio_driver2 (fluid_settings_t *settings,
+ *                          fluid_audio_func_t func,
+ *                          void *data)
  *
- * Get the default value of a named numeric (double) setting.
+ * Create a new audio driver.
+ *
+ * Bound as `new_fluid_audio_driver2(settings, synth, chain)`: the
+ * driver's callback renders `synth` and runs its output through
+ * `chain` (see `dsp_chain_from_lua`), all in C on the audio thread.
+ * The driver is deleted with `delete_fluid_audio_driver` or when it
+ * is collected.
  *
  */
 
+static int
+c_new_fluid_audio_driver2 (lua_State* L)
+{
+        fluid_settings_t* settings = *(fluid_settings_t**)lua_touserdata(L, 1);
+        if (settings == NULL) { lua_pushnil(L); return 1; }
+
+        fluid_synth_t* synth = *(fluid_synth_t**)lua_touserdata(L, 2);
+        if (synth == NULL) { lua_pushnil(L); return 1; }
+
+        double sample_rate = 44100.0;
+        fluid_settings_getnum(settings, "synth.sample-rate", &sample_rate);
+
+        struct dsp_chain* chain = NULL;
+        if (!lua_isnoneornil(L, 3)) {
+                chain = dsp_chain_from_lua(L, 3, sample_rate);
+                if (chain == NULL) { lua_pushnil(L); return 1; }
+        }
+
+        struct dsp_driver* d = lua_newuserdata(L, sizeof(struct dsp_driver));
+        memset(d, 0, sizeof(struct dsp_driver));
+        d->synth = synth;
+        d->sample_rate = sample_rate;
+        d->current = chain;
+        atomic_init(&d->pending, NULL);
+        atomic_init(&d->retired, NULL);
+        luaL_setmetatable(L, "fluid.audiodriver2");
+
+        d->driver = new_fluid_audio_driver2(settings, dsp_driver_callback, d);
+        if (d->driver == NULL) {
+                dsp_chain_free(chain);
+                d->current = NULL;
+                lua_pushnil(L);
+                return 1;
+        }
+
+        return 1;
+}
+
 /*
- * FLUIDSYNTH_API void
- * fluid_settings_getnum_range (fluid_settings_t *settings,
- *                              const char *name,
- *                              double *min,
- *                              double *max)
+ * fluid_audio_driver_set_chain (driver, chain)
  *
- * Get the range of values of a numeric setting.
+ * Replace the insert chain of a driver from `new_fluid_audio_driver2`.
+ * The audio thread switches at the start of its next block; inserts of
+ * the same kind at the same position keep their state, and a changed
+ * gain is ramped over that block.
  *
  */
 
+static int
+c_fluid_audio_driver_set_chain (lua_State* L)
+{
+        struct dsp_driver* d = luaL_checkudata(L, 1, "fluid.audiodriver2");
+        if (d->driver == NULL) { lua_pushnil(L); return 1; }
+
+        struct dsp_chain* chain = dsp_chain_from_lua(L, 2, d->sample_rate);
+        if (chain == NULL) { lua_pushnil(L); return 1; }
+        dsp_driver_set_chain(d, chain);
+
+        lua_pushinteger(L, FLUID_OK);
+        return 1;
+}
+
 /*
- * FLUIDSYNTH_API int
- * fluid_settings_setint (fluid_settings_t *settings,
- *                        const char *name,
- *                        int val)
+ * FLUIDSYNTH_API void
+ * delete_fluid_audio_driver (fluid_audio_driver_t *driver)
  *
- * Set an integer value for a setting.
+ * Deletes an audio driver instance.
  *
  */
 
+static int
+c_delete_fluid_audio_driver (lua_State* L)
+{
+        if (luaL_testudata(L, 1, "fluid.audiodriver2") != NULL) {
+                return gc_delete_fluid_audio_driver2(L);
+        }
+
+        fluid_audio_driver_t* driver = *(fluid_audio_driver_t**)lua_touserdata(L, 1);
+        if (driver == NULL) { lua_pushnil(L); return 1; }
+
+        delete_fluid_audio_driver(driver);
+        
+        return 0;
+}
+
 /*
- * FLUIDSYNTH_API int
- * fluid_settings_getint (fluid_settings_t *settings,
- *                        const char *name,
- *                        int *val)
+ * FLUIDSYNTH_API fluid_file_renderer_t *
+ * new_fluid_file_renderer (fluid_synth_t *synth)
  *
- * Get an integer value setting.
+ * Create a new file renderer and open the file.
  *
  */
 
 /*
  * FLUIDSYNTH_API int
- * fluid_settings_getint_default (fluid_settings_t *settings,
- *                                const char *name)
+ * fluid_file_renderer_process_block (fluid_file_renderer_t *dev)
  *
- * Get the default value of an integer setting.
+ * Write period_size samples to file.
  *
  */
 
 /*
  * FLUIDSYNTH_API void
- * fluid_settings_getint_range (fluid_settings_t *settings,
- *                              const char *name,
- *                              int *min,
- *                              int *max)
+ * delete_fluid_file_renderer (fluid_file_renderer_t *dev)
  *
- * Get the range of values of an integer setting.
+ * Close file and destroy a file renderer object.
  *
  */
 
 /*
- * FLUIDSYNTH_API void
- * fluid_settings_foreach_option (fluid_settings_t *settings,
- *                                const char *name,
- *                                void *data,
- *                                fluid_settings_foreach_option_t func)
+ * Render farm. Jobs rendering a MIDI file with a SoundFont to an
+ * audio file through the file renderer run on a fixed pool of worker
+ * threads, each with its own settings and synth, and finished jobs
+ * are collected with `fluid_render_farm_poll`. A worker keeps its
+ * synth, and with it the loaded SoundFont, while consecutive jobs use
+ * the same SoundFont and settings.
  *
- * Iterate the available options for a named string setting, calling
- * the provided callback function for each existing option.
+ * Jobs render as fast as possible with "player.timing-source" set to
+ * "sample". The output format follows the "audio.file.*" settings of
+ * the job.
  *
  */
 
-/*
- * FLUIDSYNTH_API int
- * fluid_settings_option_count (fluid_settings_t *settings,
- *                              const char *name)
- * 
- * Count option string values for a string setting.
- * 
- */
+struct farm_setting {
+        char* name;
+        char* str;              // NULL for numbers
+        double num;
+};
 
-/*
- * FLUIDSYNTH_API char *
- * fluid_settings_option_concat (fluid_settings_t *settings,
- *                               const char *name,
- *                               const char *separator)
- *
- * Concatenate options for a string setting together with a separator
- * between.
- * 
- */
+struct farm_job {
+        int id;
+        char* midi;
+        char* soundfont;
+        char* output;
+        int nsettings;
+        struct farm_setting* settings;
+        char* key;              // SoundFont and settings, see `farm_worker`
+
+        int ok;
+        char message[128];
+
+        struct farm_job* next;
+};
+
+struct farm_worker {
+        struct render_farm* farm;
+        fluid_settings_t* settings;
+        fluid_synth_t* synth;
+        char* key;
+};
+
+struct render_farm {
+        pthread_mutex_t lock;
+        pthread_cond_t work;            // jobs were queued, or stopping
+        pthread_cond_t done;            // a job finished
+        struct farm_job* queue;
+        struct farm_job** queue_tail;
+        struct farm_job* finished;
+        struct farm_job** finished_tail;
+        int pending;                    // jobs queued or running
+        int stopping;
+        int next_id;
+
+        int nworkers;
+        pthread_t* threads;
+        struct farm_worker* workers;
+        int fds[2];                     // one byte per finished job
+};
+
+static void
+farm_job_free (struct farm_job* job)
+{
+        for (int i = 0; i < job->nsettings; i++) {
+                free(job->settings[i].name);
+                free(job->settings[i].str);
+        }
+        free(job->settings);
+        free(job->midi);
+        free(job->soundfont);
+        free(job->output);
+        free(job->key);
+        free(job);
+}
+
+static void
+farm_worker_reset (struct farm_worker* w)
+{
+        if (w->synth != NULL) { delete_fluid_synth(w->synth); }
+        if (w->settings != NULL) { delete_fluid_settings(w->settings); }
+        free(w->key);
+        w->synth = NULL;
+        w->settings = NULL;
+        w->key = NULL;
+}
+
+static void
+farm_apply_setting (fluid_settings_t* settings, const struct farm_setting* s)
+{
+        if (s->str != NULL) {
+                fluid_settings_setstr(settings, s->name, s->str);
+        } else if (fluid_settings_get_type(settings, s->name) == FLUID_INT_TYPE) {
+                fluid_settings_setint(settings, s->name, (int)s->num);
+        } else {
+                fluid_settings_setnum(settings, s->name, s->num);
+        }
+}
+
+static int
+farm_fail (struct farm_job* job, const char* what, const char* path)
+{
+        snprintf(job->message, sizeof(job->message), "%s: %s", what, path);
+        job->ok = 0;
+        return FLUID_FAILED;
+}
+
+static int
+farm_run (struct farm_worker* w, struct farm_job* job)
+{
+        if (w->key == NULL || strcmp(w->key, job->key) != 0) {
+                farm_worker_reset(w);
+
+                w->settings = new_fluid_settings();
+                if (w->settings == NULL) { return farm_fail(job, "cannot create settings", job->midi); }
+                fluid_settings_setstr(w->settings, "player.timing-source", "sample");
+                fluid_settings_setint(w->settings, "synth.lock-memory", 0);
+                for (int i = 0; i < job->nsettings; i++) {
+                        farm_apply_setting(w->settings, &job->settings[i]);
+                }
+
+                pthread_mutex_lock(&synth_init_lock);
+                w->synth = new_fluid_synth(w->settings);
+                pthread_mutex_unlock(&synth_init_lock);
+                if (w->synth == NULL) { return farm_fail(job, "cannot create synth", job->midi); }
+
+                if (fluid_synth_sfload(w->synth, job->soundfont, 1) == FLUID_FAILED) {
+                        farm_worker_reset(w);
+                        return farm_fail(job, "cannot load soundfont", job->soundfont);
+                }
+                w->key = farm_strdup(job->key);
+        } else {
+                fluid_synth_system_reset(w->synth);
+        }
+
+        fluid_settings_setstr(w->settings, "audio.file.name", job->output);
+
+        fluid_player_t* player = new_fluid_player(w->synth);
+        if (player == NULL) { return farm_fail(job, "cannot create player", job->midi); }
+        if (fluid_player_add(player, job->midi) != FLUID_OK) {
+                delete_fluid_player(player);
+                return farm_fail(job, "cannot read midi file", job->midi);
+        }
+
+        fluid_file_renderer_t* renderer = new_fluid_file_renderer(w->synth);
+        if (renderer == NULL) {
+                delete_fluid_player(player);
+                return farm_fail(job, "cannot open output", job->output);
+        }
+
+        job->ok = 1;
+        fluid_player_play(player);
+        while (fluid_player_get_status(player) == FLUID_PLAYER_PLAYING) {
+                if (fluid_file_renderer_process_block(renderer) != FLUID_OK) {
+                        farm_fail(job, "cannot write output", job->output);
+                        break;
+                }
+        }
+
+        fluid_player_stop(player);
+        delete_fluid_player(player);
+        delete_fluid_file_renderer(renderer);
+
+        return job->ok ? FLUID_OK : FLUID_FAILED;
+}
+
+static void*
+farm_worker_main (void* arg)
+{
+        struct farm_worker* w = (struct farm_worker*)arg;
+        struct render_farm* farm = w->farm;
+
+        pthread_mutex_lock(&farm->lock);
+        for (;;) {
+                while (farm->queue == NULL && !farm->stopping) {
+                        pthread_cond_wait(&farm->work, &farm->lock);
+                }
+                if (farm->stopping) { break; }
+
+                struct farm_job* job = farm->queue;
+                farm->queue = job->next;
+                if (farm->queue == NULL) { farm->queue_tail = &farm->queue; }
+                pthread_mutex_unlock(&farm->lock);
+
+                farm_run(w, job);
+
+                pthread_mutex_lock(&farm->lock);
+                job->next = NULL;
+                *farm->finished_tail = job;
+                farm->finished_tail = &job->next;
+                farm->pending--;
+                pthread_cond_broadcast(&farm->done);
+
+                char byte = 1;
+                if (write(farm->fds[1], &byte, 1) != 1) { /* the pipe is only a hint */ }
+        }
+        pthread_mutex_unlock(&farm->lock);
+
+        farm_worker_reset(w);
+        return NULL;
+}
+
+static void
+farm_free_list (struct farm_job* job)
+{
+        while (job != NULL) {
+                struct farm_job* next = job->next;
+                farm_job_free(job);
+                job = next;
+        }
+}
+
+static void
+render_farm_delete (struct render_farm* farm)
+{
+        pthread_mutex_lock(&farm->lock);
+        farm->stopping = 1;
+        pthread_cond_broadcast(&farm->work);
+        pthread_mutex_unlock(&farm->lock);
+
+        for (int i = 0; i < farm->nworkers; i++) {
+                pthread_join(farm->threads[i], NULL);
+        }
+
+        farm_free_list(farm->queue);
+        farm_free_list(farm->finished);
+        close(farm->fds[0]);
+        close(farm->fds[1]);
+        pthread_cond_destroy(&farm->work);
+        pthread_cond_destroy(&farm->done);
+        pthread_mutex_destroy(&farm->lock);
+        free(farm->threads);
+        free(farm->workers);
+        free(farm);
+}
+
+static struct render_farm*
+check_render_farm (lua_State* L, int index)
+{
+        struct render_farm** farm_p = luaL_checkudata(L, index, "fluid.renderfarm");
+        if (*farm_p == NULL) { luaL_argerror(L, index, "deleted render farm"); }
+        return *farm_p;
+}
 
 /*
- * FLUIDSYNTH_API void
- * fluid_settings_foreach (fluid_settings_t *settings,
- *                         void *data,
- *                         fluid_settings_foreach_t func)
+ * new_fluid_render_farm (threads)
  *
- * Iterate the existing settings defined in a settings object, calling
- * the provided callback function for each setting.
+ * Start a render farm with `threads` worker threads.
  *
  */
 
+static int
+c_new_fluid_render_farm (lua_State* L)
+{
+        int nworkers = (int)luaL_checkinteger(L, 1);
+        luaL_argcheck(L, nworkers > 0, 1, "need at least one thread");
+
+        struct render_farm** farm_p = lua_newuserdata(L, sizeof(struct render_farm*));
+        *farm_p = NULL;
+        luaL_setmetatable(L, "fluid.renderfarm");
+
+        struct render_farm* farm = calloc(1, sizeof(struct render_farm));
+        if (farm == NULL) { lua_pushnil(L); return 1; }
+
+        farm->threads = calloc(nworkers, sizeof(pthread_t));
+        farm->workers = calloc(nworkers, sizeof(struct farm_worker));
+        if (farm->threads == NULL || farm->workers == NULL || pipe(farm->fds) != 0) {
+                free(farm->threads);
+                free(farm->workers);
+                free(farm);
+                lua_pushnil(L);
+                return 1;
+        }
+        fcntl(farm->fds[0], F_SETFL, fcntl(farm->fds[0], F_GETFL) | O_NONBLOCK);
+        fcntl(farm->fds[1], F_SETFL, fcntl(farm->fds[1], F_GETFL) | O_NONBLOCK);
+
+        pthread_mutex_init(&farm->lock, NULL);
+        pthread_cond_init(&farm->work, NULL);
+        pthread_cond_init(&farm->done, NULL);
+        farm->queue_tail = &farm->queue;
+        farm->finished_tail = &farm->finished;
+        farm->next_id = 1;
+
+        for (int i = 0; i < nworkers; i++) {
+                farm->workers[i].farm = farm;
+                if (pthread_create(&farm->threads[i], NULL, farm_worker_main, &farm->workers[i]) != 0) {
+                        break;
+                }
+                farm->nworkers++;
+        }
+
+        *farm_p = farm;
+        if (farm->nworkers < nworkers) {
+                render_farm_delete(farm);
+                *farm_p = NULL;
+                lua_pushnil(L);
+        }
 
-/*-------------------------------------------------------------------
-  ---=  Audio =---
-  ------------------------------------------------------------------*/
+        return 1;
+}
+
+static int
+gc_delete_fluid_render_farm (lua_State* L)
+{
+        struct render_farm** farm_p = (struct render_farm**)lua_touserdata(L, 1);
+        if (*farm_p == NULL) { return 0; }
+
+        render_farm_delete(*farm_p);
+        *farm_p = NULL;
+        return 0;
+}
 
 /*
- * FLUIDSYNTH_API fluid_audio_driver_t *
- * new_fluid_audio_driver (fluid_settings_t *settings,
- *                         fluid_synth_t *synth)
+ * delete_fluid_render_farm (farm)
  *
- * Create a new audio driver.
+ * Drop the queued jobs, wait for the running ones and stop the
+ * workers.
  *
  */
 
 static int
-c_new_fluid_audio_driver (lua_State* L)
+c_delete_fluid_render_farm (lua_State* L)
 {
-        fluid_settings_t* settings = *(fluid_settings_t**)lua_touserdata(L, 1);
-        if (settings == NULL) { lua_pushnil(L); return 1; }
+        luaL_checkudata(L, 1, "fluid.renderfarm");
+        return gc_delete_fluid_render_farm(L);
+}
 
-        fluid_synth_t* synth = *(fluid_synth_t**)lua_touserdata(L, 2);
-        if (synth == NULL) { lua_pushnil(L); return 1; }
+static int
+farm_setting_compare (const void* a, const void* b)
+{
+        return strcmp(((const struct farm_setting*)a)->name,
+                      ((const struct farm_setting*)b)->name);
+}
 
-        fluid_audio_driver_t** driver_p =
-                lua_newuserdata(L, sizeof(fluid_audio_driver_t*));
-        *driver_p = new_fluid_audio_driver(settings, synth);
-        
-        return 1;
+// the SoundFont followed by the sorted settings, one per line
+static char*
+farm_job_key (struct farm_job* job)
+{
+        qsort(job->settings, job->nsettings, sizeof(struct farm_setting), farm_setting_compare);
+
+        size_t len = strlen(job->soundfont) + 1;
+        for (int i = 0; i < job->nsettings; i++) {
+                len += strlen(job->settings[i].name) + 64
+                        + (job->settings[i].str ? strlen(job->settings[i].str) : 0);
+        }
+
+        char* key = malloc(len);
+        if (key == NULL) { return NULL; }
+
+        char* p = key + sprintf(key, "%s", job->soundfont);
+        for (int i = 0; i < job->nsettings; i++) {
+                const struct farm_setting* st = &job->settings[i];
+                if (st->str != NULL) {
+                        p += sprintf(p, "\n%s=%s", st->name, st->str);
+                } else {
+                        p += sprintf(p, "\n%s=%.17g", st->name, st->num);
+                }
+        }
+
+        return key;
 }
 
 /*
- * FLUIDSYNTH_API fluid_audio_driver_t *
- * new_fluid_audio_driver2 (fluid_settings_t *settings,
- *                          fluid_audio_func_t func,
- *                          void *data)
- *
- * Create a new audio driver.
+ * Copy the job table at `index` into a new job. Returns NULL when out
+ * of memory, or when a path is missing after pointing `missing` at
+ * its name.
  *
  */
 
+static struct farm_job*
+farm_job_from_lua (lua_State* L, int index, const char** missing)
+{
+        struct farm_job* job = calloc(1, sizeof(struct farm_job));
+        if (job == NULL) { return NULL; }
+
+        const char* fields[] = { "midi", "soundfont", "output" };
+        char** dest[] = { &job->midi, &job->soundfont, &job->output };
+        for (int i = 0; i < 3; i++) {
+                lua_getfield(L, index, fields[i]);
+                const char* s = lua_tostring(L, -1);
+                if (s == NULL) {
+                        lua_pop(L, 1);
+                        farm_job_free(job);
+                        *missing = fields[i];
+                        return NULL;
+                }
+                *dest[i] = farm_strdup(s);
+                lua_pop(L, 1);
+                if (*dest[i] == NULL) { farm_job_free(job); return NULL; }
+        }
+
+        lua_getfield(L, index, "settings");
+        if (lua_istable(L, -1)) {
+                int capacity = 0;
+                lua_pushnil(L);
+                while (lua_next(L, -2) != 0) {
+                        int type = lua_type(L, -1);
+                        if (lua_type(L, -2) != LUA_TSTRING
+                            || (type != LUA_TNUMBER && type != LUA_TSTRING)) {
+                                lua_pop(L, 1);
+                                continue;
+                        }
+
+                        if (job->nsettings == capacity) {
+                                capacity = capacity ? 2 * capacity : 8;
+                                struct farm_setting* settings =
+                                        realloc(job->settings, capacity * sizeof(struct farm_setting));
+                                if (settings == NULL) { farm_job_free(job); return NULL; }
+                                job->settings = settings;
+                        }
+
+                        struct farm_setting* st = &job->settings[job->nsettings++];
+                        st->name = farm_strdup(lua_tostring(L, -2));
+                        st->str = type == LUA_TSTRING ? farm_strdup(lua_tostring(L, -1)) : NULL;
+                        st->num = type == LUA_TNUMBER ? lua_tonumber(L, -1) : 0;
+                        lua_pop(L, 1);
+
+                        if (st->name == NULL || (type == LUA_TSTRING && st->str == NULL)) {
+                                farm_job_free(job);
+                                return NULL;
+                        }
+                }
+        }
+        lua_pop(L, 1);
+
+        job->key = farm_job_key(job);
+        if (job->key == NULL) { farm_job_free(job); return NULL; }
+
+        return job;
+}
+
 /*
- * FLUIDSYNTH_API void
- * delete_fluid_audio_driver (fluid_audio_driver_t *driver)
+ * fluid_render_farm_submit (farm, jobs)
  *
- * Deletes an audio driver instance.
+ * Queue an array of jobs, each a table
+ *
+ *   { midi = path, soundfont = path, output = path,
+ *     settings = { ["synth.sample-rate"] = 48000, ... } }
+ *
+ * Returns the id of the first job. The others get the following ids.
  *
  */
 
 static int
-c_delete_fluid_audio_driver (lua_State* L)
+c_fluid_render_farm_submit (lua_State* L)
 {
-        fluid_audio_driver_t* driver = *(fluid_audio_driver_t**)lua_touserdata(L, 1);
-        if (driver == NULL) { lua_pushnil(L); return 1; }
-
-        delete_fluid_audio_driver(driver);
-        
-        return 0;
+        struct render_farm* farm = check_render_farm(L, 1);
+        luaL_checktype(L, 2, LUA_TTABLE);
+        int n = (int)lua_rawlen(L, 2);
+
+        // build every job before queueing any, so that a bad one
+        // leaves the queue untouched
+        struct farm_job* jobs = NULL;
+        struct farm_job** tail = &jobs;
+        for (int i = 1; i <= n; i++) {
+                lua_rawgeti(L, 2, i);
+                if (!lua_istable(L, -1)) {
+                        farm_free_list(jobs);
+                        return luaL_error(L, "job %d is not a table", i);
+                }
+                const char* missing = NULL;
+                struct farm_job* job = farm_job_from_lua(L, lua_gettop(L), &missing);
+                lua_pop(L, 1);
+                if (job == NULL) {
+                        farm_free_list(jobs);
+                        if (missing != NULL) { return luaL_error(L, "job %d has no `%s`", i, missing); }
+                        lua_pushnil(L);
+                        return 1;
+                }
+                *tail = job;
+                tail = &job->next;
+        }
+
+        pthread_mutex_lock(&farm->lock);
+        int first = farm->next_id;
+        for (struct farm_job* job = jobs; job != NULL; job = job->next) {
+                job->id = farm->next_id++;
+                farm->pending++;
+        }
+        if (jobs != NULL) {
+                *farm->queue_tail = jobs;
+                farm->queue_tail = tail;
+                pthread_cond_broadcast(&farm->work);
+        }
+        pthread_mutex_unlock(&farm->lock);
+
+        lua_pushinteger(L, first);
+        return 1;
 }
 
 /*
- * FLUIDSYNTH_API fluid_file_renderer_t *
- * new_fluid_file_renderer (fluid_synth_t *synth)
+ * fluid_render_farm_poll (farm, timeout)
  *
- * Create a new file renderer and open the file.
+ * Take one finished job, waiting up to `timeout` milliseconds for it
+ * (default 0, negative waits until one finishes).
+ *
+ * Returns the id of the job, true or false for success and an error
+ * message on failure, or nil if no job finished in time.
  *
  */
 
+static int
+c_fluid_render_farm_poll (lua_State* L)
+{
+        struct render_farm* farm = check_render_farm(L, 1);
+        lua_Integer timeout = luaL_optinteger(L, 2, 0);
+
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        if (timeout > 0) {
+                deadline.tv_sec += timeout / 1000;
+                deadline.tv_nsec += (timeout % 1000) * 1000000;
+                if (deadline.tv_nsec >= 1000000000) {
+                        deadline.tv_sec++;
+                        deadline.tv_nsec -= 1000000000;
+                }
+        }
+
+        pthread_mutex_lock(&farm->lock);
+        while (farm->finished == NULL && farm->pending > 0 && timeout != 0) {
+                if (timeout < 0) {
+                        pthread_cond_wait(&farm->done, &farm->lock);
+                } else if (pthread_cond_timedwait(&farm->done, &farm->lock, &deadline) != 0) {
+                        break;
+                }
+        }
+
+        struct farm_job* job = farm->finished;
+        if (job != NULL) {
+                farm->finished = job->next;
+                if (farm->finished == NULL) { farm->finished_tail = &farm->finished; }
+
+                char byte;
+                if (read(farm->fds[0], &byte, 1) != 1) { /* the pipe is only a hint */ }
+        }
+        pthread_mutex_unlock(&farm->lock);
+
+        if (job == NULL) { lua_pushnil(L); return 1; }
+
+        lua_pushinteger(L, job->id);
+        lua_pushboolean(L, job->ok);
+        if (job->ok) {
+                lua_pushnil(L);
+        } else {
+                lua_pushstring(L, job->message);
+        }
+        farm_job_free(job);
+
+        return 3;
+}
+
 /*
- * FLUIDSYNTH_API int
- * fluid_file_renderer_process_block (fluid_file_renderer_t *dev)
+ * fluid_render_farm_pending (farm)
  *
- * Write period_size samples to file.
+ * Get the number of jobs queued or running, and the number finished
+ * but not yet polled.
  *
  */
 
+static int
+c_fluid_render_farm_pending (lua_State* L)
+{
+        struct render_farm* farm = check_render_farm(L, 1);
+
+        pthread_mutex_lock(&farm->lock);
+        int pending = farm->pending;
+        int finished = 0;
+        for (struct farm_job* job = farm->finished; job != NULL; job = job->next) { finished++; }
+        pthread_mutex_unlock(&farm->lock);
+
+        lua_pushinteger(L, pending);
+        lua_pushinteger(L, finished);
+        return 2;
+}
+
 /*
- * FLUIDSYNTH_API void
- * delete_fluid_file_renderer (fluid_file_renderer_t *dev)
+ * fluid_render_farm_fd (farm)
  *
- * Close file and destroy a file renderer object.
+ * Get a file descriptor that is readable while finished jobs wait to
+ * be polled, for event loops. Only `fluid_render_farm_poll` may read
+ * from it.
  *
  */
 
+static int
+c_fluid_render_farm_fd (lua_State* L)
+{
+        struct render_farm* farm = check_render_farm(L, 1);
+
+        lua_pushinteger(L, farm->fds[0]);
+        return 1;
+}
+
 /*-------------------------------------------------------------------
   ---=  Misc Utilities =---
   ------------------------------------------------------------------*/
@@ -3194,11 +11929,66 @@ static const struct luaL_Reg mlib[] = {
         {"new_fluid_synth",    c_new_fluid_synth },
         {"delete_fluid_synth", c_delete_fluid_synth },
         {"fluid_synth_sfload", c_fluid_synth_sfload },
+        {"fluid_synth_find_preset", c_fluid_synth_find_preset },
+        {"fluid_synth_get_preset_name", c_fluid_synth_get_preset_name },
+        {"fluid_synth_program_select_by_name", c_fluid_synth_program_select_by_name },
+        {"fluid_synth_get_presets", c_fluid_synth_get_presets },
+        {"fluid_synth_get_channel_preset", c_fluid_synth_get_channel_preset },
+        {"fluid_synth_sfload_shared", c_fluid_synth_sfload_shared },
+        {"fluid_synth_sfunload_shared", c_fluid_synth_sfunload_shared },
+        {"fluid_sfont_cache_info", c_fluid_sfont_cache_info },
+        {"fluid_synth_sfload_async", c_fluid_synth_sfload_async },
+        {"fluid_sfload_poll", c_fluid_sfload_poll },
+        {"fluid_synth_sfswap", c_fluid_synth_sfswap },
+        {"fluid_sfswap_poll", c_fluid_sfswap_poll },
+        {"fluid_synth_add_mmap_sfloader", c_fluid_synth_add_mmap_sfloader },
+        {"fluid_synth_prewarm", c_fluid_synth_prewarm },
+        {"fluid_prewarm_poll", c_fluid_prewarm_poll },
+        {"fluid_prewarm_release", c_fluid_prewarm_release },
+        {"fluid_synth_apply_midi", c_fluid_synth_apply_midi },
+        {"fluid_synth_snapshot", c_fluid_synth_snapshot },
+        {"fluid_synth_restore", c_fluid_synth_restore },
+        {"fluid_synth_write_s16", c_fluid_synth_write_s16 },
+        {"fluid_synth_write_float", c_fluid_synth_write_float },
+        {"fluid_synth_render_wav", c_fluid_synth_render_wav },
+        {"fluid_synth_set_polyphony", c_fluid_synth_set_polyphony },
+        {"fluid_synth_get_polyphony", c_fluid_synth_get_polyphony },
+        {"fluid_synth_get_active_voice_count", c_fluid_synth_get_active_voice_count },
+        {"fluid_synth_get_cpu_load", c_fluid_synth_get_cpu_load },
+        {"fluid_synth_get_stats", c_fluid_synth_get_stats },
+
+        /* Audio Buffer */
+        {"new_fluid_audio_buffer",     c_new_fluid_audio_buffer },
+        {"delete_fluid_audio_buffer",  c_delete_fluid_audio_buffer },
+        {"fluid_audio_buffer_pointer", c_fluid_audio_buffer_pointer },
+        {"fluid_audio_buffer_frames",  c_fluid_audio_buffer_frames },
+        {"fluid_audio_buffer_get",     c_fluid_audio_buffer_get },
+        {"fluid_audio_buffer_set",     c_fluid_audio_buffer_set },
+        {"fluid_audio_buffer_write",   c_fluid_audio_buffer_write },
+        {"fluid_audio_buffer_convert", c_fluid_audio_buffer_convert },
+        {"fluid_convert_isa",          c_fluid_convert_isa },
+
+        /* Meter */
+        {"new_fluid_meter",            c_new_fluid_meter },
+        {"fluid_meter_read",           c_fluid_meter_read },
+        {"fluid_meter_reset",          c_fluid_meter_reset },
+        {"fluid_meter_feed",           c_fluid_meter_feed },
+        {"fluid_synth_set_meter",      c_fluid_synth_set_meter },
         
         /* Audio */
         {"new_fluid_audio_driver",    c_new_fluid_audio_driver },
+        {"new_fluid_audio_driver2",   c_new_fluid_audio_driver2 },
+        {"fluid_audio_driver_set_chain", c_fluid_audio_driver_set_chain },
         {"delete_fluid_audio_driver", c_delete_fluid_audio_driver },
 
+        /* Render Farm */
+        {"new_fluid_render_farm",     c_new_fluid_render_farm },
+        {"delete_fluid_render_farm",  c_delete_fluid_render_farm },
+        {"fluid_render_farm_submit",  c_fluid_render_farm_submit },
+        {"fluid_render_farm_poll",    c_fluid_render_farm_poll },
+        {"fluid_render_farm_pending", c_fluid_render_farm_pending },
+        {"fluid_render_farm_fd",      c_fluid_render_farm_fd },
+
         /* Midi */
         {"new_fluid_player",          c_new_fluid_player },
         {"delete_fluid_player",       c_delete_fluid_player },
@@ -3215,25 +12005,35 @@ static const struct luaL_Reg mlib[] = {
         {"fluid_sequencer_get_use_system_timer", c_fluid_sequencer_get_use_system_timer },
         {"fluid_sequencer_register_client",      c_fluid_sequencer_register_client },
         {"fluid_sequencer_unregister_client",    c_fluid_sequencer_unregister_client },
+        {"new_fluid_sequencer_client",           c_new_fluid_sequencer_client },
+        {"delete_fluid_sequencer_client",        c_delete_fluid_sequencer_client },
+        {"fluid_sequencer_client_id",            c_fluid_sequencer_client_id },
         {"fluid_sequencer_count_clients",        c_fluid_sequencer_count_clients },
         {"fluid_sequencer_get_client_id",        c_fluid_sequencer_get_client_id },
         {"fluid_sequencer_get_client_name",      c_fluid_sequencer_get_client_name },
         {"fluid_sequencer_client_is_dest",       c_fluid_sequencer_client_is_dest },
         {"fluid_sequencer_process",              c_fluid_sequencer_process },
+        {"fluid_sequencer_dispatch",             c_fluid_sequencer_dispatch },
         {"fluid_sequencer_send_now",             c_fluid_sequencer_send_now },
         {"fluid_sequencer_send_at",              c_fluid_sequencer_send_at },
+        {"fluid_sequencer_send_batch",           c_fluid_sequencer_send_batch },
         {"fluid_sequencer_remove_events",        c_fluid_sequencer_remove_events },
+        {"fluid_sequencer_enable_ledger",        c_fluid_sequencer_enable_ledger },
+        {"fluid_sequencer_cancel_range",         c_fluid_sequencer_cancel_range },
         {"fluid_sequencer_get_tick",             c_fluid_sequencer_get_tick },
+        {"fluid_sequencer_get_stats",            c_fluid_sequencer_get_stats },
         {"fluid_sequencer_set_time_scale",       c_fluid_sequencer_set_time_scale },
         {"fluid_sequencer_get_time_scale",       c_fluid_sequencer_get_time_scale },
 
         /* Sequencer Bind */
         {"fluid_sequencer_add_midi_event_to_buffer", c_fluid_sequencer_add_midi_event_to_buffer},
         {"fluid_sequencer_register_fluidsynth", c_fluid_sequencer_register_fluidsynth},
+        {"fluid_sequencer_render",              c_fluid_sequencer_render},
         
         /* Events */
         {"new_fluid_event",                c_new_fluid_event },
         {"delete_fluid_event",             c_delete_fluid_event },
+        {"fluid_event_pool_stats",         c_fluid_event_pool_stats },
         {"fluid_event_set_source",         c_fluid_event_set_source },
         {"fluid_event_set_dest",           c_fluid_event_set_dest },
         {"fluid_event_timer",              c_fluid_event_timer },
@@ -3273,6 +12073,20 @@ static const struct luaL_Reg mlib[] = {
         {"fluid_event_get_pitch",          c_fluid_event_get_pitch },
         {"fluid_event_get_sfont_id",       c_fluid_event_get_sfont_id },
 
+        /* Scheduler */
+        {"new_fluid_scheduler",        c_new_fluid_scheduler },
+        {"delete_fluid_scheduler",     c_delete_fluid_scheduler },
+        {"fluid_scheduler_spawn",      c_fluid_scheduler_spawn },
+        {"fluid_scheduler_wait",       c_fluid_scheduler_wait },
+        {"fluid_scheduler_count",      c_fluid_scheduler_count },
+
+        /* Pattern */
+        {"new_fluid_pattern",          c_new_fluid_pattern },
+        {"delete_fluid_pattern",       c_delete_fluid_pattern },
+        {"fluid_pattern_start",        c_fluid_pattern_start },
+        {"fluid_pattern_stop",         c_fluid_pattern_stop },
+        {"fluid_pattern_swap",         c_fluid_pattern_swap },
+
         /* Misc */
         {"fluid_is_soundfont",         c_fluid_is_soundfont },
         {"fluid_is_midifile",          c_fluid_is_midifile },
@@ -3283,6 +12097,70 @@ static const struct luaL_Reg mlib[] = {
 int
 luaopen_cfluidsynth(lua_State* L)
 {
+        convert_select(NULL);
+        meter_select();
+        dsp_select();
+        pthread_once(&sfont_fileapi_once, sfont_fileapi_install);
+
+        luaL_newmetatable(L, "fluid.event");
+        lua_pushcfunction(L, gc_delete_fluid_event);
+        lua_setfield(L, -2, "__gc");
+        lua_pop(L, 1);
+
+        luaL_newmetatable(L, "fluid.client");
+        lua_pushcfunction(L, gc_delete_fluid_sequencer_client);
+        lua_setfield(L, -2, "__gc");
+#if LUA_VERSION_NUM >= 504
+        lua_pushcfunction(L, gc_delete_fluid_sequencer_client);
+        lua_setfield(L, -2, "__close");
+#endif
+        lua_pop(L, 1);
+
+        luaL_newmetatable(L, "fluid.audiobuffer");
+        lua_pushcfunction(L, gc_delete_fluid_audio_buffer);
+        lua_setfield(L, -2, "__gc");
+        lua_pop(L, 1);
+
+        luaL_newmetatable(L, "fluid.sfload");
+        lua_pushcfunction(L, gc_fluid_sfload);
+        lua_setfield(L, -2, "__gc");
+        lua_pop(L, 1);
+
+        luaL_newmetatable(L, "fluid.audiodriver2");
+        lua_pushcfunction(L, gc_delete_fluid_audio_driver2);
+        lua_setfield(L, -2, "__gc");
+        lua_pop(L, 1);
+
+        luaL_newmetatable(L, "fluid.sfswap");
+        lua_pushcfunction(L, gc_fluid_sfswap);
+        lua_setfield(L, -2, "__gc");
+        lua_pop(L, 1);
+
+        luaL_newmetatable(L, "fluid.prewarm");
+        lua_pushcfunction(L, c_fluid_prewarm_release);
+        lua_setfield(L, -2, "__gc");
+        lua_pop(L, 1);
+
+        luaL_newmetatable(L, "fluid.meter");
+        lua_pushcfunction(L, gc_delete_fluid_meter);
+        lua_setfield(L, -2, "__gc");
+        lua_pop(L, 1);
+
+        luaL_newmetatable(L, "fluid.renderfarm");
+        lua_pushcfunction(L, gc_delete_fluid_render_farm);
+        lua_setfield(L, -2, "__gc");
+        lua_pop(L, 1);
+
+        luaL_newmetatable(L, "fluid.scheduler");
+        lua_pushcfunction(L, gc_delete_fluid_scheduler);
+        lua_setfield(L, -2, "__gc");
+        lua_pop(L, 1);
+
+        luaL_newmetatable(L, "fluid.pattern");
+        lua_pushcfunction(L, gc_delete_fluid_pattern);
+        lua_setfield(L, -2, "__gc");
+        lua_pop(L, 1);
+
         luaL_newlib(L, mlib);
         /* lua_setglobal(L, "mlib"); */
         return 1;
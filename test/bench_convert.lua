@@ -0,0 +1,55 @@
+local FS = require "cfluidsynth"
+
+-- Compares the scalar and SIMD float to integer sample conversion.
+--
+--    lua bench_convert.lua [soundfont.sf2]
+--
+-- With a SoundFont a chord is rendered as the source material,
+-- otherwise the source is silence, which converts at the same speed.
+
+local FRAMES = 1 << 20
+local ROUNDS = 20
+
+local settings = FS.new_fluid_settings()
+local synth = FS.new_fluid_synth(settings)
+
+if arg[1] then
+   FS.fluid_synth_sfload(synth, arg[1], 1)
+   FS.fluid_synth_apply_midi(synth, "\x90\x3c\x64\x40\x64\x43\x64\x48\x64")
+end
+
+local source = FS.new_fluid_audio_buffer(FRAMES, "float")
+FS.fluid_synth_write_float(synth, FRAMES, source)
+
+local best = FS.fluid_convert_isa()
+print(string.format("%d frames, %d rounds, fastest available: %s\n",
+                    FRAMES, ROUNDS, best))
+
+local function bench (format, dither)
+   local target = FS.new_fluid_audio_buffer(FRAMES, format)
+   local start = os.clock()
+   for _ = 1, ROUNDS do
+      FS.fluid_audio_buffer_convert(source, target, dither)
+   end
+   local seconds = os.clock() - start
+   return 2 * FRAMES * ROUNDS / seconds / 1e6
+end
+
+print(string.format("%-8s %-6s %-6s %12s", "isa", "format", "dither", "Msamples/s"))
+for _, isa in ipairs { "scalar", "sse2", "avx2" } do
+   if FS.fluid_convert_isa(isa) then
+      for _, format in ipairs { "s16", "s24", "s32" } do
+         for _, dither in ipairs { "none", "tpdf" } do
+            print(string.format("%-8s %-6s %-6s %12.1f",
+                                isa, format, dither, bench(format, dither)))
+         end
+      end
+   end
+end
+
+print(string.format("%-8s %-6s %-6s %12.1f", "scalar", "s16", "shaped",
+                    bench("s16", "shaped")))
+
+FS.fluid_convert_isa(best)
+FS.delete_fluid_synth(synth)
+FS.delete_fluid_settings(settings)
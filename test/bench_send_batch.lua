@@ -0,0 +1,68 @@
+local FS = require "cfluidsynth"
+
+-- Compares scheduling notes one call at a time with
+-- fluid_sequencer_send_batch, from event tables and packed records.
+--
+--    lua bench_send_batch.lua [events]
+
+local EVENTS = tonumber(arg[1]) or 10000
+local ROUNDS = 20
+
+local settings = FS.new_fluid_settings()
+local synth = FS.new_fluid_synth(settings)
+local sequencer = FS.new_fluid_sequencer2(false)
+local dest = FS.fluid_sequencer_register_fluidsynth(sequencer, synth)
+
+local tables, records = {}, {}
+for i = 1, EVENTS do
+   local time, key = i * 10, 36 + i % 48
+   tables[i] = { time, dest, "note", 0, key, 100, 200 }
+   records[i] = string.pack("<I4i2BBi2i2I4", time, dest, 0, 0, key, 100, 200)
+end
+records = table.concat(records)
+assert(FS.fluid_sequencer_send_batch(sequencer, records, false) == EVENTS)
+FS.fluid_sequencer_remove_events(sequencer, -1, dest, -1)
+
+local function single ()
+   for i = 1, EVENTS do
+      local e = tables[i]
+      local event = FS.new_fluid_event()
+      FS.fluid_event_set_source(event, -1)
+      FS.fluid_event_set_dest(event, dest)
+      FS.fluid_event_note(event, 0, e[5], e[6], e[7])
+      FS.fluid_sequencer_send_at(sequencer, event, e[1], false)
+      FS.delete_fluid_event(event)
+   end
+end
+
+local function batch_tables ()
+   FS.fluid_sequencer_send_batch(sequencer, tables, false)
+end
+
+local function batch_records ()
+   FS.fluid_sequencer_send_batch(sequencer, records, false)
+end
+
+local function bench (f)
+   local seconds = 0
+   for _ = 1, ROUNDS do
+      local start = os.clock()
+      f()
+      seconds = seconds + os.clock() - start
+      FS.fluid_sequencer_remove_events(sequencer, -1, dest, -1)
+   end
+   return EVENTS * ROUNDS / seconds / 1e6
+end
+
+print(string.format("%d events, %d rounds\n", EVENTS, ROUNDS))
+print(string.format("%-16s %12s %8s", "method", "Mevents/s", "speedup"))
+local base = bench(single)
+print(string.format("%-16s %12.2f %8.1f", "send_at", base, 1))
+for _, method in ipairs { { "batch tables", batch_tables }, { "batch records", batch_records } } do
+   local rate = bench(method[2])
+   print(string.format("%-16s %12.2f %8.1f", method[1], rate, rate / base))
+end
+
+FS.delete_fluid_sequencer(sequencer)
+FS.delete_fluid_synth(synth)
+FS.delete_fluid_settings(settings)
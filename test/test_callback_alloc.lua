@@ -0,0 +1,59 @@
+local FS = require "cfluidsynth"
+
+-- Drives a sequencer without the system timer and measures how much
+-- Lua memory each client callback allocates in the "event" and
+-- "fields" callback modes. The garbage collector is stopped while
+-- measuring, so `collectgarbage("count")` only grows.
+
+local TIMER = 17 -- index of "timer" in the batch event kinds
+local N = 10000
+
+local calls = 0
+
+function on_event (time, event, seq, data)
+   calls = calls + 1
+end
+
+function on_fields (time, type, channel, key, vel, control, value, seq, data)
+   calls = calls + 1
+end
+
+function measure (mode, callback)
+   local sequencer = FS.new_fluid_sequencer2(false)
+   local client = FS.fluid_sequencer_register_client(
+      sequencer, "alloc-" .. mode, callback, {}, mode)
+
+   local records = {}
+   for i = 1, N do
+      records[i] = string.pack("<I4i2BBi2i2I4", i, client, TIMER, 0, 0, 0, 0)
+   end
+   local batch = table.concat(records)
+   records = nil
+
+   FS.fluid_sequencer_send_batch(sequencer, batch, true)
+
+   -- warm up the call path before measuring
+   FS.fluid_sequencer_process(sequencer, 1)
+
+   collectgarbage("collect")
+   collectgarbage("stop")
+   calls = 0
+   local before = collectgarbage("count")
+   FS.fluid_sequencer_process(sequencer, N + 1)
+   local after = collectgarbage("count")
+   collectgarbage("restart")
+
+   FS.fluid_sequencer_unregister_client(sequencer, client)
+   FS.delete_fluid_sequencer(sequencer)
+
+   return (after - before) * 1024 / calls, calls
+end
+
+local per_event, n_event = measure("event", on_event)
+local per_fields, n_fields = measure("fields", on_fields)
+
+print(string.format("event:  %d callbacks, %.1f bytes per callback", n_event, per_event))
+print(string.format("fields: %d callbacks, %.1f bytes per callback", n_fields, per_fields))
+
+assert(n_fields == N - 1, "expected every timer to be dispatched")
+assert(per_fields == 0, "fields mode allocated in the callback path")
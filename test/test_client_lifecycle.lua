@@ -0,0 +1,60 @@
+local FS = require "cfluidsynth"
+
+-- Registers and unregisters sequencer clients a million times, both by
+-- id and through client handles, and checks that neither the Lua heap
+-- nor the registry keeps growing.
+
+local N = 1000000
+
+local function callback (time, event, seq, data)
+end
+
+local function registry_size ()
+   local n = 0
+   for _ in pairs(debug.getregistry()) do n = n + 1 end
+   return n
+end
+
+local function measure (label, cycle)
+   local sequencer = FS.new_fluid_sequencer2(false)
+
+   -- warm up so the registry and allocator reach their steady size
+   for i = 1, 1000 do cycle(sequencer, i) end
+
+   collectgarbage("collect")
+   collectgarbage("collect")
+   local memory = collectgarbage("count")
+   local registry = registry_size()
+
+   for i = 1, N do cycle(sequencer, i) end
+
+   collectgarbage("collect")
+   collectgarbage("collect")
+   local memory_growth = collectgarbage("count") - memory
+   local registry_growth = registry_size() - registry
+
+   FS.delete_fluid_sequencer(sequencer)
+
+   print(string.format("%-8s %d cycles, %+.1f KB, %+d registry slots",
+                       label, N, memory_growth, registry_growth))
+
+   assert(registry_growth <= 0, label .. ": registry grew")
+   assert(memory_growth < 64, label .. ": Lua heap grew")
+end
+
+measure("by id", function (sequencer, i)
+   local id = FS.fluid_sequencer_register_client(
+      sequencer, "lifecycle", callback, {}, "fields")
+   FS.fluid_sequencer_unregister_client(sequencer, id)
+end)
+
+measure("delete", function (sequencer, i)
+   local client = FS.new_fluid_sequencer_client(
+      sequencer, "lifecycle", callback, {}, "queued", 16)
+   FS.delete_fluid_sequencer_client(client)
+end)
+
+measure("gc", function (sequencer, i)
+   FS.new_fluid_sequencer_client(sequencer, "lifecycle", callback, {})
+   if i % 1000 == 0 then collectgarbage("collect") end
+end)
@@ -0,0 +1,69 @@
+local FS = require "cfluidsynth"
+
+-- Checks that the SIMD float to integer conversions produce the same
+-- bytes as the scalar one without dither, for every format and layout
+-- and for lengths that are not a multiple of the vector width.
+--
+--    lua test_convert.lua
+
+local LENGTHS = { 1, 2, 3, 5, 7, 8, 9, 15, 17, 31, 33, 1001 }
+
+-- exact values, rounding ties, clipping and then noise
+local EDGES = { 0, 1, -1, 0.5, -0.5, 1.5, -1.5, 1e-9, -1e-9,
+                0.5 / 32768, -0.5 / 32768, 1.5 / 32768, -1.5 / 32768,
+                0.5 / 8388608, -0.5 / 8388608, 32767 / 32768, -32768 / 32768 }
+
+local function source (frames, layout)
+   local buffer = FS.new_fluid_audio_buffer(frames, "float", layout)
+   local k = 0
+   math.randomseed(frames)
+   for frame = 0, frames - 1 do
+      for chan = 0, 1 do
+         k = k + 1
+         FS.fluid_audio_buffer_set(buffer, frame, chan, EDGES[k] or (math.random() * 2.2 - 1.1))
+      end
+   end
+   return buffer
+end
+
+local function convert (isa, src, frames, format, layout)
+   assert(FS.fluid_convert_isa(isa))
+   local dst = FS.new_fluid_audio_buffer(frames, format, layout)
+   FS.fluid_audio_buffer_convert(src, dst, "none")
+   local file = io.tmpfile()
+   assert(FS.fluid_audio_buffer_write(dst, file))
+   file:seek("set")
+   local bytes = file:read("a")
+   file:close()
+   return bytes
+end
+
+local best = FS.fluid_convert_isa()
+local checked = 0
+
+for _, isa in ipairs { "sse2", "avx2" } do
+   if FS.fluid_convert_isa(isa) then
+      for _, layout in ipairs { "interleaved", "planar" } do
+         for _, frames in ipairs(LENGTHS) do
+            local src = source(frames, layout)
+            for _, format in ipairs { "s16", "s24", "s32" } do
+               local want = convert("scalar", src, frames, format, layout)
+               local got = convert(isa, src, frames, format, layout)
+               assert(#got == #want, "length differs")
+               if got ~= want then
+                  local i = 1
+                  while got:byte(i) == want:byte(i) do i = i + 1 end
+                  error(string.format("%s %s %s, %d frames: byte %d differs",
+                                      isa, format, layout, frames, i))
+               end
+               checked = checked + 1
+            end
+         end
+      end
+   else
+      print(isa .. " not available")
+   end
+end
+
+FS.fluid_convert_isa(best)
+print("convert ok, " .. checked .. " conversions")
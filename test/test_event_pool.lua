@@ -0,0 +1,31 @@
+local FS = require "cfluidsynth"
+
+-- Checks that events recycled through the pool come back cleared and
+-- that a deleted event raises an error instead of being used.
+
+local timer = FS.new_fluid_event()
+FS.fluid_event_timer(timer, nil)
+local timer_type = FS.fluid_event_get_type(timer)
+
+local event = FS.new_fluid_event()
+FS.fluid_event_set_source(event, 3)
+FS.fluid_event_set_dest(event, 4)
+FS.fluid_event_note(event, 9, 60, 100, 500)
+FS.delete_fluid_event(event)
+
+local ok, msg = pcall(FS.fluid_event_get_key, event)
+assert(not ok and msg:find("deleted event"), "a deleted event should raise an error")
+assert(not pcall(FS.fluid_event_noteon, event, 0, 60, 100),
+       "setters should reject a deleted event too")
+
+local stats = FS.fluid_event_pool_stats()
+local recycled = FS.new_fluid_event()
+assert(FS.fluid_event_pool_stats().hits == stats.hits + 1, "the event should come from the pool")
+assert(FS.fluid_event_get_type(recycled) == timer_type, "the note should be cleared")
+assert(FS.fluid_event_get_source(recycled) == -1 and FS.fluid_event_get_dest(recycled) == -1,
+       "source and destination should be cleared")
+assert(FS.fluid_event_get_channel(recycled) == 0 and FS.fluid_event_get_key(recycled) == 0
+       and FS.fluid_event_get_velocity(recycled) == 0 and FS.fluid_event_get_duration(recycled) == 0,
+       "the note fields should be cleared")
+
+print("event pool ok")
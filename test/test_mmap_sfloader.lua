@@ -0,0 +1,75 @@
+local FS = require "cfluidsynth"
+
+-- Loads one SoundFont through the default and the memory mapped
+-- loader, and checks that both list the same presets and render the
+-- same notes sample for sample.
+--
+--    lua test_mmap_sfloader.lua soundfont.sf2
+
+local FRAMES = 4096
+
+local path = assert(arg[1], "usage: lua test_mmap_sfloader.lua soundfont.sf2")
+
+local settings = FS.new_fluid_settings()
+local plain = FS.new_fluid_synth(settings)
+local mapped = FS.new_fluid_synth(settings)
+
+local ok, err = FS.fluid_synth_add_mmap_sfloader(mapped)
+if not ok then
+   print("mmap sfloader skipped: " .. err)
+   os.exit(0)
+end
+
+local plain_id = assert(FS.fluid_synth_sfload(plain, path, 1), "default loader failed")
+local mapped_id = assert(FS.fluid_synth_sfload(mapped, path, 1), "mmap loader failed")
+
+local function presets (synth, id)
+   local list = {}
+   for _, preset in ipairs(FS.fluid_synth_get_presets(synth)) do
+      if preset.sfont_id == id then
+         list[#list + 1] = string.format("%d:%d %s", preset.bank, preset.program, preset.name)
+      end
+   end
+   table.sort(list)
+   return list
+end
+
+local a, b = presets(plain, plain_id), presets(mapped, mapped_id)
+assert(#a > 0, "no presets")
+assert(#a == #b, "preset count " .. #a .. " vs " .. #b)
+for i = 1, #a do assert(a[i] == b[i], a[i] .. " vs " .. b[i]) end
+
+-- every preset plays a low, middle and high note, percussion banks
+-- on channel 10
+local function render (synth)
+   local buffers = {}
+   for _, name in ipairs(a) do
+      local bank, program = name:match("^(%d+):(%d+)")
+      bank, program = tonumber(bank), tonumber(program)
+      local chan = bank >= 128 and 9 or 0
+      local midi = string.char(0xb0 | chan, 0, bank & 0x7f, 0xc0 | chan, program,
+                               0x90 | chan, 0x24, 0x64, 0x3c, 0x50, 0x60, 0x7f)
+      FS.fluid_synth_apply_midi(synth, midi)
+      local buffer = FS.new_fluid_audio_buffer(FRAMES)
+      FS.fluid_synth_write_float(synth, FRAMES, buffer)
+      FS.fluid_synth_apply_midi(synth, string.char(0xb0 | chan, 0x78, 0))
+      buffers[#buffers + 1] = buffer
+   end
+   return buffers
+end
+
+local x, y = render(plain), render(mapped)
+for i = 1, #x do
+   for frame = 0, FRAMES - 1 do
+      for chan = 0, 1 do
+         local s, t = FS.fluid_audio_buffer_get(x[i], frame, chan),
+            FS.fluid_audio_buffer_get(y[i], frame, chan)
+         assert(s == t, string.format("%s differs at frame %d: %g vs %g", a[i], frame, s, t))
+      end
+   end
+end
+
+FS.delete_fluid_synth(plain)
+FS.delete_fluid_synth(mapped)
+FS.delete_fluid_settings(settings)
+print("mmap sfloader ok, " .. #a .. " presets")
@@ -0,0 +1,73 @@
+local FS = require "cfluidsynth"
+
+-- Runs coroutines on a scheduler driven by a sequencer without the
+-- system timer, checks that they wake in order at the right ticks, that
+-- errors are reported, that a coroutine may delete its own scheduler,
+-- and that deleting the sequencer before the scheduler is safe.
+
+local sequencer = FS.new_fluid_sequencer2(false)
+local sched = FS.new_fluid_scheduler(sequencer)
+
+local log = {}
+
+local function sleeper (name, period, times)
+   for _ = 1, times do
+      local tick = FS.fluid_scheduler_wait(period)
+      log[#log + 1] = { name, tick }
+   end
+end
+
+FS.fluid_scheduler_spawn(sched, sleeper, "a", 100, 3)
+FS.fluid_scheduler_spawn(sched, sleeper, "b", 250, 2)
+assert(FS.fluid_scheduler_count(sched) == 2, "both coroutines should sleep")
+
+for msec = 0, 600, 10 do
+   FS.fluid_sequencer_process(sequencer, msec)
+end
+
+local expected = { { "a", 100 }, { "a", 200 }, { "b", 250 }, { "a", 300 }, { "b", 500 } }
+assert(#log == #expected, "expected " .. #expected .. " wake ups, got " .. #log)
+for i, wake in ipairs(expected) do
+   assert(log[i][1] == wake[1], "wake up " .. i .. " out of order")
+   assert(log[i][2] >= wake[2] and log[i][2] < wake[2] + 10,
+          "wake up " .. i .. " at tick " .. log[i][2])
+end
+assert(FS.fluid_scheduler_count(sched) == 0, "finished coroutines should be dropped")
+
+-- errors before the first wait are returned, later ones are kept
+local ok, msg = FS.fluid_scheduler_spawn(sched, function () error("early") end)
+assert(ok == nil and msg:find("early"), "spawn should return the error")
+FS.fluid_scheduler_spawn(sched, function ()
+   FS.fluid_scheduler_wait(10)
+   error("late")
+end)
+for msec = 610, 650, 10 do
+   FS.fluid_sequencer_process(sequencer, msec)
+end
+local sleeping, errors = FS.fluid_scheduler_count(sched)
+assert(sleeping == 0 and #errors == 1 and errors[1]:find("late"),
+       "the late error should be kept")
+assert(#select(2, FS.fluid_scheduler_count(sched)) == 0, "errors are read once")
+
+-- a coroutine deleting its own scheduler
+local doomed = FS.new_fluid_scheduler(sequencer)
+FS.fluid_scheduler_spawn(doomed, function ()
+   FS.fluid_scheduler_wait(10)
+   FS.delete_fluid_scheduler(doomed)
+   log[#log + 1] = { "deleted" }
+end)
+FS.fluid_scheduler_spawn(doomed, sleeper, "never", 10, 1)
+for msec = 660, 700, 10 do
+   FS.fluid_sequencer_process(sequencer, msec)
+end
+assert(log[#log][1] == "deleted", "the other coroutine should not run")
+
+-- a scheduler that outlives its sequencer
+FS.fluid_scheduler_spawn(sched, sleeper, "c", 100, 1)
+FS.delete_fluid_sequencer(sequencer)
+assert(FS.fluid_scheduler_spawn(sched, sleeper, "d", 100, 1) == nil,
+       "spawning on a deleted sequencer should fail")
+sched = nil
+collectgarbage("collect")
+
+print("scheduler ok")
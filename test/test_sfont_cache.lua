@@ -0,0 +1,48 @@
+local FS = require "cfluidsynth"
+
+-- Loads one SoundFont into 16 synths through the shared cache and
+-- checks that the resident set grows by about one copy of the font.
+--
+--    lua test_sfont_cache.lua soundfont.sf2
+
+local N = 16
+
+local path = assert(arg[1], "usage: lua test_sfont_cache.lua soundfont.sf2")
+
+local function resident_mb ()
+   local statm = io.open("/proc/self/statm"):read("a")
+   local pages = tonumber(statm:match("^%d+%s+(%d+)"))
+   return pages * 4096 / (1 << 20)
+end
+
+local file = io.open(path, "rb")
+local font_mb = file:seek("end") / (1 << 20)
+file:close()
+
+local settings = FS.new_fluid_settings()
+local synths = {}
+for i = 1, N do synths[i] = FS.new_fluid_synth(settings) end
+
+local before = resident_mb()
+local ids = {}
+for i = 1, N do
+   ids[i] = assert(FS.fluid_synth_sfload_shared(synths[i], path), "load failed")
+end
+local growth = resident_mb() - before
+
+-- every synth keeps the id it was given, whoever loaded the font last
+for i = 1, N do
+   local _, _, _, sfont_id = FS.fluid_synth_get_channel_preset(synths[i], 0)
+   assert(sfont_id == ids[i], "synth " .. i .. " lost its font id")
+end
+
+local info = FS.fluid_sfont_cache_info()
+print(string.format("%d synths, font %.1f MB, resident +%.1f MB, %d cached font(s) with %d refs",
+                    N, font_mb, growth, #info, info[1].refs))
+
+assert(#info == 1 and info[1].refs == N, "font was loaded more than once")
+assert(growth < 2 * font_mb + 16, "resident set grew by more than one copy")
+
+for i = 1, N do FS.delete_fluid_synth(synths[i]) end
+assert(#FS.fluid_sfont_cache_info() == 0, "font outlived its synths")
+FS.delete_fluid_settings(settings)
@@ -0,0 +1,80 @@
+local FS = require "cfluidsynth"
+
+-- Swaps the font of a synth at a sequencer tick while a note plays,
+-- and checks that the channel moves to the new font at that tick, the
+-- old font stays until the note has ended, and swaps survive their
+-- sequencer being deleted or their handle being collected.
+--
+--    lua test_sfswap.lua old.sf2 [new.sf2]
+
+local old_path = assert(arg[1], "usage: lua test_sfswap.lua old.sf2 [new.sf2]")
+local new_path = arg[2] or old_path
+
+local settings = FS.new_fluid_settings()
+local synth = FS.new_fluid_synth(settings)
+local buffer = FS.new_fluid_audio_buffer(64)
+
+local function has_font (id)
+   for _, preset in ipairs(FS.fluid_synth_get_presets(synth)) do
+      if preset.sfont_id == id then return true end
+   end
+   return false
+end
+
+local function loaded (swap)
+   local state, new_id
+   repeat state, new_id = FS.fluid_sfswap_poll(swap, 100) until state ~= "loading"
+   return state, new_id
+end
+
+-- retarget at a tick
+local sequencer = FS.new_fluid_sequencer2(false)
+local old_id = assert(FS.fluid_synth_sfload(synth, old_path, 1))
+FS.fluid_synth_apply_midi(synth, "\x90\x3c\x64")
+
+local swap = assert(FS.fluid_synth_sfswap(synth, old_id, new_path, sequencer, 100))
+local state, new_id = loaded(swap)
+assert(state == "armed", "expected armed, got " .. state)
+
+FS.fluid_sequencer_process(sequencer, 50)
+assert(FS.fluid_sfswap_poll(swap) == "armed", "retargeted before its tick")
+FS.fluid_sequencer_process(sequencer, 100)
+
+local retargeted
+state, new_id, retargeted = FS.fluid_sfswap_poll(swap)
+assert(state == "draining", "expected draining, got " .. state)
+assert(retargeted >= 1, "channel 0 was not retargeted")
+local _, _, _, sfont_id = FS.fluid_synth_get_channel_preset(synth, 0)
+assert(sfont_id == new_id, "channel 0 still plays the old font")
+assert(has_font(old_id), "old font removed while its note plays")
+
+FS.fluid_synth_apply_midi(synth, "\x80\x3c\x00")
+for _ = 1, 10000 do
+   FS.fluid_synth_write_float(synth, 64, buffer)
+   state = FS.fluid_sfswap_poll(swap)
+   if state ~= "draining" then break end
+end
+assert(state == "done", "expected done, got " .. state)
+assert(not has_font(old_id), "old font outlived the swap")
+
+-- the sequencer goes away while the swap is armed
+old_id = new_id
+swap = assert(FS.fluid_synth_sfswap(synth, old_id, new_path, sequencer, 1000))
+assert(loaded(swap) == "armed")
+FS.delete_fluid_sequencer(sequencer)
+state = FS.fluid_sfswap_poll(swap)
+assert(state == "draining" or state == "done", "swap stuck after its sequencer")
+
+-- the handle is collected while armed
+old_id = select(2, FS.fluid_sfswap_poll(swap))
+sequencer = FS.new_fluid_sequencer2(false)
+swap = assert(FS.fluid_synth_sfswap(synth, old_id, new_path, sequencer, 100))
+assert(loaded(swap) == "armed")
+swap = nil
+collectgarbage("collect")
+FS.fluid_sequencer_process(sequencer, 200)
+FS.delete_fluid_sequencer(sequencer)
+
+FS.delete_fluid_synth(synth)
+FS.delete_fluid_settings(settings)
+print("sfswap ok")